@@ -0,0 +1,433 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit pogoshm.c is the client side of the shared memory ring transport.
+// The ring layout and the wakeup protocol are described in shmring.h.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "../src/shmring.h"
+#include "pogoshm.h"
+
+// Spin this many times on an empty ring before sleeping on the futex.
+// There's no spinning on a single cpu, where it would only keep the server
+// from running.
+#define SPINS 2000
+
+struct pogoshm {
+    int fd;
+    struct shmring_hdr *hdr;
+    size_t mapsize;
+    size_t size;
+    char *reqbuf;
+    char *respbuf;
+    uint64_t reqtail;   // request bytes published
+    uint64_t resphead;  // response bytes consumed
+    char *in;           // buffered response bytes
+    size_t inlen;
+    size_t incap;
+    size_t inpos;       // start of the unread bytes
+    size_t lastreply;   // bytes of the last reply from pogoshm_command
+    char *out;          // command that is being built
+    size_t outcap;
+    int spins;
+};
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Read the reply to SHMRING, which carries the memfd.
+static int recvreply(int fd, char *buf, size_t cap, int *memfd) {
+    size_t len = 0;
+    *memfd = -1;
+    while (len < 2 || buf[len-2] != '\r' || buf[len-1] != '\n') {
+        if (len == cap) {
+            errno = EPROTO;
+            return -1;
+        }
+        struct iovec iov = { .iov_base = buf+len, .iov_len = 1 };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(memfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        len += n;
+    }
+    return len;
+}
+
+struct pogoshm *pogoshm_open(const char *path, size_t ringsize) {
+    int memfd = -1;
+    struct pogoshm *shm = calloc(1, sizeof(struct pogoshm));
+    if (!shm) {
+        return 0;
+    }
+    shm->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPINS : 0;
+    shm->fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (shm->fd == -1) {
+        goto fail;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    if (connect(shm->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        goto fail;
+    }
+    char cmd[64];
+    char size[24];
+    int n = snprintf(size, sizeof(size), "%zu", ringsize);
+    n = snprintf(cmd, sizeof(cmd), "*2\r\n$7\r\nSHMRING\r\n$%d\r\n%s\r\n",
+        n, size);
+    if (send(shm->fd, cmd, n, MSG_NOSIGNAL) != n) {
+        goto fail;
+    }
+    char reply[256];
+    if (recvreply(shm->fd, reply, sizeof(reply), &memfd) == -1) {
+        goto fail;
+    }
+    if (memfd == -1 || memcmp(reply, "+OK\r\n", 5) != 0) {
+        errno = EPROTO;
+        goto fail;
+    }
+    struct stat st;
+    if (fstat(memfd, &st) == -1) {
+        goto fail;
+    }
+    if ((size_t)st.st_size < SHMRING_HDRSIZE+SHMRING_MINSIZE*2) {
+        errno = EPROTO;
+        goto fail;
+    }
+    shm->mapsize = st.st_size;
+    void *mem = mmap(0, shm->mapsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+        memfd, 0);
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    close(memfd);
+    memfd = -1;
+    shm->hdr = mem;
+    if (shm->hdr->magic != SHMRING_MAGIC ||
+        shm->hdr->version != SHMRING_VERSION ||
+        SHMRING_HDRSIZE+(size_t)shm->hdr->size*2 != shm->mapsize)
+    {
+        errno = EPROTO;
+        goto fail;
+    }
+    shm->size = shm->hdr->size;
+    shm->reqbuf = shmring_reqbuf(shm->hdr);
+    shm->respbuf = shmring_respbuf(shm->hdr);
+    return shm;
+fail:
+    if (memfd != -1) {
+        close(memfd);
+    }
+    pogoshm_close(shm);
+    return 0;
+}
+
+void pogoshm_close(struct pogoshm *shm) {
+    if (!shm) {
+        return;
+    }
+    int err = errno;
+    if (shm->hdr) {
+        munmap(shm->hdr, shm->mapsize);
+    }
+    if (shm->fd != -1) {
+        close(shm->fd);
+    }
+    free(shm->in);
+    free(shm->out);
+    free(shm);
+    errno = err;
+}
+
+// Ring the doorbell if the server is sleeping on the given condition.
+static void wakeserver(struct pogoshm *shm, uint32_t cond) {
+    atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (atomic_load_explicit(&shm->hdr->srvwait, __ATOMIC_RELAXED) == cond &&
+        atomic_compare_exchange_strong(&shm->hdr->srvwait, &cond, 0))
+    {
+        ssize_t n = send(shm->fd, "!", 1, MSG_NOSIGNAL);
+        (void)n;
+    }
+}
+
+// Returns true if the server closed the connection.
+static bool hungup(struct pogoshm *shm) {
+    char c;
+    ssize_t n = recv(shm->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+    return n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR);
+}
+
+static size_t reqspace(struct pogoshm *shm) {
+    uint64_t head = atomic_load_explicit(&shm->hdr->req.head,
+        __ATOMIC_ACQUIRE);
+    return shm->size-(shm->reqtail-head);
+}
+
+static size_t respready(struct pogoshm *shm) {
+    uint64_t tail = atomic_load_explicit(&shm->hdr->resp.tail,
+        __ATOMIC_ACQUIRE);
+    return tail-shm->resphead;
+}
+
+// Wait until the ready function returns something. The client spins for a
+// bit, and then sleeps until the server wakes it.
+static size_t waitfor(struct pogoshm *shm, size_t(*ready)(struct pogoshm*)) {
+    size_t n;
+    int spins = 0;
+    while ((n = ready(shm)) == 0) {
+        if (spins < shm->spins) {
+            spins++;
+            cpu_relax();
+            continue;
+        }
+        uint32_t seq = atomic_load(&shm->hdr->clifutex);
+        atomic_store(&shm->hdr->cliwait, 1);
+        atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((n = ready(shm)) != 0) {
+            atomic_store(&shm->hdr->cliwait, 0);
+            break;
+        }
+        struct timespec timeout = { .tv_nsec = 100000000 }; // 100 ms
+        long ret = syscall(SYS_futex, &shm->hdr->clifutex, FUTEX_WAIT, seq,
+            &timeout, 0, 0);
+        atomic_store(&shm->hdr->cliwait, 0);
+        if (ret == -1 && errno == ETIMEDOUT && hungup(shm)) {
+            errno = ECONNRESET;
+            return 0;
+        }
+    }
+    return n;
+}
+
+int pogoshm_write(struct pogoshm *shm, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        size_t n = waitfor(shm, reqspace);
+        if (n == 0) {
+            return -1;
+        }
+        if (n > len) {
+            n = len;
+        }
+        size_t off = shm->reqtail&(shm->size-1);
+        size_t n1 = n < shm->size-off ? n : shm->size-off;
+        memcpy(shm->reqbuf+off, p, n1);
+        memcpy(shm->reqbuf, p+n1, n-n1);
+        shm->reqtail += n;
+        atomic_store_explicit(&shm->hdr->req.tail, shm->reqtail,
+            __ATOMIC_RELEASE);
+        wakeserver(shm, SHMRING_WAITREQ);
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read directly from the response ring.
+static ssize_t readring(struct pogoshm *shm, char *data, size_t len) {
+    size_t n = waitfor(shm, respready);
+    if (n == 0) {
+        return -1;
+    }
+    if (n > len) {
+        n = len;
+    }
+    size_t off = shm->resphead&(shm->size-1);
+    size_t n1 = n < shm->size-off ? n : shm->size-off;
+    memcpy(data, shm->respbuf+off, n1);
+    memcpy(data+n1, shm->respbuf, n-n1);
+    shm->resphead += n;
+    atomic_store_explicit(&shm->hdr->resp.head, shm->resphead,
+        __ATOMIC_RELEASE);
+    wakeserver(shm, SHMRING_WAITSPACE);
+    return n;
+}
+
+ssize_t pogoshm_read(struct pogoshm *shm, void *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    shm->inpos += shm->lastreply;
+    shm->lastreply = 0;
+    if (shm->inpos < shm->inlen) {
+        // Bytes left over from pogoshm_command go first.
+        size_t n = shm->inlen-shm->inpos;
+        n = n < len ? n : len;
+        memcpy(data, shm->in+shm->inpos, n);
+        shm->inpos += n;
+        return n;
+    }
+    return readring(shm, data, len);
+}
+
+// Returns the length of the complete reply at data, zero if more bytes are
+// needed, or -1 if the reply is not valid.
+static ssize_t replylen(const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    const char *e = memchr(data, '\n', len);
+    if (!e) {
+        return 0;
+    }
+    size_t n = e-data+1;
+    if (n < 3 || e[-1] != '\r') {
+        return -1;
+    }
+    long long x;
+    switch (data[0]) {
+    case '+': case '-': case ':': case '_': case ',': case '#': case '(':
+        return n;
+    case '$': case '!': case '=':
+        x = strtoll(data+1, 0, 10);
+        if (x < 0) {
+            return n;
+        }
+        if (len-n < (size_t)x+2) {
+            return 0;
+        }
+        return n+x+2;
+    case '*': case '~': case '>': case '%':
+        x = strtoll(data+1, 0, 10);
+        if (data[0] == '%') {
+            x *= 2;
+        }
+        for (long long i = 0; i < x; i++) {
+            ssize_t m = replylen(data+n, len-n);
+            if (m <= 0) {
+                return m;
+            }
+            n += m;
+        }
+        return n;
+    }
+    return -1;
+}
+
+static int appendout(struct pogoshm *shm, size_t *len, const void *data,
+    size_t n)
+{
+    if (shm->outcap-*len < n) {
+        size_t cap = shm->outcap ? shm->outcap : 256;
+        while (cap-*len < n) {
+            cap *= 2;
+        }
+        char *out = realloc(shm->out, cap);
+        if (!out) {
+            return -1;
+        }
+        shm->out = out;
+        shm->outcap = cap;
+    }
+    memcpy(shm->out+*len, data, n);
+    *len += n;
+    return 0;
+}
+
+int pogoshm_command(struct pogoshm *shm, int argc, const char *argv[],
+    const size_t argvlen[], const char **reply, size_t *replylen_)
+{
+    char hdr[32];
+    size_t len = 0;
+    int n = snprintf(hdr, sizeof(hdr), "*%d\r\n", argc);
+    if (appendout(shm, &len, hdr, n) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < argc; i++) {
+        size_t arglen = argvlen ? argvlen[i] : strlen(argv[i]);
+        n = snprintf(hdr, sizeof(hdr), "$%zu\r\n", arglen);
+        if (appendout(shm, &len, hdr, n) == -1 ||
+            appendout(shm, &len, argv[i], arglen) == -1 ||
+            appendout(shm, &len, "\r\n", 2) == -1)
+        {
+            return -1;
+        }
+    }
+    if (pogoshm_write(shm, shm->out, len) == -1) {
+        return -1;
+    }
+    // Drop the previous reply.
+    shm->inpos += shm->lastreply;
+    shm->lastreply = 0;
+    if (shm->inpos == shm->inlen) {
+        shm->inpos = 0;
+        shm->inlen = 0;
+    }
+    while (1) {
+        ssize_t m = replylen(shm->in+shm->inpos, shm->inlen-shm->inpos);
+        if (m == -1) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (m > 0) {
+            *reply = shm->in+shm->inpos;
+            *replylen_ = m;
+            shm->lastreply = m;
+            return 0;
+        }
+        if (shm->inpos > 0) {
+            memmove(shm->in, shm->in+shm->inpos, shm->inlen-shm->inpos);
+            shm->inlen -= shm->inpos;
+            shm->inpos = 0;
+        }
+        if (shm->incap-shm->inlen < 4096) {
+            size_t cap = shm->incap ? shm->incap*2 : 65536;
+            char *in = realloc(shm->in, cap);
+            if (!in) {
+                return -1;
+            }
+            shm->in = in;
+            shm->incap = cap;
+        }
+        ssize_t nread = readring(shm, shm->in+shm->inlen,
+            shm->incap-shm->inlen);
+        if (nread == -1) {
+            return -1;
+        }
+        shm->inlen += nread;
+    }
+}
@@ -0,0 +1,50 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Client library for the shared memory ring transport. It's for processes
+// that run on the same host as Pogocache and can reach its unix socket.
+// Requests and responses are the normal RESP stream, but they move through
+// a pair of rings in shared memory instead of the socket.
+//
+// A pogoshm handle is not thread-safe. Use one per thread.
+#ifndef POGOSHM_H
+#define POGOSHM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct pogoshm;
+
+// Connect to the Pogocache unix socket at path and move the connection over
+// to a shared memory ring. The ringsize is the number of bytes in each ring,
+// or zero for the server default.
+// Returns NULL and sets errno on failure. The EPROTO errno means that the
+// server refused the ring, for example when it is not running on Linux.
+struct pogoshm *pogoshm_open(const char *path, size_t ringsize);
+void pogoshm_close(struct pogoshm *shm);
+
+// Send one command and wait for its reply. The reply is the raw RESP reply,
+// such as "$5\r\nhello\r\n", and it is valid until the next call.
+// Returns 0 on success, or -1 and sets errno.
+int pogoshm_command(struct pogoshm *shm, int argc, const char *argv[],
+    const size_t argvlen[], const char **reply, size_t *replylen);
+
+// Write raw RESP requests. This blocks until all bytes are in the ring.
+// Use for pipelining, and read the replies with pogoshm_read. The server
+// stops taking requests while the response ring is full, so a pipeline that
+// is larger than the rings must be read while it's written.
+// Returns 0 on success, or -1 and sets errno.
+int pogoshm_write(struct pogoshm *shm, const void *data, size_t len);
+
+// Read raw RESP replies. This blocks until at least one byte is available.
+// Returns the number of bytes read, or -1 and sets errno.
+ssize_t pogoshm_read(struct pogoshm *shm, void *data, size_t len);
+
+#endif
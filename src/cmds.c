@@ -32,7 +32,13 @@
 #include "pogocache.h"
 #include "stats.h"
 #include "monitor.h"
+#include "compress.h"
+#include "tier.h"
+#include "heap.h"
+#include "repl.h"
+#include "route.h"
 #include "tls.h"
+#include "hash.h"
 
 // from main.c
 extern const uint64_t seed;
@@ -49,7 +55,14 @@ extern atomic_bool lowmem;
 extern const int nshards;
 extern const int narenas;
 extern const int64_t procstart;
+extern const bool useshm;
+extern const bool useroute;
+extern const bool usetls;
 extern const int maxconns;
+extern int *numashards;
+extern const bool usesharednothing;
+extern const bool uselockstats;
+extern const int busypoll;
 extern atomic_bool monitoring;
 
 extern struct pogocache *cache;
@@ -83,7 +96,8 @@ static bool set_entry(int shard, int64_t time, const void *key,
 static void execSET(struct conn *conn, const char *cmdname, 
     int64_t now, const char *key,
     size_t keylen, const char *val, size_t vallen, int64_t expires, bool nx,
-    bool xx, bool get, bool keepttl, uint32_t flags, uint64_t cas, bool withcas)
+    bool xx, bool get, bool keepttl, uint32_t flags, uint64_t cas, bool withcas,
+    uint64_t lease, int64_t grace, int64_t delta)
 {
     stat_cmd_set_incr(conn);
     struct set_entry_context ctx = { .conn = conn, .cmdname = cmdname };
@@ -97,6 +111,9 @@ static void execSET(struct conn *conn, const char *cmdname,
         .nx = nx,
         .xx = xx,
         .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+        .lease = lease,
+        .grace = grace,
+        .delta = delta,
         .entry = get?set_entry:0,
         .udata = get?&ctx:0,
     };
@@ -106,6 +123,9 @@ static void execSET(struct conn *conn, const char *cmdname,
         conn_write_error(conn, ERR_OUT_OF_MEMORY);
         return;
     }
+    if (lease && status == POGOCACHE_CANCELED) {
+        stat_lease_rejected_incr(conn);
+    }
     if (get) {
         if (!ctx.written) {
             if (conn_proto(conn) == PROTO_POSTGRES) {
@@ -201,6 +221,9 @@ static void cmdSET(struct conn *conn, struct args *args) {
     uint32_t flags = 0;
     uint64_t cas = 0;
     bool withcas = false;
+    uint64_t lease = 0;
+    int64_t grace = 0;
+    int64_t delta = 0;
     for (size_t i = 3; i < args->len; i++) {
         if (argeq(args, i, "ex")) {
             exkind = 1;
@@ -279,6 +302,36 @@ static void cmdSET(struct conn *conn, struct args *args) {
                 goto err_syntax;
             }
             withcas = true;
+        } else if (argeq(args, i, "lease")) {
+            i++;
+            if (i == args->len) {
+                goto err_syntax;
+            }
+            if (!argu64(args, i, &lease) || lease == 0) {
+                goto err_syntax;
+            }
+        } else if (argeq(args, i, "grace")) {
+            i++;
+            if (i == args->len) {
+                goto err_syntax;
+            }
+            if (!parse_i64(args->bufs[i].data, args->bufs[i].len, &grace) ||
+                grace < 0)
+            {
+                goto err_syntax;
+            }
+            grace = int64_mul_clamp(grace, SECOND);
+        } else if (argeq(args, i, "delta")) {
+            i++;
+            if (i == args->len) {
+                goto err_syntax;
+            }
+            if (!parse_i64(args->bufs[i].data, args->bufs[i].len, &delta) ||
+                delta < 0)
+            {
+                goto err_syntax;
+            }
+            delta = int64_mul_clamp(delta, MILLISECOND);
         } else {
             goto err_syntax;
         }
@@ -291,7 +344,7 @@ static void cmdSET(struct conn *conn, struct args *args) {
         goto err_syntax;
     }
     execSET(conn, "SET", now, key, keylen, val, vallen, expires, nx, xx, get,
-        keepttl, flags, cas, withcas);
+        keepttl, flags, cas, withcas, lease, grace, delta);
     return;
 err_syntax:
     conn_write_error(conn, ERR_SYNTAX_ERROR);
@@ -316,7 +369,7 @@ static void cmdSETEX(struct conn *conn, struct args *args) {
     const char *val = args->bufs[3].data;
     size_t vallen = args->bufs[3].len;
     execSET(conn, "SETEX", now, key, keylen, val, vallen, ex, 0, 0, 0, 0, 0, 0,
-        0);
+        0, 0, 0, 0);
 }
 
 enum get_entry_kind {
@@ -326,6 +379,7 @@ enum get_entry_kind {
 struct get_entry_context {
     struct conn *conn;
     enum get_entry_kind kind;
+    int type;
 };
 
 static void get_entry(int shard, int64_t time, const void *key, size_t keylen,
@@ -334,13 +388,16 @@ static void get_entry(int shard, int64_t time, const void *key, size_t keylen,
 {
     (void)shard, (void)time, (void)expires, (void)flags, (void)update;
     struct get_entry_context *ctx = udata;
+    if (ctx->type != POGOCACHE_TYPE_STRING) {
+        // Only strings are returned. The caller treats others as misses.
+        return;
+    }
     uint8_t buf[24];
     switch (conn_proto(ctx->conn)) {
     case PROTO_POSTGRES:;
         char flagsbuf[24];
-        size_t flagsn = snprintf(flagsbuf, sizeof(flagsbuf), "%" PRIu32, flags);
         char casbuf[24];
-        size_t casn = snprintf(casbuf, sizeof(casbuf), "%" PRIu64, cas);
+        size_t flagsn, casn;
         switch (ctx->kind) {
         case KIND_GET:
             pg_write_row_data(ctx->conn, (const char*[]){ val, }, 
@@ -351,6 +408,8 @@ static void get_entry(int shard, int64_t time, const void *key, size_t keylen,
                 (size_t[]){ keylen, vallen }, 2);
             break;
         case KIND_MGETS:
+            flagsn = pg_encode_i64(ctx->conn, 1, flags, flagsbuf);
+            casn = pg_encode_i64(ctx->conn, 2, cas, casbuf);
             pg_write_row_data(ctx->conn, 
                 (const char*[]){ key, flagsbuf, casbuf, val }, 
                 (size_t[]){ keylen, flagsn, casn, vallen }, 
@@ -390,6 +449,88 @@ static void get_entry(int shard, int64_t time, const void *key, size_t keylen,
     }
 }
 
+static void get_reply(struct conn *conn, int status, int type);
+
+// A GET of a spilled value, which is loaded on the io pool.
+struct bgget_context {
+    struct pogocache_load_opts opts; // the request's load options
+    char *key;
+    size_t keylen;
+    int status;
+    int type;
+    char *val;
+    size_t vallen;
+    int64_t expires;
+    uint32_t flags;
+    uint64_t cas;
+};
+
+static void bgget_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *val, size_t vallen, int64_t expires,
+    uint32_t flags, uint64_t cas, struct pogocache_update **update,
+    void *udata);
+
+// The load options are copied from the request, with the outputs pointed at
+// the context, because the request's stack is gone when the load runs.
+static struct bgget_context *bgget_context_new(const char *key, size_t keylen,
+    struct pogocache_load_opts *opts)
+{
+    struct bgget_context *ctx = xmalloc(sizeof(struct bgget_context));
+    memset(ctx, 0, sizeof(struct bgget_context));
+    ctx->opts = *opts;
+    ctx->opts.lease = 0;
+    ctx->opts.leasetoken = 0;
+    ctx->opts.refresh = 0;
+    ctx->opts.type = &ctx->type;
+    ctx->opts.nospilled = false;
+    ctx->opts.entry = bgget_entry;
+    ctx->opts.udata = ctx;
+    ctx->key = xmalloc(keylen+1);
+    memcpy(ctx->key, key, keylen);
+    ctx->keylen = keylen;
+    return ctx;
+}
+
+static void bgget_context_free(struct bgget_context *ctx) {
+    xfree(ctx->val);
+    xfree(ctx->key);
+    xfree(ctx);
+}
+
+static void bgget_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *val, size_t vallen, int64_t expires,
+    uint32_t flags, uint64_t cas, struct pogocache_update **update,
+    void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)update;
+    struct bgget_context *ctx = udata;
+    ctx->val = xmalloc(vallen+1);
+    memcpy(ctx->val, val, vallen);
+    ctx->vallen = vallen;
+    ctx->expires = expires;
+    ctx->flags = flags;
+    ctx->cas = cas;
+}
+
+static void bgget_work(void *udata) {
+    struct bgget_context *ctx = udata;
+    ctx->status = pogocache_load(cache, ctx->key, ctx->keylen, &ctx->opts);
+}
+
+static void bgget_done(struct conn *conn, void *udata) {
+    struct bgget_context *ctx = udata;
+    if (ctx->status != POGOCACHE_NOTFOUND) {
+        struct get_entry_context gctx = {
+            .conn = conn,
+            .type = ctx->type,
+        };
+        get_entry(0, ctx->opts.time, ctx->key, ctx->keylen, ctx->val, 
+            ctx->vallen, ctx->expires, ctx->flags, ctx->cas, 0, &gctx);
+    }
+    get_reply(conn, ctx->status, ctx->type);
+    bgget_context_free(ctx);
+}
+
 // GET key
 static void cmdGET(struct conn *conn, struct args *args) {
     stat_cmd_get_incr(conn);
@@ -413,15 +554,39 @@ static void cmdGET(struct conn *conn, struct args *args) {
     };
     struct pogocache_load_opts opts = {
         .time = now,
+        .type = &ctx.type,
         .entry = get_entry,
         .udata = &ctx,
+        .nospilled = true,
     };
     int proto = conn_proto(conn);
     if (proto == PROTO_POSTGRES) {
         pg_write_row_desc(conn, (const char*[]){ "value" }, 1);
     }
     int status = pogocache_load(cache, key, keylen, &opts);
-    if (status == POGOCACHE_NOTFOUND) {
+    if (status == POGOCACHE_SPILLED) {
+        // Read the value from secondary storage on the io pool.
+        struct bgget_context *bgctx = bgget_context_new(key, keylen, &opts);
+        if (conn_iowork(conn, bgget_work, bgget_done, bgctx)) {
+            return;
+        }
+        bgget_context_free(bgctx);
+        opts.nospilled = false;
+        status = pogocache_load(cache, key, keylen, &opts);
+    }
+    get_reply(conn, status, ctx.type);
+}
+
+// Writes the rest of the GET reply, after the entry callback.
+static void get_reply(struct conn *conn, int status, int type) {
+    int proto = conn_proto(conn);
+    if (status != POGOCACHE_NOTFOUND && type != POGOCACHE_TYPE_STRING &&
+        proto == PROTO_RESP)
+    {
+        conn_write_error(conn, ERR_WRONG_TYPE);
+    } else if (status == POGOCACHE_NOTFOUND ||
+        type != POGOCACHE_TYPE_STRING)
+    {
         stat_get_misses_incr(conn);
         if (proto == PROTO_HTTP) {
             conn_write_http(conn, 404, "Not Found", "Not Found\r\n" , -1);
@@ -441,6 +606,101 @@ static void cmdGET(struct conn *conn, struct args *args) {
     }
 }
 
+struct lget_entry_context {
+    struct conn *conn;
+    uint64_t *token;
+    bool *refresh;
+    int type;
+};
+
+// The refresh and token outputs are set before the entry callback.
+static void lget_entry(int shard, int64_t time, const void *key, size_t keylen,
+    const void *val, size_t vallen, int64_t expires, uint32_t flags,
+    uint64_t cas, struct pogocache_update **update, void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)expires;
+    (void)flags, (void)cas, (void)update;
+    struct lget_entry_context *ctx = udata;
+    if (ctx->type != POGOCACHE_TYPE_STRING) {
+        conn_write_error(ctx->conn, ERR_WRONG_TYPE);
+        return;
+    }
+    if (!*ctx->refresh) {
+        conn_write_bulk(ctx->conn, val, vallen);
+        return;
+    }
+    conn_write_array(ctx->conn, 2);
+    conn_write_bulk(ctx->conn, val, vallen);
+    if (*ctx->token) {
+        conn_write_int(ctx->conn, (int64_t)*ctx->token);
+    } else {
+        conn_write_null(ctx->conn);
+    }
+}
+
+// LGET key ms
+// Same as GET, but on a miss the first caller is granted a lease for filling
+// the key, which lasts 'ms' milliseconds. The reply is the lease token as an
+// integer. Other callers get a null until the lease holder stores the value
+// using SET key value LEASE token, or until the lease expires.
+// When the key was found but should be refreshed (see SET GRACE and DELTA)
+// the reply is an array of the value and the lease token, with a null token
+// for all but the first caller.
+static void cmdLGET(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_RESP) {
+        conn_write_error(conn, "unavailable");
+        return;
+    }
+    stat_cmd_get_incr(conn);
+    if (args->len != 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    int64_t ms;
+    if (!parse_i64(args->bufs[2].data, args->bufs[2].len, &ms) || ms <= 0) {
+        conn_write_error(conn, "ERR invalid lease time");
+        return;
+    }
+    uint64_t token = 0;
+    bool refresh = false;
+    struct lget_entry_context ctx = { 
+        .conn = conn,
+        .token = &token,
+        .refresh = &refresh,
+    };
+    struct pogocache_load_opts opts = {
+        .time = sys_now(),
+        .lease = int64_mul_clamp(ms, MILLISECOND),
+        .leasetoken = &token,
+        .refresh = &refresh,
+        .stale = true,
+        .type = &ctx.type,
+        .entry = lget_entry,
+        .udata = &ctx,
+    };
+    int status = pogocache_load(cache, args->bufs[1].data, args->bufs[1].len,
+        &opts);
+    if (status == POGOCACHE_NOMEM) {
+        // No memory for the lease of a missing entry, or for reading the
+        // value. Nothing was written.
+        conn_write_error(conn, ERR_OUT_OF_MEMORY);
+    } else if (status == POGOCACHE_NOTFOUND) {
+        stat_get_misses_incr(conn);
+        if (token) {
+            stat_lease_granted_incr(conn);
+            conn_write_int(conn, (int64_t)token);
+        } else {
+            stat_lease_hot_misses_incr(conn);
+            conn_write_null(conn);
+        }
+    } else {
+        stat_get_hits_incr(conn);
+        if (token) {
+            stat_lease_granted_incr(conn);
+        }
+    }
+}
+
 // MGET(S) key [key...]
 static void cmdMGET(struct conn *conn, struct args *args) {
     if (args->len < 2) {
@@ -454,6 +714,7 @@ static void cmdMGET(struct conn *conn, struct args *args) {
     };
     struct pogocache_load_opts opts = {
         .time = now,
+        .type = &ctx.type,
         .entry = get_entry,
         .udata = &ctx,
     };
@@ -462,7 +723,7 @@ static void cmdMGET(struct conn *conn, struct args *args) {
     if (proto == PROTO_POSTGRES) {
         if (ctx.kind == KIND_MGETS) {
             const char *rows[] = {"key", "flags", "cas", "value"};
-            pg_write_row_desc(conn, rows, 4);
+            pg_write_row_desc_typed(conn, rows, "tiit", 4);
         } else {
             const char *rows[] = {"key", "value"};
             pg_write_row_desc(conn, rows, 2);
@@ -474,8 +735,9 @@ static void cmdMGET(struct conn *conn, struct args *args) {
         stat_cmd_get_incr(conn);
         const char *key = args->bufs[i].data;
         size_t keylen = args->bufs[i].len;
+        ctx.type = POGOCACHE_TYPE_STRING;
         int status = pogocache_load(cache, key, keylen, &opts);
-        if (status == POGOCACHE_NOTFOUND) {
+        if (status == POGOCACHE_NOTFOUND || ctx.type != POGOCACHE_TYPE_STRING) {
             stat_get_misses_incr(conn);
             if (proto == PROTO_RESP) {
                 conn_write_null(conn);
@@ -493,17 +755,258 @@ static void cmdMGET(struct conn *conn, struct args *args) {
     }
 }
 
+// An item of an HTTP batch request.
+struct batchitem {
+    const char *key;
+    size_t keylen;
+    const char *val;
+    size_t vallen;
+    int shard;
+    size_t idx;
+    size_t ofs; // offset of the loaded value, or SIZE_MAX when missing
+};
+
+static int batchitem_shard_cmp(const void *a, const void *b) {
+    const struct batchitem *x = a;
+    const struct batchitem *y = b;
+    if (x->shard != y->shard) {
+        return x->shard < y->shard ? -1 : 1;
+    }
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+static int batchitem_idx_cmp(const void *a, const void *b) {
+    const struct batchitem *x = a;
+    const struct batchitem *y = b;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+// Reads the items from the body of an HTTP batch request, which has already
+// been checked by the parser. The items are sorted by shard, allowing for
+// each shard to be locked once for all of its keys.
+static struct batchitem *batch_items(struct args *args, bool pair,
+    size_t *count)
+{
+    bool framed = argeq(args, 2, "framed");
+    const char *body = args->bufs[1].data;
+    size_t bodylen = args->bufs[1].len;
+    struct batchitem *items = 0;
+    size_t nitems = 0;
+    size_t cap = 0;
+    struct batchitem item = { 0 };
+    size_t pos = 0;
+    while (http_batch_next(body, bodylen, framed, pair, &pos, &item.key,
+        &item.keylen, &item.val, &item.vallen) == 1)
+    {
+        if (nitems == cap) {
+            cap = cap == 0 ? 16 : cap*2;
+            items = xrealloc(items, cap*sizeof(struct batchitem));
+        }
+        item.shard = pogocache_shard(cache, item.key, item.keylen);
+        item.idx = nitems;
+        item.ofs = SIZE_MAX;
+        items[nitems++] = item;
+    }
+    if (nitems > 1) {
+        qsort(items, nitems, sizeof(struct batchitem), batchitem_shard_cmp);
+    }
+    *count = nitems;
+    return items;
+}
+
+// Stores the shard sorted items, locking each shard once. Returns false if
+// the cache ran out of memory.
+static bool batch_store(struct conn *conn, struct batchitem *items,
+    size_t nitems, struct pogocache_store_opts *opts)
+{
+    size_t i = 0;
+    while (i < nitems) {
+        int shard = items[i].shard;
+        struct pogocache *batch = pogocache_begin(cache);
+        for (; i < nitems && items[i].shard == shard; i++) {
+            stat_cmd_set_incr(conn);
+            int status = pogocache_store(batch, items[i].key, items[i].keylen,
+                items[i].val, items[i].vallen, opts);
+            if (status == POGOCACHE_NOMEM) {
+                stat_store_no_memory_incr(conn);
+                pogocache_end(batch);
+                return false;
+            }
+        }
+        pogocache_end(batch);
+    }
+    return true;
+}
+
+struct batchget_context {
+    struct buf *out;
+    struct batchitem *item;
+    int type;
+};
+
+static void batchget_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *val, size_t vallen, int64_t expires,
+    uint32_t flags, uint64_t cas, struct pogocache_update **update,
+    void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)expires;
+    (void)flags, (void)cas, (void)update;
+    struct batchget_context *ctx = udata;
+    if (ctx->type != POGOCACHE_TYPE_STRING) {
+        return;
+    }
+    ctx->item->ofs = ctx->out->len;
+    ctx->item->vallen = vallen;
+    buf_append(ctx->out, val, vallen);
+}
+
+// POST /_mget (HTTP only)
+// The body has a list of keys. The response has a value for each key, in the
+// order requested, as "<len>\r\n<value>\r\n", or "-1\r\n" when missing.
+static void cmdHTTPMGET(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_HTTP || args->len != 3) {
+        conn_write_error(conn, "ERR command only available over HTTP");
+        return;
+    }
+    int64_t now = sys_now();
+    size_t nitems;
+    struct batchitem *items = batch_items(args, false, &nitems);
+    struct buf vals = { 0 };
+    struct batchget_context ctx = { .out = &vals };
+    struct pogocache_load_opts opts = {
+        .time = now,
+        .type = &ctx.type,
+        .entry = batchget_entry,
+        .udata = &ctx,
+    };
+    size_t i = 0;
+    while (i < nitems) {
+        int shard = items[i].shard;
+        struct pogocache *batch = pogocache_begin(cache);
+        for (; i < nitems && items[i].shard == shard; i++) {
+            stat_cmd_get_incr(conn);
+            ctx.item = &items[i];
+            ctx.type = POGOCACHE_TYPE_STRING;
+            pogocache_load(batch, items[i].key, items[i].keylen, &opts);
+            if (items[i].ofs == SIZE_MAX) {
+                stat_get_misses_incr(conn);
+            } else {
+                stat_get_hits_incr(conn);
+            }
+        }
+        pogocache_end(batch);
+    }
+    if (nitems > 1) {
+        qsort(items, nitems, sizeof(struct batchitem), batchitem_idx_cmp);
+    }
+    struct buf body = { 0 };
+    uint8_t num[24];
+    for (i = 0; i < nitems; i++) {
+        if (items[i].ofs == SIZE_MAX) {
+            buf_append(&body, "-1\r\n", 4);
+            continue;
+        }
+        buf_append(&body, num, u64toa(items[i].vallen, num));
+        buf_append(&body, "\r\n", 2);
+        buf_append(&body, vals.data+items[i].ofs, items[i].vallen);
+        buf_append(&body, "\r\n", 2);
+    }
+    conn_write_http(conn, 200, "OK", body.data, body.len);
+    buf_clear(&body);
+    buf_clear(&vals);
+    xfree(items);
+}
+
+// POST /_mset[?ttl=seconds][&flags=flags] (HTTP only)
+// The body has a list of key and value pairs, which are all stored with the
+// same ttl and flags.
+static void cmdHTTPMSET(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_HTTP || args->len < 3) {
+        conn_write_error(conn, "ERR command only available over HTTP");
+        return;
+    }
+    int64_t now = sys_now();
+    int64_t expires = 0;
+    uint32_t flags = 0;
+    for (size_t i = 3; i < args->len; i++) {
+        if (argeq(args, i, "ex") && i+1 < args->len) {
+            i++;
+            if (!parse_i64(args->bufs[i].data, args->bufs[i].len,
+                &expires) || expires <= 0)
+            {
+                conn_write_error(conn, "ERR invalid expire time");
+                return;
+            }
+            expires = int64_mul_clamp(expires, SECOND);
+            expires = expiry_seconds_time(conn, now, expires);
+        } else if (argeq(args, i, "flags") && i+1 < args->len) {
+            i++;
+            uint64_t x;
+            if (!argu64(args, i, &x)) {
+                conn_write_error(conn, ERR_SYNTAX_ERROR);
+                return;
+            }
+            flags = x&UINT32_MAX;
+        } else {
+            conn_write_error(conn, ERR_SYNTAX_ERROR);
+            return;
+        }
+    }
+    size_t nitems;
+    struct batchitem *items = batch_items(args, true, &nitems);
+    struct pogocache_store_opts opts = {
+        .time = now,
+        .expires = expires,
+        .flags = flags,
+        .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+    };
+    bool nomem = !batch_store(conn, items, nitems, &opts);
+    xfree(items);
+    if (nomem) {
+        conn_write_error(conn, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    char msg[48];
+    snprintf(msg, sizeof(msg), "Stored %zu\r\n", nitems);
+    conn_write_http(conn, 200, "OK", msg, -1);
+}
+
+// Nanoseconds that a SCAN may run. A SCAN runs on the event loop, and stops
+// early with a cursor to continue from when its time is up. It only stops
+// between shards, so the cursor is the next shard, which stays valid when
+// the entries of a shard move around.
+#define SCANBUDGET 500000
+
+// Keys are gathered by worker threads, each over their own range of shards.
+struct keys_part {
+    struct keys_ctx *ctx;
+    pthread_t th;
+    int start;
+    int nshards;
+    struct buf buf;
+    size_t count;
+    int type;
+};
+
 struct keys_ctx {
     int64_t now;
-    struct buf buf;
     size_t count;
     char *pattern;
     size_t plen;
+    size_t prefixlen;  // literal prefix of the pattern
+    bool anyrest;      // pattern is the prefix followed by a '*'
+    bool values;       // gather string values too, for COPY TO STDOUT
+    bool binary;       // COPY TO STDOUT binary format
+    int nparts;
+    struct keys_part *parts;
 };
 
 static void keys_ctx_free(struct keys_ctx *ctx) {
+    for (int i = 0; i < ctx->nparts; i++) {
+        buf_clear(&ctx->parts[i].buf);
+    }
+    xfree(ctx->parts);
     xfree(ctx->pattern);
-    buf_clear(&ctx->buf);
     xfree(ctx);
 }
 
@@ -511,80 +1014,227 @@ static int keys_entry(int shard, int64_t time, const void *key, size_t keylen,
         const void *value, size_t valuelen, int64_t expires, uint32_t flags,
         uint64_t cas, void *udata)
 {
-    (void)shard, (void)time, (void)value, (void)valuelen, (void)expires, 
-    (void)flags, (void)cas;
-    struct keys_ctx *ctx = udata;
-    if ((ctx->plen == 1 && *ctx->pattern == '*') || 
-        match(ctx->pattern, ctx->plen, key, keylen, 0))
+    (void)shard, (void)time, (void)expires, (void)flags, (void)cas;
+    struct keys_part *part = udata;
+    struct keys_ctx *ctx = part->ctx;
+    if (ctx->values && part->type != POGOCACHE_TYPE_STRING) {
+        return POGOCACHE_ITER_CONTINUE;
+    }
+    // The iterator already matched the literal prefix.
+    if (ctx->anyrest || match(ctx->pattern+ctx->prefixlen, 
+        ctx->plen-ctx->prefixlen, (char*)key+ctx->prefixlen, 
+        keylen-ctx->prefixlen, 0))
     {
-        buf_append_uvarint(&ctx->buf, keylen);
-        buf_append(&ctx->buf, key, keylen);
-        ctx->count++;
+        buf_append_uvarint(&part->buf, keylen);
+        buf_append(&part->buf, key, keylen);
+        if (ctx->values) {
+            buf_append_uvarint(&part->buf, valuelen);
+            buf_append(&part->buf, value, valuelen);
+        }
+        part->count++;
     }
     return POGOCACHE_ITER_CONTINUE;
 }
 
-static void bgkeys_work(void *udata) {
-    struct keys_ctx *ctx = udata;
+static void *thkeys(void *arg) {
+    struct keys_part *part = arg;
+    struct keys_ctx *ctx = part->ctx;
     struct pogocache_iter_opts opts = {
         .time = ctx->now,
+        .oneshard = true,
+        .keysonly = !ctx->values,
+        .type = &part->type,
+        .prefix = ctx->pattern,
+        .prefixlen = ctx->prefixlen,
         .entry = keys_entry,
-        .udata = ctx,
+        .udata = part,
     };
-    pogocache_iter(cache, &opts);
+    for (int i = 0; i < part->nshards; i++) {
+        opts.oneshardidx = part->start+i;
+        pogocache_iter(cache, &opts);
+    }
+    return 0;
+}
+
+static void bgkeys_work(void *udata) {
+    struct keys_ctx *ctx = udata;
+    int nprocs = sys_nprocs();
+    if (nprocs > nshards) {
+        nprocs = nshards;
+    }
+    ctx->nparts = nprocs;
+    ctx->parts = xmalloc(nprocs*sizeof(struct keys_part));
+    memset(ctx->parts, 0, nprocs*sizeof(struct keys_part));
+    int start = 0;
+    for (int i = 0; i < nprocs; i++) {
+        struct keys_part *part = &ctx->parts[i];
+        part->ctx = ctx;
+        part->start = start;
+        part->nshards = nshards/nprocs;
+        if (i == nprocs-1) {
+            part->nshards = nshards-part->start;
+        }
+        // The first range is done by this thread.
+        if (i == 0 || pthread_create(&part->th, 0, thkeys, part) != 0) {
+            part->th = 0;
+        }
+        start += part->nshards;
+    }
+    for (int i = 0; i < nprocs; i++) {
+        struct keys_part *part = &ctx->parts[i];
+        if (part->th == 0) {
+            thkeys(part);
+        }
+    }
+    for (int i = 0; i < nprocs; i++) {
+        struct keys_part *part = &ctx->parts[i];
+        if (part->th != 0) {
+            pthread_join(part->th, 0);
+        }
+        ctx->count += part->count;
+    }
 }
 
 static void bgkeys_done(struct conn *conn, void *udata) {
     struct keys_ctx *ctx = udata;
     int proto = conn_proto(conn);
-    const char *p = ctx->buf.data;
     if (proto == PROTO_POSTGRES) {
         pg_write_row_desc(conn, (const char*[]){ "key" }, 1);
-        for (size_t i = 0; i < ctx->count; i++) {
-            uint64_t keylen;
-            p += varint_read_u64(p, 10, &keylen);
-            const char *key = p;
-            p += keylen;
-            pg_write_row_data(conn, (const char*[]){ key }, 
-                (size_t[]){ keylen }, 1);
-        }
-        pg_write_completef(conn, "KEYS %zu", ctx->count);
-        pg_write_ready(conn, 'I');
     } else {
         conn_write_array(conn, ctx->count);
-        for (size_t i = 0; i < ctx->count; i++) {
+    }
+    for (int i = 0; i < ctx->nparts; i++) {
+        struct keys_part *part = &ctx->parts[i];
+        const char *p = part->buf.data;
+        for (size_t j = 0; j < part->count; j++) {
             uint64_t keylen;
             p += varint_read_u64(p, 10, &keylen);
             const char *key = p;
             p += keylen;
-            conn_write_bulk(conn, key, keylen);
+            if (proto == PROTO_POSTGRES) {
+                pg_write_row_data(conn, (const char*[]){ key }, 
+                    (size_t[]){ keylen }, 1);
+            } else {
+                conn_write_bulk(conn, key, keylen);
+            }
         }
     }
+    if (proto == PROTO_POSTGRES) {
+        pg_write_completef(conn, "KEYS %zu", ctx->count);
+        pg_write_ready(conn, 'I');
+    }
     keys_ctx_free(ctx);
 }
 
-static void cmdKEYS(struct conn *conn, struct args *args) {
-    if (args->len != 2) {
-        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
-        return;
-    }
-    int64_t now = sys_now();
-    const char *pattern = args->bufs[1].data;
-    size_t plen = args->bufs[1].len;
+static struct keys_ctx *keys_ctx_new(const char *pattern, size_t plen) {
     struct keys_ctx *ctx = xmalloc(sizeof(struct keys_ctx));
     memset(ctx, 0, sizeof(struct keys_ctx));
     ctx->pattern = xmalloc(plen+1);
     memcpy(ctx->pattern, pattern, plen);
     ctx->pattern[plen] = '\0';
     ctx->plen = plen;
-    ctx->now = now;
-    if (!conn_bgwork(conn, bgkeys_work, bgkeys_done, ctx)) {
-        conn_write_error(conn, "ERR failed to do work");
-        keys_ctx_free(ctx);
-    }
+    ctx->prefixlen = match_prefix(pattern, plen, &ctx->anyrest);
+    ctx->now = sys_now();
+    return ctx;
 }
 
-// SELECT 0
+static void cmdKEYS(struct conn *conn, struct args *args) {
+    if (args->len != 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    struct keys_ctx *ctx = keys_ctx_new(args->bufs[1].data, args->bufs[1].len);
+    if (!conn_bgwork(conn, bgkeys_work, bgkeys_done, ctx)) {
+        conn_write_error(conn, "ERR failed to do work");
+        keys_ctx_free(ctx);
+    }
+}
+
+static void bgcopyout_done(struct conn *conn, void *udata) {
+    struct keys_ctx *ctx = udata;
+    pg_write_copy_out(conn, ctx->binary, 2);
+    for (int i = 0; i < ctx->nparts; i++) {
+        struct keys_part *part = &ctx->parts[i];
+        const char *p = part->buf.data;
+        for (size_t j = 0; j < part->count; j++) {
+            uint64_t keylen;
+            p += varint_read_u64(p, 10, &keylen);
+            const char *key = p;
+            p += keylen;
+            uint64_t vallen;
+            p += varint_read_u64(p, 10, &vallen);
+            const char *val = p;
+            p += vallen;
+            pg_write_copy_row(conn, ctx->binary, (const char*[]){ key, val },
+                (size_t[]){ keylen, vallen }, 2);
+        }
+    }
+    pg_write_copy_done(conn, ctx->binary);
+    pg_write_completef(conn, "COPY %zu", ctx->count);
+    pg_write_ready(conn, 'I');
+    keys_ctx_free(ctx);
+}
+
+// COPY ... TO STDOUT (Postgres only)
+// _copyout pattern text|binary
+// The string entries with keys matching the pattern are gathered in the
+// background, like KEYS, and written as key and value rows.
+static void cmdCOPYOUT(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_POSTGRES || args->len != 3) {
+        conn_write_error(conn, "ERR command only available over Postgres");
+        return;
+    }
+    struct keys_ctx *ctx = keys_ctx_new(args->bufs[1].data, args->bufs[1].len);
+    ctx->values = true;
+    ctx->binary = argeq(args, 2, "binary");
+    if (!conn_bgwork(conn, bgkeys_work, bgcopyout_done, ctx)) {
+        conn_write_error(conn, "ERR failed to do work");
+        keys_ctx_free(ctx);
+    }
+}
+
+// COPY ... FROM STDIN (Postgres only)
+// _copyin text|binary
+static void cmdCOPYIN(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_POSTGRES || args->len != 2) {
+        conn_write_error(conn, "ERR command only available over Postgres");
+        return;
+    }
+    pg_copy_begin(conn, argeq(args, 1, "binary"));
+}
+
+// _copyrows key value [key value ...]
+// The rows of a COPY FROM STDIN, as they are read by the parser. The rows are
+// stored in shard order, locking each shard once per batch.
+static void cmdCOPYROWS(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_POSTGRES || !pg_copying(conn)) {
+        conn_write_error(conn, "ERR command only available over Postgres");
+        return;
+    }
+    size_t nitems = (args->len-1)/2;
+    struct batchitem *items = xmalloc((nitems+1)*sizeof(struct batchitem));
+    for (size_t i = 0; i < nitems; i++) {
+        struct batchitem *item = &items[i];
+        item->key = args->bufs[1+i*2].data;
+        item->keylen = args->bufs[1+i*2].len;
+        item->val = args->bufs[2+i*2].data;
+        item->vallen = args->bufs[2+i*2].len;
+        item->shard = pogocache_shard(cache, item->key, item->keylen);
+        item->idx = i;
+    }
+    if (nitems > 1) {
+        qsort(items, nitems, sizeof(struct batchitem), batchitem_shard_cmp);
+    }
+    struct pogocache_store_opts opts = {
+        .time = sys_now(),
+        .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+    };
+    bool nomem = !batch_store(conn, items, nitems, &opts);
+    xfree(items);
+    pg_copy_stored(conn, nomem ? 0 : nitems, nomem ? "out of memory" : 0);
+}
+
+// SELECT 0
 // This is an undocumented RESP only command that exists in order to provide
 // compatibility for certain integrations that need it.
 static void cmdSELECT(struct conn *conn, struct args *args) {
@@ -947,7 +1597,8 @@ static void ttl_entry(int shard, int64_t time, const void *key, size_t keylen,
     struct ttlctx *ctx = udata;
     int64_t ttl;
     if (expires > 0) {
-        ttl = expires-time;
+        // Zero while the entry is served in its grace period.
+        ttl = expires > time ? expires-time : 0;
         if (ctx->pttl) {
             ttl /= MILLISECOND;
         } else {
@@ -958,7 +1609,7 @@ static void ttl_entry(int shard, int64_t time, const void *key, size_t keylen,
     }
     if (conn_proto(ctx->conn) == PROTO_POSTGRES) {
         char ttlstr[24];
-        size_t n = i64toa(ttl, (uint8_t*)ttlstr);
+        size_t n = pg_encode_i64(ctx->conn, 0, ttl, ttlstr);
         pg_write_row_data(ctx->conn, (const char*[]){ ttlstr }, 
             (size_t[]){ n }, 1);
     } else {
@@ -983,7 +1634,8 @@ static void cmdTTL(struct conn *conn, struct args *args) {
     };
     int proto = conn_proto(conn);
     if (proto == PROTO_POSTGRES) {
-        pg_write_row_desc(conn, (const char*[]){ pttl?"pttl":"ttl" }, 1);
+        pg_write_row_desc_typed(conn, (const char*[]){ pttl?"pttl":"ttl" }, "i",
+            1);
     }
     int status = pogocache_load(cache, key, keylen, &opts);
     if (status == POGOCACHE_NOTFOUND) {
@@ -1236,6 +1888,37 @@ static void cmdSWEEP(struct conn *conn, struct args *args) {
     }
 }
 
+// DELPREFIX prefix [prefix ...]
+// Deletes all keys that start with a prefix, without scanning the cache.
+// The keys are missing from now on, and are reclaimed by the next sweep.
+static void cmdDELPREFIX(struct conn *conn, struct args *args) {
+    if (args->len < 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    struct pogocache_invalidate_opts opts = {
+        .time = sys_now(),
+    };
+    for (size_t i = 1; i < args->len; i++) {
+        const char *prefix = args->bufs[i].data;
+        size_t prefixlen = args->bufs[i].len;
+        if (pogocache_invalidate(cache, prefix, prefixlen, &opts) != 
+            POGOCACHE_FINISHED)
+        {
+            conn_write_error(conn, ERR_OUT_OF_MEMORY);
+            return;
+        }
+        repl_invalidate(prefix, prefixlen);
+    }
+    atomic_store(&sweep, true);
+    if (conn_proto(conn) == PROTO_POSTGRES) {
+        pg_write_completef(conn, "DELPREFIX %zu", args->len-1);
+        pg_write_ready(conn, 'I');
+    } else {
+        conn_write_string(conn, "OK");
+    }
+}
+
 static void purge_work(void *udata) {
     (void)udata;
     int64_t start = sys_now();
@@ -1539,7 +2222,7 @@ static void monitor_done(struct conn *conn, void *udata) {
 
 
 static void cmdMONITOR(struct conn *conn, struct args *args) {
-    if (conn_proto(conn) != PROTO_RESP) {
+    if (conn_proto(conn) != PROTO_RESP || conn_isshm(conn)) {
         conn_write_error(conn, "unavailable");
         return;
     }
@@ -1558,6 +2241,52 @@ static void cmdMONITOR(struct conn *conn, struct args *args) {
 
 }
 
+struct sync_ctx {
+    int fd;
+    char id[64];
+    uint64_t offset;
+};
+
+static void sync_work(void *udata) {
+    struct sync_ctx *ctx = udata;
+    repl_serve(ctx->fd, ctx->id, ctx->offset);
+}
+
+static void sync_done(struct conn *conn, void *udata) {
+    xfree(udata);
+    conn_close(conn);
+}
+
+// SYNC replid offset
+// Used by replicas for streaming changes from this server. The changes are
+// written straight to the socket, so TLS connections are not supported.
+static void cmdSYNC(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_RESP || conn_isshm(conn) ||
+        conn_istls(conn))
+    {
+        conn_write_error(conn, "unavailable");
+        return;
+    }
+    if (args->len != 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    uint64_t offset;
+    if (!argu64(args, 2, &offset) || args->bufs[1].len > 63) {
+        conn_write_error(conn, ERR_SYNTAX_ERROR);
+        return;
+    }
+    struct sync_ctx *ctx = xmalloc(sizeof(struct sync_ctx));
+    memset(ctx, 0, sizeof(struct sync_ctx));
+    ctx->fd = conn_fd(conn);
+    memcpy(ctx->id, args->bufs[1].data, args->bufs[1].len);
+    ctx->offset = offset;
+    if (!conn_bgwork(conn, sync_work, sync_done, ctx)) {
+        conn_write_error(conn, "ERR failed to do work");
+        xfree(ctx);
+    }
+}
+
 static void cmdPING(struct conn *conn, struct args *args) {
     if (args->len > 2) {
         conn_write_error(conn, ERR_WRONG_NUM_ARGS);
@@ -1579,6 +2308,83 @@ static void cmdPING(struct conn *conn, struct args *args) {
     }
 }
 
+// SHMRING [size]
+// Moves a unix socket connection over to a shared memory ring. The reply
+// carries a memfd that the client maps. See client/pogoshm.h.
+static void cmdSHMRING(struct conn *conn, struct args *args) {
+    if (conn_proto(conn) != PROTO_RESP) {
+        conn_write_error(conn, "unavailable");
+        return;
+    }
+    if (args->len > 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    uint64_t size = 0;
+    if (args->len == 2 && !argu64(args, 1, &size)) {
+        conn_write_error(conn, ERR_SYNTAX_ERROR);
+        return;
+    }
+    const char *err;
+    if (!conn_shmring(conn, size, &err)) {
+        conn_write_error(conn, err);
+    }
+}
+
+static void client_list_iter(struct net_conninfo *info, void *udata) {
+    struct args *lines = udata;
+    char line[512];
+    size_t n = snprintf(line, sizeof(line), "id=%" PRIu64 " addr=%s fd=%d "
+        "thread=%d age=%" PRId64 " idle=%" PRId64 " inmem=%zu outmem=%zu "
+        "mem=%zu tls=%d shm=%d", info->id, info->addr, info->fd, 
+        info->thread, info->age/SECOND, info->idle/SECOND, info->inmem, 
+        info->outmem, info->mem, info->tls, info->shm);
+    args_append(lines, line, n, false);
+}
+
+// CLIENT LIST
+static void cmdCLIENT(struct conn *conn, struct args *args) {
+    if (args->len != 2 || !argeq(args, 1, "list")) {
+        conn_write_error(conn, ERR_SYNTAX_ERROR);
+        return;
+    }
+    struct args lines = { 0 };
+    net_conns(client_list_iter, &lines);
+    int proto = conn_proto(conn);
+    if (proto == PROTO_POSTGRES) {
+        pg_write_row_desc(conn, (const char*[]){ "client" }, 1);
+        for (size_t i = 0; i < lines.len; i++) {
+            pg_write_row_data(conn, (const char*[]){ lines.bufs[i].data },
+                (size_t[]){ lines.bufs[i].len }, 1);
+        }
+        pg_write_completef(conn, "CLIENT %zu", lines.len);
+        pg_write_ready(conn, 'I');
+    } else {
+        struct buf buf = { 0 };
+        for (size_t i = 0; i < lines.len; i++) {
+            if (proto == PROTO_MEMCACHE) {
+                buf_append(&buf, "CLIENT ", 7);
+            }
+            buf_append(&buf, lines.bufs[i].data, lines.bufs[i].len);
+            if (proto == PROTO_MEMCACHE) {
+                buf_append(&buf, "\r\n", 2);
+            } else {
+                buf_append_byte(&buf, '\n');
+            }
+        }
+        if (proto == PROTO_MEMCACHE) {
+            buf_append(&buf, "END\r\n", 5);
+            conn_write_raw(conn, buf.data, buf.len);
+        } else if (proto == PROTO_HTTP) {
+            conn_write_http(conn, 200, "OK", buf.data, buf.len);
+        } else {
+            conn_write_bulk(conn, buf.data, buf.len);
+        }
+        buf_clear(&buf);
+    }
+    args_free(&lines);
+}
+
 static void cmdQUIT(struct conn *conn, struct args *args) {
     (void)args;
     if (conn_proto(conn) == PROTO_RESP) {
@@ -1625,120 +2431,66 @@ static void cmdTOUCH(struct conn *conn, struct args *args) {
     }
 }
 
-struct get64ctx {
-    bool ok;
-    bool isunsigned;
-    union {
-        int64_t ival;
-        uint64_t uval;
-    };
-    int64_t expires;
-    uint32_t flags;
-    uint64_t cas;
-};
-
 union delta { 
     uint64_t u;
     int64_t i;
 };
 
-static void get64(int shard, int64_t time, const void *key,
-    size_t keylen, const void *val, size_t vallen, int64_t expires,
-    uint32_t flags, uint64_t cas, struct pogocache_update **update, void *udata)
-{
-    (void)shard, (void)time, (void)key, (void)keylen, (void)update;
-    struct get64ctx *ctx = udata;
-    ctx->flags = flags;
-    ctx->expires = expires;
-    ctx->cas = cas;
-    if (ctx->isunsigned) {
-        ctx->ok = parse_u64(val, vallen, &ctx->uval);
-    } else {
-        ctx->ok = parse_i64(val, vallen, &ctx->ival);
-    }
-}
-
 static void execINCRDECR(struct conn *conn, const char *key, size_t keylen, 
     union delta delta, bool decr, bool isunsigned, const char *cmdname)
 {
     bool hit = false;
     bool miss = false;
-    int64_t now = sys_now();
-    struct get64ctx ctx = { .isunsigned = isunsigned };
-    struct pogocache *batch = pogocache_begin(cache);
-    struct pogocache_load_opts gopts = {
-        .time = now,
-        .entry = get64,
-        .udata = &ctx,
+    int proto = conn_proto(conn);
+    struct pogocache_incr_opts opts = {
+        .time = sys_now(),
+        .isunsigned = isunsigned,
+        .decr = decr,
+        .nocreate = proto == PROTO_MEMCACHE,
+        .wrap = proto == PROTO_MEMCACHE,
+        .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
     };
-    int status = pogocache_load(batch, key, keylen, &gopts);
-    bool found = status == POGOCACHE_FOUND;
-    if (found && !ctx.ok) {
-        if (conn_proto(conn) == PROTO_MEMCACHE) {
-            conn_write_raw_cstr(conn, "CLIENT_ERROR cannot increment or "
-                "decrement non-numeric value\r\n");
-            goto done;
-        }
-        goto fail_value_non_numeric;
-    } else if (!found && conn_proto(conn) == PROTO_MEMCACHE) {
+    union delta val;
+    int status = pogocache_incr(cache, key, keylen, delta.u, &val.u, &opts);
+    switch (status) {
+    case POGOCACHE_NOTFOUND:
         miss = true;
         conn_write_raw_cstr(conn, "NOT_FOUND\r\n");
         goto done;
-    }
-    // add or subtract
-    bool overflow;
-    if (isunsigned) {
-        if (decr) {
-            overflow = __builtin_sub_overflow(ctx.uval, delta.u, &ctx.uval);
-        } else {
-            overflow = __builtin_add_overflow(ctx.uval, delta.u, &ctx.uval);
+    case POGOCACHE_WRONGTYPE:
+        if (proto != PROTO_MEMCACHE) {
+            conn_write_error(conn, ERR_WRONG_TYPE);
+            goto done;
         }
-    } else {
-        if (decr) {
-            overflow = __builtin_sub_overflow(ctx.ival, delta.i, &ctx.ival);
-        } else {
-            overflow = __builtin_add_overflow(ctx.ival, delta.i, &ctx.ival);
+        // fallthrough
+    case POGOCACHE_NOTNUMBER:
+        if (proto == PROTO_MEMCACHE) {
+            conn_write_raw_cstr(conn, "CLIENT_ERROR cannot increment or "
+                "decrement non-numeric value\r\n");
+            goto done;
         }
-    }
-    if (overflow && conn_proto(conn) != PROTO_MEMCACHE) {
+        goto fail_value_non_numeric;
+    case POGOCACHE_OVERFLOW:
         goto fail_overflow;
-    }
-    // re-set the value
-    char val[24];
-    size_t vallen;
-    if (isunsigned) {
-        vallen = u64toa(ctx.uval, (uint8_t*)val);
-    } else {
-        vallen = i64toa(ctx.ival, (uint8_t*)val);
-    }
-    struct pogocache_store_opts sopts = {
-        .time = now,
-        .expires = ctx.expires, 
-        .flags = ctx.flags, 
-        .cas = ctx.cas,
-        .udata = &ctx,
-    };
-    status = pogocache_store(batch, key, keylen, val, vallen, &sopts);
-    if (status == POGOCACHE_NOMEM) {
+    case POGOCACHE_NOMEM:
         stat_store_no_memory_incr(conn);
         conn_write_error(conn, ERR_OUT_OF_MEMORY);
         goto done;
     }
     assert(status == POGOCACHE_INSERTED || status == POGOCACHE_REPLACED);
-    int proto = conn_proto(conn);
     if (proto == PROTO_POSTGRES) {
-        char val[24];
+        char str[24];
         if (isunsigned) {
-            snprintf(val, sizeof(val), "%" PRIu64, ctx.uval);
+            snprintf(str, sizeof(str), "%" PRIu64, val.u);
         } else {
-            snprintf(val, sizeof(val), "%" PRIi64, ctx.ival);
+            snprintf(str, sizeof(str), "%" PRIi64, val.i);
         }
-        pg_write_simple_row_str_readyf(conn, "value", val, "%s", cmdname);
+        pg_write_simple_row_str_readyf(conn, "value", str, "%s", cmdname);
     } else {
         if (isunsigned) {
-            conn_write_uint(conn, ctx.uval);
+            conn_write_uint(conn, val.u);
         } else {
-            conn_write_int(conn, ctx.ival);
+            conn_write_int(conn, val.i);
         }
         if (proto == PROTO_MEMCACHE) {
             conn_write_raw_cstr(conn, "\r\n");
@@ -1766,7 +2518,6 @@ done:
             stat_incr_misses_incr(conn);
         }
     }
-    pogocache_end(batch);
 }
 
 static void cmdINCRDECRBY(struct conn *conn, struct args *args, 
@@ -1836,6 +2587,8 @@ static void cmdINCR(struct conn *conn, struct args *args) {
 
 struct appendctx {
     bool prepend;
+    bool wrongtype;
+    int type;
     uint32_t flags;
     int64_t expires;
     const char *val;
@@ -1850,6 +2603,10 @@ static void append_entry(int shard, int64_t time, const void *key,
 {
     (void)shard, (void)time, (void)key, (void)keylen, (void)update, (void)cas;
     struct appendctx *ctx = udata;
+    if (ctx->type != POGOCACHE_TYPE_STRING) {
+        ctx->wrongtype = true;
+        return;
+    }
     ctx->expires = expires;
     ctx->flags = flags;
     ctx->outvallen = vallen+ctx->vallen;
@@ -1886,6 +2643,7 @@ static void cmdAPPEND(struct conn *conn, struct args *args) {
     struct pogocache *batch = pogocache_begin(cache);
     struct pogocache_load_opts lopts = { 
         .time = now,
+        .type = &ctx.type,
         .entry = append_entry,
         .udata = &ctx,
     };
@@ -1900,6 +2658,13 @@ static void cmdAPPEND(struct conn *conn, struct args *args) {
             .time = now,
         };
         status = pogocache_store(batch, key, keylen, val, vallen, &sopts);
+    } else if (ctx.wrongtype) {
+        if (proto == PROTO_MEMCACHE) {
+            conn_write_raw_cstr(conn, "NOT_STORED\r\n");
+        } else {
+            conn_write_error(conn, ERR_WRONG_TYPE);
+        }
+        goto done;
     } else {
         if (ctx.outvallen > MAXARGSZ) {
             // do not let values become larger than 500MB
@@ -1910,7 +2675,7 @@ static void cmdAPPEND(struct conn *conn, struct args *args) {
         len = ctx.outvallen;
         struct pogocache_store_opts sopts = {
             .time = now,
-            .expires = ctx.expires,
+            .keepttl = true,
             .flags = ctx.flags,
         };
         status = pogocache_store(batch, key, keylen, ctx.outval, ctx.outvallen, 
@@ -1938,6 +2703,485 @@ static void cmdPREPEND(struct conn *conn, struct args *args) {
     cmdAPPEND(conn, args);
 }
 
+// Hash commands. A hash is stored as a single entry with an encoded value,
+// see hash.c. Reads are replied to from the load callback, and changes use
+// pogocache_modify, which rewrites the hash while holding the shard lock.
+// Field expirations are unix times.
+
+static bool resp_only(struct conn *conn) {
+    if (conn_proto(conn) != PROTO_RESP) {
+        conn_write_error(conn, "unavailable");
+        return false;
+    }
+    return true;
+}
+
+// Parses 'FIELDS numfields field [field ...]' at args[idx], which must be
+// the last arguments.
+static bool hash_fields_arg(struct conn *conn, struct args *args, size_t idx) {
+    int64_t n;
+    if (idx+2 > args->len || !argeq(args, idx, "fields")) {
+        conn_write_error(conn, ERR_SYNTAX_ERROR);
+        return false;
+    }
+    if (!argi64(args, idx+1, &n) || n <= 0 ||
+        (size_t)n != args->len-idx-2)
+    {
+        conn_write_error(conn, "ERR the numfields parameter must match the "
+            "number of arguments");
+        return false;
+    }
+    return true;
+}
+
+struct hash_read_ctx {
+    struct conn *conn;
+    struct args *args;
+    int type;
+    int64_t unixnow;
+    void (*reply)(struct hash_read_ctx *ctx, const char *data, size_t len);
+};
+
+static void hash_read_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *val, size_t vallen, int64_t expires,
+    uint32_t flags, uint64_t cas, struct pogocache_update **update,
+    void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)expires;
+    (void)flags, (void)cas, (void)update;
+    struct hash_read_ctx *ctx = udata;
+    if (ctx->type != POGOCACHE_TYPE_HASH) {
+        conn_write_error(ctx->conn, ERR_WRONG_TYPE);
+        return;
+    }
+    ctx->reply(ctx, val, vallen);
+}
+
+// Replies to a read of the hash at args[1]. The reply callback is called with
+// the encoded hash, which is empty when the key does not exist.
+static void hash_read(struct conn *conn, struct args *args, 
+    void (*reply)(struct hash_read_ctx *ctx, const char *data, size_t len))
+{
+    struct hash_read_ctx ctx = {
+        .conn = conn,
+        .args = args,
+        .unixnow = sys_unixnow(),
+        .reply = reply,
+    };
+    struct pogocache_load_opts opts = {
+        .time = sys_now(),
+        .type = &ctx.type,
+        .entry = hash_read_entry,
+        .udata = &ctx,
+    };
+    int status = pogocache_load(cache, args->bufs[1].data, args->bufs[1].len,
+        &opts);
+    if (status == POGOCACHE_NOTFOUND) {
+        stat_get_misses_incr(conn);
+        reply(&ctx, 0, 0);
+    } else if (status == POGOCACHE_NOMEM) {
+        conn_write_error(conn, ERR_OUT_OF_MEMORY);
+    } else {
+        stat_get_hits_incr(conn);
+    }
+}
+
+static void hget_reply(struct hash_read_ctx *ctx, const char *data,
+    size_t len)
+{
+    struct args *args = ctx->args;
+    if (argeq(args, 0, "hmget")) {
+        conn_write_array(ctx->conn, args->len-2);
+    }
+    for (size_t i = 2; i < args->len; i++) {
+        struct hash_field f;
+        if (hash_get(data, len, ctx->unixnow, args->bufs[i].data,
+            args->bufs[i].len, &f))
+        {
+            conn_write_bulk(ctx->conn, f.value, f.valuelen);
+        } else {
+            conn_write_null(ctx->conn);
+        }
+    }
+}
+
+// HGET key field
+static void cmdHGET(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    hash_read(conn, args, hget_reply);
+}
+
+// HMGET key field [field ...]
+static void cmdHMGET(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len < 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    hash_read(conn, args, hget_reply);
+}
+
+static void hgetall_reply(struct hash_read_ctx *ctx, const char *data,
+    size_t len)
+{
+    bool keys = argeq(ctx->args, 0, "hkeys");
+    bool vals = argeq(ctx->args, 0, "hvals");
+    size_t count = hash_count(data, len, ctx->unixnow);
+    conn_write_array(ctx->conn, keys || vals ? count : count*2);
+    struct hash_field f;
+    size_t pos = 0;
+    while (hash_next(data, len, ctx->unixnow, &pos, &f)) {
+        if (!vals) {
+            conn_write_bulk(ctx->conn, f.field, f.fieldlen);
+        }
+        if (!keys) {
+            conn_write_bulk(ctx->conn, f.value, f.valuelen);
+        }
+    }
+}
+
+// HGETALL key
+// HKEYS key
+// HVALS key
+static void cmdHGETALL(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    hash_read(conn, args, hgetall_reply);
+}
+
+static void hlen_reply(struct hash_read_ctx *ctx, const char *data,
+    size_t len)
+{
+    if (argeq(ctx->args, 0, "hexists")) {
+        struct hash_field f;
+        conn_write_int(ctx->conn, hash_get(data, len, ctx->unixnow, 
+            ctx->args->bufs[2].data, ctx->args->bufs[2].len, &f));
+    } else {
+        conn_write_int(ctx->conn, hash_count(data, len, ctx->unixnow));
+    }
+}
+
+// HLEN key
+static void cmdHLEN(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    hash_read(conn, args, hlen_reply);
+}
+
+// HEXISTS key field
+static void cmdHEXISTS(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    hash_read(conn, args, hlen_reply);
+}
+
+static void httl_reply(struct hash_read_ctx *ctx, const char *data,
+    size_t len)
+{
+    struct args *args = ctx->args;
+    conn_write_array(ctx->conn, args->len-4);
+    for (size_t i = 4; i < args->len; i++) {
+        struct hash_field f;
+        if (!hash_get(data, len, ctx->unixnow, args->bufs[i].data,
+            args->bufs[i].len, &f))
+        {
+            conn_write_int(ctx->conn, -2);
+        } else if (f.expires == 0) {
+            conn_write_int(ctx->conn, -1);
+        } else {
+            conn_write_int(ctx->conn, 
+                (f.expires-ctx->unixnow+SECOND-1)/SECOND);
+        }
+    }
+}
+
+// HTTL key FIELDS numfields field [field ...]
+// Returns the remaining seconds for each field, -1 for fields without an
+// expiration, and -2 for fields that do not exist.
+static void cmdHTTL(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len < 5) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    if (hash_fields_arg(conn, args, 2)) {
+        hash_read(conn, args, httl_reply);
+    }
+}
+
+struct hash_write_ctx {
+    struct hash_change *changes;
+    int nchanges;
+    int64_t unixnow;
+    struct buf buf;
+    struct pogocache_update update;
+    bool incr;           // HINCRBY on the first change
+    int64_t delta;
+    int64_t result;
+    const char *err;
+    char num[24];
+};
+
+static void hash_write_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *val, size_t vallen, int64_t expires,
+    uint32_t flags, struct pogocache_update **update, void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen;
+    struct hash_write_ctx *ctx = udata;
+    if (ctx->incr) {
+        struct hash_field *f = &ctx->changes[0].f;
+        struct hash_field old;
+        int64_t x = 0;
+        if (hash_get(val, vallen, ctx->unixnow, f->field, f->fieldlen, &old)
+            && !parse_i64(old.value, old.valuelen, &x))
+        {
+            ctx->err = "ERR hash value is not an integer";
+            return;
+        }
+        if (__builtin_add_overflow(x, ctx->delta, &x)) {
+            ctx->err = "ERR increment or decrement would overflow";
+            return;
+        }
+        ctx->result = x;
+        f->valuelen = snprintf(ctx->num, sizeof(ctx->num), "%" PRId64, x);
+        f->value = ctx->num;
+    }
+    size_t count = hash_rewrite(val, vallen, ctx->unixnow, ctx->changes,
+        ctx->nchanges, &ctx->buf);
+    bool changed = false;
+    for (int i = 0; i < ctx->nchanges; i++) {
+        changed = changed || ctx->changes[i].status != HASH_MISSING;
+    }
+    if (!changed && !(val && count == 0)) {
+        return;
+    }
+    // Store the new hash, or delete the entry when the hash is empty.
+    ctx->update = (struct pogocache_update) {
+        .value = count > 0 ? ctx->buf.data : 0,
+        .valuelen = ctx->buf.len,
+        .expires = expires,
+        .flags = flags,
+    };
+    *update = &ctx->update;
+}
+
+// Applies the changes to the hash at args[1], setting the status of each
+// change. Returns false if an error was written.
+static bool hash_write(struct conn *conn, struct args *args,
+    struct hash_write_ctx *ctx)
+{
+    ctx->unixnow = sys_unixnow();
+    struct pogocache_modify_opts opts = {
+        .time = sys_now(),
+        .type = POGOCACHE_TYPE_HASH,
+        .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+        .entry = hash_write_entry,
+        .udata = ctx,
+    };
+    int status = pogocache_modify(cache, args->bufs[1].data, 
+        args->bufs[1].len, &opts);
+    buf_clear(&ctx->buf);
+    if (status == POGOCACHE_WRONGTYPE) {
+        conn_write_error(conn, ERR_WRONG_TYPE);
+        return false;
+    }
+    if (status == POGOCACHE_NOMEM) {
+        stat_store_no_memory_incr(conn);
+        conn_write_error(conn, ERR_OUT_OF_MEMORY);
+        return false;
+    }
+    if (ctx->err) {
+        conn_write_error(conn, ctx->err);
+        return false;
+    }
+    return true;
+}
+
+// Returns changes for the args from args[start] to args[end], stepping by
+// 'step' args per field.
+static struct hash_change *hash_changes(struct args *args, size_t start,
+    size_t end, size_t step, int action, int *nchanges)
+{
+    *nchanges = (end-start)/step;
+    struct hash_change *changes = xmalloc(sizeof(struct hash_change)*
+        (*nchanges));
+    for (int i = 0; i < *nchanges; i++) {
+        size_t j = start+i*step;
+        changes[i] = (struct hash_change) {
+            .f.field = args->bufs[j].data,
+            .f.fieldlen = args->bufs[j].len,
+            .action = action,
+        };
+        if (step == 2) {
+            changes[i].f.value = args->bufs[j+1].data;
+            changes[i].f.valuelen = args->bufs[j+1].len;
+        }
+    }
+    return changes;
+}
+
+static int count_status(struct hash_write_ctx *ctx, int status) {
+    int count = 0;
+    for (int i = 0; i < ctx->nchanges; i++) {
+        count += ctx->changes[i].status == status;
+    }
+    return count;
+}
+
+// HSET key field value [field value ...]
+// Returns the number of fields that were added.
+static void cmdHSET(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len < 4 || args->len%2 != 0) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    stat_cmd_set_incr(conn);
+    struct hash_write_ctx ctx = { 0 };
+    ctx.changes = hash_changes(args, 2, args->len, 2, HASH_SETVALUE,
+        &ctx.nchanges);
+    if (hash_write(conn, args, &ctx)) {
+        conn_write_int(conn, count_status(&ctx, HASH_ADDED));
+    }
+    xfree(ctx.changes);
+}
+
+// HDEL key field [field ...]
+// Returns the number of fields that were deleted.
+static void cmdHDEL(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len < 3) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    struct hash_write_ctx ctx = { 0 };
+    ctx.changes = hash_changes(args, 2, args->len, 1, HASH_DELETE,
+        &ctx.nchanges);
+    if (hash_write(conn, args, &ctx)) {
+        conn_write_int(conn, count_status(&ctx, HASH_EXISTED));
+    }
+    xfree(ctx.changes);
+}
+
+// HINCRBY key field increment
+// The field keeps its expiration.
+static void cmdHINCRBY(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 4) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    struct hash_write_ctx ctx = { .incr = true };
+    if (!argi64(args, 3, &ctx.delta)) {
+        conn_write_error(conn, ERR_INVALID_INTEGER);
+        return;
+    }
+    ctx.changes = hash_changes(args, 2, 3, 1, HASH_SETVALUE|HASH_KEEPTTL,
+        &ctx.nchanges);
+    if (hash_write(conn, args, &ctx)) {
+        conn_write_int(conn, ctx.result);
+    }
+    xfree(ctx.changes);
+}
+
+// HEXPIRE key seconds FIELDS numfields field [field ...]
+// Returns for each field 1 when the expiration was set, 2 when the field was
+// deleted because the expiration is zero, or -2 when it does not exist.
+static void cmdHEXPIRE(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len < 6) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    int64_t secs;
+    if (!argi64(args, 2, &secs) || secs < 0) {
+        conn_write_error(conn, "ERR invalid expire time");
+        return;
+    }
+    if (!hash_fields_arg(conn, args, 3)) {
+        return;
+    }
+    struct hash_write_ctx ctx = { 0 };
+    int action = secs == 0 ? HASH_DELETE : HASH_SETEXPIRES;
+    ctx.changes = hash_changes(args, 5, args->len, 1, action,
+        &ctx.nchanges);
+    int64_t expires = int64_add_clamp(sys_unixnow(), 
+        int64_mul_clamp(secs, SECOND));
+    for (int i = 0; i < ctx.nchanges; i++) {
+        ctx.changes[i].f.expires = expires;
+    }
+    if (hash_write(conn, args, &ctx)) {
+        conn_write_array(conn, ctx.nchanges);
+        for (int i = 0; i < ctx.nchanges; i++) {
+            if (ctx.changes[i].status == HASH_MISSING) {
+                conn_write_int(conn, -2);
+            } else {
+                conn_write_int(conn, secs == 0 ? 2 : 1);
+            }
+        }
+    }
+    xfree(ctx.changes);
+}
+
+// TYPE key
+static void cmdTYPE(struct conn *conn, struct args *args) {
+    if (!resp_only(conn)) {
+        return;
+    }
+    if (args->len != 2) {
+        conn_write_error(conn, ERR_WRONG_NUM_ARGS);
+        return;
+    }
+    int type = POGOCACHE_TYPE_STRING;
+    struct pogocache_load_opts opts = {
+        .time = sys_now(),
+        .notouch = true,
+        .type = &type,
+    };
+    int status = pogocache_load(cache, args->bufs[1].data, args->bufs[1].len,
+        &opts);
+    if (status == POGOCACHE_NOTFOUND) {
+        conn_write_string(conn, "none");
+    } else if (type == POGOCACHE_TYPE_HASH) {
+        conn_write_string(conn, "hash");
+    } else {
+        conn_write_string(conn, "string");
+    }
+}
+
 static void cmdAUTH(struct conn *conn, struct args *args) {
     stat_auth_cmds_incr(0);
     if (!argeq(args, 0, "auth")) {
@@ -2071,6 +3315,10 @@ static void stats(struct conn *conn) {
     stats_printf(&stats, "curr_connections %zu", net_nconns());
     stats_printf(&stats, "total_connections %zu", net_tconns());
     stats_printf(&stats, "rejected_connections %zu", net_rconns());
+    stats_printf(&stats, "shm_connections %zu", net_shmconns());
+    stats_printf(&stats, "idle_closed_connections %zu", net_idleconns());
+    stats_printf(&stats, "limit_closed_connections %" PRIu64, 
+        stat_limit_closed());
     stats_printf(&stats, "cmd_get %" PRIu64, stat_cmd_get());
     stats_printf(&stats, "cmd_set %" PRIu64, stat_cmd_set());
     stats_printf(&stats, "cmd_flush %" PRIu64, stat_cmd_flush());
@@ -2089,7 +3337,13 @@ static void stats(struct conn *conn) {
     stats_printf(&stats, "store_no_memory %" PRIu64, stat_store_no_memory());
     stats_printf(&stats, "auth_cmds %" PRIu64, stat_auth_cmds());
     stats_printf(&stats, "auth_errors %" PRIu64, stat_auth_errors());
+    stats_printf(&stats, "lease_granted %" PRIu64, stat_lease_granted());
+    stats_printf(&stats, "lease_hot_misses %" PRIu64, stat_lease_hot_misses());
+    stats_printf(&stats, "lease_rejected %" PRIu64, stat_lease_rejected());
     stats_printf(&stats, "threads %d", nthreads);
+    if (usesharednothing) {
+        stats_printf(&stats, "cmd_forwarded %" PRIu64, stat_forwarded());
+    }
     struct sys_meminfo meminfo;
     sys_getmeminfo(&meminfo);
     stats_printf(&stats, "rss %zu", meminfo.rss);
@@ -2097,6 +3351,151 @@ static void stats(struct conn *conn) {
     stats_printf(&stats, "bytes %zu", pogocache_size(cache, &sopts));
     stats_printf(&stats, "curr_items %zu", pogocache_count(cache, 0));
     stats_printf(&stats, "total_items %" PRIu64, pogocache_total(cache, 0));
+    if (uselockstats) {
+        struct pogocache_lockstats lstats;
+        pogocache_lockstats(cache, &lstats, 0);
+        stats_printf(&stats, "lock_acquisitions %" PRIu64, 
+            lstats.acquisitions);
+        stats_printf(&stats, "lock_contended %" PRIu64, lstats.contended);
+        stats_printf(&stats, "lock_wait_ns %" PRIu64, lstats.waitns);
+    }
+    struct pogocache_compressstats cstats;
+    pogocache_compressstats(cache, &cstats);
+    stats_printf(&stats, "compress_values %" PRIu64, cstats.compressed);
+    stats_printf(&stats, "compress_rejected %" PRIu64, cstats.rejected);
+    stats_printf(&stats, "compress_inflated %" PRIu64, cstats.inflated);
+    stats_printf(&stats, "compress_ns %" PRIu64, cstats.compressns);
+    stats_printf(&stats, "compress_inflate_ns %" PRIu64, cstats.inflatens);
+    stats_printf(&stats, "compress_raw_bytes %" PRIu64, cstats.rawbytes);
+    stats_printf(&stats, "compress_stored_bytes %" PRIu64, cstats.storedbytes);
+    stats_printf(&stats, "compress_ratio %.2f", cstats.storedbytes ? 
+        (double)cstats.rawbytes/cstats.storedbytes : 1.0);
+    struct compress_stats dstats;
+    compress_stats(&dstats);
+    stats_printf(&stats, "compress_dict_version %d", dstats.dictversion);
+    stats_printf(&stats, "compress_dict_bytes %zu", dstats.dictsize);
+    stats_printf(&stats, "compress_dict_trained %" PRIu64, dstats.ntrained);
+    stats_printf(&stats, "compress_dict_values %" PRIu64, dstats.ndictvalues);
+    struct tier_stats tstats;
+    tier_stats(&tstats);
+    if (tstats.enabled) {
+        stats_printf(&stats, "tier_extents %d", tstats.extents);
+        stats_printf(&stats, "tier_disk_bytes %" PRIu64, tstats.diskbytes);
+        stats_printf(&stats, "tier_live_bytes %" PRIu64, tstats.livebytes);
+        stats_printf(&stats, "tier_spilled %" PRIu64, tstats.spilled);
+        stats_printf(&stats, "tier_reads %" PRIu64, tstats.reads);
+        stats_printf(&stats, "tier_lost %" PRIu64, tstats.lost);
+        stats_printf(&stats, "tier_compacted %" PRIu64, tstats.compacted);
+        stats_printf(&stats, "tier_dropped %" PRIu64, tstats.dropped);
+        stats_printf(&stats, "tier_min_idle_ms %" PRId64, 
+            tstats.minidle/1000000);
+    }
+    if (useshm) {
+        stats_printf(&stats, "shm_size %zu", heap_size());
+        stats_printf(&stats, "shm_used %zu", heap_used());
+    }
+    struct repl_stats rstats;
+    repl_stats(&rstats);
+    stats_printf(&stats, "repl_role %s", rstats.replica?"replica":"primary");
+    stats_printf(&stats, "repl_offset %" PRIu64, rstats.offset);
+    if (rstats.replica) {
+        stats_printf(&stats, "repl_link %s", rstats.linkup?"up":"down");
+        stats_printf(&stats, "repl_full_syncs %" PRIu64, rstats.fullsyncs);
+        stats_printf(&stats, "repl_partial_syncs %" PRIu64, 
+            rstats.partialsyncs);
+    } else {
+        stats_printf(&stats, "repl_replicas %d", rstats.replicas);
+        stats_printf(&stats, "repl_backlog_bytes %zu", rstats.backlog);
+    }
+    if (usetls) {
+        struct tls_stats tstats;
+        tls_stats(&tstats);
+        stats_printf(&stats, "tls_handshakes %" PRIu64, tstats.handshakes);
+        stats_printf(&stats, "tls_resumed %" PRIu64, tstats.resumed);
+        stats_printf(&stats, "tls_failed %" PRIu64, tstats.failed);
+        stats_printf(&stats, "tls_ktls %" PRIu64, tstats.ktls);
+    }
+    if (useroute) {
+        struct route_stats rtstats;
+        route_stats(&rtstats);
+        stats_printf(&stats, "route_backends %d", rtstats.backends);
+        stats_printf(&stats, "route_forwarded %" PRIu64, rtstats.forwarded);
+        stats_printf(&stats, "route_split %" PRIu64, rtstats.split);
+        stats_printf(&stats, "route_errors %" PRIu64, rtstats.errors);
+        stats_printf(&stats, "route_l1_hits %" PRIu64, rtstats.l1hits);
+    }
+    int nnodes = net_nnodes();
+    for (int i = 0; i < nnodes; i++) {
+        struct net_nodestats nstats;
+        net_nodestats(i, &nstats);
+        if (nstats.threads == 0) {
+            continue;
+        }
+        stats_printf(&stats, "node%d_threads %d", i, nstats.threads);
+        stats_printf(&stats, "node%d_curr_connections %zu", i, nstats.conns);
+        stats_printf(&stats, "node%d_cmd_get %" PRIu64, i, nstats.cmd_get);
+        stats_printf(&stats, "node%d_cmd_set %" PRIu64, i, nstats.cmd_set);
+        stats_printf(&stats, "node%d_get_hits %" PRIu64, i, nstats.get_hits);
+        stats_printf(&stats, "node%d_get_misses %" PRIu64, i, 
+            nstats.get_misses);
+        if (numashards) {
+            size_t bytes = 0;
+            size_t items = 0;
+            for (int j = numashards[i*2]; j < numashards[i*2+1]; j++) {
+                struct pogocache_size_opts sopts = { .entriesonly=true, 
+                    .oneshard=true, .oneshardidx=j };
+                bytes += pogocache_size(cache, &sopts);
+                struct pogocache_count_opts copts = { .oneshard=true, 
+                    .oneshardidx=j };
+                items += pogocache_count(cache, &copts);
+            }
+            stats_printf(&stats, "node%d_shards %d", i, 
+                numashards[i*2+1]-numashards[i*2]);
+            stats_printf(&stats, "node%d_bytes %zu", i, bytes);
+            stats_printf(&stats, "node%d_curr_items %zu", i, items);
+        }
+    }
+    if (busypoll > 0) {
+        int nthreads = net_nthreads();
+        for (int i = 0; i < nthreads; i++) {
+            struct net_pollstats pstats;
+            net_pollstats(i, &pstats);
+            stats_printf(&stats, "thread%d_poll_spin_us %" PRIu64, i, 
+                pstats.spin_ns/1000);
+            stats_printf(&stats, "thread%d_poll_sleep_us %" PRIu64, i, 
+                pstats.sleep_ns/1000);
+            stats_printf(&stats, "thread%d_poll_spin_hits %" PRIu64, i, 
+                pstats.spin_hits);
+            stats_printf(&stats, "thread%d_poll_sleeps %" PRIu64, i, 
+                pstats.sleeps);
+        }
+    }
+    stats_end(&stats, conn);
+}
+
+// Lock stats for each shard that has seen contention, in the style of the
+// memcache "stats slabs" output.
+static void stats_locks(struct conn *conn) {
+    struct stats stats;
+    stats_begin(&stats);
+    int nshards = pogocache_nshards(cache);
+    int ncontended = 0;
+    for (int i = 0; i < nshards; i++) {
+        struct pogocache_lockstats lstats;
+        struct pogocache_lockstats_opts opts = { .oneshard=true, 
+            .oneshardidx=i };
+        pogocache_lockstats(cache, &lstats, &opts);
+        if (lstats.contended == 0) {
+            continue;
+        }
+        stats_printf(&stats, "%d:acquisitions %" PRIu64, i, 
+            lstats.acquisitions);
+        stats_printf(&stats, "%d:contended %" PRIu64, i, lstats.contended);
+        stats_printf(&stats, "%d:wait_ns %" PRIu64, i, lstats.waitns);
+        ncontended++;
+    }
+    stats_printf(&stats, "shards %d", nshards);
+    stats_printf(&stats, "contended_shards %d", ncontended);
     stats_end(&stats, conn);
 }
 
@@ -2105,6 +3504,14 @@ static void cmdSTATS(struct conn *conn, struct args *args) {
         stats(conn);
         return;
     }
+    if (args->len == 2 && argeq(args, 1, "locks")) {
+        if (!uselockstats) {
+            conn_write_error(conn, "ERR lock stats are not enabled");
+            return;
+        }
+        stats_locks(conn);
+        return;
+    }
     conn_write_error(conn, ERR_SYNTAX_ERROR);
     return;
 }
@@ -2130,43 +3537,67 @@ static void cmdVERSION(struct conn *conn, struct args *args) {
 struct scan_ctx {
     char *pattern;
     size_t plen;
+    size_t prefixlen;  // literal prefix of the pattern
+    bool anyrest;      // pattern is the prefix followed by a '*'
     int64_t now;
     size_t count;
+    int type;          // only entries of this type, or -1 for all types
+    int etype;         // type of the current entry
     uint64_t cursor;
-    struct pogocache_entry **entries;
+    struct buf buf;    // matching keys
     size_t len;
-    size_t cap;
 };
 
 static void scan_ctx_free(struct scan_ctx *ctx) {
     if (ctx) {
-        xfree(ctx->entries);
+        buf_clear(&ctx->buf);
         xfree(ctx->pattern);
         xfree(ctx);
     }
 }
 
+static int scan_entry(int shard, int64_t time, const void *key, size_t keylen,
+        const void *value, size_t valuelen, int64_t expires, uint32_t flags,
+        uint64_t cas, void *udata)
+{
+    (void)shard, (void)time, (void)value, (void)valuelen, (void)expires, 
+    (void)flags, (void)cas;
+    struct scan_ctx *ctx = udata;
+    if ((ctx->type < 0 || ctx->etype == ctx->type) && (ctx->anyrest ||
+        match(ctx->pattern+ctx->prefixlen, ctx->plen-ctx->prefixlen, 
+            (char*)key+ctx->prefixlen, keylen-ctx->prefixlen, 0)))
+    {
+        buf_append_uvarint(&ctx->buf, keylen);
+        buf_append(&ctx->buf, key, keylen);
+        ctx->len++;
+    }
+    return POGOCACHE_ITER_CONTINUE;
+}
+
+// Scan whole shards, starting at the cursor, until there are enough keys or
+// the time is up. The count may be exceeded by the last shard.
 static void scan_work(void *udata) {
     struct scan_ctx *ctx = udata;
-    while (ctx->len < ctx->count) {
-        struct pogocache_entry *entry;
-        entry = pogocache_entry_iter(cache, ctx->now, &ctx->cursor);
-        if (!entry) {
+    struct pogocache_iter_opts opts = {
+        .time = ctx->now,
+        .oneshard = true,
+        .type = &ctx->etype,
+        .keysonly = true,
+        .prefix = ctx->pattern,
+        .prefixlen = ctx->prefixlen,
+        .entry = scan_entry,
+        .udata = ctx,
+    };
+    int64_t start = sys_now();
+    uint64_t shard = ctx->cursor;
+    while (shard < (uint64_t)nshards) {
+        opts.oneshardidx = shard++;
+        pogocache_iter(cache, &opts);
+        if (ctx->len >= ctx->count || sys_now()-start >= SCANBUDGET) {
             break;
         }
-        char buf[128];
-        size_t keylen;
-        const void *key = pogocache_entry_key(cache, entry, &keylen, buf);
-        if (match(ctx->pattern, ctx->plen, key, keylen, 0)) {
-            if (ctx->len == ctx->cap) {
-                ctx->cap = ctx->cap ? ctx->cap * 2 : 16;
-                ctx->entries = xrealloc(ctx->entries, sizeof(void*)*ctx->cap);
-            }
-            ctx->entries[ctx->len++] = entry;
-        } else {
-            pogocache_entry_release(cache, entry);
-        }
     }
+    ctx->cursor = shard < (uint64_t)nshards ? shard : 0;
 }
 
 static void scan_done(struct conn *conn, void *udata) {
@@ -2181,18 +3612,18 @@ static void scan_done(struct conn *conn, void *udata) {
         conn_write_bulk_cstr(conn, scursor);
         conn_write_array(conn, ctx->len);
     }
+    const char *p = ctx->buf.data;
     for (size_t i = 0; i < ctx->len; i++) {
-        struct pogocache_entry *entry = ctx->entries[i];
-        char buf[128];
-        size_t keylen;
-        const void *key = pogocache_entry_key(cache, entry, &keylen, buf);
+        uint64_t keylen;
+        p += varint_read_u64(p, 10, &keylen);
+        const char *key = p;
+        p += keylen;
         if (proto == PROTO_POSTGRES) {
             pg_write_row_data(conn, (const char*[]){ key, scursor },
                 (size_t[]){ keylen, clen }, 2);
         } else {
             conn_write_bulk(conn, key, keylen);
         }
-        pogocache_entry_release(cache, entry);
     }
     if (proto == PROTO_POSTGRES) {
         pg_write_completef(conn, "SCAN %zu", ctx->len);
@@ -2208,7 +3639,7 @@ static void cmdSCAN(struct conn *conn, struct args *args) {
         return;
     }
     size_t count = 100;
-    const char *stype = "string";
+    int type = -1;
     const void *pattern = "*";
     size_t plen = 1;
     uint64_t cursor;
@@ -2240,7 +3671,9 @@ static void cmdSCAN(struct conn *conn, struct args *args) {
                 goto err_syntax;
             }
             if (argeq(args, i, "string")) {
-                stype = "string";
+                type = POGOCACHE_TYPE_STRING;
+            } else if (argeq(args, i, "hash")) {
+                type = POGOCACHE_TYPE_HASH;
             } else {
                 char str[128];
                 snprintf(str, sizeof(str), "ERR unknown type name '%.*s'",
@@ -2252,7 +3685,6 @@ static void cmdSCAN(struct conn *conn, struct args *args) {
             goto err_syntax;
         }
     }
-    (void)stype;
     int64_t now = sys_now();
     struct scan_ctx *ctx = xmalloc(sizeof(struct scan_ctx));
     memset(ctx, 0, sizeof(struct scan_ctx));
@@ -2260,11 +3692,13 @@ static void cmdSCAN(struct conn *conn, struct args *args) {
     memcpy(ctx->pattern, pattern, plen);
     ctx->pattern[plen] = '\0';
     ctx->plen = plen;
+    ctx->prefixlen = match_prefix(pattern, plen, &ctx->anyrest);
     ctx->count = count;
+    ctx->type = type;
     ctx->now = now;
     ctx->cursor = cursor;
 
-    // call in the foreground
+    // call in the foreground, bounded by SCANBUDGET
     scan_work(ctx);
     scan_done(conn, ctx);
     
@@ -2280,52 +3714,86 @@ err_syntax:
 static int nbuckets;
 static struct cmd *buckets;
 
+// Key layout of a command, used for forwarding in shared-nothing mode.
+#define NOKEY 0 // no keys, or not forwardable
+#define KEY1  1 // one key at the first argument
+#define KEYN  2 // one or more keys, starting at the first argument
+
+// Commands that modify the data are rejected by replicas.
+#define RD 0 // read only
+#define WR 1 // writes data
+
 struct cmd {
     const char *name;
     void (*func)(struct conn *conn, struct args *args);
+    int keys;
+    int write;
 };
 
 static struct cmd cmds[] = {
-    { "set",       cmdSET      }, // pg
-    { "get",       cmdGET      }, // pg
-    { "del",       cmdDEL      }, // pg
-    { "mget",      cmdMGET     }, // pg
-    { "mgets",     cmdMGET     }, // pg cas detected
-    { "ttl",       cmdTTL      }, // pg
-    { "pttl",      cmdTTL      }, // pg
-    { "expire",    cmdEXPIRE   }, // pg
-    { "setex",     cmdSETEX    }, // pg
-    { "dbsize",    cmdDBSIZE   }, // pg
-    { "quit",      cmdQUIT     }, // pg
-    { "echo",      cmdECHO     }, // pg
-    { "exists",    cmdEXISTS   }, // pg
-    { "flushdb",   cmdFLUSHALL }, // pg
-    { "flushall",  cmdFLUSHALL }, // pg
-    { "flush",     cmdFLUSHALL }, // pg
-    { "monitor",   cmdMONITOR  }, // pg not available
-    { "purge",     cmdPURGE    }, // pg
-    { "sweep",     cmdSWEEP    }, // pg
-    { "keys",      cmdKEYS     }, // pg
-    { "select",    cmdSELECT   }, // pg
-    { "ping",      cmdPING     }, // pg
-    { "touch",     cmdTOUCH    }, // pg
-    { "debug",     cmdDEBUG    }, // pg
-    { "incrby",    cmdINCRBY   }, // pg
-    { "decrby",    cmdDECRBY   }, // pg
-    { "incr",      cmdINCR     }, // pg
-    { "decr",      cmdDECR     }, // pg
-    { "uincrby",   cmdINCRBY   }, // pg unsigned detected in signed operation
-    { "udecrby",   cmdDECRBY   }, // pg unsigned detected in signed operation
-    { "uincr",     cmdINCR     }, // pg unsigned detected in signed operation
-    { "udecr",     cmdDECR     }, // pg unsigned detected in signed operation
-    { "append",    cmdAPPEND   }, // pg
-    { "prepend",   cmdPREPEND  }, // pg
-    { "auth",      cmdAUTH     }, // pg
-    { "save",      cmdSAVELOAD }, // pg
-    { "load",      cmdSAVELOAD }, // pg
-    { "stats",     cmdSTATS    }, // pg memcache style stats
-    { "version",   cmdVERSION  }, // pg
-    { "scan",      cmdSCAN     }, // pg
+    { "set",       cmdSET,      KEY1,  WR }, // pg
+    { "get",       cmdGET,      KEY1,  RD }, // pg
+    { "lget",      cmdLGET,     KEY1,  RD }, // pg not available
+    { "del",       cmdDEL,      KEYN,  WR }, // pg
+    { "mget",      cmdMGET,     KEYN,  RD }, // pg
+    { "_mget",     cmdHTTPMGET, NOKEY, RD },
+    { "_mset",     cmdHTTPMSET, NOKEY, WR },
+    { "_copyin",   cmdCOPYIN,   NOKEY, WR },
+    { "_copyrows", cmdCOPYROWS, NOKEY, WR },
+    { "_copyout",  cmdCOPYOUT,  NOKEY, RD },
+    { "mgets",     cmdMGET,     KEYN,  RD }, // pg cas detected
+    { "ttl",       cmdTTL,      KEY1,  RD }, // pg
+    { "pttl",      cmdTTL,      KEY1,  RD }, // pg
+    { "expire",    cmdEXPIRE,   KEY1,  WR }, // pg
+    { "setex",     cmdSETEX,    KEY1,  WR }, // pg
+    { "dbsize",    cmdDBSIZE,   NOKEY, RD }, // pg
+    { "quit",      cmdQUIT,     NOKEY, RD }, // pg
+    { "echo",      cmdECHO,     NOKEY, RD }, // pg
+    { "exists",    cmdEXISTS,   KEYN,  RD }, // pg
+    { "flushdb",   cmdFLUSHALL, NOKEY, WR }, // pg
+    { "flushall",  cmdFLUSHALL, NOKEY, WR }, // pg
+    { "flush",     cmdFLUSHALL, NOKEY, WR }, // pg
+    { "monitor",   cmdMONITOR,  NOKEY, RD }, // pg not available
+    { "purge",     cmdPURGE,    NOKEY, RD }, // pg
+    { "sweep",     cmdSWEEP,    NOKEY, RD }, // pg
+    { "delprefix", cmdDELPREFIX, NOKEY, WR }, // pg
+    { "keys",      cmdKEYS,     NOKEY, RD }, // pg
+    { "select",    cmdSELECT,   NOKEY, RD }, // pg
+    { "ping",      cmdPING,     NOKEY, RD }, // pg
+    { "touch",     cmdTOUCH,    KEYN,  RD }, // pg
+    { "debug",     cmdDEBUG,    NOKEY, RD }, // pg
+    { "incrby",    cmdINCRBY,   KEY1,  WR }, // pg
+    { "decrby",    cmdDECRBY,   KEY1,  WR }, // pg
+    { "incr",      cmdINCR,     KEY1,  WR }, // pg
+    { "decr",      cmdDECR,     KEY1,  WR }, // pg
+    { "uincrby",   cmdINCRBY,   KEY1,  WR }, // pg unsigned detected in signed operation
+    { "udecrby",   cmdDECRBY,   KEY1,  WR }, // pg unsigned detected in signed operation
+    { "uincr",     cmdINCR,     KEY1,  WR }, // pg unsigned detected in signed operation
+    { "udecr",     cmdDECR,     KEY1,  WR }, // pg unsigned detected in signed operation
+    { "append",    cmdAPPEND,   KEY1,  WR }, // pg
+    { "prepend",   cmdPREPEND,  KEY1,  WR }, // pg
+    { "auth",      cmdAUTH,     NOKEY, RD }, // pg
+    { "save",      cmdSAVELOAD, NOKEY, RD }, // pg
+    { "load",      cmdSAVELOAD, NOKEY, WR }, // pg
+    { "stats",     cmdSTATS,    NOKEY, RD }, // pg memcache style stats
+    { "version",   cmdVERSION,  NOKEY, RD }, // pg
+    { "scan",      cmdSCAN,     NOKEY, RD }, // pg
+    { "type",      cmdTYPE,     KEY1,  RD },
+    { "hset",      cmdHSET,     KEY1,  WR },
+    { "hget",      cmdHGET,     KEY1,  RD },
+    { "hmget",     cmdHMGET,    KEY1,  RD },
+    { "hdel",      cmdHDEL,     KEY1,  WR },
+    { "hincrby",   cmdHINCRBY,  KEY1,  WR },
+    { "hgetall",   cmdHGETALL,  KEY1,  RD },
+    { "hkeys",     cmdHGETALL,  KEY1,  RD },
+    { "hvals",     cmdHGETALL,  KEY1,  RD },
+    { "hlen",      cmdHLEN,     KEY1,  RD },
+    { "hexists",   cmdHEXISTS,  KEY1,  RD },
+    { "hexpire",   cmdHEXPIRE,  KEY1,  WR },
+    { "httl",      cmdHTTL,     KEY1,  RD },
+    { "sync",      cmdSYNC,     NOKEY, RD }, // pg not available
+    { "shmring",   cmdSHMRING,  NOKEY, RD }, // pg not available
+    { "client",    cmdCLIENT,   NOKEY, RD },
 };
 
 static void build_commands_table(void) {
@@ -2376,6 +3844,61 @@ static struct cmd *get_cmd(const char *name, size_t namelen) {
     }
 }
 
+struct fwdcmd {
+    struct cmd *cmd;
+    struct args args;
+};
+
+static void fwdcmd_work(struct conn *conn, void *udata) {
+    struct fwdcmd *fwd = udata;
+    fwd->cmd->func(conn, &fwd->args);
+}
+
+static void fwdcmd_done(struct conn *conn, void *udata) {
+    (void)conn;
+    struct fwdcmd *fwd = udata;
+    args_free(&fwd->args);
+    xfree(fwd);
+}
+
+// Forward a single key command to the thread that owns the key's shard.
+// Returns false if the command should execute on the current thread.
+// Commands that are not forwarded, which are HTTP and Postgres commands,
+// multi-key commands, and commands that run locally because the owner's ring
+// is full, still take the shard locks from any thread.
+static bool forward(struct conn *conn, struct cmd *cmd, struct args *args) {
+    if (cmd->keys == 0 || args->len < 2 || (cmd->keys == KEYN && 
+        args->len != 2))
+    {
+        return false;
+    }
+    int proto = conn_proto(conn);
+    if (proto != PROTO_RESP && proto != PROTO_MEMCACHE) {
+        return false;
+    }
+    int nshards = pogocache_nshards(cache);
+    int shard = pogocache_shard(cache, args->bufs[1].data, args->bufs[1].len);
+    // Each thread owns a contiguous range of shards.
+    int owner = ((int64_t)(shard+1)*nthreads-1)/nshards;
+    if (owner == conn_thread(conn)) {
+        return false;
+    }
+    // The args may reference the connection's input buffer, which can move
+    // while the command is in flight. Take a copy.
+    struct fwdcmd *fwd = xmalloc(sizeof(struct fwdcmd));
+    memset(fwd, 0, sizeof(struct fwdcmd));
+    fwd->cmd = cmd;
+    for (size_t i = 0; i < args->len; i++) {
+        args_append(&fwd->args, args->bufs[i].data, args->bufs[i].len, false);
+    }
+    if (!conn_forward(conn, owner, fwdcmd_work, fwdcmd_done, fwd)) {
+        args_free(&fwd->args);
+        xfree(fwd);
+        return false;
+    }
+    return true;
+}
+
 void evcommand(struct conn *conn, struct args *args) {
     if (useauth && !conn_auth(conn)) {
         if (conn_proto(conn) == PROTO_HTTP) {
@@ -2395,6 +3918,17 @@ void evcommand(struct conn *conn, struct args *args) {
     struct cmd *cmd = get_cmd(args->bufs[0].data, args->bufs[0].len);
     if (cmd) {
         monitor_cmd(sys_unixnow(), 0, conn_addr(conn), args);
+        if (cmd->write && repl_isreplica()) {
+            conn_write_error(conn, 
+                "READONLY You can't write against a read only replica.");
+            return;
+        }
+        if (useroute && route_command(conn, args, cmd->keys, cmd->write)) {
+            return;
+        }
+        if (usesharednothing && forward(conn, cmd, args)) {
+            return;
+        }
         cmd->func(conn, args);
     } else {
         char *errmsg = xmalloc(256);
@@ -0,0 +1,378 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit compress.c provides the lz4 value compression callbacks for the cache,
+// along with shared dictionaries that are trained from samples of the small
+// values in the cache.
+//
+// Each compressed value starts with a one byte dictionary version, followed by
+// the lz4 block. Version zero means that no dictionary was used. Dictionaries
+// are never freed, so old values always remain readable, and at most 255
+// versions are trained during the lifetime of the process.
+#include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "compress.h"
+#include "lz4.h"
+#include "sys.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define DICTMIN     32      // minimum value size for dictionary compression
+#define DICTMAXSIZE 65536   // lz4 can only reference the last 64 KB
+#define MAXDICTS    255     // versions are stored in one byte
+#define NSAMPLES    4096    // maximum number of values sampled for training
+#define SAMPLEMAX   1024    // sampled values are truncated to this size
+#define SHARDVISITS 32      // maximum number of entries visited per shard
+#define SEGSIZE     64      // dictionary segment size
+#define GRAMSIZE    8       // size of the substrings counted in samples
+#define GRAMBITS    18      // log2 size of the substring counting table
+#define MINGAIN     0.95    // a new dictionary must be at least 5% better
+
+extern const int verb;
+
+struct dict {
+    char *data;
+    int size;
+    LZ4_stream_t *stream; // preloaded dictionary, for attaching
+};
+
+static size_t largemin = SIZE_MAX;
+static bool usedict = false;
+static struct dict *dicts[MAXDICTS+1];
+static atomic_int curversion = 0;
+static atomic_uint_fast64_t ntrained = 0;
+static atomic_uint_fast64_t ndictvalues = 0;
+static pthread_mutex_t trainmu = PTHREAD_MUTEX_INITIALIZER;
+static __thread LZ4_stream_t *workstream = 0;
+
+// Values that are at least 'largemin0' bytes are always compressed. Smaller
+// values are only compressed using a trained dictionary, if 'usedict0'.
+void compress_init(size_t largemin0, bool usedict0) {
+    largemin = largemin0;
+    usedict = usedict0;
+}
+
+// Returns the minimum value size that should be passed to compress_value.
+size_t compress_min(void) {
+    return usedict && largemin > DICTMIN ? DICTMIN : largemin;
+}
+
+static LZ4_stream_t *stream_new(void) {
+    LZ4_stream_t *stream = xmalloc(sizeof(LZ4_stream_t));
+    LZ4_initStream(stream, sizeof(LZ4_stream_t));
+    return stream;
+}
+
+static int compress_dict(const char *src, int srclen, char *dst, int dstcap,
+    struct dict *dict)
+{
+    if (!workstream) {
+        workstream = stream_new();
+    }
+    LZ4_resetStream_fast(workstream);
+    LZ4_attach_dictionary(workstream, dict->stream);
+    return LZ4_compress_fast_continue(workstream, src, dst, srclen, dstcap, 1);
+}
+
+size_t compress_value(const void *src, size_t srclen, void *dst,
+    size_t dstcap, void *udata)
+{
+    (void)udata;
+    if (srclen > LZ4_MAX_INPUT_SIZE || dstcap < 2) {
+        return 0;
+    }
+    if (dstcap-1 > INT_MAX) {
+        dstcap = (size_t)INT_MAX+1;
+    }
+    int version = 0;
+    if (usedict) {
+        version = atomic_load_explicit(&curversion, __ATOMIC_ACQUIRE);
+    }
+    char *out = dst;
+    int n;
+    if (version > 0) {
+        n = compress_dict(src, srclen, out+1, dstcap-1, dicts[version]);
+        if (n > 0) {
+            atomic_fetch_add_explicit(&ndictvalues, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        if (srclen < largemin) {
+            return 0;
+        }
+        n = LZ4_compress_default(src, out+1, srclen, dstcap-1);
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    out[0] = version;
+    return n+1;
+}
+
+bool decompress_value(const void *src, size_t srclen, void *dst,
+    size_t dstlen, void *udata)
+{
+    (void)udata;
+    if (srclen < 1 || srclen-1 > INT_MAX || dstlen > INT_MAX) {
+        return false;
+    }
+    const char *in = src;
+    int version = (uint8_t)in[0];
+    int n;
+    if (version == 0) {
+        n = LZ4_decompress_safe(in+1, dst, srclen-1, dstlen);
+    } else {
+        struct dict *dict = dicts[version];
+        if (!dict) {
+            return false;
+        }
+        n = LZ4_decompress_safe_usingDict(in+1, dst, srclen-1, dstlen,
+            dict->data, dict->size);
+    }
+    return n == (int)dstlen;
+}
+
+struct samples {
+    char *data;     // all sampled values, back to back
+    size_t len;
+    int *offs;      // offset of each sample, plus the end
+    int count;
+    int visits;     // entries visited in the current shard
+};
+
+static int sample_entry(int shard, int64_t time, const void *key,
+    size_t keylen, const void *value, size_t valuelen, int64_t expires,
+    uint32_t flags, uint64_t cas, void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)expires;
+    (void)flags, (void)cas;
+    struct samples *samples = udata;
+    if (valuelen >= DICTMIN && valuelen < largemin) {
+        size_t len = valuelen < SAMPLEMAX ? valuelen : SAMPLEMAX;
+        memcpy(samples->data+samples->len, value, len);
+        samples->len += len;
+        samples->count++;
+        samples->offs[samples->count] = samples->len;
+    }
+    samples->visits++;
+    if (samples->count == NSAMPLES || samples->visits == SHARDVISITS) {
+        return POGOCACHE_ITER_STOP;
+    }
+    return POGOCACHE_ITER_CONTINUE;
+}
+
+// Collect small values from the cache, starting at a random shard and
+// visiting a few entries from each shard.
+static void sample_values(struct pogocache *cache, struct samples *samples) {
+    uint64_t seed = sys_now();
+    int nshards = pogocache_nshards(cache);
+    int start = rand_next(&seed)%nshards;
+    for (int i = 0; i < nshards && samples->count < NSAMPLES; i++) {
+        samples->visits = 0;
+        struct pogocache_iter_opts opts = {
+            .oneshard = true,
+            .oneshardidx = (start+i)%nshards,
+            .entry = sample_entry,
+            .udata = samples,
+        };
+        pogocache_iter(cache, &opts);
+    }
+}
+
+static uint32_t gram_hash(const char *p) {
+    return mix13(read_u64(p))>>(64-GRAMBITS);
+}
+
+struct segment {
+    int off;
+    int len;
+    uint64_t score;
+};
+
+static uint64_t segment_score(const char *data, struct segment *seg,
+    uint32_t *counts)
+{
+    uint64_t score = 0;
+    for (int i = 0; i+GRAMSIZE <= seg->len; i++) {
+        uint32_t count = counts[gram_hash(data+seg->off+i)];
+        // Substrings that appear in only one sample are worthless.
+        score += count > 1 ? count : 0;
+    }
+    return score;
+}
+
+static int segment_cmp(const void *a, const void *b) {
+    const struct segment *sa = a;
+    const struct segment *sb = b;
+    return sa->score < sb->score ? 1 : sa->score > sb->score ? -1 : 0;
+}
+
+// Build a dictionary from the segments of the samples that contain the most
+// common substrings. Each substring is counted at most once per sample. Once
+// a segment is added to the dictionary its substrings no longer count towards
+// the score of other segments, which avoids filling the dictionary with
+// duplicates. The best segments are placed at the end of the dictionary,
+// closest to the data.
+static struct dict *dict_build(struct samples *samples) {
+    size_t ncounts = (size_t)1<<GRAMBITS;
+    uint32_t *counts = xmalloc(ncounts*sizeof(uint32_t));
+    uint32_t *stamps = xmalloc(ncounts*sizeof(uint32_t));
+    memset(counts, 0, ncounts*sizeof(uint32_t));
+    memset(stamps, 0, ncounts*sizeof(uint32_t));
+    int nsegs = 0;
+    for (int i = 0; i < samples->count; i++) {
+        int start = samples->offs[i];
+        int end = samples->offs[i+1];
+        for (int j = start; j+GRAMSIZE <= end; j++) {
+            uint32_t h = gram_hash(samples->data+j);
+            if (stamps[h] != (uint32_t)i+1) {
+                stamps[h] = i+1;
+                counts[h]++;
+            }
+        }
+        nsegs += (end-start+SEGSIZE-1)/SEGSIZE;
+    }
+    struct segment *segs = xmalloc(nsegs*sizeof(struct segment));
+    nsegs = 0;
+    for (int i = 0; i < samples->count; i++) {
+        int end = samples->offs[i+1];
+        for (int off = samples->offs[i]; off+GRAMSIZE <= end; off += SEGSIZE) {
+            struct segment *seg = &segs[nsegs++];
+            seg->off = off;
+            seg->len = end-off < SEGSIZE ? end-off : SEGSIZE;
+            seg->score = segment_score(samples->data, seg, counts);
+        }
+    }
+    qsort(segs, nsegs, sizeof(struct segment), segment_cmp);
+    char *buf = xmalloc(DICTMAXSIZE);
+    int size = 0;
+    for (int i = 0; i < nsegs && size < DICTMAXSIZE; i++) {
+        struct segment *seg = &segs[i];
+        if (seg->score == 0) {
+            break;
+        }
+        // Only add the segment if at least half of its value remains.
+        uint64_t score = segment_score(samples->data, seg, counts);
+        if (score == 0 || score*2 < seg->score) {
+            continue;
+        }
+        int len = seg->len < DICTMAXSIZE-size ? seg->len : DICTMAXSIZE-size;
+        memcpy(buf+DICTMAXSIZE-size-len, samples->data+seg->off, len);
+        size += len;
+        for (int j = 0; j+GRAMSIZE <= seg->len; j++) {
+            counts[gram_hash(samples->data+seg->off+j)] = 0;
+        }
+    }
+    xfree(segs);
+    xfree(stamps);
+    xfree(counts);
+    if (size == 0) {
+        xfree(buf);
+        return 0;
+    }
+    struct dict *dict = xmalloc(sizeof(struct dict));
+    dict->size = size;
+    dict->data = xmalloc(size);
+    memcpy(dict->data, buf+DICTMAXSIZE-size, size);
+    xfree(buf);
+    dict->stream = stream_new();
+    LZ4_loadDict(dict->stream, dict->data, dict->size);
+    return dict;
+}
+
+static void dict_free(struct dict *dict) {
+    xfree(dict->stream);
+    xfree(dict->data);
+    xfree(dict);
+}
+
+// Returns the total compressed size of the samples using the dictionary,
+// or without any compression if the dictionary is null.
+static size_t dict_cost(struct dict *dict, struct samples *samples,
+    char *dst, int dstcap)
+{
+    size_t cost = 0;
+    for (int i = 0; i < samples->count; i++) {
+        int start = samples->offs[i];
+        int len = samples->offs[i+1]-start;
+        int n = 0;
+        if (dict) {
+            n = compress_dict(samples->data+start, len, dst, dstcap, dict);
+        }
+        cost += n > 0 && n < len ? n : len;
+    }
+    return cost;
+}
+
+// Sample values from the cache and train a new dictionary. The dictionary is
+// only used for newly stored values, and only if it compresses the samples
+// better than the current dictionary.
+// Returns true if a new dictionary version is in use.
+bool compress_train(struct pogocache *cache) {
+    if (!usedict) {
+        return false;
+    }
+    pthread_mutex_lock(&trainmu);
+    bool adopted = false;
+    int version = atomic_load_explicit(&curversion, __ATOMIC_ACQUIRE);
+    struct samples samples = { 0 };
+    if (version == MAXDICTS) {
+        goto done;
+    }
+    samples.data = xmalloc((size_t)NSAMPLES*SAMPLEMAX);
+    samples.offs = xmalloc((NSAMPLES+1)*sizeof(int));
+    samples.offs[0] = 0;
+    sample_values(cache, &samples);
+    if (samples.count < 64) {
+        // Not enough small values to be useful.
+        goto done;
+    }
+    struct dict *dict = dict_build(&samples);
+    if (!dict) {
+        goto done;
+    }
+    int dstcap = LZ4_compressBound(SAMPLEMAX);
+    char *dst = xmalloc(dstcap);
+    size_t oldcost = dict_cost(version ? dicts[version] : 0, &samples, dst,
+        dstcap);
+    size_t newcost = dict_cost(dict, &samples, dst, dstcap);
+    xfree(dst);
+    if (newcost >= oldcost*MINGAIN) {
+        dict_free(dict);
+        goto done;
+    }
+    version++;
+    dicts[version] = dict;
+    atomic_store_explicit(&curversion, version, __ATOMIC_RELEASE);
+    atomic_fetch_add_explicit(&ntrained, 1, __ATOMIC_RELAXED);
+    adopted = true;
+    if (verb >= 1) {
+        printf(". Value dictionary (version=%d, size=%d, samples=%d, "
+            "ratio=%.2f)\n", version, dict->size, samples.count,
+            (double)samples.len/newcost);
+    }
+done:
+    if (samples.data) {
+        xfree(samples.offs);
+        xfree(samples.data);
+    }
+    pthread_mutex_unlock(&trainmu);
+    return adopted;
+}
+
+void compress_stats(struct compress_stats *stats) {
+    int version = atomic_load_explicit(&curversion, __ATOMIC_ACQUIRE);
+    stats->dictversion = version;
+    stats->dictsize = version ? dicts[version]->size : 0;
+    stats->ntrained = atomic_load_explicit(&ntrained, __ATOMIC_RELAXED);
+    stats->ndictvalues = atomic_load_explicit(&ndictvalues, __ATOMIC_RELAXED);
+}
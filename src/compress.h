@@ -0,0 +1,34 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pogocache.h"
+
+struct compress_stats {
+    int dictversion;        // current dictionary version, zero for none
+    size_t dictsize;        // size of the current dictionary
+    uint64_t ntrained;      // number of dictionaries trained
+    uint64_t ndictvalues;   // number of values compressed with a dictionary
+};
+
+void compress_init(size_t largemin, bool usedict);
+size_t compress_value(const void *src, size_t srclen, void *dst,
+    size_t dstcap, void *udata);
+bool decompress_value(const void *src, size_t srclen, void *dst,
+    size_t dstlen, void *udata);
+size_t compress_min(void);
+bool compress_train(struct pogocache *cache);
+void compress_stats(struct compress_stats *stats);
+
+#endif
@@ -20,8 +20,14 @@
 #include "parse.h"
 #include "util.h"
 #include "helppage.h"
+#include "stats.h"
 
-#define MAXPACKETSZ 1048576 // Maximum read packet size
+#define PACKETKEEPSZ 65536 // Largest packet buffer that is kept after a burst
+#define ARGSKEEP 256       // Most argument slots that are kept after a burst
+#define RECVAHEAD 1048576  // Least room reserved for a large pending value
+
+extern const size_t inbuflimit;
+extern const size_t outbuflimit;
 
 struct conn {
     struct net_conn *conn5; // originating connection
@@ -31,6 +37,7 @@ struct conn {
     bool noreply;           // only for memcache
     bool keepalive;         // only for http
     int httpvers;           // only for http
+    struct http_chunked chunked; // only for http, an incomplete chunked body
     struct args args;       // command args, if any
     struct pg *pg;          // postgres context, only if proto is postgres
 };
@@ -39,6 +46,14 @@ bool conn_istls(struct conn *conn) {
     return net_conn_istls(conn->conn5);
 }
 
+bool conn_isshm(struct conn *conn) {
+    return net_conn_isshm(conn->conn5);
+}
+
+bool conn_shmring(struct conn *conn, size_t size, const char **err) {
+    return net_conn_shmring(conn->conn5, size, err);
+}
+
 int conn_proto(struct conn *conn) {
     return conn->proto;
 }
@@ -65,6 +80,35 @@ void evopened(struct net_conn *conn5, void *udata) {
     memset(conn, 0, sizeof(struct conn));
     conn->conn5 = conn5;
     net_conn_setudata(conn5, conn);
+    net_conn_setinmem(conn5, sizeof(struct conn));
+}
+
+// The packet has an incomplete request. Make room for the rest of it, when
+// its size is known, and have the next read go straight into the packet.
+// The room only grows as fast as the data arrives, so a client can't make it
+// reserve a large value that it never sends.
+static void recvahead(struct conn *conn) {
+    size_t need = parse_lastneed();
+    if (need > 0) {
+        size_t ahead = conn->packet.len > RECVAHEAD ? conn->packet.len :
+            RECVAHEAD;
+        buf_ensure(&conn->packet, need < ahead ? need : ahead);
+    }
+    net_conn_setrecvbuf(conn->conn5, conn->packet.data+conn->packet.len,
+        conn->packet.cap-conn->packet.len);
+}
+
+// Drop buffers that grew during a burst, and report the memory that's left.
+static void shrink(struct conn *conn) {
+    if (conn->packet.len == 0 && conn->packet.cap > PACKETKEEPSZ) {
+        buf_clear(&conn->packet);
+    }
+    if (conn->args.cap > ARGSKEEP && !net_conn_bgworking(conn->conn5)) {
+        args_free(&conn->args);
+        memset(&conn->args, 0, sizeof(struct args));
+    }
+    net_conn_setinmem(conn->conn5, sizeof(struct conn)+conn->packet.cap+
+        conn->args.cap*sizeof(struct buf));
 }
 
 void evclosed(struct net_conn *conn5, void *udata) {
@@ -97,6 +141,9 @@ void evdata(struct net_conn *conn5, const void *evdata, size_t evlen,
     }
     return;
 #endif
+    // Data may have been read straight into the packet, with the rest, if
+    // any, in evdata.
+    conn->packet.len += net_conn_recvbuf_take(conn5);
     char *data;
     size_t len;
     bool copied;
@@ -113,12 +160,16 @@ void evdata(struct net_conn *conn5, const void *evdata, size_t evlen,
     while (len > 0 && !conn_isclosed(conn)) {
         // Parse the command
         ssize_t n = parse_command(data, len, &conn->args, &conn->proto, 
-            &conn->noreply, &conn->httpvers, &conn->keepalive, &conn->pg);
+            &conn->noreply, &conn->httpvers, &conn->keepalive, &conn->pg,
+            &conn->chunked);
         if (n == 0) {
             // Not enough data provided yet.
             break;
         } else if (n == -1) {
             // Protocol error occurred.
+            // The end of a bad HTTP request is unknown, so the connection
+            // will be closed after the response.
+            conn->keepalive = false;
             conn_write_error(conn, parse_lasterror());
             if (conn->proto == PROTO_MEMCACHE) {
                 // Memcache doesn't close, but we'll need to know the last
@@ -163,7 +214,15 @@ void evdata(struct net_conn *conn5, const void *evdata, size_t evlen,
             // BGWORK(0)
             break;
         }
-        if (conn->proto == PROTO_HTTP) {
+        if (net_conn_out_len(conn->conn5) > outbuflimit) {
+            // The pending responses are over the limit. Drop them and
+            // disconnect the client.
+            net_conn_out_setlen(conn->conn5, 0);
+            stat_limit_closed_incr(conn);
+            conn_close(conn);
+            break;
+        }
+        if (conn->proto == PROTO_HTTP && !conn->keepalive) {
             conn_close(conn);
         }
     }
@@ -172,19 +231,23 @@ void evdata(struct net_conn *conn5, const void *evdata, size_t evlen,
     }
     if (len == 0) {
         if (copied) {
-            if (conn->packet.cap > MAXPACKETSZ) {
-                buf_clear(&conn->packet);
-            }
             conn->packet.len = 0;
         }
     } else {
+        if (len > inbuflimit) {
+            // The incomplete request is over the limit.
+            stat_limit_closed_incr(conn);
+            goto close;
+        }
         if (copied) {
             memmove(conn->packet.data, data, len);
             conn->packet.len = len;
         } else {
             buf_append(&conn->packet, data, len);
         }
+        recvahead(conn);
     }
+    shrink(conn);
     return;
 close:
     conn_close(conn);
@@ -206,6 +269,9 @@ static void done5(struct net_conn *conn, void *udata) {
     (void)conn;
     struct bgworkctx *ctx = udata;
     ctx->done(ctx->conn, ctx->udata);
+    if (ctx->conn->proto == PROTO_HTTP && !ctx->conn->keepalive) {
+        conn_close(ctx->conn);
+    }
     xfree(ctx);
 }
 
@@ -227,6 +293,88 @@ bool conn_bgwork(struct conn *conn, void(*work)(void *udata),
     return true;
 }
 
+// conn_iowork is conn_bgwork for short blocking reads, which run on a small
+// pool of threads that is shared by all connections.
+bool conn_iowork(struct conn *conn, void(*work)(void *udata), 
+    void(*done)(struct conn *conn, void *udata), void *udata)
+{
+    struct bgworkctx *ctx = xmalloc(sizeof(struct bgworkctx));
+    ctx->conn = conn;
+    ctx->udata = udata;
+    ctx->work = work;
+    ctx->done = done;
+    if (!net_conn_iowork(conn->conn5, work5, done5, ctx)) {
+        xfree(ctx);
+        return false;
+    }
+    return true;
+}
+
+struct fwdctx {
+    struct conn *conn;
+    void *udata;
+    void(*work)(struct conn *conn, void *udata);
+    void(*done)(struct conn *conn, void *udata);
+};
+
+static void fwdwork5(void *udata) {
+    struct fwdctx *ctx = udata;
+    ctx->work(ctx->conn, ctx->udata);
+}
+
+static void fwddone5(struct net_conn *conn, void *udata) {
+    (void)conn;
+    struct fwdctx *ctx = udata;
+    ctx->done(ctx->conn, ctx->udata);
+    xfree(ctx);
+}
+
+// conn_forward processes work on the qthread at index 'thread'.
+// The connection is paused until the work is done, so the work function may
+// write to the connection. The done function is called on the connection's
+// own thread.
+bool conn_forward(struct conn *conn, int thread, 
+    void(*work)(struct conn *conn, void *udata), 
+    void(*done)(struct conn *conn, void *udata), void *udata)
+{
+    struct fwdctx *ctx = xmalloc(sizeof(struct fwdctx));
+    ctx->conn = conn;
+    ctx->udata = udata;
+    ctx->work = work;
+    ctx->done = done;
+    if (!net_conn_forward(conn->conn5, thread, fwdwork5, fwddone5, ctx)) {
+        xfree(ctx);
+        return false;
+    }
+    return true;
+}
+
+// conn_park pauses the connection until conn_unpark is called from the
+// connection's own thread, such as while it waits on another server. Then
+// the done function is called.
+bool conn_park(struct conn *conn, void(*done)(struct conn *conn, void *udata),
+    void *udata)
+{
+    struct bgworkctx *ctx = xmalloc(sizeof(struct bgworkctx));
+    ctx->conn = conn;
+    ctx->udata = udata;
+    ctx->work = 0;
+    ctx->done = done;
+    if (!net_conn_park(conn->conn5, done5, ctx)) {
+        xfree(ctx);
+        return false;
+    }
+    return true;
+}
+
+void conn_unpark(struct conn *conn) {
+    net_conn_unpark(conn->conn5);
+}
+
+int conn_thread(struct conn *conn) {
+    return net_conn_thread(conn->conn5);
+}
+
 static void writeln(struct conn *conn, char ch, const void *data, ssize_t len) {
     if (len < 0) {
         len = strlen(data);
@@ -374,9 +522,9 @@ void conn_write_http(struct conn *conn, int code, const char *status,
     size_t n = snprintf(resp, sizeof(resp), 
         "HTTP/1.1 %d %s\r\n"
         "Content-Length: %zu\r\n"
-        "Connection: Close\r\n"
+        "Connection: %s\r\n"
         "\r\n",
-        code, status, bodylen);
+        code, status, bodylen, conn->keepalive ? "keep-alive" : "close");
     conn_write_raw(conn, resp, n);
     if (bodylen > 0) {
         conn_write_raw(conn, body, bodylen);
@@ -441,6 +589,10 @@ struct pg *conn_pg(struct conn *conn) {
     return conn->pg;
 }
 
+int conn_fd(struct conn *conn) {
+    return net_conn_fd(conn->conn5);
+}
+
 int conn_setnonblock(struct conn *conn, bool set) {
     return net_conn_setnonblock(conn->conn5, set);
 }
@@ -23,6 +23,8 @@
 #define ERR_INDEX_OUT_OF_RANGE	"ERR index is out of range"
 #define ERR_INVALID_INTEGER     "ERR value is not an integer or out of range"
 #define ERR_OUT_OF_MEMORY       "ERR out of memory"
+#define ERR_WRONG_TYPE          "WRONGTYPE Operation against a key holding " \
+                                "the wrong kind of value"
 #define CLIENT_ERROR_BAD_FORMAT "CLIENT_ERROR bad command line format"
 #define CLIENT_ERROR_BAD_CHUNK  "CLIENT_ERROR bad data chunk"
 
@@ -31,6 +33,8 @@ struct conn;
 void conn_close(struct conn *conn);
 bool conn_isclosed(struct conn *conn);
 bool conn_istls(struct conn *conn);
+bool conn_isshm(struct conn *conn);
+bool conn_shmring(struct conn *conn, size_t size, const char **err);
 
 // only use these from bgwork threads
 ssize_t conn_read(struct conn *conn, char *bytes, size_t nbytes);
@@ -63,12 +67,22 @@ void conn_setauth(struct conn *conn, bool authorized);
 bool pg_execute(struct conn *conn);
 
 void pg_write_row_desc(struct conn *conn, const char **fields, int nfields);
+void pg_write_row_desc_typed(struct conn *conn, const char **fields,
+    const char *types, int nfields);
+size_t pg_encode_i64(struct conn *conn, int col, int64_t x, char *dst);
 void pg_write_row_data(struct conn *conn, const char **cols, 
     const size_t *collens, int ncols);
 void pg_write_error(struct conn *conn, const char *msg);
 void pg_write_complete(struct conn *conn, const char *tag);
 void pg_write_completef(struct conn *conn, const char *tag_format, ...);
 void pg_write_ready(struct conn *conn, unsigned char code);
+void pg_copy_begin(struct conn *conn, bool binary);
+bool pg_copying(struct conn *conn);
+void pg_copy_stored(struct conn *conn, size_t count, const char *err);
+void pg_write_copy_out(struct conn *conn, bool binary, int ncols);
+void pg_write_copy_row(struct conn *conn, bool binary, const char **cols,
+    const size_t *collens, int ncols);
+void pg_write_copy_done(struct conn *conn, bool binary);
 void pg_write_simple_row_data_ready(struct conn *conn, const char *desc,
     const void *row, size_t len, const char *tag);
 void pg_write_simple_row_i64_ready(struct conn *conn, const char *desc,
@@ -82,6 +96,15 @@ void pg_write_simple_row_str_readyf(struct conn *conn, const char *desc,
 
 bool conn_bgwork(struct conn *conn, void(*work)(void *udata), 
     void(*done)(struct conn *conn, void *udata), void *udata);
+bool conn_iowork(struct conn *conn, void(*work)(void *udata), 
+    void(*done)(struct conn *conn, void *udata), void *udata);
+bool conn_forward(struct conn *conn, int thread, 
+    void(*work)(struct conn *conn, void *udata), 
+    void(*done)(struct conn *conn, void *udata), void *udata);
+bool conn_park(struct conn *conn, void(*done)(struct conn *conn, void *udata),
+    void *udata);
+void conn_unpark(struct conn *conn);
+int conn_thread(struct conn *conn);
 
 void stat_cmd_get_incr(struct conn *conn);
 void stat_cmd_set_incr(struct conn *conn);
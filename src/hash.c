@@ -0,0 +1,340 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit hash.c provides the encoding for hash values, which are maps of fields
+// stored as a single cache entry.
+//
+// A hash is a type byte followed by a list of field records.
+//
+//   record: uvarint(fieldlen<<1|hasexpires) field uvarint(vallen) val
+//           [int64 expires]
+//
+// Small hashes are a plain list that's scanned linearly. Hashes with more
+// than TABLEMIN fields also carry an open addressing table of record offsets
+// after the list, making field lookups constant time.
+//
+//   list:  0x00 records
+//   table: 0x01 uint32(recordslen) records uint32(cap) uint32(slot)*cap
+//
+// Field expirations are unix times, so they remain valid across restarts.
+// Expired fields are skipped when read and dropped on the next rewrite.
+// Changing a hash always writes a new encoding with the fields in their
+// original order, which keeps the size the same when only values of the same
+// length are changed.
+#include <string.h>
+#include "util.h"
+#include "hash.h"
+
+#define HASH_LIST  0
+#define HASH_TABLE 1
+#define TABLEMIN   64   // field count that switches to the table encoding
+
+static uint32_t fnv1a(const char *data, size_t len) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash^(uint8_t)data[i])*0x01000193;
+    }
+    return hash;
+}
+
+// Returns the records of the hash.
+static bool hash_records(const char *data, size_t len, const char **recs,
+    size_t *recslen)
+{
+    if (len == 0) {
+        *recs = data;
+        *recslen = 0;
+        return true;
+    }
+    if (data[0] == HASH_LIST) {
+        *recs = data+1;
+        *recslen = len-1;
+        return true;
+    }
+    if (data[0] == HASH_TABLE && len >= 5) {
+        size_t n = read_u32(data+1);
+        if (n <= len-5) {
+            *recs = data+5;
+            *recslen = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the record at pos. Returns the size of the record, or zero if it's
+// malformed.
+static size_t read_record(const char *recs, size_t recslen, size_t pos,
+    struct hash_field *f)
+{
+    const char *p = recs+pos;
+    size_t n = recslen-pos;
+    uint64_t x;
+    int m = varint_read_u64(p, n, &x);
+    if (m <= 0 || (x>>1) > n-m) {
+        return 0;
+    }
+    bool hasexp = x&1;
+    f->fieldlen = x>>1;
+    f->field = p+m;
+    p += m+f->fieldlen;
+    n -= m+f->fieldlen;
+    m = varint_read_u64(p, n, &x);
+    if (m <= 0 || x > n-m || (hasexp && x+8 > n-m)) {
+        return 0;
+    }
+    f->valuelen = x;
+    f->value = p+m;
+    p += m+f->valuelen;
+    f->expires = 0;
+    if (hasexp) {
+        memcpy(&f->expires, p, 8);
+        p += 8;
+    }
+    return p-(recs+pos);
+}
+
+static bool field_alive(const struct hash_field *f, int64_t now) {
+    return f->expires == 0 || f->expires > now;
+}
+
+// Returns true if the data is a well formed hash.
+bool hash_valid(const char *data, size_t len) {
+    const char *recs;
+    size_t recslen;
+    if (!hash_records(data, len, &recs, &recslen)) {
+        return false;
+    }
+    struct hash_field f;
+    size_t pos = 0;
+    while (pos < recslen) {
+        size_t n = read_record(recs, recslen, pos, &f);
+        if (n == 0) {
+            return false;
+        }
+        pos += n;
+    }
+    if (len == 0 || data[0] == HASH_LIST) {
+        return true;
+    }
+    const char *p = recs+recslen;
+    size_t n = len-(p-data);
+    if (n < 4) {
+        return false;
+    }
+    size_t cap = read_u32(p);
+    if (cap == 0 || (cap&(cap-1)) || cap > (n-4)/4) {
+        return false;
+    }
+    bool hasempty = false;
+    for (size_t i = 0; i < cap; i++) {
+        uint32_t slot = read_u32(p+4+i*4);
+        if (slot > recslen) {
+            return false;
+        }
+        hasempty = hasempty || slot == 0;
+    }
+    // Lookups stop at an empty slot.
+    return hasempty;
+}
+
+// Iterates over the fields of the hash, skipping expired fields. The 'pos'
+// must start at zero. Returns false when there are no more fields.
+bool hash_next(const char *data, size_t len, int64_t now, size_t *pos,
+    struct hash_field *f)
+{
+    const char *recs;
+    size_t recslen;
+    if (!hash_records(data, len, &recs, &recslen)) {
+        return false;
+    }
+    while (*pos < recslen) {
+        size_t n = read_record(recs, recslen, *pos, f);
+        if (n == 0) {
+            return false;
+        }
+        *pos += n;
+        if (field_alive(f, now)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds a field in the hash. Returns false if it does not exist or expired.
+bool hash_get(const char *data, size_t len, int64_t now, const char *field,
+    size_t fieldlen, struct hash_field *f)
+{
+    if (len > 0 && data[0] == HASH_TABLE) {
+        const char *recs;
+        size_t recslen;
+        if (!hash_records(data, len, &recs, &recslen)) {
+            return false;
+        }
+        const char *table = recs+recslen;
+        size_t cap = read_u32(table);
+        size_t i = fnv1a(field, fieldlen)&(cap-1);
+        while (1) {
+            uint32_t slot = read_u32(table+4+i*4);
+            if (slot == 0) {
+                return false;
+            }
+            if (read_record(recs, recslen, slot-1, f) > 0 &&
+                f->fieldlen == fieldlen &&
+                memcmp(f->field, field, fieldlen) == 0)
+            {
+                return field_alive(f, now);
+            }
+            i = (i+1)&(cap-1);
+        }
+    }
+    size_t pos = 0;
+    while (hash_next(data, len, now, &pos, f)) {
+        if (f->fieldlen == fieldlen &&
+            memcmp(f->field, field, fieldlen) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the number of fields in the hash.
+size_t hash_count(const char *data, size_t len, int64_t now) {
+    size_t count = 0;
+    size_t pos = 0;
+    struct hash_field f;
+    while (hash_next(data, len, now, &pos, &f)) {
+        count++;
+    }
+    return count;
+}
+
+static void write_record(struct buf *dst, const struct hash_field *f) {
+    buf_append_uvarint(dst, (f->fieldlen<<1)|(f->expires != 0));
+    buf_append(dst, f->field, f->fieldlen);
+    buf_append_uvarint(dst, f->valuelen);
+    buf_append(dst, f->value, f->valuelen);
+    if (f->expires != 0) {
+        buf_append(dst, &f->expires, 8);
+    }
+}
+
+static bool same_field(const struct hash_field *a, const struct hash_field *b)
+{
+    return a->fieldlen == b->fieldlen &&
+        memcmp(a->field, b->field, a->fieldlen) == 0;
+}
+
+static void apply_change(struct hash_field *f, struct hash_change *change) {
+    if (change->action&HASH_SETVALUE) {
+        f->value = change->f.value;
+        f->valuelen = change->f.valuelen;
+        if (!(change->action&HASH_KEEPTTL)) {
+            f->expires = 0;
+        }
+    }
+    if (change->action&HASH_SETEXPIRES) {
+        f->expires = change->f.expires;
+    }
+}
+
+// Writes the hash with the changes applied to 'dst', which is reset first.
+// Changes are applied in order, and the status of each change is set.
+// Returns the number of fields in the new hash. An empty hash is written as
+// zero bytes.
+size_t hash_rewrite(const char *data, size_t len, int64_t now,
+    struct hash_change *changes, int nchanges, struct buf *dst)
+{
+    dst->len = 0;
+    for (int i = 0; i < nchanges; i++) {
+        changes[i].status = HASH_MISSING;
+    }
+    buf_append_byte(dst, HASH_LIST);
+    size_t count = 0;
+    size_t pos = 0;
+    struct hash_field f;
+    while (hash_next(data, len, now, &pos, &f)) {
+        bool deleted = false;
+        for (int i = 0; i < nchanges; i++) {
+            if (same_field(&f, &changes[i].f)) {
+                changes[i].status = deleted ? HASH_MISSING : HASH_EXISTED;
+                if (changes[i].action&HASH_DELETE) {
+                    deleted = true;
+                } else if (!deleted) {
+                    apply_change(&f, &changes[i]);
+                }
+            }
+        }
+        if (!deleted) {
+            write_record(dst, &f);
+            count++;
+        }
+    }
+    // Add the new fields, where a repeated field takes the last value.
+    for (int i = 0; i < nchanges; i++) {
+        if (changes[i].status != HASH_MISSING ||
+            !(changes[i].action&HASH_SETVALUE))
+        {
+            continue;
+        }
+        f = changes[i].f;
+        f.expires = 0;
+        apply_change(&f, &changes[i]);
+        changes[i].status = HASH_ADDED;
+        bool deleted = false;
+        for (int j = i+1; j < nchanges; j++) {
+            if (same_field(&f, &changes[j].f)) {
+                changes[j].status = deleted ? HASH_MISSING : HASH_EXISTED;
+                if (changes[j].action&HASH_DELETE) {
+                    deleted = true;
+                } else if (!deleted) {
+                    apply_change(&f, &changes[j]);
+                }
+            }
+        }
+        if (!deleted) {
+            write_record(dst, &f);
+            count++;
+        }
+    }
+    if (count == 0) {
+        dst->len = 0;
+        return 0;
+    }
+    if (count > TABLEMIN && dst->len < UINT32_MAX) {
+        // Convert to the table encoding.
+        size_t recslen = dst->len-1;
+        size_t cap = 1;
+        while (cap < count*2) {
+            cap *= 2;
+        }
+        buf_ensure(dst, 8+cap*4);
+        char *recs = dst->data+5;
+        memmove(recs, dst->data+1, recslen);
+        dst->data[0] = HASH_TABLE;
+        write_u32(dst->data+1, recslen);
+        char *table = recs+recslen;
+        write_u32(table, cap);
+        memset(table+4, 0, cap*4);
+        dst->len = 5+recslen+4+cap*4;
+        pos = 0;
+        while (pos < recslen) {
+            size_t n = read_record(recs, recslen, pos, &f);
+            size_t i = fnv1a(f.field, f.fieldlen)&(cap-1);
+            while (read_u32(table+4+i*4) != 0) {
+                i = (i+1)&(cap-1);
+            }
+            write_u32(table+4+i*4, pos+1);
+            pos += n;
+        }
+    }
+    return count;
+}
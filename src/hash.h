@@ -0,0 +1,52 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "buf.h"
+
+// Actions for a hash_change
+#define HASH_SETVALUE   1 // set the value of the field, adding it if missing
+#define HASH_SETEXPIRES 2 // set the expiration of an existing field
+#define HASH_KEEPTTL    4 // keep the expiration when setting the value
+#define HASH_DELETE     8 // delete the field
+
+// Status of a hash_change after hash_rewrite
+#define HASH_MISSING 0 // field does not exist
+#define HASH_EXISTED 1 // field existed
+#define HASH_ADDED   2 // field was added
+
+struct hash_field {
+    const char *field;
+    size_t fieldlen;
+    const char *value;
+    size_t valuelen;
+    int64_t expires;  // unix time in nanoseconds, zero for no expiration
+};
+
+struct hash_change {
+    struct hash_field f;
+    int action;
+    int status;       // output
+};
+
+bool hash_valid(const char *data, size_t len);
+bool hash_next(const char *data, size_t len, int64_t now, size_t *pos,
+    struct hash_field *f);
+bool hash_get(const char *data, size_t len, int64_t now, const char *field,
+    size_t fieldlen, struct hash_field *f);
+size_t hash_count(const char *data, size_t len, int64_t now);
+size_t hash_rewrite(const char *data, size_t len, int64_t now,
+    struct hash_change *changes, int nchanges, struct buf *dst);
+
+#endif
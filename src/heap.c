@@ -0,0 +1,285 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit heap.c provides a memory allocator that operates on a shared memory
+// file, allowing for the cache to outlive the process.
+//
+// The file is always mapped at the same fixed address, so pointers stored in
+// the heap remain valid when a new process maps it again. Allocations are
+// rounded up to size classes, with each class having its own free list, and
+// new memory is carved from the top of the heap. There's no coalescing of
+// freed memory between classes.
+// The heap is marked as clean only after the cache was detached, otherwise
+// a new process will start with an empty heap.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heap.h"
+
+#ifdef CCSANI
+// The address sanitizer keeps its own allocator at 0x600000000000.
+#define HEAPADDR    ((uintptr_t)0x500000000000) // fixed mapping address
+#else
+#define HEAPADDR    ((uintptr_t)0x600000000000) // fixed mapping address
+#endif
+#define HEAPMAGIC   0x706165686f676f70          // "pogoheap"
+#define HEAPVERSION 1
+#define HEAPALIGN   (2*1024*1024) // allows for hugepages
+#define HEAPHDRSIZE 4096          // room for the heap header
+#define NCLASSES    176           // number of size classes
+#define BLOCKHDR    16            // block header, holds the size class
+#define LOCKTRIES   500           // wait up to 5 seconds for the file lock
+
+struct heap_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean;               // heap was closed after a detach
+    uint64_t size;                // size of the file
+    void *root;                   // user root pointer
+    atomic_uint_fast64_t top;     // offset of unused memory
+    atomic_uint_fast64_t used;    // bytes allocated, including headers
+    void *free[NCLASSES];         // free lists, one per size class
+};
+
+static struct heap_header *heap = 0;
+static int heapfd = -1;
+static atomic_flag locks[NCLASSES];
+
+// Returns the size class for an allocation of n bytes.
+// Classes are 16 byte steps up to 128 bytes, and four steps per power of two
+// after that.
+static int size_class(size_t n) {
+    if (n <= 128) {
+        return n == 0 ? 0 : (int)((n-1)/16);
+    }
+    int b = 63-__builtin_clzll(n-1);
+    return 8 + (b-7)*4 + (int)(((n-1)>>(b-2))&3);
+}
+
+static size_t class_size(int c) {
+    if (c < 8) {
+        return (size_t)(c+1)*16;
+    }
+    int b = 7+(c-8)/4;
+    int sub = (c-8)%4;
+    return ((size_t)1<<b) + ((size_t)(sub+1)<<(b-2));
+}
+
+static void class_lock(int c) {
+    while (atomic_flag_test_and_set_explicit(&locks[c], __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void class_unlock(int c) {
+    atomic_flag_clear_explicit(&locks[c], __ATOMIC_RELEASE);
+}
+
+void *heap_malloc(size_t size) {
+    int c = size_class(size);
+    if (!heap || c >= NCLASSES) {
+        return 0;
+    }
+    size_t csize = class_size(c);
+    uint8_t *block = 0;
+    class_lock(c);
+    if (heap->free[c]) {
+        block = (uint8_t*)heap->free[c]-BLOCKHDR;
+        heap->free[c] = *(void**)heap->free[c];
+    }
+    class_unlock(c);
+    if (!block) {
+        uint64_t off = atomic_load(&heap->top);
+        do {
+            if (off+BLOCKHDR+csize > heap->size) {
+                // Out of memory. The top is left as is, so that smaller
+                // allocations may still fit.
+                return 0;
+            }
+        } while (!atomic_compare_exchange_weak(&heap->top, &off, 
+            off+BLOCKHDR+csize));
+        block = (uint8_t*)heap+off;
+        *(uint64_t*)block = c;
+    }
+    atomic_fetch_add_explicit(&heap->used, BLOCKHDR+csize, __ATOMIC_RELAXED);
+    return block+BLOCKHDR;
+}
+
+void heap_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    int c = (int)*(uint64_t*)((uint8_t*)ptr-BLOCKHDR);
+    atomic_fetch_sub_explicit(&heap->used, BLOCKHDR+class_size(c),
+        __ATOMIC_RELAXED);
+    class_lock(c);
+    *(void**)ptr = heap->free[c];
+    heap->free[c] = ptr;
+    class_unlock(c);
+}
+
+static void *map_heap(int fd, size_t size) {
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void *addr = mmap((void*)HEAPADDR, size, PROT_READ|PROT_WRITE, flags, fd,
+        0);
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+    if (addr != (void*)HEAPADDR) {
+        // The fixed address is not available.
+        munmap(addr, size);
+        errno = EADDRINUSE;
+        return 0;
+    }
+    return addr;
+}
+
+// Returns true if the file holds a heap that this build can map, clean or
+// not. The root is checked against the address, because the heap of a build
+// with another address can't be attached.
+static bool heap_valid(int fd, struct heap_header *hdr) {
+    ssize_t n = pread(fd, hdr, sizeof(struct heap_header), 0);
+    struct stat st;
+    return n == sizeof(struct heap_header) && hdr->magic == HEAPMAGIC &&
+        hdr->version == HEAPVERSION &&
+        (uintptr_t)hdr->root > HEAPADDR &&
+        (uintptr_t)hdr->root < HEAPADDR+hdr->size &&
+        fstat(fd, &st) == 0 && (uint64_t)st.st_size == hdr->size;
+}
+
+// Open the heap file and map it into memory. The 'attached' param will be set
+// to true if an existing clean heap was opened, which is required for using
+// the heap_root. Otherwise the heap is reset to the provided size.
+// Fails with EBUSY when another process has the heap open.
+bool heap_open(const char *path, size_t size, bool *attached) {
+    *attached = false;
+    size = (size+HEAPALIGN-1)/HEAPALIGN*HEAPALIGN;
+    if (size < HEAPALIGN*2) {
+        size = HEAPALIGN*2;
+    }
+    int fd = open(path, O_RDWR|O_CREAT, 0600);
+    if (fd == -1) {
+        return false;
+    }
+    // The lock is held while the file is mapped, so the file is never
+    // resized while another process is using it. A process that handed over
+    // the heap keeps the lock until it has fully exited, which is waited on.
+    int tries = 0;
+    while (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+        if (errno != EWOULDBLOCK || ++tries == LOCKTRIES) {
+            if (errno == EWOULDBLOCK) {
+                errno = EBUSY;
+            }
+            close(fd);
+            return false;
+        }
+        usleep(10000);
+    }
+    struct heap_header hdr;
+    if (heap_valid(fd, &hdr) && hdr.clean) {
+        heap = map_heap(fd, hdr.size);
+        if (!heap) {
+            close(fd);
+            return false;
+        }
+        heap->clean = 0;
+        heapfd = fd;
+        *attached = true;
+        return true;
+    }
+    // Start a new heap.
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        close(fd);
+        return false;
+    }
+    heap = map_heap(fd, size);
+    if (!heap) {
+        close(fd);
+        return false;
+    }
+    memset(heap, 0, sizeof(struct heap_header));
+    heap->magic = HEAPMAGIC;
+    heap->version = HEAPVERSION;
+    heap->size = size;
+    atomic_init(&heap->top, HEAPHDRSIZE);
+    atomic_init(&heap->used, 0);
+    heapfd = fd;
+    return true;
+}
+
+// Check the heap at path while another process may still be using it, such
+// as before asking that process to hand it over. The file is mapped read-only
+// at any address, and the check is called with the root at that address.
+// Only the root's own memory may be read, because the pointers in the heap
+// are for the fixed address.
+// Returns false if there's no heap that this build can map, or if the check
+// returns false.
+bool heap_peek(const char *path, bool (*check)(void *root, void *udata),
+    void *udata)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = false;
+    struct heap_header hdr;
+    if (heap_valid(fd, &hdr)) {
+        void *mem = mmap(0, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            ok = check((char*)mem+((uintptr_t)hdr.root-HEAPADDR), udata);
+            munmap(mem, hdr.size);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Close the heap. Set 'clean' when there are no operations in progress and
+// the next process may use the heap contents.
+// The memory stays mapped until the process exits because other threads may
+// still be waiting on locks that are stored in the heap.
+void heap_close(bool clean) {
+    if (heapfd == -1) {
+        return;
+    }
+    heap->clean = clean;
+    msync(heap, HEAPHDRSIZE, MS_SYNC);
+    close(heapfd);
+    heapfd = -1;
+}
+
+void *heap_root(void) {
+    return heap ? heap->root : 0;
+}
+
+void heap_setroot(void *root) {
+    heap->root = root;
+}
+
+// Returns the number of bytes allocated.
+size_t heap_used(void) {
+    return heap ? atomic_load_explicit(&heap->used, __ATOMIC_RELAXED) : 0;
+}
+
+// Returns the size of the heap.
+size_t heap_size(void) {
+    return heap ? heap->size : 0;
+}
@@ -0,0 +1,27 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+bool heap_open(const char *path, size_t size, bool *attached);
+void heap_close(bool clean);
+bool heap_peek(const char *path, bool (*check)(void *root, void *udata),
+    void *udata);
+void *heap_malloc(size_t size);
+void heap_free(void *ptr);
+void *heap_root(void);
+void heap_setroot(void *root);
+size_t heap_used(void);
+size_t heap_size(void);
+
+#endif
@@ -35,8 +35,185 @@ bool http_valid_key(const char *key, size_t len) {
     return true;
 }
 
-ssize_t parse_http(const char *data, size_t len, struct args *args, 
-    int *httpvers, bool *keepalive)
+static int hexval(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch-'0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch-'a'+10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch-'A'+10;
+    }
+    return -1;
+}
+
+// Saves how far an incomplete chunked body was read, and returns zero.
+static ssize_t chunked_wait(struct http_chunked *state, size_t pos,
+    size_t bodylen, bool trailers)
+{
+    if (state) {
+        state->pos = pos;
+        state->bodylen = bodylen;
+        state->trailers = trailers;
+    }
+    return 0;
+}
+
+// Reads a chunked body, which is a series of chunks that each have a hex size
+// line, followed by a zero sized chunk and optional trailers.
+// Returns the number of bytes of the encoded body, or zero if it's not
+// complete yet, or -1 if it's malformed. The decoded body is appended to
+// 'dst', when provided, and its size is returned in 'bodylen'.
+// When 'state' is provided, the read continues from where the last read of
+// the same body stopped, rather than from the first chunk, and it's cleared
+// once the body is complete or malformed.
+static ssize_t read_chunked(const char *data, size_t len, struct buf *dst,
+    size_t *bodylen, struct http_chunked *state)
+{
+    const char *p = data;
+    const char *e = data+len;
+    *bodylen = 0;
+    bool trailers = false;
+    if (state) {
+        if (state->pos <= len) {
+            p += state->pos;
+            *bodylen = state->bodylen;
+            trailers = state->trailers;
+        }
+        memset(state, 0, sizeof(struct http_chunked));
+    }
+    while (!trailers) {
+        // chunk size line: hex-size [;extensions] CRLF
+        const char *line = p;
+        uint64_t size = 0;
+        int ndigits = 0;
+        while (p < e && hexval(*p) >= 0) {
+            size = (size<<4)|hexval(*p);
+            if (++ndigits > 8) {
+                return -1;
+            }
+            p++;
+        }
+        const char *eol = p < e ? memchr(p, '\n', e-p) : 0;
+        if (!eol) {
+            return chunked_wait(state, line-data, *bodylen, false);
+        }
+        if (ndigits == 0 || eol == p || *(eol-1) != '\r' ||
+            (eol-1 != p && *p != ';'))
+        {
+            return -1;
+        }
+        p = eol+1;
+        if (size == 0) {
+            break;
+        }
+        if (*bodylen+size > MAXARGSZ) {
+            stat_store_too_large_incr(0);
+            return -1;
+        }
+        if ((size_t)(e-p) < size+2) {
+            // The rest of the chunk is known to be missing.
+            parse_need = size+2-(e-p);
+            return chunked_wait(state, line-data, *bodylen, false);
+        }
+        if (p[size] != '\r' || p[size+1] != '\n') {
+            return -1;
+        }
+        if (dst) {
+            buf_append(dst, p, size);
+        }
+        *bodylen += size;
+        p += size+2;
+    }
+    // trailers, ending with an empty line
+    while (1) {
+        const char *eol = memchr(p, '\n', e-p);
+        if (!eol) {
+            return chunked_wait(state, p-data, *bodylen, true);
+        }
+        if (eol == p || *(eol-1) != '\r') {
+            return -1;
+        }
+        bool empty = eol == p+1;
+        p = eol+1;
+        if (empty) {
+            break;
+        }
+    }
+    return p-data;
+}
+
+// Reads one length framed item, "<len>\r\n<bytes>\r\n".
+static int read_framed(const char *body, size_t len, size_t *pos,
+    const char **item, size_t *itemlen)
+{
+    const char *p = body+*pos;
+    const char *e = body+len;
+    const char *eol = memchr(p, '\n', e-p);
+    uint64_t x;
+    if (!eol || eol == p || *(eol-1) != '\r' || !parse_u64(p, eol-1-p, &x) ||
+        x > (size_t)(e-eol-1) || (size_t)(e-eol-1)-x < 2 ||
+        eol[1+x] != '\r' || eol[2+x] != '\n')
+    {
+        return -1;
+    }
+    *item = eol+1;
+    *itemlen = x;
+    *pos = (eol+3+x)-body;
+    return 1;
+}
+
+// Reads the next item from the body of a batch request. Items are either one
+// per line, or length framed when 'framed' is true. For a 'pair', the item is
+// a key and a value, which are two frames, or a line with a space between
+// them. Returns 1 for an item, 0 at the end of the body, or -1 if the body is
+// malformed.
+int http_batch_next(const char *body, size_t len, bool framed, bool pair,
+    size_t *pos, const char **key, size_t *keylen, const char **val,
+    size_t *vallen)
+{
+    if (framed) {
+        if (*pos == len) {
+            return 0;
+        }
+        if (read_framed(body, len, pos, key, keylen) != 1 ||
+            (pair && read_framed(body, len, pos, val, vallen) != 1))
+        {
+            return -1;
+        }
+        return 1;
+    }
+    const char *line;
+    size_t linelen;
+    do {
+        if (*pos == len) {
+            return 0;
+        }
+        line = body+*pos;
+        const char *eol = memchr(line, '\n', len-*pos);
+        linelen = eol ? (size_t)(eol-line) : len-*pos;
+        *pos += eol ? linelen+1 : linelen;
+        if (linelen > 0 && line[linelen-1] == '\r') {
+            linelen--;
+        }
+    } while (linelen == 0);
+    if (!pair) {
+        *key = line;
+        *keylen = linelen;
+        return 1;
+    }
+    const char *sp = memchr(line, ' ', linelen);
+    if (!sp || sp == line) {
+        return -1;
+    }
+    *key = line;
+    *keylen = sp-line;
+    *val = sp+1;
+    *vallen = linelen-(sp+1-line);
+    return 1;
+}
+
+ssize_t parse_http(const char *data, size_t len, struct args *args,
+    int *httpvers, bool *keepalive, struct http_chunked *chunkstate)
 {
     *keepalive = false;
     *httpvers = 0;
@@ -51,7 +228,9 @@ ssize_t parse_http(const char *data, size_t len, struct args *args,
     size_t hdrvallen = 0;
     size_t bodylen = 0;
     bool nocontentlength = true;
+    bool chunked = false;
     bool html = false;
+    bool framed = false;
     const char *authhdr = 0;
     size_t authhdrlen = 0;
     const char *p = data;
@@ -108,12 +287,28 @@ ssize_t parse_http(const char *data, size_t len, struct args *args,
         
         p++;
     }
-    goto badreq;
+    // The request line is not complete yet, such as for a pipelined request
+    // that was split by the read.
+    return 0;
 readhdrs:
     // Parse the headers, pulling the pairs along the way.
     while (p < e) {
+        if (*p == '\r') {
+            // An empty line ends the headers.
+            if (e-p < 2) {
+                return 0;
+            }
+            if (p[1] != '\n') {
+                goto badreq;
+            }
+            p += 2;
+            goto readbody;
+        }
         hdrname = p;
         while (p < e) {
+            if (*p == '\n') {
+                goto badreq;
+            }
             if (*p == ':') {
                 hdrnamelen = p-hdrname;
                 p++;
@@ -132,25 +327,47 @@ readhdrs:
                         // We have a new header pair (hdrname, hdrval);
                         if (argeq_bytes(hdrname, hdrnamelen, "content-length")){
                             uint64_t x;
-                            if (!parse_u64(hdrval, hdrvallen, &x) || 
-                                x > MAXARGSZ)
-                            {
+                            if (!parse_u64(hdrval, hdrvallen, &x)) {
+                                goto badreq;
+                            }
+                            if (x > MAXARGSZ) {
                                 stat_store_too_large_incr(0);
                                 goto badreq;
                             }
+                            if (!nocontentlength && x != bodylen) {
+                                // conflicting lengths
+                                goto badreq;
+                            }
                             bodylen = x;
                             nocontentlength = false;
+                        } else if (argeq_bytes(hdrname, hdrnamelen,
+                            "transfer-encoding"))
+                        {
+                            if (!argeq_bytes(hdrval, hdrvallen, "chunked")) {
+                                goto badreq;
+                            }
+                            chunked = true;
                         } else if (argeq_bytes(hdrname, hdrnamelen,
                             "connection"))
                         {
-                            *keepalive = argeq_bytes(hdrval, hdrvallen, 
-                                "keep-alive");
+                            if (argeq_bytes(hdrval, hdrvallen, "close")) {
+                                *keepalive = false;
+                            } else if (argeq_bytes(hdrval, hdrvallen, 
+                                "keep-alive"))
+                            {
+                                *keepalive = true;
+                            }
                         } else if (argeq_bytes(hdrname, hdrnamelen,
                             "accept"))
                         {
                             if (memmem(hdrval, hdrvallen, "text/html", 9) != 0){
                                 html = true;
                             }
+                        } else if (argeq_bytes(hdrname, hdrnamelen,
+                            "content-type"))
+                        {
+                            framed = hdrvallen >= 24 && strncasecmp(hdrval,
+                                "application/octet-stream", 24) == 0;
                         } else if (argeq_bytes(hdrname, hdrnamelen,
                             "authorization"))
                         {
@@ -158,15 +375,6 @@ readhdrs:
                             authhdrlen = hdrvallen;
                         }
                         p++;
-                        if (p < e && *p == '\r') {
-                            p++;
-                            if (p < e && *p == '\n') {
-                                p++;
-                            } else {
-                                goto badreq;
-                            }
-                            goto readbody;
-                        }
                         break;
                     }
                     p++;
@@ -179,11 +387,29 @@ readhdrs:
     return 0;
 readbody:
     // read the content body
-    if ((size_t)(e-p) < bodylen) {
-        return 0;
+    if (chunked && !nocontentlength) {
+        // A message must not have both.
+        goto badreq;
     }
     const char *body = p;
-    p = e;
+    if (chunked) {
+        // Only the size is known for now, the body is decoded into the
+        // arguments below, once it's complete.
+        ssize_t n = read_chunked(p, e-p, 0, &bodylen, chunkstate);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            goto badreq;
+        }
+        e = p+n;
+    } else {
+        if ((size_t)(e-p) < bodylen) {
+            return 0;
+        }
+        // Anything after the body is the next pipelined request.
+        e = p+bodylen;
+    }
 
     // check
     if (urilen == 0 || uri[0] != '/') {
@@ -288,7 +514,13 @@ readbody:
         }
         args_append(args, "set", 3, true);
         args_append(args, uri, urilen, true);
-        args_append(args, body, bodylen, true);
+        if (chunked) {
+            // The chunks are joined into a buffer owned by the args.
+            args_append(args, 0, 0, false);
+            read_chunked(body, e-body, &args->bufs[args->len-1], &bodylen, 0);
+        } else {
+            args_append(args, body, bodylen, true);
+        }
         if (cas) {
             args_append(args, "cas", 3, true);
             args_append(args, cas, caslen, true);
@@ -316,6 +548,48 @@ readbody:
         }
         args_append(args, "del", 3, true);
         args_append(args, uri, urilen, true);
+    } else if (bytes_const_eq(method, methodlen, "POST")) {
+        // Batch requests, where the keys and values are in the body.
+        bool mset = bytes_const_eq(uri, urilen, "_mset");
+        if (!mset && !bytes_const_eq(uri, urilen, "_mget")) {
+            parse_seterror("Method Not Allowed");
+            goto badreq;
+        }
+        args_append(args, mset ? "_mset" : "_mget", 5, true);
+        if (chunked) {
+            args_append(args, 0, 0, false);
+            read_chunked(body, e-body, &args->bufs[args->len-1], &bodylen, 0);
+        } else {
+            args_append(args, body, bodylen, true);
+        }
+        const char *bdata = args->bufs[1].data;
+        size_t pos = 0;
+        const char *k, *v;
+        size_t klen, vlen;
+        int ret;
+        while ((ret = http_batch_next(bdata, bodylen, framed, mset, &pos,
+            &k, &klen, &v, &vlen)) == 1)
+        {
+            if (klen > 250) {
+                goto badkey;
+            }
+        }
+        if (ret == -1) {
+            goto badreq;
+        }
+        if (framed) {
+            args_append(args, "framed", 6, true);
+        } else {
+            args_append(args, "lines", 5, true);
+        }
+        if (mset && ex) {
+            args_append(args, "ex", 2, true);
+            args_append(args, ex, exlen, true);
+        }
+        if (mset && flags) {
+            args_append(args, "flags", 5, true);
+            args_append(args, flags, flagslen, true);
+        }
     } else {
         parse_seterror("Method Not Allowed");
         goto badreq;
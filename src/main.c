@@ -13,6 +13,7 @@
 #include <signal.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
@@ -34,12 +35,23 @@
 #include "pogocache.h"
 #include "gitinfo.h"
 #include "uring.h"
+#include "compress.h"
+#include "tier.h"
+#include "heap.h"
+#include "upgrade.h"
+#include "repl.h"
+#include "route.h"
 
 // default user flags
 int nthreads = 0;             // number of client threads
 char *port = "9401";          // default tcp port (non-tls)
 char *host = "127.0.0.1";     // default hostname or ip address
 char *persist = "";           // file to load and save data to
+char *shm = "";               // shared memory file for keeping the cache
+char *replicaof = "";         // primary to replicate from, host:port
+char *replbacklog = "64mb";   // size of the replication backlog
+char *route = "";             // backends to route to, host:port,...
+int routel1 = 0;              // ms to keep routed GETs locally, 0 for off
 char *unixsock = "";          // use a unix socket
 char *reuseport = "no";       // reuse tcp port for other programs
 char *tcpnodelay = "yes";     // disable nagle's algorithm
@@ -53,6 +65,11 @@ char *maxmemory = "80%";      // Maximum memory allowed - 80% total system
 char *evict = "yes";          // evict keys when maxmemory reached
 int loadfactor = 75;          // hashmap load factor
 char *keysixpack = "yes";     // use sixpack compression on keys
+char *lockstats = "no";       // count shard lock acquisitions and waits
+char *compress = "no";        // lz4 compression: yes, no, or dict
+int compressmin = 1024;       // minimum value size to compress without dict
+char *tier = "";              // directory for spilling cold values to disk
+char *tiermax = "64gb";       // maximum disk space used for spilled values
 char *trackallocs = "no";     // track allocations (for debugging)
 char *auth = "";              // auth token or pa
 char *tlsport = "";           // enable tls over tcp port
@@ -61,8 +78,16 @@ char *tlskeyfile = "";        // tls key file
 char *tlscacertfile = "";     // tls ca cert file
 char *uring = "yes";          // use uring (linux only)
 int maxconns = 1024;          // maximum number of sockets
+int idletimeout = 0;          // close connections idle for secs, 0=never
+char *maxinbuf = "1gb";       // max buffered input per connection
+char *maxoutbuf = "unlimited";// max pending output per connection
 char *autosweep = "yes";      // perform automatic sweeps of expired entries
 char *warmup = "yes";
+char *cpus = "";              // pin threads to cpus, such as "0-7,16-23"
+char *numa = "no";            // numa awareness: yes, no, or shards
+char *sharednothing = "no";   // each thread owns a range of shards
+int busypoll = 0;             // usecs to keep polling after activity, 0=off
+char *busypollsock = "no";    // SO_BUSY_POLL on tcp sockets while busypolling
 #if !defined(NOMIMALLOC)
 char *allocator = "mimalloc";
 #elif !defined(NOJEMALLOC)
@@ -79,16 +104,26 @@ char *githash;
 uint64_t seed;
 size_t sysmem;
 size_t memlimit;
+size_t inbuflimit;  // close connections with more buffered input
+size_t outbuflimit; // close connections with more pending output
 int verb;           // verbosity, 0=no, 1=verbose, 2=very, 3=extremely
 bool useautosweep;
 bool usesixpack;
+bool uselockstats;
 int useallocator;
 bool usetrackallocs;
 bool useevict;
 bool usetls;        // use tls security (pemfile required);
 bool useauth;       // use auth password
+bool usesharednothing; // forward single key commands to the shard owner
 bool usecolor;      // allow color in terminal
+bool useshm;        // cache lives in a shared memory heap
+bool useroute;      // proxy keyed commands to the route backends
+bool shmattached;   // cache was attached from a previous process
 char *useid;        // instance id (unique to every process run)
+int *usecpus;       // cpu for each thread, or null when threads are not pinned
+int numanodes;      // number of numa nodes used by the pinned threads
+int *numashards;    // start and end shard pairs per numa node, if partitioned
 int64_t procstart;  // proc start boot time, for uptime stat
 
 // Global atomic variable. These are safe to read and modify by other source
@@ -99,6 +134,9 @@ atomic_bool lowmem;              // system is in low memory mode.
 
 struct pogocache *cache;
 
+// spill values to disk when memory usage reaches this percent of maxmemory
+#define TIERPRESSURE 90
+
 // min max robinhood load factor (75% performs pretty well)
 #define MINLOADFACTOR_RH 55
 #define MAXLOADFACTOR_RH 95
@@ -149,7 +187,17 @@ static void showhelp(FILE *file) {
     HOPT("--maxmemory value", "set max memory usage", "%s", maxmemory);
     HOPT("--evict yes/no", "evict keys at maxmemory", "%s", evict);
     HOPT("--persist path", "persistence file", "%s", *persist?persist:"none");
+    HOPT("--shm path", "shared memory cache file", "%s", *shm?shm:"none");
+    HOPT("--replicaof host:port", "replicate from primary", "%s", 
+        *replicaof?replicaof:"none");
+    HOPT("--replbacklog size", "replication backlog size", "%s", replbacklog);
+    HOPT("--route host:port,...", "proxy to backends", "%s", 
+        *route?route:"none");
+    HOPT("--routel1 ms", "local ttl for routed GETs", "%d", routel1);
     HOPT("--maxconns conns", "maximum connections", "%d", maxconns);
+    HOPT("--idletimeout secs", "close idle connections", "%d", idletimeout);
+    HOPT("--maxinbuf size", "max input buffer per conn", "%s", maxinbuf);
+    HOPT("--maxoutbuf size", "max output buffer per conn", "%s", maxoutbuf);
     HELP("\n");
     
     HELP("Security options:\n");
@@ -170,9 +218,25 @@ static void showhelp(FILE *file) {
     HOPT("--tcpnodelay yes/no", "disable nagle's algo", "%s", tcpnodelay);
     HOPT("--quickack yes/no", "use quickack (linux)", "%s", quickack);
     HOPT("--uring yes/no", "use uring (linux)", "%s", uring);
+    HOPT("--cpus list", "pin threads to cpus", "%s", *cpus?cpus:"none");
+    HOPT("--numa yes/no/shards", "numa aware threads, shards", "%s", numa);
+    HOPT("--sharednothing yes/no", "threads own shard ranges", "%s", 
+        sharednothing);
+    HOPT("--busypoll usecs", "spin for events after activity", "%d", 
+        busypoll);
+    HOPT("--busypollsock yes/no", "busy poll sockets (linux)", "%s", 
+        busypollsock);
     HOPT("--loadfactor percent", "hashmap load factor", "%d", loadfactor);
     HOPT("--autosweep yes/no", "automatic eviction sweeps", "%s", autosweep);
     HOPT("--keysixpack yes/no", "sixpack compress keys", "%s", keysixpack);
+    HOPT("--lockstats yes/no", "count shard lock contention", "%s", 
+        lockstats);
+    HOPT("--compress yes/no/dict", "lz4 compress values", "%s", compress);
+    HOPT("--compressmin bytes", "min value size to compress", "%d", 
+        compressmin);
+    HOPT("--tier path", "spill cold values to disk", "%s", 
+        *tier?tier:"none");
+    HOPT("--tiermax size", "max disk space for --tier", "%s", tiermax);
     HOPT("--cas yes/no", "use compare and store", "%s", usecas);
     HOPT("--allocator name", allocators, "%s", allocator);
     HELP("\n");
@@ -186,7 +250,7 @@ static void showversion(FILE *file) {
 #endif
 }
 
-static size_t calc_memlimit(char *maxmemory) {
+static size_t calc_memlimit(const char *name, char *maxmemory) {
     if (strcmp(maxmemory, "unlimited") == 0) {
         return SIZE_MAX;
     }
@@ -220,7 +284,7 @@ static size_t calc_memlimit(char *maxmemory) {
         return mem*1024.0*1024.0*1024.0*1024.0;
     }
 fail:
-    fprintf(stderr, "# Invalid maxmemory '%s'\n", oval);
+    fprintf(stderr, "# Invalid %s '%s'\n", name, oval);
     showhelp(stderr);
     exit(1);
 }
@@ -307,12 +371,33 @@ void sigterm(int sig) {
     }
 }
 
+// Leave the cache in the shared memory heap for the next process. The heap
+// is only marked as clean when the cache was fully loaded.
+static void shmdetach(void) {
+    if (useshm) {
+        pogocache_detach(cache);
+        heap_close(atomic_load(&loaded));
+        upgrade_cleanup();
+    }
+}
+
+static void shmhandover(int fds[3]) {
+    shmdetach();
+    net_listeners(fds);
+}
+
+// Check the cache of a running process before it's asked to hand over.
+static bool cache_compatible(void *root, void *udata) {
+    return pogocache_compatible(root, udata);
+}
+
 static void *sigtermticker(void *arg) {
     (void)arg;
     while (atomic_load_explicit(&sigexit, memory_order_relaxed) == 0) {
         usleep(100000);
     }
     if (!atomic_load(&loaded) || !*persist) {
+        shmdetach();
         printf("# Pogocache exiting now\n");
         exit(0);
     }
@@ -323,6 +408,7 @@ static void *sigtermticker(void *arg) {
             perror("# Save failed");
             exit(1);
         }
+        shmdetach();
         printf("# Pogocache exiting now\n");
         exit(0);
     }
@@ -336,7 +422,7 @@ static void *memticker(void *arg) {
     memstr(memlimit, limit);
     while (1) {
         if (atomic_load_explicit(&loaded, __ATOMIC_ACQUIRE)) {
-            size_t rss = xrss();
+            size_t rss = useshm ? heap_used() : xrss();
             memstr(rss, usage);
             if (memlimit < SIZE_MAX) {
                 if (verb >= 1) {
@@ -381,7 +467,10 @@ static void *autosweepticker(void *arg) {
                 .time = time, 
                 .pollsize = 20,
             };
-            if (pogocache_sweep_poll(cache, &opts) > 0.10) {
+            // Also sweep when asked to, such as after a DELPREFIX.
+            if (atomic_exchange(&sweep, false) ||
+                pogocache_sweep_poll(cache, &opts) > 0.10)
+            {
                 struct pogocache_sweep_opts opts = { .time = time };
                 pogocache_sweep(cache, 0, 0, &opts);
             }
@@ -391,6 +480,38 @@ static void *autosweepticker(void *arg) {
     return 0;
 }
 
+static void *dictticker(void *arg) {
+    (void)arg;
+    // Train the first value dictionary as soon as there are enough values in
+    // the cache, then occasionally retrain in case the values change shape.
+    int wait = 10;
+    while (1) {
+        sleep(wait);
+        if (atomic_load_explicit(&loaded, __ATOMIC_ACQUIRE)) {
+            compress_train(cache);
+            struct compress_stats stats;
+            compress_stats(&stats);
+            wait = stats.dictversion > 0 ? 300 : 10;
+        }
+    }
+    return 0;
+}
+
+static void *tierticker(void *arg) {
+    (void)arg;
+    while (1) {
+        if (atomic_load_explicit(&loaded, __ATOMIC_ACQUIRE)) {
+            // Start spilling cold values before the memory limit is reached,
+            // so that values are moved to disk instead of being evicted.
+            bool pressure = memlimit < SIZE_MAX && 
+                xrss() > memlimit/100*TIERPRESSURE;
+            tier_tick(cache, pressure);
+        }
+        sleep(1);
+    }
+    return 0;
+}
+
 static void start_sigtermticker(void) {
     pthread_t th;
     int ret = pthread_create(&th, 0, sigtermticker, 0);
@@ -418,10 +539,35 @@ static void start_autosweepticker(void) {
     }
 }
 
+static void start_dictticker(void) {
+    pthread_t th;
+    int ret = pthread_create(&th, 0, dictticker, 0);
+    if (ret == -1) {
+        perror("# pthread_create(dictticker)");
+        exit(1);
+    }
+}
+
+static void start_tierticker(void) {
+    pthread_t th;
+    int ret = pthread_create(&th, 0, tierticker, 0);
+    if (ret == -1) {
+        perror("# pthread_create(tierticker)");
+        exit(1);
+    }
+}
+
 static void listening(void *udata) {
     (void)udata;
     printf("* Network listener established\n");
-    if (*persist) {
+    if (useshm) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.sock", shm);
+        if (!upgrade_listen(path, shmhandover)) {
+            perror("# upgrade_listen");
+        }
+    }
+    if (*persist && !shmattached) {
         if (!cleanwork(persist)) {
             // An error message has already been printed
             _Exit(0);
@@ -445,6 +591,114 @@ static void listening(void *udata) {
         }
     }
     atomic_store(&loaded, true);
+    if (*replicaof) {
+        if (!repl_replicaof(replicaof)) {
+            perror("# replicaof");
+            _Exit(1);
+        }
+    }
+}
+
+static int cmpcpunode(const void *a, const void *b) {
+    int acpu = *(int*)a;
+    int bcpu = *(int*)b;
+    int anode = sys_cpunode(acpu);
+    int bnode = sys_cpunode(bcpu);
+    return anode < bnode ? -1 : anode > bnode ? 1 : 
+           acpu < bcpu ? -1 : acpu > bcpu;
+}
+
+// Choose a cpu for each thread. When numa is used, the cpus are ordered by
+// node and the threads are spread evenly across them, which keeps the threads
+// for each node adjacent to each other.
+static int *threadcpus(bool usenuma) {
+    int maxcpus = 4096;
+    int *list = xmalloc(sizeof(int)*maxcpus);
+    int ncpus;
+    if (*cpus) {
+        ncpus = sys_parsecpus(cpus, list, maxcpus);
+        if (ncpus <= 0) {
+            INVALID_FLAG("cpus", cpus);
+        }
+    } else {
+        ncpus = sys_cpus(list, maxcpus);
+    }
+    int *tcpus = xmalloc(sizeof(int)*nthreads);
+    if (usenuma) {
+        qsort(list, ncpus, sizeof(int), cmpcpunode);
+        for (int i = 0; i < nthreads; i++) {
+            tcpus[i] = list[(int)((int64_t)i*ncpus/nthreads)];
+        }
+    } else {
+        for (int i = 0; i < nthreads; i++) {
+            tcpus[i] = list[i%ncpus];
+        }
+    }
+    xfree(list);
+    return tcpus;
+}
+
+struct numactx {
+    int cpu;
+    int start;
+    int end;
+};
+
+static void *numapartition(void *arg) {
+    struct numactx *ctx = arg;
+    sys_pinthread(ctx->cpu);
+    // Clearing an empty shard reallocates its buckets from this thread, and
+    // because this thread is pinned, that memory lands on its numa node.
+    for (int i = ctx->start; i < ctx->end; i++) {
+        struct pogocache_clear_opts opts = { .oneshard = true, .oneshardidx=i };
+        pogocache_clear(cache, &opts);
+    }
+    return 0;
+}
+
+// Partition the shards into contiguous ranges, one per numa node. Each range
+// is proportional to the number of threads on the node.
+static void partition_shards(void) {
+    numashards = xmalloc(sizeof(int)*numanodes*2);
+    struct numactx *ctxs = xmalloc(sizeof(struct numactx)*numanodes);
+    pthread_t *ths = xmalloc(sizeof(pthread_t)*numanodes);
+    for (int node = 0; node < numanodes; node++) {
+        int first = -1;
+        int last = -1;
+        for (int i = 0; i < nthreads; i++) {
+            if (sys_cpunode(usecpus[i]) == node) {
+                first = first == -1 ? i : first;
+                last = i;
+            }
+        }
+        int start = 0;
+        int end = 0;
+        if (first != -1) {
+            start = (int64_t)first*nshards/nthreads;
+            end = (int64_t)(last+1)*nshards/nthreads;
+        }
+        numashards[node*2+0] = start;
+        numashards[node*2+1] = end;
+        ctxs[node] = (struct numactx){ 
+            .cpu = first == -1 ? -1 : usecpus[first], 
+            .start = start, 
+            .end = end,
+        };
+        ths[node] = 0;
+        if (first != -1) {
+            if (pthread_create(&ths[node], 0, numapartition, &ctxs[node])) {
+                perror("# pthread_create(numapartition)");
+                exit(1);
+            }
+        }
+    }
+    for (int node = 0; node < numanodes; node++) {
+        if (ctxs[node].cpu != -1) {
+            pthread_join(ths[node], 0);
+        }
+    }
+    xfree(ths);
+    xfree(ctxs);
 }
 
 int main(int argc, char *argv[]) {
@@ -520,15 +774,33 @@ int main(int argc, char *argv[]) {
             AFLAG("trackallocs", trackallocs = flag)
             AFLAG("cas", usecas = flag)
             AFLAG("maxconns", maxconns = atoi(flag))
+            AFLAG("idletimeout", idletimeout = atoi(flag))
+            AFLAG("maxinbuf", maxinbuf = flag)
+            AFLAG("maxoutbuf", maxoutbuf = flag)
             AFLAG("loadfactor", loadfactor = atoi(flag))
             AFLAG("sixpack", keysixpack = flag)
+            AFLAG("lockstats", lockstats = flag)
+            AFLAG("compress", compress = flag)
+            AFLAG("compressmin", compressmin = atoi(flag))
+            AFLAG("tier", tier = flag)
+            AFLAG("tiermax", tiermax = flag)
             AFLAG("seed", seed = strtoull(flag, 0, 10))
             AFLAG("auth", auth = flag)
             AFLAG("persist", persist = flag)
+            AFLAG("shm", shm = flag)
+            AFLAG("replicaof", replicaof = flag)
+            AFLAG("replbacklog", replbacklog = flag)
+            AFLAG("route", route = flag)
+            AFLAG("routel1", routel1 = atoi(flag))
             AFLAG("noticker", (void)flag )
             AFLAG("autosweep", autosweep = flag)
             AFLAG("warmup", warmup = flag)
             AFLAG("allocator", allocator = flag)
+            AFLAG("cpus", cpus = flag)
+            AFLAG("numa", numa = flag)
+            AFLAG("sharednothing", sharednothing = flag)
+            AFLAG("busypoll", busypoll = atoi(flag))
+            AFLAG("busypollsock", busypollsock = flag)
 #ifndef NOOPENSSL
             // TLS flags
             AFLAG("tlsport", tlsport = flag)
@@ -639,6 +911,10 @@ int main(int argc, char *argv[]) {
         maxconns = 1024;
     }
 
+    if (idletimeout < 0) {
+        INVALID_FLAG("idletimeout", "negative");
+    }
+
     if (strcmp(autosweep, "yes") == 0) {
         useautosweep = true;
     } else if (strcmp(usecas, "no") == 0) {
@@ -685,6 +961,81 @@ int main(int argc, char *argv[]) {
         INVALID_FLAG("sixpack", keysixpack);
     }
 
+    if (strcmp(lockstats, "yes") == 0) {
+        uselockstats = true;
+    } else if (strcmp(lockstats, "no") == 0) {
+        uselockstats = false;
+    } else {
+        INVALID_FLAG("lockstats", lockstats);
+    }
+
+    bool usecompress;
+    bool usecompressdict;
+    if (strcmp(compress, "yes") == 0) {
+        usecompress = true;
+        usecompressdict = false;
+    } else if (strcmp(compress, "dict") == 0) {
+        usecompress = true;
+        usecompressdict = true;
+    } else if (strcmp(compress, "no") == 0) {
+        usecompress = false;
+        usecompressdict = false;
+    } else {
+        INVALID_FLAG("compress", compress);
+    }
+    if (compressmin < 16) {
+        compressmin = 16;
+    }
+    compress_init(compressmin, usecompressdict);
+
+    bool usenuma;
+    bool usenumashards;
+    if (strcmp(numa, "yes") == 0) {
+        usenuma = true;
+        usenumashards = false;
+    } else if (strcmp(numa, "shards") == 0) {
+        usenuma = true;
+        usenumashards = true;
+    } else if (strcmp(numa, "no") == 0) {
+        usenuma = false;
+        usenumashards = false;
+    } else {
+        INVALID_FLAG("numa", numa);
+    }
+    if (strcmp(sharednothing, "yes") == 0) {
+        usesharednothing = nthreads > 1;
+    } else if (strcmp(sharednothing, "no") == 0) {
+        usesharednothing = false;
+    } else {
+        INVALID_FLAG("sharednothing", sharednothing);
+    }
+
+    if (busypoll < 0) {
+        busypoll = 0;
+    }
+#ifndef __linux__
+    busypollsock = "no";
+#endif
+    bool usebusypollsock;
+    if (strcmp(busypollsock, "yes") == 0) {
+        usebusypollsock = busypoll > 0;
+    } else if (strcmp(busypollsock, "no") == 0) {
+        usebusypollsock = false;
+    } else {
+        INVALID_FLAG("busypollsock", busypollsock);
+    }
+
+    if (*cpus || usenuma) {
+        usecpus = threadcpus(usenuma);
+        numanodes = 0;
+        for (int i = 0; i < nthreads; i++) {
+            int node = sys_cpunode(usecpus[i]);
+            if (node+1 > numanodes) {
+                numanodes = node+1;
+            }
+        }
+    }
+
     if (loadfactor < MINLOADFACTOR_RH) {
         loadfactor = MINLOADFACTOR_RH;
         printf("# loadfactor minumum set to %d\n", MINLOADFACTOR_RH);
@@ -725,13 +1076,48 @@ int main(int argc, char *argv[]) {
     }
     setmaxrlimit();
     sysmem = sys_memory();
-    memlimit = calc_memlimit(maxmemory);
+    memlimit = calc_memlimit("maxmemory", maxmemory);
+    inbuflimit = calc_memlimit("maxinbuf", maxinbuf);
+    outbuflimit = calc_memlimit("maxoutbuf", maxoutbuf);
 
     if (memlimit == SIZE_MAX) {
         evict = "no";
         useevict = false;
     }
 
+    useshm = *shm != 0;
+    if (useshm && (usecompressdict || *tier)) {
+        fprintf(stderr, "# The --shm option cannot be used with "
+            "--compress dict or --tier\n");
+        exit(1);
+    }
+
+    repl_init(calc_memlimit("replbacklog", replbacklog));
+
+    useroute = *route != 0;
+    if (useroute) {
+        if (*replicaof) {
+            fprintf(stderr, "# The --route option cannot be used with "
+                "--replicaof\n");
+            exit(1);
+        }
+        if (routel1 < 0) {
+            INVALID_FLAG("routel1", "negative");
+        }
+        if (!route_init(route, (int64_t)routel1*MILLISECOND)) {
+            INVALID_FLAG("route", route);
+        }
+    }
+
+    bool usetier = false;
+    if (*tier) {
+        if (!tier_init(tier, calc_memlimit("tiermax", tiermax))) {
+            perror("# tier");
+            exit(1);
+        }
+        usetier = true;
+    }
+
     struct pogocache_opts opts = {
         .seed = seed,
         .malloc = xmalloc,
@@ -741,12 +1127,58 @@ int main(int argc, char *argv[]) {
         .usecas = usecasflag,
         .allowshrink = true,
         .usethreadbatch = true,
+        .lockstats = uselockstats,
+        .compress = usecompress ? compress_value : 0,
+        .decompress = usecompress ? decompress_value : 0,
+        .compressmin = compress_min(),
+        .spill = usetier ? tier_spill : 0,
+        .unspill = usetier ? tier_unspill : 0,
+        .spillfree = usetier ? tier_release : 0,
+        .notify = repl_notify,
     };
 
-    cache = pogocache_new(&opts);
-    if (!cache) {
-        perror("pogocache_new");
-        abort();
+    int inherited[3];
+    bool useinherited = false;
+    if (useshm) {
+        // Take over from a running process that uses the same heap, if any.
+        // Its cache is checked first, because once it has handed over there
+        // is nothing left serving if this process can't attach the cache.
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.sock", shm);
+        if (upgrade_running(path) && !heap_peek(shm, cache_compatible, &opts)) {
+            fprintf(stderr, "# The cache in %s is not compatible with the "
+                "current options, the running process was left as is\n", shm);
+            exit(1);
+        }
+        useinherited = upgrade_request(path, inherited);
+        size_t size = memlimit < SIZE_MAX ? memlimit+memlimit/4 : sysmem;
+        if (!heap_open(shm, size, &shmattached)) {
+            perror("# shm");
+            exit(1);
+        }
+        opts.malloc = heap_malloc;
+        opts.free = heap_free;
+    }
+    if (shmattached) {
+        cache = pogocache_attach(heap_root(), &opts);
+        if (!cache) {
+            fprintf(stderr, "# The cache in %s is not compatible with the "
+                "current options\n", shm);
+            exit(1);
+        }
+        nshards = pogocache_nshards(cache);
+    } else {
+        cache = pogocache_new(&opts);
+        if (!cache) {
+            perror("pogocache_new");
+            abort();
+        }
+        if (useshm) {
+            heap_setroot(cache);
+        }
+    }
+    if (usenumashards) {
+        partition_shards();
     }
 
     // Print the program details
@@ -765,9 +1197,10 @@ int main(int argc, char *argv[]) {
     printf("* Memory (system: %s, max: %s, evict: %s, allocator: %s)\n", 
         memstr(sysmem, buf0), buf2, evict, allocator);
     printf("* Features (verbosity: %s, sixpack: %s, cas: %s, persist: %s, "
-        "uring: %s)\n",
+        "uring: %s, compress: %s)\n",
         verb==0?"normal":verb==1?"verbose":verb==2?"very":"extremely",
-        keysixpack, usecas, *persist?persist:"none", useuring?"yes":"no");
+        keysixpack, usecas, *persist?persist:"none", useuring?"yes":"no",
+        compress);
     char tcp_addr[256];
     snprintf(tcp_addr, sizeof(tcp_addr), "%s:%s", host, port);
     printf("* Network (port: %s, unixsocket: %s, backlog: %d, reuseport: %s, "
@@ -775,7 +1208,35 @@ int main(int argc, char *argv[]) {
         backlog, reuseport, maxconns);
     printf("* Socket (tcpnodelay: %s, keepalive: %s, quickack: %s)\n",
         tcpnodelay, keepalive, quickack);
-    printf("* Threads (threads: %d, queuesize: %d)\n", nthreads, queuesize);
+    printf("* Clients (idletimeout: %ds, maxinbuf: %s, maxoutbuf: %s)\n",
+        idletimeout, maxinbuf, maxoutbuf);
+    printf("* Threads (threads: %d, queuesize: %d, sharednothing: %s)\n", 
+        nthreads, queuesize, usesharednothing?"yes":"no");
+    if (busypoll > 0) {
+        printf("* Busypoll (window: %dus, sockets: %s)\n", busypoll, 
+            usebusypollsock?"yes":"no");
+    }
+    if (usecpus) {
+        printf("* Affinity (cpus: %s, numa: %s, nodes: %d)\n", 
+            *cpus?cpus:"all", numa, numanodes);
+    }
+    if (usetier) {
+        printf("* Tier (path: %s, max: %s)\n", tier, tiermax);
+    }
+    if (*replicaof) {
+        printf("* Replication (replicaof: %s, backlog: %s)\n", replicaof, 
+            replbacklog);
+    } else {
+        printf("* Replication (role: primary, backlog: %s)\n", replbacklog);
+    }
+    if (useroute) {
+        printf("* Route (backends: %s, l1: %dms)\n", route, routel1);
+    }
+    if (useshm) {
+        printf("* Shm (path: %s, size: %s, attached: %s, handover: %s)\n", 
+            shm, memstr(heap_size(), buf0), shmattached?"yes":"no",
+            useinherited?"yes":"no");
+    }
     printf("* Shards (shards: %d, loadfactor: %d%%, autosweep: %s)\n", nshards, 
         loadfactor, useautosweep?"yes":"no");
     printf("* Security (auth: %s, tlsport: %s)\n", 
@@ -786,6 +1247,12 @@ int main(int argc, char *argv[]) {
     if (useautosweep) {
         start_autosweepticker();
     }
+    if (usecompressdict) {
+        start_dictticker();
+    }
+    if (usetier) {
+        start_tierticker();
+    }
 
 #ifdef DATASETOK
     printf("# DATASETOK\n");
@@ -813,6 +1280,12 @@ int main(int argc, char *argv[]) {
         .nthreads = nthreads,
         .nowarmup = strcmp(warmup, "no") == 0,
         .nouring = !useuring,
+        .cpus = usecpus,
+        .sharednothing = usesharednothing,
+        .busypoll = busypoll,
+        .busypollsock = usebusypollsock,
+        .idletimeout = idletimeout,
+        .listenfds = useinherited ? inherited : 0,
         .listening = listening,
         .ready = ready,
         .data = evdata,
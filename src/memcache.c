@@ -250,6 +250,7 @@ ssize_t parse_memcache(const char *data, size_t len, struct args *args,
 
         // Storage commands must read a value that follows the first line.
         if (len-n < (size_t)x+2) {
+            parse_need = (size_t)x+2-(len-n);
             return 0;
         }
         const char *value = data+n;
@@ -31,12 +31,17 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #ifdef __linux__
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #elif defined(__EMSCRIPTEN__)
 #include <emscripten/html5.h>
 #else
@@ -48,10 +53,13 @@
 #include "net.h"
 #include "util.h"
 #include "tls.h"
+#include "sys.h"
 #include "xmalloc.h"
+#include "shmring.h"
 
 #define PACKETSIZE 16384
 #define MINURINGEVENTS 2 // there must be at least 2 events for uring use
+#define MAXOUTKEEP 65536 // largest output buffer that is kept after a flush
 
 extern const int verb;
 
@@ -83,6 +91,17 @@ static int setquickack(int fd, bool quickack) {
 #endif
 }
 
+static void setbusypoll(int fd, int usecs) {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    // Best effort, because raising it above the net.core.busy_read sysctl
+    // requires CAP_NET_ADMIN.
+    int ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(int));
+    (void)ret;
+#else
+    (void)fd, (void)usecs;
+#endif
+}
+
 static int setkeepalive(int fd, bool keepalive) {
     int val = keepalive;
     if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val))) {
@@ -118,14 +137,42 @@ typedef int event_t;
 typedef struct kevent event_t;
 #endif
 
-static int event_fd(event_t *ev) {
+// Events carry a pointer to their connection in the user data. The listeners
+// and the wake fd are not connections, so they carry their fd tagged with the
+// low bit, which is never set on a connection pointer. Watched sockets carry
+// their watch tagged with the second bit.
+static void *fdudata(int fd) {
+    return (void*)(((uintptr_t)fd<<1)|1);
+}
+
+static bool udata_isfd(void *udata) {
+    return ((uintptr_t)udata)&1;
+}
+
+static int udata_fd(void *udata) {
+    return (int)(((uintptr_t)udata)>>1);
+}
+
+static void *watchudata(struct net_watch *w) {
+    return (void*)((uintptr_t)w|2);
+}
+
+static bool udata_iswatch(void *udata) {
+    return !udata_isfd(udata) && (((uintptr_t)udata)&2);
+}
+
+static struct net_watch *udata_watch(void *udata) {
+    return (struct net_watch*)(((uintptr_t)udata)&~(uintptr_t)3);
+}
+
+static void *event_udata(event_t *ev) {
 #ifdef __linux__
-    return ev->data.fd;
+    return ev->data.ptr;
 #elif defined(__EMSCRIPTEN__)
     (void)ev;
     return 0;
 #else
-    return ev->ident;
+    return (void*)ev->udata;
 #endif
 }
 
@@ -159,18 +206,83 @@ static int getevents(int fd, event_t evs[], int nevs, bool wait_forever,
     }
 }
 
-static int addread(int qfd, int fd) {
+static int addread(int qfd, int fd, void *udata) {
 #ifdef __linux__
     struct epoll_event ev = { 0 };
+    // Exclusive wakeups keep a connection on a listener, which is in every
+    // queue, from waking all of the qthreads.
     ev.events = EPOLLIN | EPOLLEXCLUSIVE;
-    ev.data.fd = fd;
+    ev.data.ptr = udata;
     return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
 #elif defined(__EMSCRIPTEN__)
-    (void)qfd, (void)fd;
+    (void)qfd, (void)fd, (void)udata;
+    errno = EPERM;
+    return -1;
+#else
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+    return kevent(qfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+// Add a new connection for reads and writes. A new socket is writable right
+// away, which lets the qthread open the connection before any data arrives.
+static int addconn(int qfd, int fd, void *udata) {
+#ifdef __linux__
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = udata;
+    return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
+#elif defined(__EMSCRIPTEN__)
+    (void)qfd, (void)fd, (void)udata;
+    errno = EPERM;
+    return -1;
+#else
+    struct kevent evs[2];
+    EV_SET(&evs[0], fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+    EV_SET(&evs[1], fd, EVFILT_WRITE, EV_ADD|EV_ONESHOT, 0, 0, udata);
+    return kevent(qfd, evs, 2, NULL, 0, NULL);
+#endif
+}
+
+// The connection added with addconn is open, stop watching it for writes.
+static int openconn(int qfd, int fd, void *udata) {
+#ifdef __linux__
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN;
+    ev.data.ptr = udata;
+    return epoll_ctl(qfd, EPOLL_CTL_MOD, fd, &ev);
+#else
+    // The kqueue write filter was a oneshot.
+    (void)qfd, (void)fd, (void)udata;
+    return 0;
+#endif
+}
+
+// Watch an open connection for writes along with reads, or stop doing so.
+// This is for a tls handshake that is waiting on the socket to be writable.
+static int connwrite(int qfd, int fd, void *udata, bool write) {
+#ifdef __linux__
+    // The connection may have been added back with an exclusive wakeup by
+    // addread, which can't be modified, so it's added again.
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | (write ? EPOLLOUT : 0);
+    ev.data.ptr = udata;
+    if (epoll_ctl(qfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+        return -1;
+    }
+    return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
+#elif defined(__EMSCRIPTEN__)
+    (void)qfd, (void)fd, (void)udata, (void)write;
     errno = EPERM;
     return -1;
 #else
-    struct kevent ev={.filter=EVFILT_READ,.flags=EV_ADD,.ident=(fd)};
+    // The kqueue write filter is a oneshot.
+    if (!write) {
+        return 0;
+    }
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_WRITE, EV_ADD|EV_ONESHOT, 0, 0, udata);
     return kevent(qfd, &ev, 1, NULL, 0, NULL);
 #endif
 }
@@ -179,7 +291,6 @@ static int delread(int qfd, int fd) {
 #ifdef __linux__
     struct epoll_event ev = { 0 };
     ev.events = EPOLLIN;
-    ev.data.fd = fd;
     return epoll_ctl(qfd, EPOLL_CTL_DEL, fd, &ev);
 #elif defined(__EMSCRIPTEN__)
     (void)qfd, (void)fd;
@@ -191,18 +302,19 @@ static int delread(int qfd, int fd) {
 #endif
 }
 
-static int addwrite(int qfd, int fd) {
+static int addwrite(int qfd, int fd, void *udata) {
 #ifdef __linux__
     struct epoll_event ev = { 0 };
     ev.events = EPOLLOUT;
-    ev.data.fd = fd;
+    ev.data.ptr = udata;
     return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
 #elif defined(__EMSCRIPTEN__)
-    (void)qfd, (void)fd;
+    (void)qfd, (void)fd, (void)udata;
     errno = EPERM;
     return -1;
 #else
-    struct kevent ev={.filter=EVFILT_WRITE,.flags=EV_ADD,.ident=(fd)};
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_WRITE, EV_ADD, 0, 0, udata);
     return kevent(qfd, &ev, 1, NULL, 0, NULL);
 #endif
 }
@@ -211,7 +323,6 @@ static int delwrite(int qfd, int fd) {
 #ifdef __linux__
     struct epoll_event ev = { 0 };
     ev.events = EPOLLOUT;
-    ev.data.fd = fd;
     return epoll_ctl(qfd, EPOLL_CTL_DEL, fd, &ev);
 #elif defined(__EMSCRIPTEN__)
     (void)qfd, (void)fd;
@@ -223,6 +334,150 @@ static int delwrite(int qfd, int fd) {
 #endif
 }
 
+// A socket that was opened by the data handler, such as a connection to
+// another server. It's polled by the qthread that added it.
+struct net_watch {
+    int fd;                 // -1 once removed
+    bool write;             // also polled for writes
+    int64_t deadline;       // time to call the event without i/o, or zero
+    void (*event)(void *udata);
+    void *udata;
+    struct qthreadctx *ctx;
+    struct net_watch *prev;
+    struct net_watch *next;
+};
+
+static int addwatch(int qfd, struct net_watch *w) {
+#ifdef __linux__
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | (w->write ? EPOLLOUT : 0);
+    ev.data.ptr = watchudata(w);
+    return epoll_ctl(qfd, EPOLL_CTL_ADD, w->fd, &ev);
+#elif defined(__EMSCRIPTEN__)
+    (void)qfd, (void)w;
+    errno = EPERM;
+    return -1;
+#else
+    struct kevent evs[2];
+    EV_SET(&evs[0], w->fd, EVFILT_READ, EV_ADD, 0, 0, watchudata(w));
+    EV_SET(&evs[1], w->fd, EVFILT_WRITE, EV_ADD, 0, 0, watchudata(w));
+    return kevent(qfd, evs, w->write ? 2 : 1, NULL, 0, NULL);
+#endif
+}
+
+// The watch was switched to or from polling for writes.
+static int modwatch(int qfd, struct net_watch *w) {
+#ifdef __linux__
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | (w->write ? EPOLLOUT : 0);
+    ev.data.ptr = watchudata(w);
+    return epoll_ctl(qfd, EPOLL_CTL_MOD, w->fd, &ev);
+#elif defined(__EMSCRIPTEN__)
+    (void)qfd, (void)w;
+    errno = EPERM;
+    return -1;
+#else
+    struct kevent ev;
+    EV_SET(&ev, w->fd, EVFILT_WRITE, w->write ? EV_ADD : EV_DELETE, 0, 0, 
+        watchudata(w));
+    return kevent(qfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+static int delwatch(int qfd, struct net_watch *w) {
+#ifdef __linux__
+    struct epoll_event ev = { 0 };
+    return epoll_ctl(qfd, EPOLL_CTL_DEL, w->fd, &ev);
+#elif defined(__EMSCRIPTEN__)
+    (void)qfd, (void)w;
+    errno = EPERM;
+    return -1;
+#else
+    struct kevent evs[2];
+    EV_SET(&evs[0], w->fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+    EV_SET(&evs[1], w->fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+    return kevent(qfd, evs, w->write ? 2 : 1, NULL, 0, NULL);
+#endif
+}
+
+// Single-producer single-consumer ring for passing work between qthreads in
+// shared-nothing mode. The head and tail are on separate cache lines.
+struct spsc {
+    atomic_size_t head; // consumer position
+    char pad0[64-sizeof(atomic_size_t)];
+    atomic_size_t tail; // producer position
+    char pad1[64-sizeof(atomic_size_t)];
+    size_t cap;         // power of two
+    void **items;
+};
+
+static void spsc_init(struct spsc *ring, size_t cap) {
+    memset(ring, 0, sizeof(struct spsc));
+    ring->cap = 2;
+    while (ring->cap < cap) {
+        ring->cap *= 2;
+    }
+    ring->items = xmalloc(sizeof(void*)*ring->cap);
+}
+
+static bool spsc_push(struct spsc *ring, void *item) {
+    size_t tail = atomic_load_explicit(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = atomic_load_explicit(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail-head == ring->cap) {
+        return false;
+    }
+    ring->items[tail&(ring->cap-1)] = item;
+    atomic_store_explicit(&ring->tail, tail+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void *spsc_pop(struct spsc *ring) {
+    size_t head = atomic_load_explicit(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = atomic_load_explicit(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    void *item = ring->items[head&(ring->cap-1)];
+    atomic_store_explicit(&ring->head, head+1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// Create a file descriptor that is used to wake up a qthread. 
+// The fds[0] is for reading and fds[1] is for writing.
+static int wakefd(int fds[2]) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK);
+    fds[0] = fd;
+    fds[1] = fd;
+    return fd == -1 ? -1 : 0;
+#elif defined(__EMSCRIPTEN__)
+    (void)fds;
+    errno = EPERM;
+    return -1;
+#else
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    if (setnonblock(fds[0], true) == -1 || setnonblock(fds[1], true) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+static void wakefd_signal(int fd) {
+    uint64_t x = 1;
+    ssize_t n = write(fd, &x, sizeof(uint64_t));
+    (void)n;
+}
+
+static void wakefd_drain(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
 static int evqueue(void) {
 #ifdef __linux__
     return epoll_create1(0);
@@ -240,15 +495,46 @@ struct bgworkctx {
     struct net_conn *conn;
     void *udata;
     bool writer;
+    bool forwarded; // work was forwarded to another qthread
+    struct bgworkctx *ionext; // next in the io pool queue
 };
 
 // static void bgdone(struct bgworkctx *bgctx);
 
+#define SHMCHUNK  65536 // most request bytes copied from a ring per read
+#define IOTHREADS 4     // threads in the pool for short blocking reads
+
+// Connection state for the shared memory ring transport. The positions that
+// the server owns are kept here, because the client can write to anything in
+// the shared header.
+struct shm {
+    struct shmring_hdr *hdr;
+    size_t mapsize;
+    size_t size;        // bytes in each ring
+    char *reqbuf;
+    char *respbuf;
+    uint64_t reqhead;   // request bytes consumed
+    uint64_t resptail;  // response bytes published
+    char *in;           // private copy of the next chunk of requests
+    size_t incap;
+    bool resume;        // call the data callback even without new requests
+    size_t outpos;      // output bytes already moved to the response ring
+    int64_t last;       // time of the last request, for the poll window
+    bool polling;       // polled on every loop, without waiting for events
+    uint64_t queued;    // loop that last queued the connection for reading
+    int sendfd;         // memfd that's waiting to be sent to the client, or -1
+    struct net_conn *prev;
+    struct net_conn *next;
+};
+
 struct net_conn {
     int fd;
-    struct net_conn *next; // for hashmap bucket
+    bool opened;   // the opened callback has been called
+    bool istls;    // accepted on the tls listener
     bool closed;
     struct tls *tls;
+    bool ktls;     // tls records are handled by the kernel
+    bool tlswrite; // watched for writes by the tls handshake
     void *udata;
     char *out;
     size_t outlen;
@@ -256,6 +542,21 @@ struct net_conn {
     char *addr;
     struct bgworkctx *bgctx;
     struct qthreadctx *ctx;
+    struct shm *shm; // shared memory ring transport, optional
+    uint64_t id;
+    int64_t created;
+    _Atomic(int64_t) lastactive;   // time of the last event
+    atomic_size_t inmem;           // reported by the data handler
+    atomic_size_t outmem;          // capacity of the output buffer
+    atomic_bool isshm;             // on a shared memory ring
+    struct net_conn *cprev;        // open connections of the qthread
+    struct net_conn *cnext;
+    struct net_conn *wprev;        // idle timer wheel slot
+    struct net_conn *wnext;
+    int64_t wtick;                 // wheel tick, or zero if not in the wheel
+    char *rbuf;                    // receive buffer for the next read
+    size_t rbuflen;
+    size_t rbufn;                  // bytes read into the receive buffer
     unsigned stat_cmd_get;
     unsigned stat_cmd_set;
     unsigned stat_get_hits;
@@ -291,6 +592,7 @@ void net_conn_out_ensure(struct net_conn *conn, size_t amount) {
     xfree(conn->out);
     conn->out = out;
     conn->outcap = cap;
+    atomic_store_explicit(&conn->outmem, cap, __ATOMIC_RELAXED);
 }
 
 void net_conn_out_write_byte_nocheck(struct net_conn *conn, char byte) {
@@ -354,117 +656,29 @@ void *net_conn_udata(struct net_conn *conn) {
     return conn->udata;
 }
 
-static uint64_t hashfd(int fd) {
-    return mix13((uint64_t)fd);
-}
-
-// map of connections
-struct cmap {
-    struct net_conn **buckets;
-    size_t nbuckets;
-    size_t len;
-};
-
-static void cmap_insert(struct cmap *cmap, struct net_conn *conn);
-
-static void cmap_grow(struct cmap *cmap) {
-    struct cmap cmap2 = { 0 };
-    cmap2.nbuckets = cmap->nbuckets*2;
-    size_t size = cmap2.nbuckets * sizeof(struct net_conn*);
-    cmap2.buckets = xmalloc(size);
-    memset(cmap2.buckets, 0, cmap2.nbuckets*sizeof(struct net_conn*));
-    for (size_t i = 0; i < cmap->nbuckets; i++) {
-        struct net_conn *conn = cmap->buckets[i];
-        while (conn) {
-            struct net_conn *next = conn->next;
-            conn->next = 0;
-            cmap_insert(&cmap2, conn);
-            conn = next;
-        }
-    }
-    xfree(cmap->buckets);
-    memcpy(cmap, &cmap2, sizeof(struct cmap));
-}
-
-// Insert a connection into a map. 
-// The connection MUST NOT exist in the map.
-static void cmap_insert(struct cmap *cmap, struct net_conn *conn) {
-    uint32_t hash = hashfd(conn->fd);
-    if (cmap->len >= cmap->nbuckets-(cmap->nbuckets>>2)) { // 75% load factor
-    // if (cmap->len >= cmap->nbuckets) { // 100% load factor
-        cmap_grow(cmap);
-    }
-    size_t i = hash % cmap->nbuckets;
-    conn->next = cmap->buckets[i];
-    cmap->buckets[i] = conn;
-    cmap->len++;
+void net_conn_setrecvbuf(struct net_conn *conn, char *buf, size_t len) {
+    conn->rbuf = len > 0 ? buf : 0;
+    conn->rbuflen = len;
 }
 
-// Return the connection or NULL if not exists.
-static struct net_conn *cmap_get(struct cmap *cmap, int fd) {
-    uint32_t hash = hashfd(fd);
-    size_t i = hash % cmap->nbuckets;
-    struct net_conn *conn = cmap->buckets[i];
-    while (conn && conn->fd != fd) {
-        conn = conn->next;
-    }
-    return conn;
+size_t net_conn_recvbuf_take(struct net_conn *conn) {
+    size_t n = conn->rbufn;
+    conn->rbuf = 0;
+    conn->rbuflen = 0;
+    conn->rbufn = 0;
+    return n;
 }
 
-// Delete connection from map. 
-// The connection MUST exist in the map.
-static void cmap_delete(struct cmap *cmap, struct net_conn *conn) {
-    uint32_t hash = hashfd(conn->fd);
-    size_t i = hash % cmap->nbuckets;
-    struct net_conn *prev = 0;
-    struct net_conn *iter = cmap->buckets[i];
-    while (iter != conn) {
-        prev = iter;
-        iter = iter->next;
-    }
-    if (prev) {
-        prev->next = iter->next;
-    } else {
-        cmap->buckets[i] = iter->next;
-    }
+void net_conn_setinmem(struct net_conn *conn, size_t bytes) {
+    atomic_store_explicit(&conn->inmem, bytes, __ATOMIC_RELAXED);
 }
 
 static atomic_size_t nconns = 0;
 static atomic_size_t tconns = 0;
 static atomic_size_t rconns = 0;
-
-static pthread_mutex_t tls_ready_fds_lock = PTHREAD_MUTEX_INITIALIZER;
-static int tls_ready_fds_cap = 0;
-static int tls_ready_fds_len = 0;
-static int *tls_ready_fds = 0;
-
-static void save_tls_fd(int fd) {
-    pthread_mutex_lock(&tls_ready_fds_lock);
-    if (tls_ready_fds_len == tls_ready_fds_cap) {
-        tls_ready_fds_cap *= 2;
-        if (tls_ready_fds_cap == 0) {
-            tls_ready_fds_cap = 8;
-        }
-        tls_ready_fds = xrealloc(tls_ready_fds, tls_ready_fds_cap*sizeof(int));
-    }
-    tls_ready_fds[tls_ready_fds_len++] = fd;
-    pthread_mutex_unlock(&tls_ready_fds_lock);
-}
-
-static bool del_tls_fd(int fd) {
-    bool found = false;
-    pthread_mutex_lock(&tls_ready_fds_lock);
-    for (int i = 0; i < tls_ready_fds_len; i++) {
-        if (tls_ready_fds[i] == fd) {
-            tls_ready_fds[i] = tls_ready_fds[tls_ready_fds_len-1];
-            tls_ready_fds_len--;
-            found = true;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&tls_ready_fds_lock);
-    return found;
-}
+static atomic_size_t shmconns = 0;
+static atomic_size_t idleconns = 0;
+static atomic_uint_fast64_t nextconnid = 0;
 
 struct qthreadctx {
     pthread_t th;
@@ -475,10 +689,30 @@ struct qthreadctx {
     bool tcpnodelay;
     bool keepalive;
     bool quickack;
+    int64_t busypoll;   // ns to keep polling for events after activity
+    int busypollsock;   // SO_BUSY_POLL usecs for tcp sockets, or zero
     int queuesize;
+    int cpu;    // pinned cpu or -1
+    int node;   // numa node of the pinned cpu
     const char *unixsock;
     void *udata;
     bool uring;
+    // shared-nothing forwarding
+    bool sharednothing;
+    int wakefds[2];     // wakes the thread for forwarded work
+    atomic_bool woken;  // wakefd has been signaled
+    struct spsc *fwdreqs;   // incoming work, one ring per source thread
+    struct spsc *fwddones;  // completed work, one ring per owner thread
+    int *fwdpending;        // outstanding forwards, one per owner thread
+    uint64_t stat_forwarded;
+    // idle connections
+    int64_t idletimeout;        // ns, or zero
+    int64_t now;                // time of the current loop
+    struct net_conn **wheel;    // WHEELSLOTS lists of connections
+    int64_t wheeltick;          // last tick that was swept
+    // open connections, for listing
+    pthread_mutex_t connsmu;
+    struct net_conn *conns;
 #ifndef NOURING
     struct io_uring ring;
 #endif
@@ -488,8 +722,11 @@ struct qthreadctx {
     int nevents;
     event_t *events;
     atomic_int nconns;
-    int ntlsconns;
+    int ntlsconns;      // tls connections that are not in the kernel (kTLS)
     char *inpkts;
+    struct iovec *iovs;     // two per uring read, receive buffer and packet
+    struct msghdr *msgs;    // one per kTLS read
+    char *cmsgs;            // control buffer per kTLS read, for record types
     struct net_conn **qreads;
     struct net_conn **qins;
     struct net_conn **qattachs;
@@ -509,14 +746,38 @@ struct qthreadctx {
     uint64_t stat_get_hits;
     uint64_t stat_get_misses;
 
+    // busy polling stats
+    atomic_uint_fast64_t poll_spin_ns;
+    atomic_uint_fast64_t poll_sleep_ns;
+    atomic_uint_fast64_t poll_spin_hits;
+    atomic_uint_fast64_t poll_sleeps;
+
+    // per-thread totals, summed per numa node for stats
+    atomic_uint_fast64_t tot_cmd_get;
+    atomic_uint_fast64_t tot_cmd_set;
+    atomic_uint_fast64_t tot_get_hits;
+    atomic_uint_fast64_t tot_get_misses;
+
     struct qthreadctx *ctxs;
-    struct cmap cmap;
+
+    // connections on shared memory rings
+    struct net_conn *shmconns;
+    int nshmpolling;    // rings that are polled without waiting for events
+    uint64_t loop;      // event loop iteration
+
+    // sockets watched for the data handler
+    struct net_watch *watches;
+    struct net_watch *unwatched; // removed, freed on the next loop
 };
 
+// The qthread that is running on the current thread, if any.
+static __thread struct qthreadctx *curctx = 0;
+
 static atomic_uint_fast64_t g_stat_cmd_get = 0;
 static atomic_uint_fast64_t g_stat_cmd_set = 0;
 static atomic_uint_fast64_t g_stat_get_hits = 0;
 static atomic_uint_fast64_t g_stat_get_misses = 0;
+static atomic_uint_fast64_t g_stat_forwarded = 0;
 
 inline
 static void sumstats(struct net_conn *conn, struct qthreadctx *ctx) {
@@ -532,6 +793,16 @@ static void sumstats(struct net_conn *conn, struct qthreadctx *ctx) {
 
 inline
 static void sumstats_global(struct qthreadctx *ctx) {
+    if (ctx->cpu != -1) {
+        atomic_fetch_add_explicit(&ctx->tot_cmd_get, ctx->stat_cmd_get, 
+            __ATOMIC_RELAXED);
+        atomic_fetch_add_explicit(&ctx->tot_cmd_set, ctx->stat_cmd_set, 
+            __ATOMIC_RELAXED);
+        atomic_fetch_add_explicit(&ctx->tot_get_hits, ctx->stat_get_hits, 
+            __ATOMIC_RELAXED);
+        atomic_fetch_add_explicit(&ctx->tot_get_misses, ctx->stat_get_misses,
+            __ATOMIC_RELAXED);
+    }
     atomic_fetch_add_explicit(&g_stat_cmd_get, ctx->stat_cmd_get, 
         __ATOMIC_RELAXED);
     ctx->stat_cmd_get = 0;
@@ -544,6 +815,11 @@ static void sumstats_global(struct qthreadctx *ctx) {
     atomic_fetch_add_explicit(&g_stat_get_misses, ctx->stat_get_misses, 
         __ATOMIC_RELAXED);
     ctx->stat_get_misses = 0;
+    if (ctx->stat_forwarded) {
+        atomic_fetch_add_explicit(&g_stat_forwarded, ctx->stat_forwarded, 
+            __ATOMIC_RELAXED);
+        ctx->stat_forwarded = 0;
+    }
 }
 
 uint64_t stat_cmd_get(void) {
@@ -563,6 +839,10 @@ uint64_t stat_get_misses(void) {
     return atomic_load_explicit(&g_stat_get_misses, __ATOMIC_RELAXED);
 }
 
+uint64_t stat_forwarded(void) {
+    return atomic_load_explicit(&g_stat_forwarded, __ATOMIC_RELAXED);
+}
+
 inline
 static void qreset(struct qthreadctx *ctx) {
     ctx->nqreads = 0;
@@ -570,50 +850,446 @@ static void qreset(struct qthreadctx *ctx) {
     ctx->nqcloses = 0;
     ctx->nqouts = 0;
     ctx->nqattachs = 0;
+    while (ctx->unwatched) {
+        struct net_watch *w = ctx->unwatched;
+        ctx->unwatched = w->next;
+        xfree(w);
+    }
+}
+
+// Wake up a qthread that has new forwarded work or completions.
+static void wake(struct qthreadctx *ctx) {
+    if (!atomic_exchange_explicit(&ctx->woken, true, __ATOMIC_ACQ_REL)) {
+        wakefd_signal(ctx->wakefds[1]);
+    }
+}
+
+// Process all work that has been forwarded to this thread, then process all
+// work that was forwarded from this thread and has been completed.
+static void qforwarded(struct qthreadctx *ctx) {
+    wakefd_drain(ctx->wakefds[0]);
+    atomic_store_explicit(&ctx->woken, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < ctx->nthreads; i++) {
+        struct qthreadctx *origin = &ctx->ctxs[i];
+        bool completed = false;
+        struct bgworkctx *bgctx;
+        while ((bgctx = spsc_pop(&ctx->fwdreqs[i]))) {
+            // FORWARD(2)
+            // Run the work on behalf of the origin connection, which is
+            // paused until it receives the completion.
+            bgctx->work(bgctx->udata);
+            // The origin never has more outstanding forwards than the ring
+            // can hold, so this push cannot fail.
+            bool ok = spsc_push(&origin->fwddones[ctx->index], bgctx);
+            assert(ok); (void)ok;
+            completed = true;
+        }
+        if (completed) {
+            wake(origin);
+        }
+    }
+    // Each attached connection takes a slot in the step queues, which are
+    // shared with the other events. The wake event itself does not need one.
+    int limit = ctx->queuesize-ctx->nevents+1;
+    for (int i = 0; i < ctx->nthreads; i++) {
+        struct bgworkctx *bgctx;
+        while (limit > 0 && (bgctx = spsc_pop(&ctx->fwddones[i]))) {
+            // FORWARD(3)
+            // The work is complete. Attach the connection back to this 
+            // thread's event loop.
+            ctx->qattachs[ctx->nqattachs++] = bgctx->conn;
+            ctx->fwdpending[i]--;
+            limit--;
+        }
+    }
+    if (limit == 0) {
+        // There may be more completions. Pick them up on the next loop.
+        wake(ctx);
+    }
+}
+
+// Keep polling an idle ring for this long before the thread goes back to
+// sleeping on events. Back-to-back requests then avoid the socket wakeup.
+// There's no window on a single cpu, where polling would only keep the
+// client from running.
+#define SHMPOLLWINDOW 50000 // 50us
+static int64_t shmpollwindow = 0;
+
+static void shm_setpolling(struct qthreadctx *ctx, struct shm *shm, 
+    bool polling)
+{
+    if (shm->polling != polling) {
+        shm->polling = polling;
+        ctx->nshmpolling += polling ? 1 : -1;
+    }
+}
+
+// Wake the client if it's sleeping on the ring.
+static void shm_wakeclient(struct shm *shm) {
+    atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (atomic_load_explicit(&shm->hdr->cliwait, __ATOMIC_RELAXED) &&
+        atomic_exchange(&shm->hdr->cliwait, 0))
+    {
+        atomic_fetch_add(&shm->hdr->clifutex, 1);
+#ifdef __linux__
+        syscall(SYS_futex, &shm->hdr->clifutex, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#endif
+    }
+}
+
+// Returns the number of contiguous request bytes that are ready, or -1 if
+// the client corrupted the ring.
+static ssize_t shm_reqready(struct shm *shm, char **data) {
+    uint64_t tail = atomic_load_explicit(&shm->hdr->req.tail, 
+        __ATOMIC_ACQUIRE);
+    if (tail-shm->reqhead > shm->size) {
+        return -1;
+    }
+    size_t off = shm->reqhead&(shm->size-1);
+    size_t n = tail-shm->reqhead;
+    if (n > shm->size-off) {
+        n = shm->size-off;
+    }
+    *data = shm->reqbuf+off;
+    return n;
+}
+
+// Returns the free space in the response ring, or -1 if the client corrupted
+// the ring.
+static ssize_t shm_respspace(struct shm *shm) {
+    uint64_t head = atomic_load_explicit(&shm->hdr->resp.head, 
+        __ATOMIC_ACQUIRE);
+    if (shm->resptail-head > shm->size) {
+        return -1;
+    }
+    return shm->size-(shm->resptail-head);
+}
+
+// Move pending output into the response ring. Output that does not fit
+// stays in the connection until the client makes room.
+static bool shm_flush(struct net_conn *conn) {
+    struct shm *shm = conn->shm;
+    if (shm->outpos == conn->outlen) {
+        return true;
+    }
+    ssize_t space = shm_respspace(shm);
+    if (space == -1) {
+        return false;
+    }
+    size_t n = conn->outlen-shm->outpos;
+    if (n > (size_t)space) {
+        n = space;
+    }
+    if (n == 0) {
+        return true;
+    }
+    size_t off = shm->resptail&(shm->size-1);
+    size_t n1 = n < shm->size-off ? n : shm->size-off;
+    memcpy(shm->respbuf+off, conn->out+shm->outpos, n1);
+    memcpy(shm->respbuf, conn->out+shm->outpos+n1, n-n1);
+    shm->resptail += n;
+    atomic_store_explicit(&shm->hdr->resp.tail, shm->resptail, 
+        __ATOMIC_RELEASE);
+    shm->outpos += n;
+    if (shm->outpos == conn->outlen) {
+        shm->outpos = 0;
+        conn->outlen = 0;
+    }
+    shm_wakeclient(shm);
+    return true;
+}
+
+// Drain the wakeup bytes from the socket. Returns false if the client hung
+// up.
+static bool shm_drain(struct net_conn *conn) {
+    char buf[64];
+    while (1) {
+        ssize_t n = read(conn->fd, buf, sizeof(buf));
+        if (n > 0) {
+            continue;
+        }
+        return n == -1 && (errno == EAGAIN || errno == EINTR);
+    }
+}
+
+// Returns true if the connection has work that can be done right now.
+static bool shm_ready(struct net_conn *conn) {
+    struct shm *shm = conn->shm;
+    if (conn->outlen > 0) {
+        return shm_respspace(shm) != 0;
+    }
+    char *data;
+    return shm_reqready(shm, &data) != 0;
+}
+
+// The ring has nothing to do. Keep polling it for a short window, and then
+// ask the client for a wakeup on the socket.
+static void shm_idle(struct net_conn *conn, struct qthreadctx *ctx) {
+    struct shm *shm = conn->shm;
+    if (sys_now()-shm->last < shmpollwindow) {
+        shm_setpolling(ctx, shm, true);
+        return;
+    }
+    atomic_store(&shm->hdr->srvwait, 
+        conn->outlen > 0 ? SHMRING_WAITSPACE : SHMRING_WAITREQ);
+    atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_ready(conn)) {
+        // The client published before it could see the flag.
+        atomic_store(&shm->hdr->srvwait, 0);
+        shm_setpolling(ctx, shm, true);
+        return;
+    }
+    shm_setpolling(ctx, shm, false);
+}
+
+// Send the +OK reply with the memfd of the ring. They go out together or
+// not at all. Returns 1 when sent, 0 if the socket is full, or -1 if the
+// connection failed.
+static int shm_handover(int fd, int memfd) {
+    char ok[] = "+OK\r\n";
+    struct iovec iov = { .iov_base = ok, .iov_len = sizeof(ok)-1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { 
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    while (1) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == (ssize_t)iov.iov_len) {
+            return 1;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        // A unix socket sends the reply whole or not at all.
+        return n == -1 && errno == EAGAIN ? 0 : -1;
+    }
+}
+
+// Read from a connection that uses a shared memory ring. The next chunk of
+// requests is copied out of the ring before it's processed, because the
+// client can still write to the ring while the requests are parsed.
+static void shm_read(struct net_conn *conn, struct qthreadctx *ctx) {
+    struct shm *shm = conn->shm;
+    if (shm->sendfd != -1) {
+        // The client is waiting on the memfd, and the socket was full when
+        // the ring was created. The connection is watched for writes until
+        // it's sent.
+        int ret = shm_handover(conn->fd, shm->sendfd);
+        if (ret == 0) {
+            return;
+        }
+        if (ret == -1 || connwrite(ctx->qfd, conn->fd, conn, false) == -1) {
+            conn->closed = true;
+            ctx->qcloses[ctx->nqcloses++] = conn;
+            return;
+        }
+        close(shm->sendfd);
+        shm->sendfd = -1;
+    }
+    if (!shm_drain(conn) || !shm_flush(conn)) {
+        conn->closed = true;
+        ctx->qcloses[ctx->nqcloses++] = conn;
+        return;
+    }
+    if (conn->outlen > 0) {
+        // Waiting on the client to consume responses.
+        shm_idle(conn, ctx);
+        return;
+    }
+    char *data;
+    ssize_t n = shm_reqready(shm, &data);
+    if (n == -1) {
+        conn->closed = true;
+        ctx->qcloses[ctx->nqcloses++] = conn;
+        return;
+    }
+    if (n == 0 && !shm->resume) {
+        shm_idle(conn, ctx);
+        return;
+    }
+    if ((size_t)n > shm->incap) {
+        n = shm->incap;
+    }
+    if (n > 0) {
+        memcpy(shm->in, data, n);
+        shm->reqhead += n;
+        atomic_store_explicit(&shm->hdr->req.head, shm->reqhead, 
+            __ATOMIC_RELEASE);
+        shm_wakeclient(shm);
+    }
+    // After background work there may be requests that are buffered in the
+    // connection, so the callback is called even when the ring is empty.
+    shm->resume = false;
+    shm->last = sys_now();
+    atomic_store_explicit(&conn->lastactive, ctx->now, __ATOMIC_RELAXED);
+    shm_setpolling(ctx, shm, true);
+    ctx->qins[ctx->nqins] = conn;
+    ctx->qinpkts[ctx->nqins] = shm->in;
+    ctx->qinpktlens[ctx->nqins] = n;
+    ctx->nqins++;
+}
+
+static void shm_free(struct net_conn *conn, struct qthreadctx *ctx) {
+    struct shm *shm = conn->shm;
+    shm_setpolling(ctx, shm, false);
+    if (shm->prev) {
+        shm->prev->shm->next = shm->next;
+    } else {
+        ctx->shmconns = shm->next;
+    }
+    if (shm->next) {
+        shm->next->shm->prev = shm->prev;
+    }
+    // Wake a client that may be sleeping on the ring, so it can see that the
+    // socket is gone.
+    atomic_store(&shm->hdr->cliwait, 1);
+    shm_wakeclient(shm);
+    munmap(shm->hdr, shm->mapsize);
+    if (shm->sendfd != -1) {
+        close(shm->sendfd);
+    }
+    xfree(shm->in);
+    xfree(shm);
+    conn->shm = 0;
+    atomic_store_explicit(&conn->isshm, false, __ATOMIC_RELAXED);
+    atomic_fetch_sub(&shmconns, 1);
+}
+
+// Idle connections are found with a timer wheel. Each connection is in the
+// slot of the tick that it may expire at. Activity only updates the last
+// active time, and a connection that's still active when its slot comes
+// around is moved to the slot of its new expiration.
+#define WHEELSLOTS 64
+#define WHEELTICK  1000000000 // 1 second
+
+static void wheel_add(struct qthreadctx *ctx, struct net_conn *conn) {
+    int64_t lastactive = atomic_load_explicit(&conn->lastactive, 
+        __ATOMIC_RELAXED);
+    int64_t tick = (lastactive+ctx->idletimeout)/WHEELTICK+1;
+    if (tick <= ctx->wheeltick) {
+        tick = ctx->wheeltick+1;
+    }
+    int slot = tick%WHEELSLOTS;
+    conn->wtick = tick;
+    conn->wprev = 0;
+    conn->wnext = ctx->wheel[slot];
+    if (conn->wnext) {
+        conn->wnext->wprev = conn;
+    }
+    ctx->wheel[slot] = conn;
+}
+
+static void wheel_del(struct qthreadctx *ctx, struct net_conn *conn) {
+    if (conn->wprev) {
+        conn->wprev->wnext = conn->wnext;
+    } else {
+        ctx->wheel[conn->wtick%WHEELSLOTS] = conn->wnext;
+    }
+    if (conn->wnext) {
+        conn->wnext->wprev = conn->wprev;
+    }
+    conn->wtick = 0;
+}
+
+// Add the newly opened connection to the list of open connections.
+static void conns_add(struct qthreadctx *ctx, struct net_conn *conn) {
+    pthread_mutex_lock(&ctx->connsmu);
+    conn->cprev = 0;
+    conn->cnext = ctx->conns;
+    if (conn->cnext) {
+        conn->cnext->cprev = conn;
+    }
+    ctx->conns = conn;
+    pthread_mutex_unlock(&ctx->connsmu);
+}
+
+static void conns_del(struct qthreadctx *ctx, struct net_conn *conn) {
+    pthread_mutex_lock(&ctx->connsmu);
+    if (conn->cprev) {
+        conn->cprev->cnext = conn->cnext;
+    } else {
+        ctx->conns = conn->cnext;
+    }
+    if (conn->cnext) {
+        conn->cnext->cprev = conn->cprev;
+    }
+    pthread_mutex_unlock(&ctx->connsmu);
 }
 
 inline
 static void qaccept(struct qthreadctx *ctx) {
     for (int i = 0; i < ctx->nevents; i++) {
-        int fd = event_fd(&ctx->events[i]);
-        struct net_conn *conn = cmap_get(&ctx->cmap, fd);
-        if (!conn) {
-            if ((fd == ctx->sfd[0] || fd == ctx->sfd[1] || fd == ctx->sfd[2])) {
-                int sfd = fd;
-                fd = accept(fd, 0, 0);
-                if (fd == -1) {
+        void *udata = event_udata(&ctx->events[i]);
+        if (udata_iswatch(udata)) {
+            struct net_watch *w = udata_watch(udata);
+            if (w->fd != -1) {
+                w->event(w->udata);
+            }
+            continue;
+        }
+        if (udata_isfd(udata)) {
+            int fd = udata_fd(udata);
+            if (ctx->sharednothing && fd == ctx->wakefds[0]) {
+                qforwarded(ctx);
+                continue;
+            }
+            int sfd = fd;
+            fd = accept(fd, 0, 0);
+            if (fd == -1) {
+                continue;
+            }
+            if (setnonblock(fd, true) == -1) {
+                close(fd);
+                continue;
+            }
+            if (sfd == ctx->sfd[0] || sfd == ctx->sfd[2]) {
+                if (setkeepalive(fd, ctx->keepalive) == -1) {
+                    close(fd);
                     continue;
                 }
-                if (setnonblock(fd, true) == -1) {
+                if (settcpnodelay(fd, ctx->tcpnodelay) == -1) {
                     close(fd);
                     continue;
                 }
-                if (sfd == ctx->sfd[0] || sfd == ctx->sfd[2]) {
-                    if (setkeepalive(fd, ctx->keepalive) == -1) {
-                        close(fd);
-                        continue;
-                    }
-                    if (settcpnodelay(fd, ctx->tcpnodelay) == -1) {
-                        close(fd);
-                        continue;
-                    }
-                    if (setquickack(fd, ctx->quickack) == -1) {
-                        close(fd);
-                        continue;
-                    }
-                    if (sfd == ctx->sfd[2]) {
-                        save_tls_fd(fd);
-                    }
-                }
-                static atomic_uint_fast64_t next_ctx_index = 0;
-                int idx = atomic_fetch_add(&next_ctx_index, 1) % ctx->nthreads;
-                if (addread(ctx->ctxs[idx].qfd, fd) == -1) {
-                    if (sfd == ctx->sfd[2]) {
-                        del_tls_fd(fd);
-                    }
+                if (setquickack(fd, ctx->quickack) == -1) {
                     close(fd);
                     continue;
                 }
+                if (ctx->busypollsock) {
+                    setbusypoll(fd, ctx->busypollsock);
+                }
+            }
+            // The connection is created here, so that its events carry it,
+            // but it's opened by the qthread that it's handed to on its
+            // first event, which comes right away.
+            static atomic_uint_fast64_t next_ctx_index = 0;
+            int idx = atomic_fetch_add(&next_ctx_index, 1) % ctx->nthreads;
+            struct net_conn *conn = conn_new(fd, &ctx->ctxs[idx]);
+            conn->istls = sfd == ctx->sfd[2];
+            if (addconn(ctx->ctxs[idx].qfd, fd, conn) == -1) {
+                close(fd);
+                conn_free(conn);
+            }
+            continue;
+        }
+        struct net_conn *conn = udata;
+        if (!conn->opened) {
+            int fd = conn->fd;
+            if (openconn(ctx->qfd, fd, conn) == -1) {
+                close(fd);
+                conn_free(conn);
                 continue;
             }
             size_t xnconns = atomic_fetch_add(&nconns, 1);
@@ -622,11 +1298,10 @@ static void qaccept(struct qthreadctx *ctx) {
                 atomic_fetch_add(&rconns, 1);
                 atomic_fetch_sub(&nconns, 1);
                 close(fd);
+                conn_free(conn);
                 continue;
             }
-            bool istls = del_tls_fd(fd);
-            conn = conn_new(fd, ctx);
-            if (istls) {
+            if (conn->istls) {
                 if (!tls_accept(conn->fd, &conn->tls)) {
                     atomic_fetch_sub(&nconns, 1);
                     close(fd);
@@ -637,14 +1312,34 @@ static void qaccept(struct qthreadctx *ctx) {
             }
             atomic_fetch_add_explicit(&ctx->nconns, 1, __ATOMIC_RELEASE);
             atomic_fetch_add_explicit(&tconns, 1, __ATOMIC_RELEASE);
-            cmap_insert(&ctx->cmap, conn);
+            conn->opened = true;
+            conn->id = atomic_fetch_add(&nextconnid, 1)+1;
+            conn->created = ctx->now;
+            atomic_init(&conn->lastactive, ctx->now);
+            conns_add(ctx, conn);
+            if (ctx->idletimeout > 0) {
+                wheel_add(ctx, conn);
+            }
             ctx->opened(conn, ctx->udata);
+        } else {
+            atomic_store_explicit(&conn->lastactive, ctx->now, 
+                __ATOMIC_RELAXED);
         }
-        if (conn->bgctx) {
+        if (conn->bgctx && conn->bgctx->forwarded) {
+            // FORWARD(1)
+            // The connection is waiting on work that was forwarded to
+            // another thread, and this event was polled before its reads
+            // were paused. It will be attached once the work completes.
+        } else if (conn->bgctx) {
             // BGWORK(2)
             // The connection has been added back to the event loop, but it
             // needs to be attached and restated.
             ctx->qattachs[ctx->nqattachs++] = conn;
+        } else if (conn->shm && !conn->closed) {
+            // Woken up by the client. Pending output is also handled by the
+            // ring read.
+            conn->shm->queued = ctx->loop;
+            ctx->qreads[ctx->nqreads++] = conn;
         } else if (conn->outlen > 0) {
             ctx->qouts[ctx->nqouts++] = conn;
         } else if (conn->closed) {
@@ -655,6 +1350,26 @@ static void qaccept(struct qthreadctx *ctx) {
     }
 }
 
+inline
+static void qpoll(struct qthreadctx *ctx) {
+    // Queue the shared memory rings that are being polled. Each takes a slot
+    // in the step queues, so whatever doesn't fit waits for the next loop.
+    int limit = ctx->queuesize-ctx->nqreads-ctx->nqouts-ctx->nqcloses-
+        ctx->nqattachs;
+    struct net_conn *conn = ctx->shmconns;
+    while (conn && limit > 0) {
+        struct shm *shm = conn->shm;
+        if (shm->polling && shm->queued != ctx->loop && !conn->bgctx && 
+            !conn->closed)
+        {
+            shm->queued = ctx->loop;
+            ctx->qreads[ctx->nqreads++] = conn;
+            limit--;
+        }
+        conn = shm->next;
+    }
+}
+
 inline
 static void handle_read(ssize_t n, char *pkt, struct net_conn *conn,
     struct qthreadctx *ctx)
@@ -672,6 +1387,13 @@ static void handle_read(ssize_t n, char *pkt, struct net_conn *conn,
         // handler with an empty packet 
         n = 0;
     }
+    if (conn->rbuf) {
+        // The start of the data went into the receive buffer and the rest,
+        // if any, into the packet.
+        conn->rbufn = (size_t)n < conn->rbuflen ? (size_t)n : conn->rbuflen;
+        conn->rbuf = 0;
+        n -= conn->rbufn;
+    }
     pkt[n] = '\0';
     ctx->qins[ctx->nqins] = conn;
     ctx->qinpkts[ctx->nqins] = pkt;
@@ -681,9 +1403,16 @@ static void handle_read(ssize_t n, char *pkt, struct net_conn *conn,
 
 inline 
 static void flush_conn(struct net_conn *conn, size_t written) {
+    if (conn->shm) {
+        // Whatever doesn't fit in the response ring stays pending.
+        if (!shm_flush(conn)) {
+            conn->closed = true;
+        }
+        return;
+    }
     while (written < conn->outlen) {
         ssize_t n;
-        if (conn->tls) {
+        if (conn->tls && !conn->ktls) {
             n = tls_write(conn->tls, conn->fd, conn->out+written, 
                 conn->outlen-written);
         } else {
@@ -700,6 +1429,13 @@ static void flush_conn(struct net_conn *conn, size_t written) {
     }
     // either everything was written or the socket is closed
     conn->outlen = 0;
+    if (conn->outcap > MAXOUTKEEP) {
+        // Don't hold on to a large buffer after a burst of output.
+        xfree(conn->out);
+        conn->out = 0;
+        conn->outcap = 0;
+        atomic_store_explicit(&conn->outmem, 0, __ATOMIC_RELAXED);
+    }
 }
 
 inline
@@ -710,13 +1446,16 @@ static void qattach(struct qthreadctx *ctx) {
         // event loop in the correct state.
         struct net_conn *conn = ctx->qattachs[i];
         struct bgworkctx *bgctx = conn->bgctx;
+        bool forwarded = bgctx->forwarded;
         bgctx->done(conn, bgctx->udata);
         conn->bgctx = 0;
         assert(bgctx);
         xfree(bgctx);
-        int ret = delwrite(conn->ctx->qfd, conn->fd);
-        assert(ret == 0); (void)ret;
-        ret = addread(conn->ctx->qfd, conn->fd);
+        if (!forwarded) {
+            int ret = delwrite(conn->ctx->qfd, conn->fd);
+            assert(ret == 0); (void)ret;
+        }
+        int ret = addread(conn->ctx->qfd, conn->fd, conn);
         assert(ret == 0); (void)ret;
         flush_conn(conn, 0);
         if (conn->closed) {
@@ -727,8 +1466,45 @@ static void qattach(struct qthreadctx *ctx) {
     }
 }
 
+// Prepares read i of a connection that has its tls records handled by the
+// kernel. The record type of the read comes back in a control message, see
+// tls_record.
+static struct msghdr *ktlsmsg(struct qthreadctx *ctx, int i,
+    struct net_conn *conn, char *pkt)
+{
+    struct iovec *iov = &ctx->iovs[i*2];
+    int niov = 0;
+    if (conn->rbuf) {
+        iov[niov].iov_base = conn->rbuf;
+        iov[niov].iov_len = conn->rbuflen;
+        niov++;
+    }
+    iov[niov].iov_base = pkt;
+    iov[niov].iov_len = PACKETSIZE-1;
+    niov++;
+    struct msghdr *msg = &ctx->msgs[i];
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = iov;
+    msg->msg_iovlen = niov;
+    msg->msg_control = ctx->cmsgs+(i*TLSCMSGSIZE);
+    msg->msg_controllen = TLSCMSGSIZE;
+    return msg;
+}
+
 inline
 static void qread(struct qthreadctx *ctx) {
+    // Connections on shared memory rings read from their rings. The rest of
+    // the queue is compacted for the socket reads.
+    int nqreads = 0;
+    for (int i = 0; i < ctx->nqreads; i++) {
+        struct net_conn *conn = ctx->qreads[i];
+        if (conn->shm) {
+            shm_read(conn, ctx);
+        } else {
+            ctx->qreads[nqreads++] = conn;
+        }
+    }
+    ctx->nqreads = nqreads;
     // Read incoming socket data
 #ifndef NOURING
     if (ctx->uring && ctx->nqreads >= MINURINGEVENTS && ctx->ntlsconns == 0) {
@@ -737,7 +1513,20 @@ static void qread(struct qthreadctx *ctx) {
             struct net_conn *conn = ctx->qreads[i];
             char *pkt = ctx->inpkts+(i*PACKETSIZE);
             struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
-            io_uring_prep_read(sqe, conn->fd, pkt, PACKETSIZE-1, 0);
+            if (conn->ktls) {
+                io_uring_prep_recvmsg(sqe, conn->fd, 
+                    ktlsmsg(ctx, i, conn, pkt), 0);
+            } else if (conn->rbuf) {
+                struct iovec *iov = &ctx->iovs[i*2];
+                iov[0].iov_base = conn->rbuf;
+                iov[0].iov_len = conn->rbuflen;
+                iov[1].iov_base = pkt;
+                iov[1].iov_len = PACKETSIZE-1;
+                io_uring_prep_readv(sqe, conn->fd, iov, 2, 0);
+            } else {
+                io_uring_prep_read(sqe, conn->fd, pkt, PACKETSIZE-1, 0);
+            }
+            io_uring_sqe_set_data64(sqe, i);
         }
         int ret = io_uring_submit(&ctx->ring);
         if (ret < 0) {
@@ -752,13 +1541,19 @@ static void qread(struct qthreadctx *ctx) {
                 perror("# io_uring_wait_cqe");
                 abort();
             }
-            struct net_conn *conn = ctx->qreads[i];
-            char *pkt = ctx->inpkts+(i*PACKETSIZE);
+            // Completions may arrive out of order. The user data has the
+            // index of the read.
+            size_t j = io_uring_cqe_get_data64(cqe);
+            struct net_conn *conn = ctx->qreads[j];
+            char *pkt = ctx->inpkts+(j*PACKETSIZE);
             ssize_t n = cqe->res;
             if (n < 0) {
                 errno = -n;
                 n = -1;
             }
+            if (conn->ktls) {
+                n = tls_record(&ctx->msgs[j], n);
+            }
             handle_read(n, pkt, conn, ctx);
             io_uring_cqe_seen(&ctx->ring, cqe);
         }
@@ -769,8 +1564,37 @@ static void qread(struct qthreadctx *ctx) {
             struct net_conn *conn = ctx->qreads[i];
             char *pkt = ctx->inpkts+(i*PACKETSIZE);
             ssize_t n;
-            if (conn->tls) {
-                n = tls_read(conn->tls, conn->fd, pkt, PACKETSIZE-1);
+            if (conn->tls && !conn->ktls) {
+                if (conn->rbuf) {
+                    n = tls_read(conn->tls, conn->fd, conn->rbuf, 
+                        conn->rbuflen);
+                } else {
+                    n = tls_read(conn->tls, conn->fd, pkt, PACKETSIZE-1);
+                }
+                if (tls_kernel(conn->tls)) {
+                    // The handshake is done and the kernel took over the
+                    // records. The connection can now use the uring path.
+                    conn->ktls = true;
+                    ctx->ntlsconns--;
+                }
+                if (tls_wantwrite(conn->tls) != conn->tlswrite) {
+                    // The handshake is waiting on the socket to be
+                    // writable, or no longer is.
+                    conn->tlswrite = !conn->tlswrite;
+                    if (connwrite(ctx->qfd, conn->fd, conn, 
+                        conn->tlswrite) == -1)
+                    {
+                        n = -1;
+                    }
+                }
+            } else if (conn->ktls) {
+                n = tls_recvmsg(conn->fd, ktlsmsg(ctx, i, conn, pkt));
+            } else if (conn->rbuf) {
+                struct iovec iov[2] = {
+                    { .iov_base = conn->rbuf, .iov_len = conn->rbuflen },
+                    { .iov_base = pkt, .iov_len = PACKETSIZE-1 },
+                };
+                n = readv(conn->fd, iov, 2);
             } else {
                 n = read(conn->fd, pkt, PACKETSIZE-1);
             }
@@ -791,7 +1615,18 @@ static void qprocess(struct qthreadctx *ctx) {
         int n = ctx->qinpktlens[i];
         ctx->data(conn, p, n, ctx->udata);
         sumstats(conn, ctx);
-        if (conn->bgctx) {
+        if (conn->shm) {
+            // The ring does not go through the write step. Responses are
+            // moved to the ring here, even if the connection entered
+            // background mode, because those were written before it did.
+            flush_conn(conn, 0);
+            if (conn->bgctx) {
+                conn->shm->resume = true;
+            }
+            if (conn->closed && !conn->bgctx) {
+                ctx->qcloses[ctx->nqcloses++] = conn;
+            }
+        } else if (conn->bgctx) {
             // BGWORK(1)
             // Connection entered background mode.
             // This means the connection is no longer in the event queue but
@@ -821,6 +1656,7 @@ static void qwrite(struct qthreadctx *ctx) {
             struct net_conn *conn = ctx->qouts[i];
             struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
             io_uring_prep_write(sqe, conn->fd, conn->out, conn->outlen, 0);
+            io_uring_sqe_set_data(sqe, conn);
         }
         int ret = io_uring_submit(&ctx->ring);
         if (ret < 0) {
@@ -834,7 +1670,7 @@ static void qwrite(struct qthreadctx *ctx) {
                 perror("# io_uring_wait_cqe");
                 abort();
             }
-            struct net_conn *conn = ctx->qouts[i];
+            struct net_conn *conn = io_uring_cqe_get_data(cqe);
             ssize_t n = cqe->res;
             if (n == -EAGAIN) {
                 n = 0;
@@ -872,22 +1708,137 @@ static void qclose(struct qthreadctx *ctx) {
     // Close all sockets that need to be closed
     for (int i = 0; i < ctx->nqcloses; i++) {
         struct net_conn *conn = ctx->qcloses[i];
+        if (conn->opened) {
+            conns_del(ctx, conn);
+        }
+        if (conn->wtick) {
+            wheel_del(ctx, conn);
+        }
         ctx->closed(conn, ctx->udata);
         if (conn->tls) {
             tls_close(conn->tls, conn->fd);
-            ctx->ntlsconns--;
+            if (!conn->ktls) {
+                ctx->ntlsconns--;
+            }
         } else {
             close(conn->fd);
         }
-        cmap_delete(&ctx->cmap, conn);
+        if (conn->shm) {
+            shm_free(conn, ctx);
+        }
         atomic_fetch_sub_explicit(&nconns, 1, __ATOMIC_RELEASE);
         atomic_fetch_sub_explicit(&ctx->nconns, 1, __ATOMIC_RELEASE);
         conn_free(conn);
     }
 }
 
+inline
+static void qidle(struct qthreadctx *ctx) {
+    // Sweep the wheel slots up to the current tick, closing the connections
+    // that have been idle for too long. Connections in the background are
+    // not idle.
+    int64_t tick = ctx->now/WHEELTICK;
+    if (tick-ctx->wheeltick > WHEELSLOTS) {
+        ctx->wheeltick = tick-WHEELSLOTS;
+    }
+    int room = ctx->queuesize*2-ctx->nqcloses;
+    while (ctx->wheeltick < tick) {
+        ctx->wheeltick++;
+        int slot = ctx->wheeltick%WHEELSLOTS;
+        struct net_conn *conn = ctx->wheel[slot];
+        ctx->wheel[slot] = 0;
+        while (conn) {
+            struct net_conn *next = conn->wnext;
+            int64_t lastactive = atomic_load_explicit(&conn->lastactive,
+                __ATOMIC_RELAXED);
+            if (conn->wtick > ctx->wheeltick || conn->closed || conn->bgctx ||
+                ctx->now-lastactive < ctx->idletimeout)
+            {
+                wheel_add(ctx, conn);
+            } else if (room == 0) {
+                // No more room to close this loop. Put the rest back and
+                // sweep this slot again on the next loop.
+                ctx->wheeltick--;
+                while (conn) {
+                    next = conn->wnext;
+                    wheel_add(ctx, conn);
+                    conn = next;
+                }
+                return;
+            } else {
+                conn->wtick = 0;
+                conn->closed = true;
+                ctx->qcloses[ctx->nqcloses++] = conn;
+                atomic_fetch_add(&idleconns, 1);
+                room--;
+            }
+            conn = next;
+        }
+    }
+}
+
+// Only the qthread writes its stats, so there's no need for an atomic add.
+static void pollstat_add(atomic_uint_fast64_t *stat, uint64_t x) {
+    atomic_store_explicit(stat, 
+        atomic_load_explicit(stat, __ATOMIC_RELAXED)+x, __ATOMIC_RELAXED);
+}
+
+// Account for the time spent getting events when busy polling.
+// Returns the earliest deadline of the watched sockets, or zero.
+static int64_t qwatch_deadline(struct qthreadctx *ctx) {
+    int64_t deadline = 0;
+    for (struct net_watch *w = ctx->watches; w; w = w->next) {
+        if (w->deadline && (!deadline || w->deadline < deadline)) {
+            deadline = w->deadline;
+        }
+    }
+    return deadline;
+}
+
+// Call the event of every watched socket whose deadline has passed.
+static void qwatch(struct qthreadctx *ctx) {
+    struct net_watch *w = ctx->watches;
+    while (w) {
+        // The event may remove the watch.
+        struct net_watch *next = w->next;
+        if (w->deadline && w->deadline <= ctx->now) {
+            w->deadline = 0;
+            w->event(w->udata);
+        }
+        w = next;
+    }
+}
+
+static void qpollstats(struct qthreadctx *ctx, int64_t start, bool spinning,
+    int64_t *lastactive)
+{
+    int64_t now = sys_now();
+    if (spinning) {
+        pollstat_add(&ctx->poll_spin_ns, now-start);
+        if (ctx->nevents > 0) {
+            pollstat_add(&ctx->poll_spin_hits, 1);
+        }
+    } else {
+        pollstat_add(&ctx->poll_sleep_ns, now-start);
+        pollstat_add(&ctx->poll_sleeps, 1);
+    }
+    if (ctx->nevents > 0) {
+        *lastactive = now;
+    }
+}
+
 static void *qthread(void *arg) {
     struct qthreadctx *ctx = arg;
+    curctx = ctx;
+    if (ctx->cpu != -1) {
+        // Pin the thread before allocating any of its buffers. This allows
+        // for the first-touch policy of the OS to place them on the local
+        // numa node.
+        if (!sys_pinthread(ctx->cpu)) {
+            fprintf(stderr, "# failed to pin thread %d to cpu %d\n",
+                ctx->index, ctx->cpu);
+        }
+    }
 #ifndef NOURING
     if (ctx->uring) {
         if (io_uring_queue_init(ctx->queuesize, &ctx->ring, 0) < 0) {
@@ -896,41 +1847,83 @@ static void *qthread(void *arg) {
         }
     }
 #endif
-    // connection map
-    memset(&ctx->cmap, 0, sizeof(struct cmap));
-    ctx->cmap.nbuckets = 64;
-    size_t size = ctx->cmap.nbuckets*sizeof(struct net_conn*);
-    ctx->cmap.buckets = xmalloc(size);
-    memset(ctx->cmap.buckets, 0, ctx->cmap.nbuckets*sizeof(struct net_conn*));
-
     ctx->events = xmalloc(sizeof(event_t)*ctx->queuesize);
     ctx->qreads = xmalloc(sizeof(struct net_conn*)*ctx->queuesize);
     ctx->inpkts = xmalloc(PACKETSIZE*ctx->queuesize);
+    ctx->iovs = xmalloc(sizeof(struct iovec)*2*ctx->queuesize);
+    ctx->msgs = xmalloc(sizeof(struct msghdr)*ctx->queuesize);
+    ctx->cmsgs = xmalloc(TLSCMSGSIZE*ctx->queuesize);
     ctx->qins = xmalloc(sizeof(struct net_conn*)*ctx->queuesize);
     ctx->qinpkts = xmalloc(sizeof(char*)*ctx->queuesize);
     ctx->qinpktlens = xmalloc(sizeof(int)*ctx->queuesize);
-    ctx->qcloses = xmalloc(sizeof(struct net_conn*)*ctx->queuesize);
     ctx->qouts = xmalloc(sizeof(struct net_conn*)*ctx->queuesize);
     ctx->qattachs = xmalloc(sizeof(struct net_conn*)*ctx->queuesize);
+    // Idle connections are closed along with the others, so there's room
+    // for both.
+    ctx->qcloses = xmalloc(sizeof(struct net_conn*)*ctx->queuesize*2);
+    ctx->now = sys_now();
+    if (ctx->idletimeout > 0) {
+        ctx->wheel = xmalloc(sizeof(struct net_conn*)*WHEELSLOTS);
+        memset(ctx->wheel, 0, sizeof(struct net_conn*)*WHEELSLOTS);
+        ctx->wheeltick = ctx->now/WHEELTICK;
+    }
 
+    int64_t lastactive = 0;
     while (1) {
         sumstats_global(ctx);
-        ctx->nevents = getevents(ctx->qfd, ctx->events, ctx->queuesize, 1, 0);
-        if (ctx->nevents <= 0) {
+        // Don't wait for events while there are shared memory rings to poll,
+        // or while busy polling after recent activity.
+        bool polling = ctx->nshmpolling > 0;
+        bool spinning = false;
+        int64_t start = 0;
+        if (ctx->busypoll > 0) {
+            start = sys_now();
+            spinning = start-lastactive < ctx->busypoll;
+        }
+        // With an idle timeout the thread wakes up to sweep the wheel, and
+        // with a watch deadline to call its event.
+        int64_t deadline = qwatch_deadline(ctx);
+        bool forever = !polling && !spinning && ctx->idletimeout == 0 &&
+            deadline == 0;
+        int64_t timeout = polling || spinning ? 0 : WHEELTICK;
+        if (deadline) {
+            int64_t left = deadline-sys_now();
+            timeout = left < timeout ? left : timeout;
+        }
+        ctx->nevents = getevents(ctx->qfd, ctx->events, ctx->queuesize,
+            forever, timeout);
+        if (ctx->busypoll > 0) {
+            qpollstats(ctx, start, polling || spinning, &lastactive);
+        }
+        ctx->now = sys_now();
+        bool sweep = ctx->idletimeout > 0 && 
+            ctx->now/WHEELTICK > ctx->wheeltick;
+        bool expired = deadline && ctx->now >= deadline;
+        if (ctx->nevents < 0 || (ctx->nevents == 0 && 
+            ctx->nshmpolling == 0 && !sweep && !expired))
+        {
             if (ctx->nevents == -1 && errno != EINTR) {
                 perror("# getevents");
                 abort();
             }
             continue;
         }
-        // reset, accept, attach, read, process, prewrite, write, close
+        ctx->loop++;
+        // reset, accept, poll, attach, read, process, prewrite, write, close
         qreset(ctx);    // reset the step queues
         qaccept(ctx);   // accept incoming connections
+        if (expired) {
+            qwatch(ctx); // watched sockets that are past their deadline
+        }
+        qpoll(ctx);     // poll shared memory rings
         qattach(ctx);   // attach bg workers. uncommon
         qread(ctx);     // read from sockets
         qprocess(ctx);  // process new socket data
         qprewrite(ctx); // perform any prewrite operations, such as fsync
         qwrite(ctx);    // write to sockets
+        if (sweep) {
+            qidle(ctx); // close idle connections
+        }
         qclose(ctx);    // close any sockets that need closing
     }
     return 0;
@@ -1032,6 +2025,7 @@ static int listen_unixsock(const char *unixsock, int backlog) {
 }
 
 static atomic_uintptr_t all_ctxs = 0;
+static int nnodes = 0;
 
 // current connections
 size_t net_nconns(void) {
@@ -1048,6 +2042,15 @@ size_t net_rconns(void) {
     return atomic_load_explicit(&rconns, __ATOMIC_ACQUIRE);
 }
 
+// current connections on shared memory rings
+size_t net_shmconns(void) {
+    return atomic_load_explicit(&shmconns, __ATOMIC_ACQUIRE);
+}
+
+size_t net_idleconns(void) {
+    return atomic_load_explicit(&idleconns, __ATOMIC_ACQUIRE);
+}
+
 static void warmupunix(const char *unixsock, int nsocks) {
     if (!unixsock || !*unixsock) {
         return;
@@ -1167,12 +2170,26 @@ char *exec_command(const char *command) {
 }
 #endif
 
+static int listenfds[3] = { 0 };
+
+// Returns the listening sockets (tcp, unix, tls), which can be handed over to
+// another process. Zero means that there's no listener.
+void net_listeners(int fds[3]) {
+    memcpy(fds, listenfds, sizeof(listenfds));
+}
+
 void net_main(struct net_opts *opts) {
-    int sfd[3] = {
-        listen_tcp(opts->host, opts->port, opts->reuseport, opts->backlog),
-        listen_unixsock(opts->unixsock, opts->backlog),
-        listen_tcp(opts->host, opts->tlsport, opts->reuseport, opts->backlog),
-    };
+    int *sfd = listenfds;
+    if (opts->listenfds) {
+        // Listeners were inherited from a previous process.
+        memcpy(sfd, opts->listenfds, sizeof(listenfds));
+    } else {
+        sfd[0] = listen_tcp(opts->host, opts->port, opts->reuseport, 
+            opts->backlog);
+        sfd[1] = listen_unixsock(opts->unixsock, opts->backlog);
+        sfd[2] = listen_tcp(opts->host, opts->tlsport, opts->reuseport, 
+            opts->backlog);
+    }
     if (!sfd[0] && !sfd[1] && !sfd[2]) {
 #ifdef __EMSCRIPTEN__
         emscripten_start(opts);
@@ -1183,6 +2200,13 @@ void net_main(struct net_opts *opts) {
 #endif
     }
     opts->listening(opts->udata);
+    if (sys_nprocs() > 1) {
+        // Busy polling can only make the ring poll window longer.
+        shmpollwindow = SHMPOLLWINDOW;
+        if ((int64_t)opts->busypoll*1000 > shmpollwindow) {
+            shmpollwindow = (int64_t)opts->busypoll*1000;
+        }
+    }
     struct qthreadctx *ctxs = xmalloc(sizeof(struct qthreadctx)*opts->nthreads);
     memset(ctxs, 0, sizeof(struct qthreadctx)*opts->nthreads);
     for (int i = 0; i < opts->nthreads; i++) {
@@ -1191,6 +2215,10 @@ void net_main(struct net_opts *opts) {
         ctx->tcpnodelay = opts->tcpnodelay;
         ctx->keepalive = opts->keepalive;
         ctx->quickack = opts->quickack;
+        ctx->busypoll = (int64_t)opts->busypoll*1000;
+        ctx->busypollsock = opts->busypollsock ? opts->busypoll : 0;
+        ctx->idletimeout = (int64_t)opts->idletimeout*1000000000;
+        pthread_mutex_init(&ctx->connsmu, 0);
         ctx->uring = !opts->nouring;
         ctx->ctxs = ctxs;
         ctx->index = i;
@@ -1208,7 +2236,7 @@ void net_main(struct net_opts *opts) {
         atomic_init(&ctx->nconns, 0);
         for (int j = 0; j < 3; j++) {
             if (sfd[j]) {
-                int ret = addread(ctx->qfd, sfd[j]);
+                int ret = addread(ctx->qfd, sfd[j], fdudata(sfd[j]));
                 if (ret == -1) {
                     perror("# addread");
                     abort();
@@ -1217,6 +2245,32 @@ void net_main(struct net_opts *opts) {
         }
         ctx->unixsock = opts->unixsock;
         ctx->queuesize = opts->queuesize;
+        ctx->sharednothing = opts->sharednothing && opts->nthreads > 1;
+        if (ctx->sharednothing) {
+            if (wakefd(ctx->wakefds) == -1) {
+                perror("# wakefd");
+                abort();
+            }
+            int fd = ctx->wakefds[0];
+            if (addread(ctx->qfd, fd, fdudata(fd)) == -1) {
+                perror("# addread");
+                abort();
+            }
+            atomic_init(&ctx->woken, false);
+            ctx->fwdreqs = xmalloc(sizeof(struct spsc)*opts->nthreads);
+            ctx->fwddones = xmalloc(sizeof(struct spsc)*opts->nthreads);
+            ctx->fwdpending = xmalloc(sizeof(int)*opts->nthreads);
+            memset(ctx->fwdpending, 0, sizeof(int)*opts->nthreads);
+            for (int j = 0; j < opts->nthreads; j++) {
+                spsc_init(&ctx->fwdreqs[j], opts->queuesize);
+                spsc_init(&ctx->fwddones[j], opts->queuesize);
+            }
+        }
+        ctx->cpu = opts->cpus ? opts->cpus[i] : -1;
+        ctx->node = opts->cpus ? sys_cpunode(ctx->cpu) : 0;
+        if (ctx->node+1 > nnodes) {
+            nnodes = ctx->node+1;
+        }
     }
     atomic_store(&all_ctxs, (uintptr_t)(void*)ctxs);
     opts->ready(opts->udata);
@@ -1241,6 +2295,97 @@ void net_main(struct net_opts *opts) {
     }
 }
 
+// Returns the number of numa nodes that the threads are pinned to, or zero
+// if the threads are not pinned.
+int net_nnodes(void) {
+    struct qthreadctx *ctxs = (void*)atomic_load(&all_ctxs);
+    if (!ctxs || ctxs[0].cpu == -1) {
+        return 0;
+    }
+    return nnodes;
+}
+
+void net_nodestats(int node, struct net_nodestats *stats) {
+    memset(stats, 0, sizeof(struct net_nodestats));
+    struct qthreadctx *ctxs = (void*)atomic_load(&all_ctxs);
+    if (!ctxs) {
+        return;
+    }
+    for (int i = 0; i < ctxs[0].nthreads; i++) {
+        struct qthreadctx *ctx = &ctxs[i];
+        if (ctx->node != node) {
+            continue;
+        }
+        stats->threads++;
+        stats->conns += atomic_load_explicit(&ctx->nconns, __ATOMIC_RELAXED);
+        stats->cmd_get += atomic_load_explicit(&ctx->tot_cmd_get, 
+            __ATOMIC_RELAXED);
+        stats->cmd_set += atomic_load_explicit(&ctx->tot_cmd_set, 
+            __ATOMIC_RELAXED);
+        stats->get_hits += atomic_load_explicit(&ctx->tot_get_hits, 
+            __ATOMIC_RELAXED);
+        stats->get_misses += atomic_load_explicit(&ctx->tot_get_misses, 
+            __ATOMIC_RELAXED);
+    }
+}
+
+int net_nthreads(void) {
+    struct qthreadctx *ctxs = (void*)atomic_load(&all_ctxs);
+    return ctxs ? ctxs[0].nthreads : 0;
+}
+
+void net_pollstats(int thread, struct net_pollstats *stats) {
+    memset(stats, 0, sizeof(struct net_pollstats));
+    struct qthreadctx *ctxs = (void*)atomic_load(&all_ctxs);
+    if (!ctxs || thread < 0 || thread >= ctxs[0].nthreads) {
+        return;
+    }
+    struct qthreadctx *ctx = &ctxs[thread];
+    stats->spin_ns = atomic_load_explicit(&ctx->poll_spin_ns, 
+        __ATOMIC_RELAXED);
+    stats->sleep_ns = atomic_load_explicit(&ctx->poll_sleep_ns, 
+        __ATOMIC_RELAXED);
+    stats->spin_hits = atomic_load_explicit(&ctx->poll_spin_hits, 
+        __ATOMIC_RELAXED);
+    stats->sleeps = atomic_load_explicit(&ctx->poll_sleeps, __ATOMIC_RELAXED);
+}
+
+static void peeraddr(int fd, char addrstr[], size_t size);
+
+void net_conns(void (*iter)(struct net_conninfo *info, void *udata),
+    void *udata)
+{
+    struct qthreadctx *ctxs = (void*)atomic_load(&all_ctxs);
+    if (!ctxs) {
+        return;
+    }
+    int64_t now = sys_now();
+    for (int i = 0; i < ctxs[0].nthreads; i++) {
+        struct qthreadctx *ctx = &ctxs[i];
+        pthread_mutex_lock(&ctx->connsmu);
+        struct net_conn *conn = ctx->conns;
+        while (conn) {
+            struct net_conninfo info = { 0 };
+            info.id = conn->id;
+            info.fd = conn->fd;
+            info.thread = ctx->index;
+            peeraddr(conn->fd, info.addr, sizeof(info.addr));
+            info.age = now-conn->created;
+            info.idle = now-atomic_load_explicit(&conn->lastactive,
+                __ATOMIC_RELAXED);
+            info.inmem = atomic_load_explicit(&conn->inmem, __ATOMIC_RELAXED);
+            info.outmem = atomic_load_explicit(&conn->outmem, 
+                __ATOMIC_RELAXED);
+            info.mem = sizeof(struct net_conn)+info.inmem+info.outmem;
+            info.tls = conn->istls;
+            info.shm = atomic_load_explicit(&conn->isshm, __ATOMIC_RELAXED);
+            iter(&info, udata);
+            conn = conn->cnext;
+        }
+        pthread_mutex_unlock(&ctx->connsmu);
+    }
+}
+
 static void *bgwork(void *arg) {
     struct bgworkctx *bgctx = arg;
     bgctx->work(bgctx->udata);
@@ -1248,34 +2393,25 @@ static void *bgwork(void *arg) {
     // connection. Adding the writer to the queue will allow for the loop
     // thread to gracefully continue the operation and then call the 'done'
     // callback.
-    int ret = addwrite(bgctx->conn->ctx->qfd, bgctx->conn->fd);
+    struct net_conn *conn = bgctx->conn;
+    int ret = addwrite(conn->ctx->qfd, conn->fd, conn);
     assert(ret == 0); (void)ret;
     return 0;
 }
 
-// net_conn_bgwork processes work in a background thread.
-// When work is finished, the done function is called.
-// It's not safe to use the conn type in the work function.
-bool net_conn_bgwork(struct net_conn *conn, void (*work)(void *udata), 
+// Pause the connection for background work, which keeps it out of the event
+// loop until the work is done. Returns false if it can't be paused.
+static bool bgpause(struct net_conn *conn, void (*work)(void *udata), 
     void (*done)(struct net_conn *conn, void *udata), void *udata)
 {
-#ifdef __EMSCRIPTEN__
-    // run in foreground
-    work(udata);
-    done(conn, udata);
-    return true;
-#endif
     if (conn->bgctx || conn->closed) {
         return false;
     }
-    if (!conn->closed) {
-        flush_conn(conn, 0);
-    }
+    flush_conn(conn, 0);
     if (conn->closed) {
         return false;
     }
-    struct qthreadctx *ctx = conn->ctx;
-    int ret = delread(ctx->qfd, conn->fd);    
+    int ret = delread(conn->ctx->qfd, conn->fd);    
     assert(ret == 0); (void)ret;
     conn->bgctx = xmalloc(sizeof(struct bgworkctx));
     memset(conn->bgctx, 0, sizeof(struct bgworkctx));
@@ -1283,13 +2419,36 @@ bool net_conn_bgwork(struct net_conn *conn, void (*work)(void *udata),
     conn->bgctx->done = done;
     conn->bgctx->work = work;
     conn->bgctx->udata = udata;
+    return true;
+}
+
+// Undo a bgpause when the work could not be started.
+static void bgunpause(struct net_conn *conn) {
+    int ret = addread(conn->ctx->qfd, conn->fd, conn);
+    assert(ret == 0); (void)ret;
+    xfree(conn->bgctx);
+    conn->bgctx = 0;
+}
+
+// net_conn_bgwork processes work in a background thread.
+// When work is finished, the done function is called.
+// It's not safe to use the conn type in the work function.
+bool net_conn_bgwork(struct net_conn *conn, void (*work)(void *udata), 
+    void (*done)(struct net_conn *conn, void *udata), void *udata)
+{
+#ifdef __EMSCRIPTEN__
+    // run in foreground
+    work(udata);
+    done(conn, udata);
+    return true;
+#endif
+    if (!bgpause(conn, work, done, udata)) {
+        return false;
+    }
     pthread_t th;
     if (pthread_create(&th, 0, bgwork, conn->bgctx) == -1) {
         // Failed to create thread. Revert and return false.
-        ret = addread(ctx->qfd, conn->fd);
-        assert(ret == 0);
-        xfree(conn->bgctx);
-        conn->bgctx = 0;
+        bgunpause(conn);
         return false;
     } else {
         pthread_detach(th);
@@ -1297,6 +2456,203 @@ bool net_conn_bgwork(struct net_conn *conn, void (*work)(void *udata),
     return true;
 }
 
+// The io pool is a small fixed set of threads for short blocking reads, such
+// as loading a spilled value. The threads are started on first use and are
+// shared by all qthreads, so a read doesn't cost a thread creation.
+static pthread_mutex_t iomu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iocond = PTHREAD_COND_INITIALIZER;
+static struct bgworkctx *iohead = 0;
+static struct bgworkctx *iotail = 0;
+static int niothreads = 0;
+
+static void *iothread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&iomu);
+        while (!iohead) {
+            pthread_cond_wait(&iocond, &iomu);
+        }
+        struct bgworkctx *bgctx = iohead;
+        iohead = bgctx->ionext;
+        if (!iohead) {
+            iotail = 0;
+        }
+        pthread_mutex_unlock(&iomu);
+        bgwork(bgctx);
+    }
+    return 0;
+}
+
+// net_conn_iowork is net_conn_bgwork for short blocking reads. The work runs
+// on the io pool instead of a new thread.
+bool net_conn_iowork(struct net_conn *conn, void (*work)(void *udata), 
+    void (*done)(struct net_conn *conn, void *udata), void *udata)
+{
+#ifdef __EMSCRIPTEN__
+    // run in foreground
+    work(udata);
+    done(conn, udata);
+    return true;
+#endif
+    if (!bgpause(conn, work, done, udata)) {
+        return false;
+    }
+    pthread_mutex_lock(&iomu);
+    while (niothreads < IOTHREADS) {
+        pthread_t th;
+        if (pthread_create(&th, 0, iothread, 0) != 0) {
+            break;
+        }
+        pthread_detach(th);
+        niothreads++;
+    }
+    bool ok = niothreads > 0;
+    if (ok) {
+        if (iotail) {
+            iotail->ionext = conn->bgctx;
+        } else {
+            iohead = conn->bgctx;
+        }
+        iotail = conn->bgctx;
+        pthread_cond_signal(&iocond);
+    }
+    pthread_mutex_unlock(&iomu);
+    if (!ok) {
+        bgunpause(conn);
+    }
+    return ok;
+}
+
+// net_conn_forward processes work on another qthread. The connection is
+// paused until the work is finished, and then the done function is called
+// from the connection's own thread.
+// Unlike net_conn_bgwork, the work function may write to the connection
+// output, because nothing else touches the connection while it's paused.
+// Returns false if the work could not be forwarded, such as when the target
+// thread has too much pending work.
+bool net_conn_forward(struct net_conn *conn, int thread, 
+    void (*work)(void *udata), void (*done)(struct net_conn *conn, void *udata),
+    void *udata)
+{
+    struct qthreadctx *ctx = conn->ctx;
+    if (!ctx || !ctx->sharednothing || conn->bgctx || conn->closed ||
+        thread == ctx->index || thread < 0 || thread >= ctx->nthreads)
+    {
+        return false;
+    }
+    struct qthreadctx *owner = &ctx->ctxs[thread];
+    if ((size_t)ctx->fwdpending[thread] == owner->fwdreqs[ctx->index].cap) {
+        return false;
+    }
+    struct bgworkctx *bgctx = xmalloc(sizeof(struct bgworkctx));
+    memset(bgctx, 0, sizeof(struct bgworkctx));
+    bgctx->conn = conn;
+    bgctx->done = done;
+    bgctx->work = work;
+    bgctx->udata = udata;
+    bgctx->forwarded = true;
+    // FORWARD(0)
+    // Stop reading while the connection is paused. Otherwise pipelined data
+    // or a hangup would keep waking this thread until the work completes.
+    int ret = delread(ctx->qfd, conn->fd);
+    assert(ret == 0); (void)ret;
+    // Mark the connection as paused before the owner can see the work, which
+    // then knows that the connection cannot start its own background work.
+    conn->bgctx = bgctx;
+    if (!spsc_push(&owner->fwdreqs[ctx->index], bgctx)) {
+        conn->bgctx = 0;
+        ret = addread(ctx->qfd, conn->fd, conn);
+        assert(ret == 0);
+        xfree(bgctx);
+        return false;
+    }
+    ctx->fwdpending[thread]++;
+    ctx->stat_forwarded++;
+    wake(owner);
+    return true;
+}
+
+// Returns the index of the qthread that owns the connection.
+int net_conn_thread(struct net_conn *conn) {
+    return conn->ctx ? conn->ctx->index : 0;
+}
+
+// net_conn_park pauses the connection without starting any work, such as
+// while it waits on another server. The done function is called once
+// net_conn_unpark has been called from the connection's own thread.
+bool net_conn_park(struct net_conn *conn, 
+    void (*done)(struct net_conn *conn, void *udata), void *udata)
+{
+    return bgpause(conn, 0, done, udata);
+}
+
+void net_conn_unpark(struct net_conn *conn) {
+    assert(conn->bgctx && !conn->bgctx->work);
+    int ret = addwrite(conn->ctx->qfd, conn->fd, conn);
+    assert(ret == 0); (void)ret;
+}
+
+// net_watch polls a non-blocking socket on the current qthread. Returns
+// NULL if the caller is not running on a qthread or the socket could not be
+// added.
+struct net_watch *net_watch(int fd, void (*event)(void *udata), 
+    void *udata)
+{
+    struct qthreadctx *ctx = curctx;
+    if (!ctx) {
+        errno = EPERM;
+        return 0;
+    }
+    struct net_watch *w = xmalloc(sizeof(struct net_watch));
+    memset(w, 0, sizeof(struct net_watch));
+    w->fd = fd;
+    w->event = event;
+    w->udata = udata;
+    w->ctx = ctx;
+    if (addwatch(ctx->qfd, w) == -1) {
+        xfree(w);
+        return 0;
+    }
+    w->next = ctx->watches;
+    if (w->next) {
+        w->next->prev = w;
+    }
+    ctx->watches = w;
+    return w;
+}
+
+void net_watch_write(struct net_watch *w, bool write) {
+    if (w->write != write) {
+        w->write = write;
+        int ret = modwatch(w->ctx->qfd, w);
+        assert(ret == 0); (void)ret;
+    }
+}
+
+void net_watch_deadline(struct net_watch *w, int64_t deadline) {
+    w->deadline = deadline;
+}
+
+// Stop polling the socket. The socket is not closed.
+void net_unwatch(struct net_watch *w) {
+    struct qthreadctx *ctx = w->ctx;
+    delwatch(ctx->qfd, w);
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        ctx->watches = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+    // Events for the socket may still be in the current batch, so the watch
+    // is freed on the next loop.
+    w->fd = -1;
+    w->deadline = 0;
+    w->next = ctx->unwatched;
+    ctx->unwatched = w;
+}
+
 bool net_conn_bgworking(struct net_conn *conn) {
     return conn->bgctx != 0;
 }
@@ -1321,6 +2677,119 @@ bool net_conn_istls(struct net_conn *conn) {
     return conn->tls != 0;
 }
 
+bool net_conn_isshm(struct net_conn *conn) {
+    return conn->shm != 0;
+}
+
+// net_conn_shmring moves the connection over to a shared memory ring. The
+// +OK reply and the memfd are sent on the socket, right away or once it's
+// writable. From then on the socket only carries wakeups. See shmring.h for
+// the layout.
+// The size is the number of bytes in each ring, or zero for the default.
+bool net_conn_shmring(struct net_conn *conn, size_t size, const char **err) {
+#ifndef __linux__
+    (void)conn, (void)size;
+    *err = "ERR shared memory rings are not supported on this platform";
+    return false;
+#else
+    if (conn->shm) {
+        *err = "ERR connection already uses a shared memory ring";
+        return false;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (!conn->ctx || conn->tls || 
+        getsockname(conn->fd, (struct sockaddr*)&addr, &addrlen) == -1 ||
+        addr.ss_family != AF_UNIX)
+    {
+        *err = "ERR shared memory rings require a unix socket connection";
+        return false;
+    }
+    if (size == 0) {
+        size = SHMRING_DEFSIZE;
+    }
+    if (size < SHMRING_MINSIZE || size > SHMRING_MAXSIZE) {
+        *err = "ERR invalid ring size";
+        return false;
+    }
+    size_t cap = SHMRING_MINSIZE;
+    while (cap < size) {
+        cap *= 2;
+    }
+    size_t mapsize = SHMRING_HDRSIZE+cap*2;
+    void *mem = MAP_FAILED;
+    // The size is sealed, so that the client can't shrink the memory from
+    // under the server, which would fault on its next access.
+    int fd = memfd_create("pogocache-shmring", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (fd == -1 || ftruncate(fd, mapsize) == -1 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) == -1)
+    {
+        goto fail;
+    }
+    mem = mmap(0, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    struct shmring_hdr *hdr = mem;
+    hdr->magic = SHMRING_MAGIC;
+    hdr->version = SHMRING_VERSION;
+    hdr->size = cap;
+    // The server sleeps until the first request.
+    atomic_store(&hdr->srvwait, SHMRING_WAITREQ);
+    // Earlier responses must reach the client before the reply.
+    flush_conn(conn, 0);
+    if (conn->closed) {
+        goto fail;
+    }
+    // The reply and the memfd are sent right away when the socket has room.
+    // Otherwise they are sent by the event loop once it's writable, before
+    // anything is read from the ring.
+    int sent = shm_handover(conn->fd, fd);
+    if (sent == -1 || 
+        (sent == 0 && connwrite(conn->ctx->qfd, conn->fd, conn, true) == -1))
+    {
+        conn->closed = true;
+        goto fail;
+    }
+    if (sent == 1) {
+        close(fd);
+        fd = -1;
+    }
+    struct shm *shm = xmalloc(sizeof(struct shm));
+    memset(shm, 0, sizeof(struct shm));
+    shm->hdr = hdr;
+    shm->mapsize = mapsize;
+    shm->size = cap;
+    shm->reqbuf = shmring_reqbuf(hdr);
+    shm->respbuf = shmring_reqbuf(hdr)+cap;
+    shm->incap = cap < SHMCHUNK ? cap : SHMCHUNK;
+    shm->in = xmalloc(shm->incap);
+    shm->sendfd = fd;
+    shm->next = conn->ctx->shmconns;
+    if (shm->next) {
+        shm->next->shm->prev = conn;
+    }
+    conn->ctx->shmconns = conn;
+    conn->shm = shm;
+    atomic_store_explicit(&conn->isshm, true, __ATOMIC_RELAXED);
+    atomic_fetch_add(&shmconns, 1);
+    return true;
+fail:
+    if (mem != MAP_FAILED) {
+        munmap(mem, mapsize);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    *err = "ERR failed to create shared memory ring";
+    return false;
+#endif
+}
+
+int net_conn_fd(struct net_conn *conn) {
+    return conn->fd;
+}
+
 int net_conn_setnonblock(struct net_conn *conn, bool set) {
     return setnonblock(conn->fd, set);
 }
@@ -1335,20 +2804,12 @@ ssize_t net_conn_write(struct net_conn *conn, const char *bytes, size_t nbytes){
 }
 
 
-// returns address for net_conn, allocates a new 
-const char *net_conn_addr(struct net_conn *conn) {
-#ifdef __EMSCRIPTEN__
-    return "wasm";
-#endif
-    if (conn->addr) {
-        return conn->addr;
-    }
-    char addrstr[512];
+static void peeraddr(int fd, char addrstr[], size_t size) {
     struct sockaddr_storage addr;
     socklen_t addr_len = sizeof(addr);
-    if (getpeername(conn->fd, (struct sockaddr *)&addr, &addr_len) == -1) {
-        strcpy(addrstr, "");
-        goto done;
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        snprintf(addrstr, size, "%s", "");
+        return;
     }
     char ipstr[INET6_ADDRSTRLEN];
     int port;
@@ -1361,15 +2822,25 @@ const char *net_conn_addr(struct net_conn *conn) {
         inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
         port = ntohs(s->sin6_port);
     } else if (addr.ss_family == AF_UNIX) {
-        strcpy(addrstr, "unixsocket");
-        goto done;
+        snprintf(addrstr, size, "%s", "unixsocket");
+        return;
     } else {
-        strcpy(addrstr, "");
-        goto done;
+        snprintf(addrstr, size, "%s", "");
+        return;
+    }
+    snprintf(addrstr, size, "%s:%d", ipstr, port);
+}
+
+// returns address for net_conn, allocates a new 
+const char *net_conn_addr(struct net_conn *conn) {
+#ifdef __EMSCRIPTEN__
+    return "wasm";
+#endif
+    if (conn->addr) {
+        return conn->addr;
     }
-    snprintf(addrstr, sizeof(addrstr), "%s:%d", ipstr, port);
-done:
-    (void)0;
+    char addrstr[512];
+    peeraddr(conn->fd, addrstr, sizeof(addrstr));
     size_t len = strlen(addrstr);
     conn->addr = xmalloc(len+1);
     memcpy(conn->addr, addrstr, len+1);
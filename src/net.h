@@ -55,6 +55,12 @@ struct net_opts {
     int maxconns;
     bool nowarmup;
     bool nouring;
+    const int *cpus; // pin each thread to a cpu (optional, nthreads entries)
+    bool sharednothing; // allow forwarding work between threads
+    int busypoll;       // usecs to keep polling for events after activity
+    bool busypollsock;  // also set SO_BUSY_POLL on tcp sockets
+    int idletimeout;    // close connections idle for secs, or zero
+    const int *listenfds; // inherited listeners (tcp, unix, tls), optional
     void *udata;
     void(*listening)(void *udata);
     void(*ready)(void *udata);
@@ -65,15 +71,40 @@ struct net_opts {
 };
 
 void net_main(struct net_opts *opts);
+void net_listeners(int fds[3]);
 
 size_t net_nconns(void);
 size_t net_tconns(void);
 size_t net_rconns(void);
+size_t net_shmconns(void);
+size_t net_idleconns(void);
 
 bool net_conn_bgwork(struct net_conn *conn, void (*work)(void *udata), 
     void (*done)(struct net_conn *conn, void *udata), void *udata);
+bool net_conn_iowork(struct net_conn *conn, void (*work)(void *udata), 
+    void (*done)(struct net_conn *conn, void *udata), void *udata);
 bool net_conn_bgworking(struct net_conn *conn);
+bool net_conn_forward(struct net_conn *conn, int thread, 
+    void (*work)(void *udata), void (*done)(struct net_conn *conn, void *udata),
+    void *udata);
+bool net_conn_park(struct net_conn *conn, 
+    void (*done)(struct net_conn *conn, void *udata), void *udata);
+void net_conn_unpark(struct net_conn *conn);
+int net_conn_thread(struct net_conn *conn);
 bool net_conn_istls(struct net_conn *conn);
+bool net_conn_isshm(struct net_conn *conn);
+bool net_conn_shmring(struct net_conn *conn, size_t size, const char **err);
+
+// Sockets that the data handler opens itself, such as connections to other
+// servers, can be polled by the qthread that runs the handler. The event is
+// called on that thread when the socket is readable, when it's writable and
+// writes were asked for, or when the deadline has passed.
+struct net_watch;
+struct net_watch *net_watch(int fd, void (*event)(void *udata), 
+    void *udata);
+void net_watch_write(struct net_watch *w, bool write);
+void net_watch_deadline(struct net_watch *w, int64_t deadline);
+void net_unwatch(struct net_watch *w);
 
 // Some stats are collected in the connection and summed in the event loop.
 void net_stat_cmd_get_incr(struct net_conn *conn);
@@ -81,12 +112,69 @@ void net_stat_cmd_set_incr(struct net_conn *conn);
 void net_stat_get_hits_incr(struct net_conn *conn);
 void net_stat_get_misses_incr(struct net_conn *conn);
 
+struct net_nodestats {
+    int threads;
+    size_t conns;
+    uint64_t cmd_get;
+    uint64_t cmd_set;
+    uint64_t get_hits;
+    uint64_t get_misses;
+};
+
+// Per numa node stats. Only available when threads are pinned.
+int net_nnodes(void);
+void net_nodestats(int node, struct net_nodestats *stats);
+
+// Per thread busy polling stats. Only collected when busy polling is on.
+struct net_pollstats {
+    uint64_t spin_ns;   // time spent checking for events without sleeping
+    uint64_t sleep_ns;  // time spent sleeping on events
+    uint64_t spin_hits; // checks that found events while spinning
+    uint64_t sleeps;    // times the thread went to sleep
+};
+
+int net_nthreads(void);
+void net_pollstats(int thread, struct net_pollstats *stats);
+
+// A receive buffer lets the next socket read go straight into the data
+// handler's own buffer, such as after a partial request. Whatever doesn't fit
+// is passed to the data callback as usual. The buffer must stay valid until
+// the next data callback, which takes the number of bytes that went into it.
+void net_conn_setrecvbuf(struct net_conn *conn, char *buf, size_t len);
+size_t net_conn_recvbuf_take(struct net_conn *conn);
+
+// Memory used by the data handler for the input of a connection, such as its
+// packet and argument buffers. It's included in the connection info.
+void net_conn_setinmem(struct net_conn *conn, size_t bytes);
+
+// Per connection info, for listing the clients.
+struct net_conninfo {
+    uint64_t id;
+    int fd;
+    int thread;
+    char addr[128];
+    int64_t age;    // ns since the connection was opened
+    int64_t idle;   // ns since the last event
+    size_t inmem;   // input buffer memory
+    size_t outmem;  // output buffer memory
+    size_t mem;     // total memory, including the connection itself
+    bool tls;
+    bool shm;
+};
+
+// Call iter for every open connection. The iter must not block, because the
+// owning thread can't open or close connections while it runs.
+void net_conns(void (*iter)(struct net_conninfo *info, void *udata),
+    void *udata);
+
 uint64_t stat_cmd_get(void);
 uint64_t stat_cmd_set(void);
 uint64_t stat_get_hits(void);
 uint64_t stat_get_misses(void);
+uint64_t stat_forwarded(void);
 
 // only use these from bgwork threads
+int net_conn_fd(struct net_conn *conn);
 int net_conn_setnonblock(struct net_conn *conn, bool set);
 ssize_t net_conn_read(struct net_conn *conn, char *bytes, size_t nbytes);
 ssize_t net_conn_write(struct net_conn *conn, const char *bytes, size_t nbytes);
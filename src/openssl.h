@@ -28,6 +28,7 @@
 #else
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define X509_FILETYPE_PEM       1
 #define X509_FILETYPE_ASN1      2
@@ -55,10 +56,20 @@
 #define SSL_ERROR_WANT_CLIENT_HELLO_CB 11
 #define SSL_ERROR_WANT_RETRY_VERIFY    12
 
+#define SSL_OP_ENABLE_KTLS              ((uint64_t)1 << 3)
+
+#define SSL_SESS_CACHE_SERVER           0x0002
+#define SSL_CTRL_SET_SESS_CACHE_SIZE    42
+#define SSL_CTRL_SET_SESS_CACHE_MODE    44
+
+#define BIO_CTRL_GET_KTLS_SEND          73
+#define BIO_CTRL_GET_KTLS_RECV          76
+
 typedef struct ssl_st SSL;
 typedef struct ssl_ctx_st SSL_CTX;
 typedef struct x509_store_ctx_st X509_STORE_CTX;
 typedef struct ssl_method_st SSL_METHOD;
+typedef struct bio_st BIO;
 
 const SSL_METHOD *TLS_server_method(void);
 const SSL_METHOD *TLS_client_method(void);
@@ -84,6 +95,17 @@ int SSL_CTX_use_certificate_file(SSL_CTX *ctx, const char *file, int type);
 int SSL_CTX_check_private_key(const SSL_CTX *ctx);
 int SSL_write(SSL *ssl, const void *buf, int num);
 int SSL_read(SSL *ssl, void *buf, int num);
+void SSL_set_accept_state(SSL *s);
+int SSL_do_handshake(SSL *s);
+int SSL_session_reused(const SSL *s);
+BIO *SSL_get_rbio(const SSL *s);
+BIO *SSL_get_wbio(const SSL *s);
+long BIO_ctrl(BIO *bp, int cmd, long larg, void *parg);
+long SSL_CTX_ctrl(SSL_CTX *ctx, int cmd, long larg, void *parg);
+uint64_t SSL_CTX_set_options(SSL_CTX *ctx, uint64_t op);
+int SSL_CTX_set_num_tickets(SSL_CTX *ctx, size_t num_tickets);
+int SSL_CTX_set_session_id_context(SSL_CTX *ctx, const unsigned char *sid_ctx,
+    unsigned int sid_ctx_len);
 
 #endif
 
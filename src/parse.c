@@ -21,16 +21,21 @@
 #include "util.h"
 
 __thread char parse_lasterr[1024] = "";
+__thread size_t parse_need = 0;
 
 const char *parse_lasterror(void) {
     return parse_lasterr;
 }
 
+size_t parse_lastneed(void) {
+    return parse_need;
+}
+
 ssize_t parse_resp(const char *bytes, size_t len, struct args *args);
 ssize_t parse_memcache(const char *data, size_t len, struct args *args,
     bool *noreply);
 ssize_t parse_http(const char *data, size_t len, struct args *args,
-    int *httpvers, bool *keepalive);
+    int *httpvers, bool *keepalive, struct http_chunked *chunkstate);
 ssize_t parse_resp_telnet(const char *bytes, size_t len, struct args *args);
 ssize_t parse_postgres(const char *data, size_t len, struct args *args,
     struct pg **pg);
@@ -103,11 +108,16 @@ static bool sniff_proto(const char *data, size_t len, int *proto) {
 // The keepalive param is an output param that is only set when the proto is
 // http. It's used to let the caller know to keep the connection alive for
 // another request.
+//
+// The chunked param is the state of an incomplete chunked http request,
+// which is kept by the caller along with the data. It must start zeroed.
 ssize_t parse_command(const void *data, size_t len, struct args *args, 
-    int *proto, bool *noreply, int *httpvers, bool *keepalive, struct pg **pg)
+    int *proto, bool *noreply, int *httpvers, bool *keepalive, struct pg **pg,
+    struct http_chunked *chunked)
 {
     args_clear(args);
     parse_lasterr[0] = '\0';
+    parse_need = 0;
     *httpvers = 0;
     *noreply = false;
     *keepalive = false;
@@ -133,7 +143,7 @@ ssize_t parse_command(const void *data, size_t len, struct args *args,
     } else if (*proto == PROTO_MEMCACHE) {
         return parse_memcache(data, len, args, noreply);
     } else if (*proto == PROTO_HTTP) {
-        return parse_http(data, len, args, httpvers, keepalive);
+        return parse_http(data, len, args, httpvers, keepalive, chunked);
     } else if (*proto == PROTO_POSTGRES) {
         return parse_postgres(data, len, args, pg);
     }
@@ -23,10 +23,28 @@
 
 const char *parse_lasterror(void);
 size_t parse_lastmc_n(void);
+
+// Returns the number of bytes that are known to be missing when the last
+// command was incomplete, such as the rest of a large value, or zero.
+size_t parse_lastneed(void);
+
+// How far the chunks of an incomplete HTTP request were read, so that the
+// next read of the same request continues from there. It's kept per client
+// and is zero between requests.
+struct http_chunked {
+    size_t pos;       // offset of the next line, from the start of the body
+    size_t bodylen;   // size of the chunks before it
+    bool trailers;    // the line is a trailer, the chunks are done
+};
+
 ssize_t parse_command(const void *data, size_t len, struct args *args, 
-    int *proto, bool *noreply, int *httpvers, bool *keepalive, struct pg **pg);
+    int *proto, bool *noreply, int *httpvers, bool *keepalive, struct pg **pg,
+    struct http_chunked *chunked);
 
 bool mc_valid_key(struct args *args, int i);
+int http_batch_next(const char *body, size_t len, bool framed, bool pair,
+    size_t *pos, const char **key, size_t *keylen, const char **val,
+    size_t *vallen);
 
 #define bytes_const_eq(data, len, str) \
     ((len) == sizeof(str)-1 && \
@@ -41,6 +59,7 @@ bool mc_valid_key(struct args *args, int i);
     args->bufs[(at)] = (struct buf){ 0 }
 
 extern __thread char parse_lasterr[1024];
+extern __thread size_t parse_need;
 
 #define parse_errorf(...) \
     snprintf(parse_lasterr, sizeof(parse_lasterr), __VA_ARGS__);
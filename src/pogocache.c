@@ -21,14 +21,35 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <sched.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include "pogocache.h"
 
+// Number parsing from util.c, which is not included because this file keeps
+// its own static copies of the other helpers.
+bool parse_i64(const char *data, size_t len, int64_t *x);
+bool parse_u64(const char *data, size_t len, uint64_t *x);
+
 #define MINLOADFACTOR_RH 55     // 55%
 #define MAXLOADFACTOR_RH 95     // 95%
 #define DEFLOADFACTOR    75     // 75%
 #define SHRINKAT         10     // 10%
 #define DEFSHARDS        4096   // default number of shards
 #define INITCAP          64     // intial number of buckets per shard
+#define LOCKSPINS        128    // lock spins before backing off
+#define LOCKBACKOFFS     8      // lock backoff rounds before parking
+#define DEFCOMPRESSMIN   1024   // default minimum size of compressed values
+#define MAXLOCATOR       32     // maximum size of a spilled value locator
+#define SPILLBATCH       64     // entries spilled each time a shard is locked
+#define LAYOUT           7      // version of the cache memory layout
+
+#define KIND_COUNTER     1      // entry_new value kinds, zero is a string
+#define KIND_UCOUNTER    2
+#define KIND_HASH        3
 
 // #define NOSIXPACK
 // #define DBGCHECKENTRY
@@ -59,11 +80,16 @@ static struct pogocache_total_opts deftotalopts = { 0 };
 static struct pogocache_size_opts defsizeopts = { 0 };
 static struct pogocache_sweep_opts defsweepopts = { 0 };
 static struct pogocache_clear_opts defclearopts = { 0 };
+static struct pogocache_invalidate_opts definvalidateopts = { 0 };
 static struct pogocache_store_opts defstoreopts = { 0 };
+static struct pogocache_incr_opts defincropts = { 0 };
+static struct pogocache_modify_opts defmodifyopts = { 0 };
 static struct pogocache_load_opts defloadopts = { 0 };
 static struct pogocache_delete_opts defdeleteopts = { 0 };
 static struct pogocache_iter_opts defiteropts = { 0 };
 static struct pogocache_sweep_poll_opts defsweeppollopts = { 0 };
+static struct pogocache_lockstats_opts deflockstatsopts = { 0 };
+static struct pogocache_spill_opts defspillopts = { 0 };
 
 static int64_t nanotime(struct timespec *ts) {
     int64_t x = ts->tv_sec;
@@ -298,16 +324,41 @@ struct pgctx {
         uint32_t flags, uint64_t cas, void *udata);
     void (*notify)(int shard, int64_t time, struct pogocache_entry *new_entry,
         struct pogocache_entry *old_entry, void *udata);
+    size_t (*compress)(const void *src, size_t srclen, void *dst,
+        size_t dstcap, void *udata);
+    bool (*decompress)(const void *src, size_t srclen, void *dst,
+        size_t dstlen, void *udata);
+    size_t compressmin;
+    size_t (*spill)(const void *value, size_t valuelen, void *locator,
+        size_t cap, void *udata);
+    bool (*unspill)(const void *locator, size_t loclen, void *dst,
+        size_t dstlen, void *udata);
+    void (*spillfree)(const void *locator, size_t loclen, void *udata);
     bool usenotify;
     bool usecas;
     bool nosixpack;
     bool noevict;
     bool allowshrink;
     bool usethreadbatch;
+    bool lockstats;
     int nshards;
     double loadfactor;
     double shrinkfactor;
     uint64_t seed;
+    uint32_t layout;      // memory layout, for attaching
+    bool hascompressed;   // entries may need the decompress callback
+    bool hasspilled;      // entries may need the unspill callback
+};
+
+// Compression stats, kept per shard so that threads working on different
+// shards don't contend on the same counters. The sizes of the compressed
+// values in the cache are tracked by the shard's map.
+struct compstats {
+    atomic_uint_fast64_t ncompressed;
+    atomic_uint_fast64_t nrejected;
+    atomic_uint_fast64_t ninflated;
+    atomic_uint_fast64_t compressns;
+    atomic_uint_fast64_t inflatens;
 };
 
 // The entry structure is a simple allocation with all the fields, being 
@@ -316,6 +367,9 @@ struct pgctx {
 // The data field contains the variable sized data, including key, value, 
 // expiration, flags, etc. The size of the entire allocation of the entry is
 // stored as a prefix in the data field, and it can be 1, 2, 4, or 8 bytes.
+// A compressed value is stored as the varint length of the original value
+// followed by the compressed bytes. A spilled value is stored as the varint
+// length of the value on secondary storage followed by its locator.
 struct entry {
     int64_t time;           // entry timestamp
     atomic_int rc;          // reference counter
@@ -323,6 +377,12 @@ struct entry {
     unsigned has_expires:1; // has 64-bit expiration
     unsigned has_flags:1;   // has 32-bit flags
     unsigned has_sixpack:1; // key is sixpack encoded
+    unsigned has_compressed:1; // value is compressed
+    unsigned has_spilled:1; // value is on secondary storage
+    unsigned has_refresh:1; // has 64-bit grace and delta, see entry_refresh
+    unsigned has_counter:1; // value is a 64-bit integer, see pogocache_incr
+    unsigned has_unsigned:1; // counter value is unsigned
+    unsigned has_hash:1;    // value is an encoded hash, see pogocache_modify
     uint8_t data[];
 };
 
@@ -372,6 +432,65 @@ static bool entry_alive(struct entry *entry, int64_t now) {
     return entry_alive_exp(entry_expires(entry), now);
 }
 
+// Returns the grace period and the recompute time of the entry.
+// The grace period is included in the entry expiration.
+static void entry_refresh(const struct entry *entry, int64_t *grace,
+    int64_t *delta, struct pgctx *ctx)
+{
+    if (!entry->has_refresh) {
+        *grace = 0;
+        *delta = 0;
+        return;
+    }
+    const uint8_t *p = entry->data;
+    p += 1<<entry->memszsz;           // memsize
+    p += (entry->has_expires&1)<<3;   // expires
+    p += (entry->has_flags&1)<<2;     // flags
+    p += (ctx->usecas&1)<<3;          // cas
+    memcpy(grace, p, 8);
+    memcpy(delta, p+8, 8);
+}
+
+// Returns the expiration as seen by the user, which excludes the grace
+// period.
+static int64_t entry_soft_expires(const struct entry *entry, int64_t expires,
+    struct pgctx *ctx)
+{
+    if (!entry->has_refresh || expires <= 0) {
+        return expires;
+    }
+    int64_t grace, delta;
+    entry_refresh(entry, &grace, &delta, ctx);
+    return expires-grace;
+}
+
+// Returns the value kind of the entry, as used by entry_new.
+static int entry_kind(const struct entry *entry) {
+    if (entry->has_hash) {
+        return KIND_HASH;
+    }
+    if (entry->has_counter) {
+        return entry->has_unsigned ? KIND_UCOUNTER : KIND_COUNTER;
+    }
+    return 0;
+}
+
+static int kind_type(int kind) {
+    return kind == KIND_HASH ? POGOCACHE_TYPE_HASH : POGOCACHE_TYPE_STRING;
+}
+
+// Overwrites the cas of the entry, if cas is in use.
+static void entry_setcas(struct entry *entry, uint64_t cas, struct pgctx *ctx)
+{
+    if (ctx->usecas) {
+        uint8_t *p = entry->data;
+        p += 1<<entry->memszsz;           // memsize
+        p += (entry->has_expires&1)<<3;   // expires
+        p += (entry->has_flags&1)<<2;     // flags
+        memcpy(p, &cas, 8);               // cas
+    }
+}
+
 static uint64_t entry_cas(const struct entry *entry, struct pgctx *ctx) {
     if (!ctx->usecas) {
         return 0;
@@ -395,6 +514,7 @@ static const char *entry_rawkey(const struct entry *entry, size_t *keylen_out,
     p += (entry->has_expires&1)<<3;   // expires
     p += (entry->has_flags&1)<<2;     // flags
     p += (ctx->usecas&1)<<3;          // cas
+    p += (entry->has_refresh&1)<<4;   // grace and delta
     p += varint_read_u64(p, &keylen); // keylen
     *keylen_out = keylen;
     return (const char*)p;
@@ -469,6 +589,9 @@ static size_t entry_extract(const struct entry *entry, const char **key,
             *cas = 0;
         }
     }
+    if (entry->has_refresh) {
+        p += 16; // grace and delta
+    }
     uint64_t x;
     p += varint_read_u64(p, &x); // keylen
     if (key) {
@@ -487,10 +610,186 @@ static size_t entry_extract(const struct entry *entry, const char **key,
     return memsize;
 }
 
+static void compstat_add(atomic_uint_fast64_t *stat, uint64_t n) {
+    atomic_fetch_add_explicit(stat, n, __ATOMIC_RELAXED);
+}
+
+// Returns the locator of a spilled value and the length of the stored value.
+static const char *entry_locator(const struct entry *entry, size_t *storedlen,
+    size_t *loclen, struct pgctx *ctx)
+{
+    size_t vallen;
+    const char *val = entry_value(entry, &vallen, ctx);
+    uint64_t x;
+    int n = varint_read_u64(val, &x);
+    *storedlen = x;
+    *loclen = vallen-n;
+    return val+n;
+}
+
+// Reads a spilled value back from secondary storage into a new allocation.
+static char *entry_unspill(const struct entry *entry, size_t *storedlen,
+    struct pgctx *ctx)
+{
+    size_t loclen;
+    const char *loc = entry_locator(entry, storedlen, &loclen, ctx);
+    char *stored = ctx->malloc(*storedlen ? *storedlen : 1);
+    if (!stored) {
+        return 0;
+    }
+    if (!ctx->unspill(loc, loclen, stored, *storedlen, ctx->udata)) {
+        ctx->free(stored);
+        return 0;
+    }
+    return stored;
+}
+
+// Inflates the value of a compressed or spilled entry. The 'val' and 'vallen'
+// params must be the stored value from entry_extract, and they are replaced
+// with the original value, which is written to 'tmp'. The caller must free
+// the 'tmp' using ctx->free. Values of other entries are left as-is.
+// Returns false if the value cannot be inflated due to no memory, or because
+// a spilled value is no longer available.
+static bool entry_inflate(const struct entry *entry, const char **val,
+    size_t *vallen, char **tmp, struct compstats *stats, struct pgctx *ctx)
+{
+    *tmp = 0;
+    if (entry->has_counter) {
+        // Counters are rendered as decimal strings.
+        uint64_t x;
+        memcpy(&x, *val, 8);
+        char *str = ctx->malloc(24);
+        if (!str) {
+            return false;
+        }
+        if (entry->has_unsigned) {
+            *vallen = snprintf(str, 24, "%" PRIu64, x);
+        } else {
+            *vallen = snprintf(str, 24, "%" PRId64, (int64_t)x);
+        }
+        *val = str;
+        *tmp = str;
+        return true;
+    }
+    if (!entry->has_compressed && !entry->has_spilled) {
+        return true;
+    }
+    char *spilled = 0;
+    if (entry->has_spilled) {
+        spilled = entry_unspill(entry, vallen, ctx);
+        if (!spilled) {
+            return false;
+        }
+        *val = spilled;
+        if (!entry->has_compressed) {
+            *tmp = spilled;
+            return true;
+        }
+    }
+    uint64_t rawlen;
+    int n = varint_read_u64(*val, &rawlen);
+    char *raw = ctx->malloc(rawlen ? rawlen : 1);
+    if (!raw) {
+        if (spilled) {
+            ctx->free(spilled);
+        }
+        return false;
+    }
+    int64_t start = getnow();
+    bool ok = ctx->decompress(*val+n, *vallen-n, raw, rawlen, ctx->udata);
+    if (spilled) {
+        ctx->free(spilled);
+    }
+    if (!ok) {
+        ctx->free(raw);
+        return false;
+    }
+    compstat_add(&stats->inflatens, getnow()-start);
+    compstat_add(&stats->ninflated, 1);
+    *val = raw;
+    *vallen = rawlen;
+    *tmp = raw;
+    return true;
+}
+
+// Compresses the value into a new allocation, if possible. Returns the
+// compressed value, which is prefixed with the varint length of the original
+// value, or null if the value should be stored uncompressed.
+static char *value_compress(const char *val, size_t vallen, size_t *complen,
+    struct compstats *stats, struct pgctx *ctx)
+{
+    if (!ctx->compress || vallen < ctx->compressmin) {
+        return 0;
+    }
+    uint8_t rawlenbuf[10];
+    size_t nrawlen = varint_write_u64(rawlenbuf, vallen);
+    if (vallen <= nrawlen+1) {
+        return 0;
+    }
+    // Only keep the compressed value when it's actually smaller.
+    size_t dstcap = vallen-nrawlen-1;
+    char *comp = ctx->malloc(nrawlen+dstcap);
+    if (!comp) {
+        return 0;
+    }
+    int64_t start = getnow();
+    size_t n = ctx->compress(val, vallen, comp+nrawlen, dstcap, ctx->udata);
+    compstat_add(&stats->compressns, getnow()-start);
+    if (n == 0 || n > dstcap) {
+        compstat_add(&stats->nrejected, 1);
+        ctx->free(comp);
+        return 0;
+    }
+    memcpy(comp, rawlenbuf, nrawlen);
+    *complen = nrawlen+n;
+    return comp;
+}
+
+// Adds the memory size field to the size of an entry allocation and returns
+// the memszsz for the entry.
+static int entry_memszsz(size_t *size) {
+    // Calculate the number of bytes needed to store the size of the entire
+    // allocation.
+    if (*size <= 0xFF-1) {
+        *size += 1;
+        return 0;
+    } else if (*size <= 0xFFFF-2) {
+        *size += 2;
+        return 1;
+    } else if (*size <= 0xFFFFFFFF-4) {
+        *size += 4;
+        return 2;
+    } else {
+        *size += 8;
+        return 3;
+    }
+}
+
+static uint8_t *write_memsize(uint8_t *p, int memszsz, size_t size) {
+    if (memszsz == 0) {
+        *p = size;
+        p++;
+    } else if (memszsz == 1) {
+        uint16_t x = size;
+        memcpy(p, &x, 2);
+        p += 2;
+    } else if (memszsz == 2) {
+        uint32_t x = size;
+        memcpy(p, &x, 4);
+        p += 4;
+    } else {
+        uint64_t x = size;
+        memcpy(p, &x, 8);
+        p += 8;
+    }
+    return p;
+}
+
 // The 'cas' param should always be set to zero unless loading from disk.
 // Setting to zero will set a new unique cas to the entry.
 static struct entry *entry_new(const char *key, size_t keylen, const char *val,
     size_t vallen, int64_t expires, uint32_t flags, uint64_t cas,
+    int64_t grace, int64_t delta, int kind, struct compstats *stats,
     struct pgctx *ctx)
 {
 #ifdef NOSIXPACK
@@ -522,6 +821,10 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
     if (ctx->usecas) {
         prefixlen += 8;
     }
+    bool has_refresh = expires > 0 && (grace > 0 || delta > 0);
+    if (has_refresh) {
+        prefixlen += 16;
+    }
     bool has_sixpack = 0;
     char buf[128];
     if (usesixpack && keylen <= 128) {
@@ -533,28 +836,20 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
         }
     }
     size_t nkeylen = varint_write_u64(keylenbuf, keylen);
+    char *comp = kind ? 0 : value_compress(val, vallen, &vallen, stats, ctx);
+    if (comp) {
+        val = comp;
+    }
     struct entry *entry_out = 0;
     size_t size = sizeof(struct entry)+prefixlen+nkeylen+keylen+vallen;
-    // Calculate the number of bytes needed to store the size of the entire
-    // allocation.
-    int memszsz;
-    if (size <= 0xFF-1) {
-        memszsz = 0;
-        size += 1;
-    } else if (size <= 0xFFFF-2) {
-        memszsz = 1;
-        size += 2;
-    } else if (size <= 0xFFFFFFFF-4) {
-        memszsz = 2;
-        size += 4;
-    } else {
-       memszsz = 3;
-       size += 8;
-    }
+    int memszsz = entry_memszsz(&size);
     // printf("malloc=%p size=%zu, ctx=%p\n", ctx->malloc, size, ctx);
     void *mem = ctx->malloc(size);
     struct entry *entry = mem;
     if (!entry) {
+        if (comp) {
+            ctx->free(comp);
+        }
         return 0;
     }
     entry->time = 0;
@@ -563,23 +858,13 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
     entry->has_expires = expires > 0;
     entry->has_flags = flags > 0;
     entry->has_sixpack = has_sixpack;
-    uint8_t *p = (void*)entry->data;
-    if (memszsz == 0) {
-        *p = size;
-        p++;
-    } else if (memszsz == 1) {
-        uint16_t x = size;
-        memcpy(p, &x, 2);
-        p += 2;
-    } else if (memszsz == 2) {
-        uint32_t x = size;
-        memcpy(p, &x, 4);
-        p += 4;
-    } else {
-        uint64_t x = size;
-        memcpy(p, &x, 8);
-        p += 8;
-    }
+    entry->has_compressed = comp != 0;
+    entry->has_spilled = 0;
+    entry->has_refresh = has_refresh;
+    entry->has_counter = kind == KIND_COUNTER || kind == KIND_UCOUNTER;
+    entry->has_unsigned = kind == KIND_UCOUNTER;
+    entry->has_hash = kind == KIND_HASH;
+    uint8_t *p = write_memsize((void*)entry->data, memszsz, size);
     if (expires > 0) {
         memcpy(p, &expires, 8);
         p += 8;
@@ -592,12 +877,22 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
         memcpy(p, &cas, 8);
         p += 8;
     }
+    if (has_refresh) {
+        memcpy(p, &grace, 8);
+        memcpy(p+8, &delta, 8);
+        p += 16;
+    }
     memcpy(p, keylenbuf, nkeylen);
     p += nkeylen;
     memcpy(p, key, keylen);
     p += keylen;
     memcpy(p, val, vallen);
     p += vallen;
+    if (comp) {
+        ctx->free(comp);
+        ctx->hascompressed = true;
+        compstat_add(&stats->ncompressed, 1);
+    }
     entry_out = entry;
 #ifdef DBGCHECKENTRY
     // check the key
@@ -609,6 +904,16 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
     char buf1[256];
     entry_extract(entry_out, &key2, &keylen2, buf1, &val2, &vallen2, &expires2,
         &flags2, &cas2, ctx);
+    const char *val3;
+    size_t vallen3;
+    val3 = entry_value(entry, &vallen3, ctx);
+    assert(val3 == val2);
+    char *tmp2 = 0;
+    struct compstats dbgstats = { 0 };
+    bool inflated = entry->has_counter ? true : 
+        entry_inflate(entry_out, &val2, &vallen2, &tmp2, &dbgstats, ctx);
+    assert(inflated);
+    (void)inflated;
     assert(expires2 == oexpires);
     assert(flags2 == oflags);
     if (ctx->usecas) {
@@ -624,12 +929,9 @@ static struct entry *entry_new(const char *key, size_t keylen, const char *val,
     key2 = entry_key(entry, &keylen2, buf1, ctx);
     assert(keylen2 == okeylen);
     assert(memcmp(key2, okey, okeylen) == 0);
-    const char *val3;
-    size_t vallen3;
-    val3 = entry_value(entry, &vallen3, ctx);
-    assert(val3 == val2);
-    assert(vallen3 == ovallen);
-    assert(memcmp(val3, oval, ovallen) == 0);
+    if (tmp2) {
+        ctx->free(tmp2);
+    }
 
 #endif
     return entry_out;
@@ -639,9 +941,56 @@ static void entry_free(struct entry *entry, struct pgctx *ctx) {
     if (atomic_fetch_sub(&entry->rc, 1) > 1) {
         return;
     }
+    if (entry->has_spilled) {
+        if (ctx->spillfree) {
+            size_t storedlen, loclen;
+            const char *loc = entry_locator(entry, &storedlen, &loclen, ctx);
+            ctx->spillfree(loc, loclen, ctx->udata);
+        }
+    }
     ctx->free(entry);
 }
 
+// Returns a copy of the entry with the value replaced by the locator of
+// where the stored value was spilled.
+static struct entry *entry_spill(const struct entry *entry, size_t storedlen,
+    const char *loc, size_t loclen, struct pgctx *ctx)
+{
+    size_t vallen;
+    const uint8_t *val = (uint8_t*)entry_value(entry, &vallen, ctx);
+    // The fields following the memory size field, up to and including the key.
+    const uint8_t *fields = entry->data+(1<<entry->memszsz);
+    size_t fieldslen = val-fields;
+    uint8_t lenbuf[10];
+    size_t nlen = varint_write_u64(lenbuf, storedlen);
+    size_t size = sizeof(struct entry)+fieldslen+nlen+loclen;
+    int memszsz = entry_memszsz(&size);
+    struct entry *entry2 = ctx->malloc(size);
+    if (!entry2) {
+        return 0;
+    }
+    entry2->time = entry->time;
+    atomic_init(&entry2->rc, 1);
+    entry2->memszsz = memszsz;
+    entry2->has_expires = entry->has_expires;
+    entry2->has_flags = entry->has_flags;
+    entry2->has_sixpack = entry->has_sixpack;
+    entry2->has_compressed = entry->has_compressed;
+    entry2->has_refresh = entry->has_refresh;
+    entry2->has_counter = 0;
+    entry2->has_unsigned = 0;
+    entry2->has_hash = entry->has_hash;
+    entry2->has_spilled = 1;
+    ctx->hasspilled = true;
+    uint8_t *p = write_memsize(entry2->data, memszsz, size);
+    memcpy(p, fields, fieldslen);
+    p += fieldslen;
+    memcpy(p, lenbuf, nlen);
+    p += nlen;
+    memcpy(p, loc, loclen);
+    return entry2;
+}
+
 static struct entry *entry_clone(struct entry *entry) {
     atomic_fetch_add(&entry->rc, 1);
     return entry;
@@ -694,18 +1043,178 @@ struct map {
     struct bucket *buckets;
     uint64_t total;  // current entry count
     size_t entsize;  // memory size of all entries
+    size_t rawsize;  // original size of compressed values in memory
+    size_t compsize; // stored size of compressed values in memory
+};
+
+// Adds the sizes of the entry to the map totals, or removes them when 'sign'
+// is negative.
+static void map_account(struct map *map, const struct entry *entry, int sign,
+    struct pgctx *ctx)
+{
+    size_t memsize = entry_memsize(entry);
+    size_t rawlen = 0;
+    size_t vallen = 0;
+    if (entry->has_compressed && !entry->has_spilled) {
+        const char *val = entry_value(entry, &vallen, ctx);
+        uint64_t x;
+        varint_read_u64(val, &x);
+        rawlen = x;
+    }
+    if (sign < 0) {
+        map->entsize -= memsize;
+        map->rawsize -= rawlen;
+        map->compsize -= vallen;
+    } else {
+        map->entsize += memsize;
+        map->rawsize += rawlen;
+        map->compsize += vallen;
+    }
+}
+
+// A lease gives one caller the right to fill a missing entry.
+// Leases are keyed by a copy of the key. The hash is only for skipping
+// mismatches quickly.
+struct lease {
+    uint32_t hash;
+    size_t keylen;
+    char *key;
+    int64_t expires;
+    uint64_t token;
+};
+
+// An invalidation of the entries with a key prefix that were stored before
+// a point in time, see pogocache_invalidate.
+struct inval {
+    int64_t time;
+    size_t prefixlen;
+    char *prefix;
 };
 
 struct shard {
     atomic_uintptr_t lock; // spinlock (batch pointer)
+    atomic_uint waiters;   // number of threads parked on the lock
+    atomic_uint seq;       // futex word, changes when parked threads are woken
+    struct compstats comp; // compression stats
+    // lock stats, only updated by the lock holder and only when enabled
+    atomic_uint_fast64_t nacquired;  // number of acquisitions
+    atomic_uint_fast64_t ncontended; // number of contended acquisitions
+    atomic_uint_fast64_t waitns;     // total time waiting on contention
     uint64_t cas;          // compare and store value
     struct map map;        // robinhood hashmap
+    struct lease *leases;  // outstanding leases, see pogocache_load_opts
+    int nleases;
+    int leasescap;
+    struct inval *invals;  // pending invalidations, until the next sweep
+    int ninvals;
+    int invalscap;
+    int64_t invaltime;     // time of the newest invalidation
     // for batch linked list only
     struct shard *next;
 };
 
+// Returns true if the entry was invalidated by a key prefix. This is checked
+// before the entry time is updated, so an entry that's older than an
+// invalidation of its prefix was always stored before it.
+static bool entry_invalid(struct shard *shard, struct entry *entry,
+    struct pgctx *ctx)
+{
+    if (shard->ninvals == 0 || entry_time(entry) >= shard->invaltime) {
+        return false;
+    }
+    char buf[128];
+    size_t keylen;
+    const char *key = entry_key(entry, &keylen, buf, ctx);
+    for (int i = 0; i < shard->ninvals; i++) {
+        struct inval *inval = &shard->invals[i];
+        if (entry_time(entry) < inval->time && keylen >= inval->prefixlen &&
+            memcmp(key, inval->prefix, inval->prefixlen) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the entry has not expired and was not invalidated.
+static bool entry_alive_in(struct shard *shard, struct entry *entry,
+    int64_t now, struct pgctx *ctx)
+{
+    return entry_alive(entry, now) && !entry_invalid(shard, entry, ctx);
+}
+
+static void lease_drop(struct shard *shard, int i, struct pgctx *ctx) {
+    ctx->free(shard->leases[i].key);
+    shard->leases[i] = shard->leases[--shard->nleases];
+}
+
+static void leases_clear(struct shard *shard, struct pgctx *ctx) {
+    while (shard->nleases > 0) {
+        lease_drop(shard, shard->nleases-1, ctx);
+    }
+}
+
+// Drop the invalidations made at or before a point in time. These no longer
+// match any entry once the shard has been swept with that time.
+static void invals_clear(struct shard *shard, int64_t time, struct pgctx *ctx)
+{
+    int i = 0;
+    shard->invaltime = 0;
+    while (i < shard->ninvals) {
+        struct inval *inval = &shard->invals[i];
+        if (inval->time <= time) {
+            ctx->free(inval->prefix);
+            *inval = shard->invals[--shard->ninvals];
+            continue;
+        }
+        if (inval->time > shard->invaltime) {
+            shard->invaltime = inval->time;
+        }
+        i++;
+    }
+}
+
+// Add an invalidation for a key prefix. Returns false if out of memory.
+static bool invals_add(struct shard *shard, const char *prefix,
+    size_t prefixlen, int64_t time, struct pgctx *ctx)
+{
+    if (shard->ninvals == shard->invalscap) {
+        int cap = shard->invalscap == 0 ? 4 : shard->invalscap*2;
+        struct inval *invals = ctx->malloc(cap*sizeof(struct inval));
+        if (!invals) {
+            return false;
+        }
+        if (shard->invals) {
+            memcpy(invals, shard->invals, shard->ninvals*sizeof(struct inval));
+            ctx->free(shard->invals);
+        }
+        shard->invals = invals;
+        shard->invalscap = cap;
+    }
+    char *copy = ctx->malloc(prefixlen+1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, prefix, prefixlen);
+    copy[prefixlen] = '\0';
+    shard->invals[shard->ninvals++] = (struct inval) {
+        .time = time,
+        .prefixlen = prefixlen,
+        .prefix = copy,
+    };
+    if (time > shard->invaltime) {
+        shard->invaltime = time;
+    }
+    return true;
+}
+
 static void lock_init(struct shard *shard) {
     atomic_init(&shard->lock, 0);
+    atomic_init(&shard->waiters, 0);
+    atomic_init(&shard->seq, 0);
+    atomic_init(&shard->nacquired, 0);
+    atomic_init(&shard->ncontended, 0);
+    atomic_init(&shard->waitns, 0);
 }
 
 struct batch {
@@ -723,6 +1232,105 @@ struct pogocache {
     struct shard shards[];
 };
 
+// Returns a shard of the cache that the context belongs to.
+static struct shard *ctx_shard(struct pgctx *ctx, int shardidx) {
+    struct pogocache *cache = (struct pogocache*)((char*)ctx-
+        offsetof(struct pogocache, ctx));
+    return &cache->shards[shardidx];
+}
+
+// Only the lock holder updates the stats, so there's no need for an atomic
+// read-modify-write.
+static void lockstat_add(atomic_uint_fast64_t *stat, uint64_t n) {
+    atomic_store_explicit(stat, atomic_load_explicit(stat, __ATOMIC_RELAXED)+n,
+        __ATOMIC_RELAXED);
+}
+
+// Park the calling thread until the shard lock is released.
+// The waiter count and the lock are both seq_cst, as in unlock, so either
+// this thread sees the lock released and doesn't wait, or the unlock sees
+// this thread as a waiter and bumps seq to wake it.
+static void lock_park(struct shard *shard) {
+#ifdef __linux__
+    unsigned seq = atomic_load_explicit(&shard->seq, __ATOMIC_SEQ_CST);
+    atomic_fetch_add_explicit(&shard->waiters, 1, __ATOMIC_SEQ_CST);
+    if (atomic_load_explicit(&shard->lock, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, &shard->seq, FUTEX_WAIT_PRIVATE, seq, 0, 0, 0);
+    }
+    atomic_fetch_sub_explicit(&shard->waiters, 1, __ATOMIC_RELAXED);
+#else
+    (void)shard;
+    sched_yield();
+#endif
+}
+
+static void unlock(struct shard *shard) {
+#ifdef __linux__
+    atomic_store_explicit(&shard->lock, 0, __ATOMIC_SEQ_CST);
+    if (atomic_load_explicit(&shard->waiters, __ATOMIC_SEQ_CST) > 0) {
+        atomic_fetch_add_explicit(&shard->seq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &shard->seq, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    }
+#else
+    atomic_store_explicit(&shard->lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+// Wait on a contended lock. Spin briefly, then back off exponentially, and
+// finally park the thread until the lock is released.
+static void lock_wait(struct shard *shard, int *tries, struct pgctx *ctx) {
+    if (ctx->yield) {
+        ctx->yield(ctx->udata);
+        return;
+    }
+    int n = (*tries)++;
+    if (n < LOCKSPINS) {
+        cpu_yield();
+    } else if (n < LOCKSPINS+LOCKBACKOFFS) {
+        int spins = 1<<(n-LOCKSPINS+4);
+        for (int i = 0; i < spins; i++) {
+            cpu_yield();
+        }
+    } else {
+        lock_park(shard);
+    }
+}
+
+static void lock(struct batch *batch, struct shard *shard, struct pgctx *ctx) {
+    uintptr_t me = batch ? (uintptr_t)(void*)batch : UINTPTR_MAX;
+    int tries = 0;
+    int64_t start = 0;
+    while (1) {
+        uintptr_t val = 0;
+        if (atomic_compare_exchange_weak_explicit(&shard->lock, &val, me,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            if (batch) {
+                shard->next = batch->shard;
+                batch->shard = shard;
+            }
+            break;
+        }
+        if (batch && val == me) {
+            // already held by this batch
+            return;
+        }
+        if (val != 0) {
+            if (tries == 0 && ctx->lockstats) {
+                start = gettime();
+            }
+            lock_wait(shard, &tries, ctx);
+        }
+    }
+    if (ctx->lockstats) {
+        lockstat_add(&shard->nacquired, 1);
+        if (tries > 0) {
+            lockstat_add(&shard->ncontended, 1);
+            lockstat_add(&shard->waitns, gettime()-start);
+        }
+    }
+}
+
 static struct entry *get_entry(struct bucket *bucket) {
     return load_ptr(bucket->entry);
 }
@@ -857,6 +1465,8 @@ static bool resize(struct map *map, size_t new_cap, struct pgctx *ctx) {
         }
     }
     size_t org_entsize = map->entsize;
+    size_t org_rawsize = map->rawsize;
+    size_t org_compsize = map->compsize;
     uint64_t org_total = map->total;
     int org_cap = map->cap;
     int org_count = map->count;
@@ -865,6 +1475,8 @@ static bool resize(struct map *map, size_t new_cap, struct pgctx *ctx) {
     map->cap = org_cap;
     map->count = org_count;
     map->entsize = org_entsize;
+    map->rawsize = org_rawsize;
+    map->compsize = org_compsize;
     map->total = org_total;
     return true;
 }
@@ -879,7 +1491,7 @@ static bool map_insert(struct map *map, struct entry *entry, uint32_t hash,
             return false;
         }
     }
-    map->entsize += entry_memsize(entry);
+    map_account(map, entry, 1, ctx);
     struct bucket ebkt;
     set_entry(&ebkt, entry);
     set_hash(&ebkt, hash);
@@ -900,7 +1512,7 @@ static bool map_insert(struct map *map, struct entry *entry, uint32_t hash,
         {
             // replaced
             *old = get_entry(&map->buckets[i]);
-            map->entsize -= entry_memsize(*old);
+            map_account(map, *old, -1, ctx);
             set_entry(&map->buckets[i], get_entry(&ebkt));
             return true;
         }
@@ -988,10 +1600,12 @@ static void tryshrink(struct map *map, struct pgctx *ctx) {
 }
 
 // Delete an entry at bucket position. Not called directly
-static struct entry *delentry_at_bkt(struct map *map, size_t i) {
+static struct entry *delentry_at_bkt(struct map *map, size_t i,
+    struct pgctx *ctx)
+{
     struct entry *old = get_entry(&map->buckets[i]);
     assert(old);
-    map->entsize -= entry_memsize(old);
+    map_account(map, old, -1, ctx);
     delbkt(map, i);
     return old;
 }
@@ -1009,7 +1623,7 @@ static struct entry *map_delete(struct map *map, const char *key,
             return 0;
         }
         if (bucket_eq(map, i, key, keylen, hash, ctx)) {
-            return delentry_at_bkt(map, i);
+            return delentry_at_bkt(map, i, ctx);
         }
         i = (i + 1) & map->mask;
     }
@@ -1077,8 +1691,20 @@ static void notify(int shardidx, enum notify kind, struct entry *new,
         uint64_t cas = 0;
         entry_extract(old, &key, &keylen, buf, &val, &vallen, &expires, 
             &flags, &cas, ctx);
+        expires = entry_soft_expires(old, expires, ctx);
+        char *tmp;
+        if (!entry_inflate(old, &val, &vallen, &tmp, 
+            &ctx_shard(ctx, shardidx)->comp, ctx))
+        {
+            // No memory to inflate the value.
+            val = 0;
+            vallen = 0;
+        }
         ctx->evicted(shardidx, evict_reason, now, key, keylen, val,
             vallen, expires, flags, cas, ctx->udata);
+        if (tmp) {
+            ctx->free(tmp);
+        }
     }
 }
 
@@ -1112,7 +1738,7 @@ static void auto_evict_entry(struct shard *shard, int shardidx, uint32_t hash,
             continue;
         }
         struct entry *entry = get_entry(bkt);
-        if (!entry_alive(entry, now)) {
+        if (!entry_alive_in(shard, entry, now, ctx)) {
             // Entry has expired. Evict this one and return immediately.
             evict_entry(shard, shardidx, entry, now, NOTIFY_EXPIRED, ctx);
             return;
@@ -1136,6 +1762,16 @@ static void auto_evict_entry(struct shard *shard, int shardidx, uint32_t hash,
 }
 
 static void shard_deinit(struct shard *shard, struct pgctx *ctx) {
+    if (shard->leases) {
+        leases_clear(shard, ctx);
+        ctx->free(shard->leases);
+        shard->leases = 0;
+    }
+    if (shard->invals) {
+        invals_clear(shard, INT64_MAX, ctx);
+        ctx->free(shard->invals);
+        shard->invals = 0;
+    }
     struct map *map = &shard->map;
     if (!map->buckets) {
         return;
@@ -1198,7 +1834,19 @@ static void opts_to_ctx(int nshards, struct pogocache_opts *opts,
         loadfactor = opts->loadfactor;
         ctx->allowshrink = opts->allowshrink;
         ctx->usethreadbatch = opts->usethreadbatch;
+        ctx->lockstats = opts->lockstats;
         ctx->usenotify = ctx->notify || ctx->evicted;
+        if (opts->compress && opts->decompress) {
+            ctx->compress = opts->compress;
+            ctx->decompress = opts->decompress;
+            ctx->compressmin = opts->compressmin > 0 ? opts->compressmin :
+                DEFCOMPRESSMIN;
+        }
+        if (opts->spill && opts->unspill) {
+            ctx->spill = opts->spill;
+            ctx->unspill = opts->unspill;
+            ctx->spillfree = opts->spillfree;
+        }
     }
     // make loadfactor a floating point
     loadfactor = loadfactor == 0 ? DEFLOADFACTOR :
@@ -1230,6 +1878,7 @@ struct pogocache *pogocache_new(struct pogocache_opts *opts) {
     opts_to_ctx(shards, opts, ctx);
     ctx->malloc = _malloc;
     ctx->free = _free;
+    ctx->layout = LAYOUT;
     for (int i = 0; i < ctx->nshards; i++) {
         if (!shard_init(&cache->shards[i], ctx)) {
             // nomem
@@ -1240,9 +1889,94 @@ struct pogocache *pogocache_new(struct pogocache_opts *opts) {
     return cache;
 }
 
-static int shard_index(struct pogocache *cache, uint64_t hash) {
-    return (hash>>32)%cache->ctx.nshards;
-}
+/// Returns an existing cache that was created by pogocache_new in memory that
+/// outlives the process, such as a shared memory heap, and was detached by
+/// the previous process using pogocache_detach.
+/// The callbacks and tuning options are taken from 'opts', while the number
+/// of shards, the hash seed, and the use of cas are kept from the original
+/// cache because they affect how the entries are stored. The 'malloc' and
+/// 'free' options must operate on the same memory as the original cache.
+/// Returns null if the memory does not contain a compatible cache, or if the
+/// entries require a 'decompress' or 'unspill' callback that's not provided.
+struct pogocache *pogocache_attach(void *mem, struct pogocache_opts *opts) {
+    struct pogocache *cache = mem;
+    if (!cache || cache->isbatch || cache->ctx.layout != LAYOUT) {
+        return 0;
+    }
+    if (!opts) {
+        opts = &newdefopts;
+    }
+    struct pgctx *ctx = &cache->ctx;
+    if ((ctx->hascompressed && !opts->decompress) ||
+        (ctx->hasspilled && !opts->unspill))
+    {
+        return 0;
+    }
+    int nshards = ctx->nshards;
+    bool usecas = ctx->usecas;
+    uint64_t seed = ctx->seed;
+    // Function pointers from the previous process are not valid.
+    ctx->yield = 0;
+    ctx->evicted = 0;
+    ctx->notify = 0;
+    ctx->udata = 0;
+    ctx->compress = 0;
+    ctx->decompress = 0;
+    ctx->spill = 0;
+    ctx->unspill = 0;
+    ctx->spillfree = 0;
+    ctx->malloc_size = 0;
+    ctx->usenotify = false;
+    opts_to_ctx(nshards, opts, ctx);
+    ctx->usecas = usecas;
+    ctx->seed = seed;
+    ctx->malloc = opts->malloc ? opts->malloc : malloc;
+    ctx->free = opts->free ? opts->free : free;
+    for (int i = 0; i < nshards; i++) {
+        lock_init(&cache->shards[i]);
+        cache->shards[i].next = 0;
+    }
+    return cache;
+}
+
+/// Returns true if pogocache_attach will accept the cache in 'mem' once it
+/// has been detached, for checking a cache that another process is still
+/// using. That process may still compress or spill entries, so the callbacks
+/// for reading them back are required when it has them, even if no entry
+/// needs them yet. Only the memory of the cache itself is read, not the
+/// entries, so 'mem' may be mapped at another address than the original.
+bool pogocache_compatible(void *mem, struct pogocache_opts *opts) {
+    struct pogocache *cache = mem;
+    if (!cache || cache->isbatch || cache->ctx.layout != LAYOUT) {
+        return false;
+    }
+    if (!opts) {
+        opts = &newdefopts;
+    }
+    struct pgctx *ctx = &cache->ctx;
+    if (((ctx->hascompressed || ctx->compress) && !opts->decompress) ||
+        ((ctx->hasspilled || ctx->spill) && !opts->unspill))
+    {
+        return false;
+    }
+    return true;
+}
+
+static struct pogocache *rootcache(struct pogocache *cache);
+
+/// Locks every shard, waiting for operations that are in progress to finish,
+/// so that the cache memory can be attached by another process using
+/// pogocache_attach. The cache cannot be used by this process afterwards.
+void pogocache_detach(struct pogocache *cache) {
+    cache = rootcache(cache);
+    for (int i = 0; i < cache->ctx.nshards; i++) {
+        lock(0, &cache->shards[i], &cache->ctx);
+    }
+}
+
+static int shard_index(struct pogocache *cache, uint64_t hash) {
+    return (hash>>32)%cache->ctx.nshards;
+}
 
 static struct shard *shard_get(struct pogocache *cache, int index) {
     return &cache->shards[index];
@@ -1278,7 +2012,7 @@ void pogocache_end(struct pogocache *batch) {
     while (shard) {
         struct shard *next = shard->next;
         shard->next = 0;
-        atomic_store_explicit(&shard->lock, 0, __ATOMIC_RELEASE);
+        unlock(shard);
         shard = next;
     }
     if (!batch->batch.cache->ctx.usethreadbatch) {
@@ -1286,43 +2020,6 @@ void pogocache_end(struct pogocache *batch) {
     }
 }
 
-static void lock(struct batch *batch, struct shard *shard, struct pgctx *ctx) {
-    if (batch) {
-        while (1) {
-            uintptr_t val = 0;
-            if (atomic_compare_exchange_weak_explicit(&shard->lock, &val, 
-                (uintptr_t)(void*)batch, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
-            {
-                shard->next = batch->shard;
-                batch->shard = shard;
-                break;
-            }
-            if (val == (uintptr_t)(void*)batch) {
-                break;
-            }
-            if (ctx->yield) {
-                ctx->yield(ctx->udata);
-            } else {
-                cpu_yield();
-            }
-        }
-    } else {
-        while (1) {
-            uintptr_t val = 0;
-            if (atomic_compare_exchange_weak_explicit(&shard->lock, &val, 
-                UINTPTR_MAX, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
-            {
-                break;
-            }
-            if (ctx->yield) {
-                ctx->yield(ctx->udata);
-            } else {
-                cpu_yield();
-            }
-        }
-    }
-}
-
 static bool acquire_for_scan(int shardidx, struct shard **shard_out, 
     struct pogocache **cache_inout)
 {
@@ -1375,7 +2072,7 @@ static bool acquire_for_key(const char *key, size_t keylen, uint32_t *hash_out,
     (void)shardidx, (void)hash, (void)ctx; \
     rettype status = op; \
     if (!usebatch) { \
-        atomic_store_explicit(&shard->lock, 0, __ATOMIC_RELEASE); \
+        unlock(shard); \
     } \
     status; \
 })
@@ -1388,21 +2085,131 @@ static bool acquire_for_key(const char *key, size_t keylen, uint32_t *hash_out,
     (void)ctx; \
     rettype status = op; \
     if (!usebatch) { \
-        atomic_store_explicit(&shard->lock, 0, __ATOMIC_RELEASE); \
+        unlock(shard); \
     } \
     status; \
 })
 
+// Returns the index of the lease for key, or -1 if there is none.
+// Expired leases are removed along the way.
+static int lease_find(struct shard *shard, const void *key, size_t keylen,
+    uint32_t hash, int64_t now, struct pgctx *ctx)
+{
+    int i = 0;
+    while (i < shard->nleases) {
+        struct lease *lease = &shard->leases[i];
+        if (lease->expires <= now) {
+            lease_drop(shard, i, ctx);
+            continue;
+        }
+        if (lease->hash == hash && lease->keylen == keylen &&
+            memcmp(lease->key, key, keylen) == 0)
+        {
+            return i;
+        }
+        i++;
+    }
+    return -1;
+}
+
+static void lease_remove(struct shard *shard, const void *key, size_t keylen,
+    uint32_t hash, int64_t now, struct pgctx *ctx)
+{
+    if (shard->nleases > 0) {
+        int i = lease_find(shard, key, keylen, hash, now, ctx);
+        if (i >= 0) {
+            lease_drop(shard, i, ctx);
+        }
+    }
+}
+
+// Grant a lease for a missing entry. The token is zero if there is already a
+// lease for the entry.
+// Returns false when there's no memory for recording the lease. No token is
+// handed out then, because a store only trusts the tokens it has recorded.
+static bool lease_grant(struct shard *shard, const void *key,
+    size_t keylen, uint32_t hash, int64_t now, int64_t ttl, uint64_t *token,
+    struct pgctx *ctx)
+{
+    *token = 0;
+    if (lease_find(shard, key, keylen, hash, now, ctx) >= 0) {
+        return true;
+    }
+    if (shard->nleases == shard->leasescap) {
+        int cap = shard->leasescap == 0 ? 4 : shard->leasescap*2;
+        struct lease *leases = ctx->malloc(cap*sizeof(struct lease));
+        if (!leases) {
+            return false;
+        }
+        if (shard->leases) {
+            memcpy(leases, shard->leases, shard->nleases*sizeof(struct lease));
+            ctx->free(shard->leases);
+        }
+        shard->leases = leases;
+        shard->leasescap = cap;
+    }
+    char *keycopy = ctx->malloc(keylen == 0 ? 1 : keylen);
+    if (!keycopy) {
+        return false;
+    }
+    memcpy(keycopy, key, keylen);
+    shard->cas++;
+    shard->leases[shard->nleases++] = (struct lease) {
+        .hash = hash,
+        .keylen = keylen,
+        .key = keycopy,
+        .expires = int64_add_clamp(now, ttl),
+        .token = shard->cas,
+    };
+    *token = shard->cas;
+    return true;
+}
+
+// Returns true when the entry should be recomputed. That's when it's in its
+// grace period, or when it's picked for an early refresh using the XFetch
+// method. The chance of an early refresh grows as the expiration nears, and
+// with the time it takes to recompute the value.
+static bool entry_needs_refresh(const struct entry *entry, int64_t expires,
+    uint32_t hash, int64_t now, struct pgctx *ctx)
+{
+    int64_t grace, delta;
+    entry_refresh(entry, &grace, &delta, ctx);
+    int64_t soft = expires-grace;
+    if (now >= soft) {
+        return true;
+    }
+    if (delta <= 0) {
+        return false;
+    }
+    // Random number in the range (0,1].
+    uint64_t x = mix13((uint64_t)now^((uint64_t)hash<<32));
+    double r = (double)((x>>11)+1)/(double)(UINT64_C(1)<<53);
+    return now-delta*log(r) >= soft;
+}
+
+// A spilled value that's read without holding the shard lock.
+struct unspill {
+    struct entry *entry; // retained entry
+    bool ok;             // the value was read
+    const char *val;     // value, which may be in 'tmp'
+    size_t vallen;
+    char *tmp;
+};
+
+// Returned by loadop when the value of the 'unspill' entry must be read
+// before trying again.
+#define LOADUNSPILL -1
+
 static int loadop(const void *key, size_t keylen, 
     struct pogocache_load_opts *opts, struct shard *shard, int shardidx, 
-    uint32_t hash, struct pgctx *ctx)
+    uint32_t hash, struct unspill *unspill, struct pgctx *ctx)
 {
     opts = opts ? opts : &defloadopts;
     int64_t now = opts->time > 0 ? opts->time : getnow();
     // Get the entry bucket index for the entry with key.
     int bidx = map_get_bucket(&shard->map, key, keylen, hash, ctx);
     if (bidx == -1) {
-        return POGOCACHE_NOTFOUND;
+        goto notfound;
     }
     // Extract the bucket, entry, and values.
     struct bucket *bkt = &shard->map.buckets[bidx];
@@ -1413,27 +2220,109 @@ static int loadop(const void *key, size_t keylen,
     uint32_t flags;
     uint64_t cas;
     entry_extract(entry, 0, 0, 0, &val, &vallen, &expires, &flags, &cas, ctx);
-    if (!entry_alive_exp(expires, now)) {
+    if (!entry_alive_exp(expires, now) || entry_invalid(shard, entry, ctx)) {
         // Entry is no longer alive. Delete from map and notify the user.
         delbkt(&shard->map, bidx);
         notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
         entry_free(entry, ctx);
-        return POGOCACHE_NOTFOUND;
+        goto notfound;
+    }
+    if (entry->has_refresh && !opts->stale && expires > 0 &&
+        now >= entry_soft_expires(entry, expires, ctx))
+    {
+        // In its grace period, which is only served to callers that can tell
+        // that the value is stale.
+        goto notfound;
+    }
+    bool prefetched = unspill && unspill->entry == entry;
+    if (entry->has_spilled && !prefetched) {
+        if (opts->nospilled) {
+            return POGOCACHE_SPILLED;
+        }
+        if (opts->entry && unspill) {
+            // Read the value after the shard is unlocked.
+            if (unspill->entry) {
+                entry_free(unspill->entry, ctx);
+            }
+            unspill->entry = entry_clone(entry);
+            return LOADUNSPILL;
+        }
     }
     if (!opts->notouch) {
         entry_settime(entry, now);
     }
+    if (opts->refresh && entry->has_refresh &&
+        entry_needs_refresh(entry, expires, hash, now, ctx))
+    {
+        *opts->refresh = true;
+        if (opts->lease > 0) {
+            // The value is still served when the lease can't be recorded,
+            // just without a token.
+            uint64_t token;
+            lease_grant(shard, key, keylen, hash, now, opts->lease, &token,
+                ctx);
+            if (opts->leasetoken) {
+                *opts->leasetoken = token;
+            }
+        }
+    }
+    if (opts->type) {
+        *opts->type = kind_type(entry_kind(entry));
+    }
     if (opts->entry) {
+        char *tmp = 0;
+        bool ok;
+        if (prefetched) {
+            ok = unspill->ok;
+            val = unspill->val;
+            vallen = unspill->vallen;
+        } else {
+            ok = entry_inflate(entry, &val, &vallen, &tmp, &shard->comp, ctx);
+        }
+        if (!ok) {
+            if (entry->has_spilled) {
+                // The spilled value is no longer available. Treat it as
+                // evicted.
+                delentry_at_bkt(&shard->map, bidx, ctx);
+                notify(shardidx, NOTIFY_LOWMEM, 0, entry, now, ctx);
+                entry_free(entry, ctx);
+                goto notfound;
+            }
+            return POGOCACHE_NOMEM;
+        }
         struct pogocache_update *update = 0;
-        opts->entry(shardidx, now, key, keylen, val, vallen, expires, flags,
+        int64_t soft = entry_soft_expires(entry, expires, ctx);
+        opts->entry(shardidx, now, key, keylen, val, vallen, soft, flags,
             cas, &update, opts->udata);
         if (update) {
             // User wants to update the entry.
             shard->cas++;
-            struct entry *entry2 = entry_new(key, keylen, update->value,
-                update->valuelen, update->expires, update->flags, shard->cas, 
-                ctx);
+            int64_t grace, delta;
+            entry_refresh(entry, &grace, &delta, ctx);
+            if (update->expires != soft) {
+                // A new expiration ends the grace period.
+                grace = 0;
+            }
+            const char *uval = update->value;
+            int kind = 0;
+            if (entry->has_counter && uval == val) {
+                // Value is unchanged. Keep it as a counter.
+                kind = entry_kind(entry);
+                uval = entry_value(entry, &vallen, ctx);
+            } else {
+                if (entry->has_hash && uval == val) {
+                    // Value is unchanged. Keep it as a hash.
+                    kind = KIND_HASH;
+                }
+                vallen = update->valuelen;
+            }
+            struct entry *entry2 = entry_new(key, keylen, uval, vallen,
+                grace > 0 ? expires : update->expires, update->flags,
+                shard->cas, grace, delta, kind, &shard->comp, ctx);
             if (!entry2) {
+                if (tmp) {
+                    ctx->free(tmp);
+                }
                 return POGOCACHE_NOMEM;
             }
             entry_settime(entry2, now);
@@ -1441,8 +2330,24 @@ static int loadop(const void *key, size_t keylen,
             notify(shardidx, NOTIFY_REPLACED, entry2, entry, now, ctx);
             entry_free(entry, ctx);
         }
+        if (tmp) {
+            ctx->free(tmp);
+        }
     }
     return POGOCACHE_FOUND;
+notfound:
+    if (opts->lease > 0) {
+        uint64_t token;
+        if (!lease_grant(shard, key, keylen, hash, now, opts->lease, &token,
+            ctx))
+        {
+            return POGOCACHE_NOMEM;
+        }
+        if (opts->leasetoken) {
+            *opts->leasetoken = token;
+        }
+    }
+    return POGOCACHE_NOTFOUND;
 }
 
 /// Loads an entry from the cache.
@@ -1450,14 +2355,47 @@ static int loadop(const void *key, size_t keylen,
 /// It's possible to update the value using the 'update' param in the callback.
 /// See 'pogocache_load_opts' for all options.
 /// @returns POGOCACHE_FOUND when the entry was found.
-/// @returns POGOCACHE_NOMEM when the entry cannot be updated due to no memory.
+/// @returns POGOCACHE_NOMEM when the entry cannot be updated due to no memory,
+/// or when a lease cannot be recorded.
 /// @returns POGOCACHE_NOTFOUND when the entry was not found.
+/// @returns POGOCACHE_SPILLED when the value was spilled and the 'nospilled'
+/// option is used.
+/// A spilled value is read from secondary storage while the shard is not
+/// locked, unless the cache is a batch.
+/// On a miss, the 'lease' option hands out a token for filling the entry to
+/// only the first caller, which avoids all callers refilling a hot entry at
+/// once. See 'pogocache_store_opts.lease'.
 int pogocache_load(struct pogocache *cache, const void *key, size_t keylen, 
     struct pogocache_load_opts *opts)
 {
-    return ACQUIRE_FOR_KEY_AND_EXECUTE(int, key, keylen, 
-        loadop(key, keylen, opts, shard, shardidx, hash, ctx)
-    );
+    // A batch keeps its shards locked, so spilled values are read in place.
+    struct unspill unspill = { 0 };
+    struct unspill *punspill = cache->isbatch ? 0 : &unspill;
+    struct pogocache *root = rootcache(cache);
+    while (1) {
+        int status = ACQUIRE_FOR_KEY_AND_EXECUTE(int, key, keylen, 
+            loadop(key, keylen, opts, shard, shardidx, hash, punspill, ctx)
+        );
+        if (unspill.tmp) {
+            root->ctx.free(unspill.tmp);
+            unspill.tmp = 0;
+        }
+        if (status != LOADUNSPILL) {
+            if (unspill.entry) {
+                entry_free(unspill.entry, &root->ctx);
+            }
+            return status;
+        }
+        // The entry was retained by loadop. Read and inflate its value
+        // without the lock, then try again. The value is only used if the
+        // entry has not been replaced in the meantime.
+        struct entry *entry = unspill.entry;
+        struct shard *shard = &root->shards[pogocache_shard(root, key, 
+            keylen)];
+        unspill.val = entry_value(entry, &unspill.vallen, &root->ctx);
+        unspill.ok = entry_inflate(entry, &unspill.val, &unspill.vallen, 
+            &unspill.tmp, &shard->comp, &root->ctx);
+    }
 }
 
 static int deleteop(const void *key, size_t keylen, 
@@ -1466,6 +2404,9 @@ static int deleteop(const void *key, size_t keylen,
 {
     opts = opts ? opts : &defdeleteopts;
     int64_t now = opts->time > 0 ? opts->time : getnow();
+    // Deleting invalidates a pending lease, because the value it will be
+    // filled with may already be stale.
+    lease_remove(shard, key, keylen, hash, now, ctx);
     struct entry *entry = map_delete(&shard->map, key, keylen, hash, ctx);
     if (!entry) {
         // Entry does not exist
@@ -1476,7 +2417,7 @@ static int deleteop(const void *key, size_t keylen,
     int64_t expires;
     uint32_t flags;
     uint64_t cas;
-    if (!entry_alive(entry, now)) {
+    if (!entry_alive_in(shard, entry, now, ctx)) {
         // Entry is no longer alive. It was already deleted from the map but
         // we still need to notify the user.
         notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
@@ -1487,9 +2428,20 @@ static int deleteop(const void *key, size_t keylen,
     if (opts->entry) {
         entry_extract(entry, 0, 0, 0, &val, &vallen, &expires, &flags, &cas,
             ctx);
-        if (!opts->entry(shardidx, now, key, keylen, val, vallen,
+        expires = entry_soft_expires(entry, expires, ctx);
+        char *tmp;
+        int status = 0;
+        if (!entry_inflate(entry, &val, &vallen, &tmp, &shard->comp, ctx)) {
+            status = POGOCACHE_NOMEM;
+        } else if (!opts->entry(shardidx, now, key, keylen, val, vallen,
             expires, flags, cas, opts->udata))
         {
+            status = POGOCACHE_CANCELED;
+        }
+        if (tmp) {
+            ctx->free(tmp);
+        }
+        if (status) {
             // User canceled the delete. Put it back into the map.
             // This insert will not cause an allocation error because the 
             // previous delete operation left us with at least one available
@@ -1498,7 +2450,7 @@ static int deleteop(const void *key, size_t keylen,
             bool ok = map_insert(&shard->map, entry, hash, &old, ctx);
             assert(ok);
             assert(!old);
-            return POGOCACHE_CANCELED;
+            return status;
         }
     }
     // Entry was successfully deleted.
@@ -1513,6 +2465,7 @@ static int deleteop(const void *key, size_t keylen,
 /// @returns POGOCACHE_DELETED when the entry was successfully deleted.
 /// @returns POGOCACHE_NOTFOUND when the entry was not found.
 /// @returns POGOCACHE_CANCELED when opts.entry callback returned false.
+/// @returns POGOCACHE_NOMEM when a compressed value cannot be inflated.
 int pogocache_delete(struct pogocache *cache, const void *key, size_t keylen, 
     struct pogocache_delete_opts *opts)
 {
@@ -1534,20 +2487,35 @@ static int storeop(const void *key, size_t keylen, const void *val,
     } else if (opts->ttl > 0) {
         expires = int64_add_clamp(now, opts->ttl);
     }
+    int64_t grace = opts->grace;
+    int64_t delta = opts->delta;
+    if (expires > 0 && grace > 0) {
+        // The entry stays around for the grace period, see entry_refresh.
+        expires = int64_add_clamp(expires, grace);
+    }
+    if (opts->lease) {
+        // Only the holder of a valid lease may fill the entry.
+        int i = lease_find(shard, key, keylen, hash, now, ctx);
+        if (i < 0 || shard->leases[i].token != opts->lease) {
+            return POGOCACHE_CANCELED;
+        }
+    }
     if (opts->keepttl) {
         // User wants to keep the existing ttl. Get the existing entry from the
         // map first and take its expiration.
         int bidx = map_get_bucket(&shard->map, key, keylen, hash, ctx);
         if (bidx >= 0) {
             struct entry *old = get_entry(&shard->map.buckets[bidx]);
-            if (entry_alive(old, now)) {
+            if (entry_alive_in(shard, old, now, ctx)) {
                 expires = entry_expires(old);
+                entry_refresh(old, &grace, &delta, ctx);
             }
         }
     }
     shard->cas++;
+    int kind = opts->type == POGOCACHE_TYPE_HASH ? KIND_HASH : 0;
     struct entry *entry = entry_new(key, keylen, val, vallen, expires,
-        opts->flags, shard->cas, ctx);
+        opts->flags, shard->cas, grace, delta, kind, &shard->comp, ctx);
     if (!entry) {
         goto nomem;
     }
@@ -1560,7 +2528,7 @@ static int storeop(const void *key, size_t keylen, const void *val,
     if (!map_insert(&shard->map, entry, hash, &old, ctx)) {
         goto nomem;
     }
-    if (old && !entry_alive(old, now)) {
+    if (old && !entry_alive_in(shard, old, now, ctx)) {
         // There's an old entry, but it's no longer alive.
         // Notify the user, as if the entry was evicted through expiration.
         notify(shardidx, NOTIFY_EXPIRED, 0, old, now, ctx);
@@ -1617,15 +2585,25 @@ static int storeop(const void *key, size_t keylen, const void *val,
         uint64_t ocas = 0;
         entry_extract(old, 0, 0, 0, &val, &vallen, &oexpires, &oflags, &ocas,
             ctx);
-        if (!opts->entry(shardidx, now, key, keylen, val, vallen, oexpires,
-            oflags, ocas, opts->udata))
-        {
+        oexpires = entry_soft_expires(old, oexpires, ctx);
+        char *tmp;
+        if (!entry_inflate(old, &val, &vallen, &tmp, &shard->comp, ctx)) {
+            put_back_status = POGOCACHE_NOMEM;
+            goto put_back;
+        }
+        bool keep = !opts->entry(shardidx, now, key, keylen, val, vallen, 
+            oexpires, oflags, ocas, opts->udata);
+        if (tmp) {
+            ctx->free(tmp);
+        }
+        if (keep) {
             // User wants to keep the old entry.
             put_back_status = POGOCACHE_CANCELED;
             goto put_back;
         }
     }
-    // The new entry was inserted.
+    // The new entry was inserted, which fulfills any lease.
+    lease_remove(shard, key, keylen, hash, now, ctx);
     if (old) {
         notify(shardidx, NOTIFY_REPLACED, entry, old, now, ctx);
         entry_free(old, ctx);
@@ -1640,7 +2618,9 @@ static int storeop(const void *key, size_t keylen, const void *val,
         return POGOCACHE_INSERTED;
     }
 nomem:
-    entry_free(entry, ctx);
+    if (entry) {
+        entry_free(entry, ctx);
+    }
     return POGOCACHE_NOMEM;
 }
 
@@ -1652,7 +2632,8 @@ nomem:
 /// @returns POGOCACHE_INSERTED when the entry was inserted.
 /// @returns POGOCACHE_REPLACED when the entry replaced an existing one.
 /// @returns POGOCACHE_FOUND when the entry already exists. (cas/nx)
-/// @returns POGOCACHE_CANCELED when the operation was canceled.
+/// @returns POGOCACHE_CANCELED when the operation was canceled, or when the
+/// opts.lease token is no longer valid.
 /// @returns POGOCACHE_NOMEM when there is system memory available.
 int pogocache_store(struct pogocache *cache, const void *key, size_t keylen, 
     const void *val, size_t vallen, struct pogocache_store_opts *opts)
@@ -1662,6 +2643,299 @@ int pogocache_store(struct pogocache *cache, const void *key, size_t keylen,
     );
 }
 
+// Reads the value of the entry as an integer, for the signed or unsigned
+// operation. Returns false if the value is not a number or does not fit.
+static bool entry_counter(const struct entry *entry, bool isunsigned,
+    uint64_t *x, struct compstats *stats, struct pgctx *ctx)
+{
+    size_t vallen;
+    const char *val = entry_value(entry, &vallen, ctx);
+    if (entry->has_counter) {
+        memcpy(x, val, 8);
+        if (isunsigned) {
+            return entry->has_unsigned || (int64_t)*x >= 0;
+        } else {
+            return !entry->has_unsigned || *x <= INT64_MAX;
+        }
+    }
+    char *tmp;
+    if (!entry_inflate(entry, &val, &vallen, &tmp, stats, ctx)) {
+        return false;
+    }
+    bool ok = vallen > 0 && (isunsigned ? parse_u64(val, vallen, x) :
+        parse_i64(val, vallen, (int64_t*)x));
+    if (tmp) {
+        ctx->free(tmp);
+    }
+    return ok;
+}
+
+static int incrop(const void *key, size_t keylen, uint64_t delta,
+    uint64_t *value, struct pogocache_incr_opts *opts, struct shard *shard,
+    int shardidx, uint32_t hash, struct pgctx *ctx)
+{
+    opts = opts ? opts : &defincropts;
+    int64_t now = opts->time > 0 ? opts->time : getnow();
+    struct entry *entry = 0;
+    int bidx = map_get_bucket(&shard->map, key, keylen, hash, ctx);
+    if (bidx >= 0) {
+        entry = get_entry(&shard->map.buckets[bidx]);
+        if (!entry_alive_in(shard, entry, now, ctx)) {
+            delbkt(&shard->map, bidx);
+            notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
+            entry_free(entry, ctx);
+            entry = 0;
+        }
+    }
+    uint64_t x = 0;
+    if (!entry) {
+        if (opts->nocreate) {
+            return POGOCACHE_NOTFOUND;
+        }
+    } else if (entry->has_hash) {
+        return POGOCACHE_WRONGTYPE;
+    } else if (!entry_counter(entry, opts->isunsigned, &x, &shard->comp,
+        ctx))
+    {
+        return POGOCACHE_NOTNUMBER;
+    }
+    bool overflow;
+    if (opts->isunsigned) {
+        if (opts->decr) {
+            overflow = __builtin_sub_overflow(x, delta, &x);
+        } else {
+            overflow = __builtin_add_overflow(x, delta, &x);
+        }
+    } else {
+        int64_t ix = (int64_t)x;
+        if (opts->decr) {
+            overflow = __builtin_sub_overflow(ix, (int64_t)delta, &ix);
+        } else {
+            overflow = __builtin_add_overflow(ix, (int64_t)delta, &ix);
+        }
+        x = (uint64_t)ix;
+    }
+    if (overflow && !opts->wrap) {
+        return POGOCACHE_OVERFLOW;
+    }
+    if (value) {
+        *value = x;
+    }
+    shard->cas++;
+    if (entry && entry->has_counter && atomic_load(&entry->rc) == 1) {
+        // Update the counter in place. This is not possible when the entry
+        // is retained elsewhere, because it may be read outside of the lock.
+        memcpy((char*)entry_value(entry, &(size_t){0}, ctx), &x, 8);
+        entry->has_unsigned = opts->isunsigned;
+        entry_setcas(entry, shard->cas, ctx);
+        entry_settime(entry, now);
+        notify(shardidx, NOTIFY_REPLACED, entry, entry, now, ctx);
+        return POGOCACHE_REPLACED;
+    }
+    // Store a new counter entry, keeping the expiration and flags of the
+    // existing entry.
+    int64_t expires = 0;
+    uint32_t flags = 0;
+    int64_t grace = 0;
+    int64_t rdelta = 0;
+    if (entry) {
+        entry_extract(entry, 0, 0, 0, 0, 0, &expires, &flags, 0, ctx);
+        entry_refresh(entry, &grace, &rdelta, ctx);
+    }
+    struct entry *entry2 = entry_new(key, keylen, (char*)&x, 8, expires, 
+        flags, shard->cas, grace, rdelta, 
+        opts->isunsigned ? KIND_UCOUNTER : KIND_COUNTER, &shard->comp, ctx);
+    if (!entry2) {
+        return POGOCACHE_NOMEM;
+    }
+    entry_settime(entry2, now);
+    if (opts->lowmem && ctx->noevict) {
+        entry_free(entry2, ctx);
+        return POGOCACHE_NOMEM;
+    }
+    int count = shard->map.count;
+    struct entry *old;
+    if (!map_insert(&shard->map, entry2, hash, &old, ctx)) {
+        entry_free(entry2, ctx);
+        return POGOCACHE_NOMEM;
+    }
+    lease_remove(shard, key, keylen, hash, now, ctx);
+    if (old) {
+        notify(shardidx, NOTIFY_REPLACED, entry2, old, now, ctx);
+        entry_free(old, ctx);
+        return POGOCACHE_REPLACED;
+    }
+    if (opts->lowmem && shard->map.count > count) {
+        auto_evict_entry(shard, shardidx, hash, now, ctx);
+    }
+    notify(shardidx, NOTIFY_INSERTED, entry2, 0, now, ctx);
+    return POGOCACHE_INSERTED;
+}
+
+/// Adds to or subtracts from the integer value of an entry, in a single
+/// operation. The entry is created with a value of zero when it does not
+/// exist, and existing decimal values are converted. The result is stored as
+/// a native integer, which is updated in place by later operations and is
+/// rendered as a decimal string when the value is loaded.
+/// See 'pogocache_incr_opts' for all options.
+/// @returns POGOCACHE_INSERTED when a new entry was created.
+/// @returns POGOCACHE_REPLACED when an existing entry was updated.
+/// @returns POGOCACHE_NOTFOUND when the entry does not exist (nocreate).
+/// @returns POGOCACHE_NOTNUMBER when the value is not a 64-bit integer.
+/// @returns POGOCACHE_WRONGTYPE when the entry is not a string.
+/// @returns POGOCACHE_OVERFLOW when the operation would overflow.
+/// @returns POGOCACHE_NOMEM when there is no system memory available.
+int pogocache_incr(struct pogocache *cache, const void *key, size_t keylen,
+    uint64_t delta, uint64_t *value, struct pogocache_incr_opts *opts)
+{
+    return ACQUIRE_FOR_KEY_AND_EXECUTE(int, key, keylen,
+        incrop(key, keylen, delta, value, opts, shard, shardidx, hash, ctx)
+    );
+}
+
+static int modifyop(const void *key, size_t keylen,
+    struct pogocache_modify_opts *opts, struct shard *shard, int shardidx,
+    uint32_t hash, struct pgctx *ctx)
+{
+    opts = opts ? opts : &defmodifyopts;
+    int64_t now = opts->time > 0 ? opts->time : getnow();
+    int kind = opts->type == POGOCACHE_TYPE_HASH ? KIND_HASH : 0;
+    struct entry *entry = 0;
+    int bidx = map_get_bucket(&shard->map, key, keylen, hash, ctx);
+    if (bidx >= 0) {
+        entry = get_entry(&shard->map.buckets[bidx]);
+        if (!entry_alive_in(shard, entry, now, ctx)) {
+            delbkt(&shard->map, bidx);
+            notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
+            entry_free(entry, ctx);
+            entry = 0;
+        }
+    }
+    const char *val = 0;
+    size_t vallen = 0;
+    int64_t expires = 0;
+    int64_t soft = 0;
+    uint32_t flags = 0;
+    char *tmp = 0;
+    if (entry) {
+        if (kind_type(entry_kind(entry)) != opts->type) {
+            return POGOCACHE_WRONGTYPE;
+        }
+        entry_extract(entry, 0, 0, 0, &val, &vallen, &expires, &flags, 0, 
+            ctx);
+        soft = entry_soft_expires(entry, expires, ctx);
+        if (!entry_inflate(entry, &val, &vallen, &tmp, &shard->comp, ctx)) {
+            return POGOCACHE_NOMEM;
+        }
+        entry_settime(entry, now);
+    }
+    struct pogocache_update *update = 0;
+    if (opts->entry) {
+        opts->entry(shardidx, now, key, keylen, val, vallen, soft, flags,
+            &update, opts->udata);
+    }
+    int status;
+    if (!update) {
+        status = entry ? POGOCACHE_FOUND : POGOCACHE_NOTFOUND;
+        goto done;
+    }
+    if (!update->value) {
+        // User wants to delete the entry.
+        status = POGOCACHE_NOTFOUND;
+        if (entry) {
+            delbkt(&shard->map, bidx);
+            notify(shardidx, NOTIFY_DELETED, 0, entry, now, ctx);
+            entry_free(entry, ctx);
+            tryshrink(&shard->map, ctx);
+            status = POGOCACHE_DELETED;
+        }
+        lease_remove(shard, key, keylen, hash, now, ctx);
+        goto done;
+    }
+    shard->cas++;
+    if (entry && !tmp && !entry->has_counter && 
+        atomic_load(&entry->rc) == 1 && update->valuelen == vallen &&
+        update->expires == soft && update->flags == flags)
+    {
+        // Same size and metadata. Overwrite the value in place. This is not
+        // possible when the entry is retained elsewhere, because it may be
+        // read outside of the lock.
+        memmove((char*)val, update->value, vallen);
+        entry_setcas(entry, shard->cas, ctx);
+        notify(shardidx, NOTIFY_REPLACED, entry, entry, now, ctx);
+        status = POGOCACHE_REPLACED;
+        goto done;
+    }
+    int64_t grace = 0;
+    int64_t delta = 0;
+    if (entry) {
+        entry_refresh(entry, &grace, &delta, ctx);
+        if (update->expires != soft) {
+            // A new expiration ends the grace period.
+            grace = 0;
+        }
+    }
+    struct entry *entry2 = entry_new(key, keylen, update->value,
+        update->valuelen, grace > 0 ? expires : update->expires, 
+        update->flags, shard->cas, grace, delta, kind, &shard->comp, ctx);
+    if (!entry2) {
+        status = POGOCACHE_NOMEM;
+        goto done;
+    }
+    entry_settime(entry2, now);
+    if (!entry && opts->lowmem && ctx->noevict) {
+        entry_free(entry2, ctx);
+        status = POGOCACHE_NOMEM;
+        goto done;
+    }
+    int count = shard->map.count;
+    struct entry *old;
+    if (!map_insert(&shard->map, entry2, hash, &old, ctx)) {
+        entry_free(entry2, ctx);
+        status = POGOCACHE_NOMEM;
+        goto done;
+    }
+    lease_remove(shard, key, keylen, hash, now, ctx);
+    if (old) {
+        notify(shardidx, NOTIFY_REPLACED, entry2, old, now, ctx);
+        entry_free(old, ctx);
+        status = POGOCACHE_REPLACED;
+    } else {
+        if (opts->lowmem && shard->map.count > count) {
+            auto_evict_entry(shard, shardidx, hash, now, ctx);
+        }
+        notify(shardidx, NOTIFY_INSERTED, entry2, 0, now, ctx);
+        status = POGOCACHE_INSERTED;
+    }
+done:
+    if (tmp) {
+        ctx->free(tmp);
+    }
+    return status;
+}
+
+/// Reads and changes the value of an entry in a single operation, such as
+/// for changing a field of a hash. The opts.entry callback receives the
+/// current value, or a null value when the entry does not exist, and may
+/// provide an update. An update with a null value deletes the entry. The
+/// entry is created when it does not exist, and an update that keeps the
+/// size and metadata of the value is written in place.
+/// See 'pogocache_modify_opts' for all options.
+/// @returns POGOCACHE_INSERTED when a new entry was created.
+/// @returns POGOCACHE_REPLACED when an existing entry was updated.
+/// @returns POGOCACHE_DELETED when the entry was deleted.
+/// @returns POGOCACHE_FOUND when the entry exists and was not changed.
+/// @returns POGOCACHE_NOTFOUND when the entry does not exist.
+/// @returns POGOCACHE_WRONGTYPE when the entry is not of opts.type.
+/// @returns POGOCACHE_NOMEM when there is no system memory available.
+int pogocache_modify(struct pogocache *cache, const void *key, size_t keylen,
+    struct pogocache_modify_opts *opts)
+{
+    return ACQUIRE_FOR_KEY_AND_EXECUTE(int, key, keylen,
+        modifyop(key, keylen, opts, shard, shardidx, hash, ctx)
+    );
+}
+
 static struct pogocache *rootcache(struct pogocache *cache) {
     return cache->isbatch ? cache->batch.cache : cache;
 }
@@ -1672,6 +2946,70 @@ int pogocache_nshards(struct pogocache *cache) {
     return cache->ctx.nshards;
 }
 
+/// Returns the lock stats for all shards, or just one shard if the oneshard
+/// option is used.
+void pogocache_lockstats(struct pogocache *cache, 
+    struct pogocache_lockstats *stats, struct pogocache_lockstats_opts *opts)
+{
+    cache = rootcache(cache);
+    opts = opts ? opts : &deflockstatsopts;
+    memset(stats, 0, sizeof(struct pogocache_lockstats));
+    int start = opts->oneshard ? opts->oneshardidx : 0;
+    int end = opts->oneshard ? opts->oneshardidx+1 : cache->ctx.nshards;
+    if (start < 0 || end > cache->ctx.nshards) {
+        return;
+    }
+    for (int i = start; i < end; i++) {
+        struct shard *shard = &cache->shards[i];
+        stats->acquisitions += atomic_load_explicit(&shard->nacquired, 
+            __ATOMIC_RELAXED);
+        stats->contended += atomic_load_explicit(&shard->ncontended, 
+            __ATOMIC_RELAXED);
+        stats->waitns += atomic_load_explicit(&shard->waitns, 
+            __ATOMIC_RELAXED);
+    }
+}
+
+static int compstatsop(struct shard *shard, 
+    struct pogocache_compressstats *stats)
+{
+    struct compstats *comp = &shard->comp;
+    stats->compressed += atomic_load_explicit(&comp->ncompressed, 
+        __ATOMIC_RELAXED);
+    stats->rejected += atomic_load_explicit(&comp->nrejected, 
+        __ATOMIC_RELAXED);
+    stats->inflated += atomic_load_explicit(&comp->ninflated, 
+        __ATOMIC_RELAXED);
+    stats->compressns += atomic_load_explicit(&comp->compressns, 
+        __ATOMIC_RELAXED);
+    stats->inflatens += atomic_load_explicit(&comp->inflatens, 
+        __ATOMIC_RELAXED);
+    stats->rawbytes += shard->map.rawsize;
+    stats->storedbytes += shard->map.compsize;
+    return 0;
+}
+
+/// Returns the value compression stats.
+void pogocache_compressstats(struct pogocache *cache,
+    struct pogocache_compressstats *stats)
+{
+    memset(stats, 0, sizeof(struct pogocache_compressstats));
+    int nshards = pogocache_nshards(cache);
+    for (int i = 0; i < nshards; i++) {
+        ACQUIRE_FOR_SCAN_AND_EXECUTE(int, i,
+            compstatsop(shard, stats);
+        );
+    }
+}
+
+/// Returns the index of the shard that the key belongs to.
+int pogocache_shard(struct pogocache *cache, const void *key, size_t keylen) {
+    cache = rootcache(cache);
+    return shard_index(cache, th64(key, keylen, cache->ctx.seed));
+}
+
+// Iterates over the whole shard. The shard lock is held throughout, because
+// entries move between buckets when the map changes.
 static int iterop(struct shard *shard, int shardidx, int64_t now,
     struct pogocache_iter_opts *opts, struct pgctx *ctx)
 {
@@ -1683,7 +3021,7 @@ static int iterop(struct shard *shard, int shardidx, int64_t now,
             continue;
         }
         struct entry *entry = get_entry(bkt);
-        if (!entry_alive(entry, now)) {
+        if (!entry_alive_in(shard, entry, now, ctx)) {
             // Entry has expired
             delbkt(&shard->map, i);
             notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
@@ -1701,8 +3039,48 @@ static int iterop(struct shard *shard, int shardidx, int64_t now,
             uint64_t cas;
             entry_extract(entry, &key, &keylen, buf, &val, &vallen,
                 &expires, &flags, &cas, ctx);
+            expires = entry_soft_expires(entry, expires, ctx);
+            if (keylen < opts->prefixlen ||
+                memcmp(key, opts->prefix, opts->prefixlen) != 0)
+            {
+                continue;
+            }
+            char *tmp = 0;
+            if (opts->keysonly) {
+                val = 0;
+                vallen = 0;
+            } else if (!entry_inflate(entry, &val, &vallen, &tmp, 
+                &shard->comp, ctx))
+            {
+                if (entry->has_spilled) {
+                    // The spilled value is no longer available.
+                    delentry_at_bkt(&shard->map, i, ctx);
+                    notify(shardidx, NOTIFY_LOWMEM, 0, entry, now, ctx);
+                    entry_free(entry, ctx);
+                    i--;
+                    continue;
+                }
+                status = POGOCACHE_NOMEM;
+                break;
+            }
+            if (opts->type) {
+                *opts->type = kind_type(entry_kind(entry));
+            }
+            if (opts->grace || opts->delta) {
+                int64_t grace, delta;
+                entry_refresh(entry, &grace, &delta, ctx);
+                if (opts->grace) {
+                    *opts->grace = grace;
+                }
+                if (opts->delta) {
+                    *opts->delta = delta;
+                }
+            }
             action = opts->entry(shardidx, now, key, keylen, val,
                 vallen, expires, flags, cas, opts->udata);
+            if (tmp) {
+                ctx->free(tmp);
+            }
         }
         if (action != POGOCACHE_ITER_CONTINUE) {
             if (action&POGOCACHE_ITER_DELETE) {
@@ -1729,6 +3107,7 @@ static int iterop(struct shard *shard, int shardidx, int64_t now,
 /// See 'pogocache_iter_opts' for all options.
 /// @return POGOCACHE_FINISHED if iteration completed
 /// @return POGOCACHE_CANCELED if iteration stopped early
+/// @return POGOCACHE_NOMEM if a compressed value cannot be inflated
 int pogocache_iter(struct pogocache *cache, struct pogocache_iter_opts *opts) {
     int nshards = pogocache_nshards(cache);
     opts = opts ? opts : &defiteropts;
@@ -1752,6 +3131,162 @@ int pogocache_iter(struct pogocache *cache, struct pogocache_iter_opts *opts) {
     return POGOCACHE_FINISHED;
 }
 
+// An entry that's being spilled. The value is written to secondary storage
+// without holding the shard lock, and the new entry replaces the old one
+// afterwards, but only if the old one is still in the map.
+struct spillent {
+    struct entry *entry;  // retained entry
+    uint32_t hash;        // bucket hash of the entry
+    struct entry *entry2; // entry with the locator, or null if not written
+};
+
+// Collects up to SPILLBATCH entries that should be spilled, starting at the
+// bucket at 'pos'. The 'pos' is updated with the next bucket, or zero when
+// the whole shard has been visited.
+static int spill_collect(struct shard *shard, int64_t now,
+    struct pogocache_spill_opts *opts, int *pos, struct spillent *ents,
+    struct pgctx *ctx)
+{
+    int n = 0;
+    int i = *pos;
+    for (; i < shard->map.nbuckets && n < SPILLBATCH; i++) {
+        struct bucket *bkt = &shard->map.buckets[i];
+        if (get_dib(bkt) == 0) {
+            continue;
+        }
+        struct entry *entry = get_entry(bkt);
+        if (!entry_alive_in(shard, entry, now, ctx)) {
+            // Leave expired entries for the sweeper.
+            continue;
+        }
+        if (entry->has_spilled) {
+            // Already spilled. Check with the user if it should be rewritten.
+            size_t storedlen, loclen;
+            const char *loc = entry_locator(entry, &storedlen, &loclen, ctx);
+            if (!opts->respill || !opts->respill(loc, loclen, opts->udata)) {
+                continue;
+            }
+        } else {
+            size_t vallen;
+            entry_value(entry, &vallen, ctx);
+            if (entry->has_counter || vallen < opts->minsize || 
+                now-entry_time(entry) < opts->minidle)
+            {
+                continue;
+            }
+        }
+        ents[n++] = (struct spillent){ 
+            .entry = entry_clone(entry), 
+            .hash = get_hash(bkt),
+        };
+    }
+    *pos = i < shard->map.nbuckets ? i : 0;
+    return n;
+}
+
+// Writes the values of the collected entries to secondary storage.
+static void spill_write(struct spillent *ents, int n, struct pgctx *ctx) {
+    char loc[MAXLOCATOR];
+    for (int i = 0; i < n; i++) {
+        struct entry *entry = ents[i].entry;
+        size_t vallen;
+        const char *val = entry_value(entry, &vallen, ctx);
+        char *stored = 0;
+        if (entry->has_spilled) {
+            stored = entry_unspill(entry, &vallen, ctx);
+            if (!stored) {
+                continue;
+            }
+            val = stored;
+        }
+        size_t loclen = ctx->spill(val, vallen, loc, sizeof(loc), ctx->udata);
+        if (loclen > 0 && loclen <= sizeof(loc)) {
+            ents[i].entry2 = entry_spill(entry, vallen, loc, loclen, ctx);
+            if (!ents[i].entry2 && ctx->spillfree) {
+                ctx->spillfree(loc, loclen, ctx->udata);
+            }
+        }
+        if (stored) {
+            ctx->free(stored);
+        }
+    }
+}
+
+// Replaces the collected entries that are unchanged with their spilled
+// entries, and releases the rest. Returns the number of entries replaced.
+static size_t spill_swap(struct shard *shard, int64_t now, 
+    struct pogocache_spill_opts *opts, struct spillent *ents, int n, 
+    struct pgctx *ctx)
+{
+    size_t count = 0;
+    for (int i = 0; i < n; i++) {
+        struct entry *entry = ents[i].entry;
+        struct entry *entry2 = ents[i].entry2;
+        if (entry2) {
+            char buf[128];
+            size_t keylen;
+            const char *key = entry_key(entry, &keylen, buf, ctx);
+            int bidx = map_get_bucket(&shard->map, key, keylen, ents[i].hash,
+                ctx);
+            struct bucket *bkt = bidx == -1 ? 0 : &shard->map.buckets[bidx];
+            if (bkt && get_entry(bkt) == entry && (entry->has_spilled || 
+                now-entry_time(entry) >= opts->minidle))
+            {
+                // The entry was not replaced or used while it was written.
+                entry2->time = entry->time;
+                map_account(&shard->map, entry, -1, ctx);
+                map_account(&shard->map, entry2, 1, ctx);
+                set_entry(bkt, entry2);
+                entry_free(entry, ctx);
+                count++;
+            } else {
+                entry_free(entry2, ctx);
+            }
+        }
+        entry_free(entry, ctx);
+    }
+    return count;
+}
+
+/// Moves cold values to secondary storage using the pogocache_opts.spill
+/// callback, keeping the key and metadata in memory. Spilled values are read
+/// back using the pogocache_opts.unspill callback when accessed.
+/// There's an option to allow for isolating the operation to a single shard.
+/// See 'pogocache_spill_opts' for all options.
+/// @return the number of entries that were spilled
+size_t pogocache_spill(struct pogocache *cache, 
+    struct pogocache_spill_opts *opts)
+{
+    int nshards = pogocache_nshards(cache);
+    opts = opts ? opts : &defspillopts;
+    if (!rootcache(cache)->ctx.spill) {
+        return 0;
+    }
+    int64_t now = opts->time > 0 ? opts->time : getnow();
+    int start = opts->oneshard ? opts->oneshardidx : 0;
+    int end = opts->oneshard ? opts->oneshardidx+1 : nshards;
+    if (start < 0 || end > nshards) {
+        return 0;
+    }
+    size_t count = 0;
+    struct spillent ents[SPILLBATCH];
+    for (int i = start; i < end; i++) {
+        int pos = 0;
+        do {
+            // The shard is only locked while collecting and swapping the
+            // entries, and not while their values are written.
+            int n = ACQUIRE_FOR_SCAN_AND_EXECUTE(int, i,
+                spill_collect(shard, now, opts, &pos, ents, ctx)
+            );
+            spill_write(ents, n, &rootcache(cache)->ctx);
+            count += ACQUIRE_FOR_SCAN_AND_EXECUTE(size_t, i,
+                spill_swap(shard, now, opts, ents, n, ctx)
+            );
+        } while (pos > 0);
+    }
+    return count;
+}
+
 static struct pogocache_entry *entryiter(struct shard *shard, int64_t now,
     int shardidx, int *iter, struct pgctx *ctx)
 {
@@ -1765,7 +3300,7 @@ static struct pogocache_entry *entryiter(struct shard *shard, int64_t now,
             continue;
         }
         struct entry *entry = get_entry(bkt);
-        if (!entry_alive(entry, now)) {
+        if (!entry_alive_in(shard, entry, now, ctx)) {
             // Entry has expired
             delbkt(&shard->map, i);
             notify(shardidx, NOTIFY_EXPIRED, 0, entry, now, ctx);
@@ -1917,7 +3452,7 @@ static int sweepop(struct shard *shard, int shardidx, int64_t now,
         }
         struct entry *entry = get_entry(bkt);
         int64_t expires = entry_expires(entry);
-        if (entry_alive_exp(expires, now)) {
+        if (entry_alive_exp(expires, now) && !entry_invalid(shard, entry, ctx)) {
             // entry is still alive
             (*kept)++;
             continue;
@@ -1932,6 +3467,7 @@ static int sweepop(struct shard *shard, int shardidx, int64_t now,
         // again.
         i--;
     }
+    invals_clear(shard, now, ctx);
     tryshrink(&shard->map, ctx);
     return 0;
 }
@@ -1976,6 +3512,8 @@ void pogocache_sweep(struct pogocache *cache, size_t *swept, size_t *kept,
 static int clearop(struct shard *shard, int shardidx, int64_t now, 
     struct pgctx *ctx, struct bucket **buckets, int *nbuckets, bool deferfree)
 {
+    leases_clear(shard, ctx);
+    invals_clear(shard, INT64_MAX, ctx);
     // loop over entries for callbacks
     for (int i = 0; i < shard->map.nbuckets; i++) {
         struct bucket *bkt = &shard->map.buckets[i];
@@ -2006,6 +3544,8 @@ static int clearop(struct shard *shard, int shardidx, int64_t now,
             sizeof(struct bucket)*shard->map.nbuckets);
         shard->map.count = 0;
         shard->map.entsize = 0;
+        shard->map.rawsize = 0;
+        shard->map.compsize = 0;
         *buckets = 0;
         *nbuckets = 0;
         return 0;
@@ -2042,6 +3582,70 @@ static void aquireclearop(struct pogocache *cache, int shardidx, int64_t now,
     }
 }
 
+// Returns true if the key starts with the prefix.
+static bool hasprefix(const char *key, size_t keylen, const char *prefix,
+    size_t prefixlen)
+{
+    return keylen >= prefixlen && memcmp(key, prefix, prefixlen) == 0;
+}
+
+// Record the invalidation, merged with the pending ones that overlap it. A
+// pending invalidation of a longer prefix is covered by this one when it's
+// not newer, and this one is covered by a pending invalidation of a shorter
+// prefix that is not older. The entries are left for the next sweep.
+static int invalop(struct shard *shard, const void *prefix, size_t prefixlen,
+    int64_t now, struct pgctx *ctx)
+{
+    int i = 0;
+    while (i < shard->ninvals) {
+        struct inval *inval = &shard->invals[i];
+        if (inval->time >= now && hasprefix(prefix, prefixlen, 
+            inval->prefix, inval->prefixlen))
+        {
+            return POGOCACHE_FINISHED;
+        }
+        if (inval->time <= now && hasprefix(inval->prefix, inval->prefixlen,
+            prefix, prefixlen))
+        {
+            ctx->free(inval->prefix);
+            *inval = shard->invals[--shard->ninvals];
+            continue;
+        }
+        i++;
+    }
+    if (!invals_add(shard, prefix, prefixlen, now, ctx)) {
+        return POGOCACHE_NOMEM;
+    }
+    return POGOCACHE_FINISHED;
+}
+
+/// Invalidate all entries whose keys start with a prefix.
+/// This does not scan the cache. Instead each shard records the prefix and
+/// the current time, and entries stored before that time are treated as
+/// missing when they are next accessed. The entries themselves are freed by
+/// the next pogocache_sweep. An invalidation that covers pending ones, such
+/// as a shorter prefix, replaces them.
+/// Entries stored after the invalidation are not affected.
+/// Returns POGOCACHE_FINISHED, or POGOCACHE_NOMEM if some shards could not
+/// record the invalidation.
+int pogocache_invalidate(struct pogocache *cache, const void *prefix,
+    size_t prefixlen, struct pogocache_invalidate_opts *opts)
+{
+    int nshards = pogocache_nshards(cache);
+    opts = opts ? opts : &definvalidateopts;
+    int64_t now = opts->time > 0 ? opts->time : getnow();
+    int status = POGOCACHE_FINISHED;
+    for (int i = 0; i < nshards; i++) {
+        int ret = ACQUIRE_FOR_SCAN_AND_EXECUTE(int, i,
+            invalop(shard, prefix, prefixlen, now, &cache->ctx);
+        );
+        if (ret != POGOCACHE_FINISHED) {
+            status = ret;
+        }
+    }
+    return status;
+}
+
 /// Clear the cache.
 /// There's an option to allow for isolating the operation to a single shard.
 void pogocache_clear(struct pogocache *cache, struct pogocache_clear_opts *opts)
@@ -2062,7 +3666,7 @@ void pogocache_clear(struct pogocache *cache, struct pogocache_clear_opts *opts)
 }
 
 static int sweeppollop(struct shard *shard, int shardidx, int64_t now, 
-    int pollsize, double *percent)
+    int pollsize, double *percent, struct pgctx *ctx)
 {
     // start at random bucket
     int count = 0;
@@ -2075,7 +3679,7 @@ static int sweeppollop(struct shard *shard, int shardidx, int64_t now,
         }
         struct entry *entry = get_entry(bkt);
         count++;
-        dead += !entry_alive(entry, now);
+        dead += !entry_alive_in(shard, entry, now, ctx);
     }
     if (count == 0) {
         *percent = 0;
@@ -2097,7 +3701,7 @@ double pogocache_sweep_poll(struct pogocache *cache,
     int shardidx = mix13(now)%nshards;
     double percent;
     ACQUIRE_FOR_SCAN_AND_EXECUTE(int, shardidx,
-        sweeppollop(shard, shardidx, now, pollsize, &percent);
+        sweeppollop(shard, shardidx, now, pollsize, &percent, &cache->ctx);
     );
     return percent;
 }
@@ -2134,16 +3738,76 @@ const void *pogocache_entry_key(struct pogocache *cache,
     return key;
 }
 
+static __thread char *thvalue;
+static __thread void (*thvaluefree)(void*);
+
+/// Returns the value of the entry.
+/// A compressed, spilled, or counter value is inflated into a thread local
+/// buffer, which remains valid until the next call to this function on the
+/// same thread.
+/// Returns null if the value cannot be inflated.
 const void *pogocache_entry_value(struct pogocache *cache,
     struct pogocache_entry *entry, size_t *valuelen)
 {
     const void *value = 0;
     size_t valuelen0 = 0;
+    if (thvalue) {
+        thvaluefree(thvalue);
+        thvalue = 0;
+    }
     if (entry) {
-        value = entry_value((struct entry*)entry, &valuelen0, &cache->ctx);
+        cache = rootcache(cache);
+        struct pgctx *ctx = &cache->ctx;
+        const char *val = entry_value((struct entry*)entry, &valuelen0, ctx);
+        char buf[128];
+        size_t keylen;
+        const char *key = entry_key((struct entry*)entry, &keylen, buf, ctx);
+        struct shard *shard = &cache->shards[shard_index(cache, 
+            th64(key, keylen, ctx->seed))];
+        if (entry_inflate((struct entry*)entry, &val, &valuelen0, &thvalue,
+            &shard->comp, ctx))
+        {
+            thvaluefree = cache->ctx.free;
+            value = val;
+        } else {
+            valuelen0 = 0;
+        }
     }
     if (valuelen) {
         *valuelen = valuelen0;
     }
     return value;
 }
+
+/// Returns the type of the entry, POGOCACHE_TYPE_STRING or
+/// POGOCACHE_TYPE_HASH.
+int pogocache_entry_type(struct pogocache *cache, 
+    struct pogocache_entry *entry)
+{
+    (void)cache;
+    return kind_type(entry_kind((struct entry*)entry));
+}
+
+/// Returns the expiration, flags, cas, grace period, and recompute time of
+/// the entry. The expiration excludes the grace period. Any of the output
+/// params may be null.
+void pogocache_entry_info(struct pogocache *cache,
+    struct pogocache_entry *entry, int64_t *expires, uint32_t *flags,
+    uint64_t *cas, int64_t *grace, int64_t *delta)
+{
+    cache = rootcache(cache);
+    struct entry *e = (struct entry*)entry;
+    int64_t exp;
+    entry_extract(e, 0, 0, 0, 0, 0, &exp, flags, cas, &cache->ctx);
+    int64_t g, d;
+    entry_refresh(e, &g, &d, &cache->ctx);
+    if (expires) {
+        *expires = entry_soft_expires(e, exp, &cache->ctx);
+    }
+    if (grace) {
+        *grace = g;
+    }
+    if (delta) {
+        *delta = d;
+    }
+}
@@ -23,6 +23,14 @@
 #define POGOCACHE_FINISHED 6
 #define POGOCACHE_CANCELED 7
 #define POGOCACHE_NOMEM    8
+#define POGOCACHE_NOTNUMBER 9
+#define POGOCACHE_OVERFLOW 10
+#define POGOCACHE_WRONGTYPE 11
+#define POGOCACHE_SPILLED 12
+
+// Types of entries, see pogocache_modify
+#define POGOCACHE_TYPE_STRING 0 // plain value
+#define POGOCACHE_TYPE_HASH   1 // encoded hash of fields, managed by the user
 
 // Helper constants for ttls and expiration timestamps
 #define POGOCACHE_NANOSECOND  INT64_C(1)
@@ -62,6 +70,28 @@ struct pogocache_opts {
     // Deleted (new == null && old != null)
     void (*notify)(int shard, int64_t time, struct pogocache_entry *new_entry, 
         struct pogocache_entry *old_entry, void *udata);
+    // The 'compress' and 'decompress' callbacks enable transparent value
+    // compression. Values that are at least 'compressmin' bytes are passed
+    // to 'compress', which writes up to 'dstcap' bytes to 'dst' and returns
+    // the compressed size, or zero if the value could not be made smaller.
+    // The 'decompress' callback must write exactly 'dstlen' bytes to 'dst',
+    // returning false on failure.
+    size_t (*compress)(const void *src, size_t srclen, void *dst,
+        size_t dstcap, void *udata);
+    bool (*decompress)(const void *src, size_t srclen, void *dst,
+        size_t dstlen, void *udata);
+    // The 'spill', 'unspill', and 'spillfree' callbacks enable tiered
+    // storage, see pogocache_spill. The 'spill' callback writes a value to
+    // secondary storage and fills 'locator' with up to 'cap' bytes describing
+    // where it was written, returning the locator size or zero on failure.
+    // The 'unspill' callback reads the value back, returning false if it's no
+    // longer available, in which case the entry is treated as evicted.
+    // The 'spillfree' callback is called when a spilled entry is freed.
+    size_t (*spill)(const void *value, size_t valuelen, void *locator,
+        size_t cap, void *udata);
+    bool (*unspill)(const void *locator, size_t loclen, void *dst,
+        size_t dstlen, void *udata);
+    void (*spillfree)(const void *locator, size_t loclen, void *udata);
     void *udata;         // user data for above callbacks
     // functionality options
     bool usecas;         // enable the compare-and-store operation
@@ -69,9 +99,11 @@ struct pogocache_opts {
     bool noevict;        // disable all eviction
     bool allowshrink;    // allow hashmap shrinking
     bool usethreadbatch; // use a thread local batch (non-reentrant)
+    bool lockstats;      // count shard lock acquisitions and waits
     int nshards;         // default 65536
     int loadfactor;      // default 75%
     uint64_t seed;       // custom hash seed, default zero
+    size_t compressmin;  // minimum value size to compress, default 1024
 };
 
 struct pogocache_store_opts {
@@ -85,6 +117,13 @@ struct pogocache_store_opts {
     bool nx;         // 
     bool xx;         // 
     bool lowmem;     // tells the operation that the system is low on memory
+    uint64_t lease;  // only store when this lease token is still valid
+    // Keep serving the entry this long after it expires, to the loads that
+    // use the 'stale' option. Expirations that are reported back to
+    // callbacks do not include the grace period.
+    int64_t grace;
+    int64_t delta;   // time it took to compute the value, for early refresh
+    int type;        // type of the entry (default: POGOCACHE_TYPE_STRING)
     // The 'entry' callback returns the value of the old entry about to be
     // replaced by the new entry. This give the caller a chance to take a peek
     // at the entry before it gets replaced. Return true to store the new entry
@@ -95,6 +134,15 @@ struct pogocache_store_opts {
     void *udata;
 };
 
+struct pogocache_incr_opts {
+    int64_t time;    // current time (default: use internal monotonic clock)
+    bool isunsigned; // value is an unsigned 64-bit integer (default: signed)
+    bool decr;       // subtract the delta instead of adding it
+    bool nocreate;   // do not create the entry when it does not exist
+    bool wrap;       // wrap around on overflow instead of failing
+    bool lowmem;     // tells the operation that the system is low on memory
+};
+
 struct pogocache_update {
     const void *value;
     size_t valuelen;
@@ -102,9 +150,42 @@ struct pogocache_update {
     int64_t expires;
 };
 
+struct pogocache_modify_opts {
+    int64_t time;    // current time (default: use internal monotonic clock)
+    int type;        // type of the entry (default: POGOCACHE_TYPE_STRING)
+    bool lowmem;     // tells the operation that the system is low on memory
+    // The 'entry' callback is called with the value of the entry, or with a
+    // null value when the entry does not exist. Set 'update' to store a new
+    // value, or to delete the entry by using a null update value.
+    void (*entry)(int shard, int64_t time, const void *key, size_t keylen,
+        const void *value, size_t valuelen, int64_t expires, uint32_t flags,
+        struct pogocache_update **update, void *udata);
+    void *udata;
+};
+
 struct pogocache_load_opts {
     int64_t time;       // current time (default: use internal monotonic clock)
     bool notouch;       // do not update lru
+    // The 'lease' option grants a lease on a miss, lasting this many
+    // nanoseconds. The token is written to 'leasetoken', or zero when another
+    // caller already holds the lease. A lease ends when the entry is stored,
+    // deleted, or the lease expires.
+    int64_t lease;
+    uint64_t *leasetoken;
+    // The 'refresh' output is set to true when the entry was found but should
+    // be recomputed, because it's in its grace period or it was picked for
+    // an early refresh, see pogocache_store_opts.grace and delta. With the
+    // 'lease' option, a lease is granted to the first caller to refresh it.
+    // Both outputs are set before the 'entry' callback is called.
+    bool *refresh;
+    // The 'stale' option also returns entries that are in their grace period,
+    // which are otherwise treated as missing. Use it with 'refresh' to tell
+    // a stale value apart.
+    bool stale;
+    int *type;          // output: type of the entry, set before 'entry'
+    // The 'nospilled' option returns POGOCACHE_SPILLED, instead of reading
+    // the value from secondary storage, when the value has been spilled.
+    bool nospilled;
     // The 'entry' callback return the value of the entry. This is required to
     // retreive the value of the current entry.
     void (*entry)(int shard, int64_t time, const void *key, size_t keylen,
@@ -129,6 +210,12 @@ struct pogocache_iter_opts {
     int64_t time;       // current time (default: use internal monotonic clock)
     bool oneshard;      // only iter over one shard (default: all shards)
     int oneshardidx;    // index of one shard iteration, if oneshard is true. 
+    int *type;          // output: type of each entry, set before 'entry'
+    int64_t *grace;     // output: grace period of each entry, ditto
+    int64_t *delta;     // output: recompute time of each entry, ditto
+    bool keysonly;      // do not load values, the 'value' is null
+    const void *prefix; // only entries with keys that start with prefix
+    size_t prefixlen;
     // The 'entry' callback is called for each entry in the cache.
     // Return POGOCACHE_ITER_NEXT to continue iterating
     // Return POGOCACHE_ITER_STOP to stop iterating
@@ -173,14 +260,55 @@ struct pogocache_clear_opts {
     bool deferfree;     // defer freeing entries until after unlocked.
 };
 
+struct pogocache_invalidate_opts {
+    int64_t time;       // current time (default: use internal monotonic clock)
+};
+
 struct pogocache_sweep_poll_opts {
     int64_t time;  // current time (default: use internal monotonic clock)
     int pollsize;  // number of entries to poll (default: 20)
 };
 
+struct pogocache_lockstats_opts {
+    bool oneshard;      // only include one shard (default: all shards)
+    int oneshardidx;    // index of one shard, if oneshard is true.
+};
+
+struct pogocache_lockstats {
+    uint64_t acquisitions; // number of times the shard locks were acquired
+    uint64_t contended;    // acquisitions that had to wait on another thread
+    uint64_t waitns;       // total nanoseconds spent waiting
+};
+
+struct pogocache_spill_opts {
+    int64_t time;       // current time (default: use internal monotonic clock)
+    bool oneshard;      // only spill one shard (default: all shards)
+    int oneshardidx;    // index of one shard to spill, if oneshard is true.
+    size_t minsize;     // only spill values that are at least this size
+    int64_t minidle;    // only spill entries that have been idle this long
+    // The 'respill' callback is called for entries that are already spilled.
+    // Return true to read the value back and spill it again, such as when
+    // compacting the storage that holds it.
+    bool (*respill)(const void *locator, size_t loclen, void *udata);
+    void *udata;
+};
+
+struct pogocache_compressstats {
+    uint64_t compressed;   // number of values stored compressed
+    uint64_t rejected;     // values that were not made smaller
+    uint64_t inflated;     // number of compressed values read back
+    uint64_t compressns;   // total nanoseconds spent compressing
+    uint64_t inflatens;    // total nanoseconds spent decompressing
+    uint64_t rawbytes;     // original size of compressed values in the cache
+    uint64_t storedbytes;  // stored size of compressed values in the cache
+};
+
 // initialize/destroy
 struct pogocache *pogocache_new(struct pogocache_opts *opts);
 void pogocache_free(struct pogocache *cache);
+struct pogocache *pogocache_attach(void *mem, struct pogocache_opts *opts);
+bool pogocache_compatible(void *mem, struct pogocache_opts *opts);
+void pogocache_detach(struct pogocache *cache);
 
 // batching
 struct pogocache *pogocache_begin(struct pogocache *cache);
@@ -193,6 +321,10 @@ int pogocache_store(struct pogocache *cache, const void *key, size_t keylen,
     const void *value, size_t valuelen, struct pogocache_store_opts *opts);
 int pogocache_load(struct pogocache *cache, const void *key, size_t keylen, 
     struct pogocache_load_opts *opts);
+int pogocache_incr(struct pogocache *cache, const void *key, size_t keylen,
+    uint64_t delta, uint64_t *value, struct pogocache_incr_opts *opts);
+int pogocache_modify(struct pogocache *cache, const void *key, size_t keylen,
+    struct pogocache_modify_opts *opts);
 
 // scan operations
 int pogocache_iter(struct pogocache *cache, struct pogocache_iter_opts *opts);
@@ -202,6 +334,10 @@ double pogocache_sweep_poll(struct pogocache *cache,
     struct pogocache_sweep_poll_opts *opts);
 void pogocache_clear(struct pogocache *cache,
     struct pogocache_clear_opts *opts);
+int pogocache_invalidate(struct pogocache *cache, const void *prefix,
+    size_t prefixlen, struct pogocache_invalidate_opts *opts);
+size_t pogocache_spill(struct pogocache *cache, 
+    struct pogocache_spill_opts *opts);
 
 // stat operations
 size_t pogocache_count(struct pogocache *cache,
@@ -210,9 +346,14 @@ uint64_t pogocache_total(struct pogocache *cache,
     struct pogocache_total_opts *opts);
 size_t pogocache_size(struct pogocache *cache,
     struct pogocache_size_opts *opts);
+void pogocache_lockstats(struct pogocache *cache, 
+    struct pogocache_lockstats *stats, struct pogocache_lockstats_opts *opts);
+void pogocache_compressstats(struct pogocache *cache,
+    struct pogocache_compressstats *stats);
 
 // utilities
 int pogocache_nshards(struct pogocache *cache);
+int pogocache_shard(struct pogocache *cache, const void *key, size_t keylen);
 int64_t pogocache_now(void);
 
 void pogocache_entry_retain(struct pogocache *cache,
@@ -222,8 +363,16 @@ void pogocache_entry_release(struct pogocache *cache,
 
 const void *pogocache_entry_key(struct pogocache *cache,
     struct pogocache_entry *entry, size_t *keylen, char buf[128]);
+// The value of a compressed, spilled, or counter entry is inflated into a
+// thread local buffer. That value is only valid until the next call to
+// pogocache_entry_value on the same thread, so copy it to keep it longer.
 const void *pogocache_entry_value(struct pogocache *cache,
     struct pogocache_entry *entry, size_t *valuelen);
+void pogocache_entry_info(struct pogocache *cache,
+    struct pogocache_entry *entry, int64_t *expires, uint32_t *flags,
+    uint64_t *cas, int64_t *grace, int64_t *delta);
+int pogocache_entry_type(struct pogocache *cache,
+    struct pogocache_entry *entry);
 
 struct pogocache_entry *pogocache_entry_iter(struct pogocache *cache,
     int64_t time, uint64_t *cursor);
@@ -28,6 +28,11 @@
 
 #define TEXTOID     25
 #define BYTEAOID    17
+#define INT8OID     20
+#define INT2OID     21
+#define INT4OID     23
+#define FLOAT4OID   700
+#define FLOAT8OID   701
 
 extern const char *version;
 extern const char *auth;
@@ -163,11 +168,15 @@ static void arg_append_unescape_simplestr(struct args *args, const char *str,
 static void pg_statement_free(struct pg_statement *statement) {
     args_free(&statement->args);
     buf_clear(&statement->argtypes);
+    buf_clear(&statement->paramoids);
+    xfree(statement->rowdesc);
+    buf_clear(&statement->rowdescfmts);
 }
 
 
 static void pg_portal_free(struct pg_portal *portal) {
     args_free(&portal->params);
+    buf_clear(&portal->resultfmts);
 }
 
 static void statments_free(struct hashmap *map) {
@@ -213,6 +222,9 @@ void pg_free(struct pg *pg) {
     xfree(pg->database);
     xfree(pg->user);
     buf_clear(&pg->buf);
+    buf_clear(&pg->copybuf);
+    xfree(pg->copyerr);
+    buf_clear(&pg->resultfmts);
     statments_free(pg->statements);
     portals_free(pg->portals);
     args_free(&pg->targs);
@@ -284,6 +296,20 @@ static void statement_insert(struct pg *pg, struct pg_statement *stmt) {
     }
 }
 
+// Returns the statement stored in the map, or NULL if not found.
+static struct pg_statement *statement_ptr(struct pg *pg, const char *name) {
+    if (!pg->statements) {
+        return 0;
+    }
+    size_t namelen = strlen(name);
+    if (namelen >= PGNAMEDATALEN) {
+        return 0;
+    }
+    struct pg_statement key = { 0 };
+    strcpy(key.name, name);
+    return (struct pg_statement*)hashmap_get(pg->statements, &key);
+}
+
 static bool statement_get(struct pg *pg, const char *name, 
     struct pg_statement *stmt)
 {
@@ -695,6 +721,9 @@ static size_t parseQ(const char *data, size_t len, struct args *args,
     parse_begin();
     const char *query = parse_cstr();
     parse_end();
+    // Simple queries always return text results.
+    pg->stmt[0] = '\0';
+    pg->resultfmts.len = 0;
     int nparams = 0;
     bool pok = parse_cache_query_args(query, args, &nparams, 0);
     if (!pok) {
@@ -726,15 +755,20 @@ static size_t parseP(const char *data, size_t len, struct args *args,
     uint16_t num_param_types = parse_int16();
     // dprintf(". Parse [%s] [%s] [%d]\n", stmt_name, query,
     //    (int)num_param_types);
+    struct buf paramoids = { 0 };
     for (uint16_t i = 0; i < num_param_types; i++) {
         int32_t param_type = parse_int32();
-        (void)param_type;
+        buf_append(&paramoids, &param_type, 4);
         // dprintf(".       [%d]\n", param_type);
     }
-    parse_end();
+    if ((size_t)(p-data) != len) {
+        buf_clear(&paramoids);
+        return -1;
+    }
     if (strlen(stmt_name) >= PGNAMEDATALEN) {
         parse_seterror("statement name too large");
         pg->error = 1;
+        buf_clear(&paramoids);
         return len;
     }
     int nparams = 0;
@@ -744,6 +778,7 @@ static size_t parseP(const char *data, size_t len, struct args *args,
         pg->error = 1;
         args_clear(args);
         buf_clear(&argtypes);
+        buf_clear(&paramoids);
         return len;
     }
     // copy over last statement
@@ -756,6 +791,7 @@ static size_t parseP(const char *data, size_t len, struct args *args,
     }
     args_clear(args);
     stmt.argtypes = argtypes;
+    stmt.paramoids = paramoids;
     statement_insert(pg, &stmt);
     pg->parse = 1;
     return len;
@@ -857,7 +893,45 @@ static size_t parseD(const char *data, size_t len, struct args *args,
     return len;
 }
 
-static size_t parseB(const char *data, size_t len, struct args *args, 
+static int64_t read_i64(const char *data) {
+    return ((uint64_t)(uint32_t)read_i32(data) << 32) |
+           ((uint64_t)(uint32_t)read_i32(data+4));
+}
+
+// Appends a Bind parameter. Binary numbers are converted to text, which is
+// what the commands expect. Other binary parameters are used as is.
+static void append_param(struct args *args, const char *b, size_t len,
+    bool binary, int32_t oid)
+{
+    char str[32];
+    int n = -1;
+    if (binary) {
+        if (oid == INT2OID && len == 2) {
+            n = snprintf(str, sizeof(str), "%d", (int)read_i16(b));
+        } else if (oid == INT4OID && len == 4) {
+            n = snprintf(str, sizeof(str), "%" PRId32, read_i32(b));
+        } else if (oid == INT8OID && len == 8) {
+            n = snprintf(str, sizeof(str), "%" PRId64, read_i64(b));
+        } else if (oid == FLOAT8OID && len == 8) {
+            uint64_t x = read_i64(b);
+            double d;
+            memcpy(&d, &x, 8);
+            n = snprintf(str, sizeof(str), "%.17g", d);
+        } else if (oid == FLOAT4OID && len == 4) {
+            uint32_t x = read_i32(b);
+            float f;
+            memcpy(&f, &x, 4);
+            n = snprintf(str, sizeof(str), "%.9g", (double)f);
+        }
+    }
+    if (n >= 0) {
+        args_append(args, str, n, false);
+    } else {
+        args_append(args, b, len, false);
+    }
+}
+
+static size_t parseB(const char *data, size_t len, struct args *args,
     struct pg *pg)
 {
     (void)args, (void)pg;
@@ -883,6 +957,7 @@ static size_t parseB(const char *data, size_t len, struct args *args,
     const char *portal_name = parse_cstr();
     const char *stmt_name = parse_cstr();
     int num_formats = parse_int16();
+    const char *formats = p;
     for (int i = 0; i < num_formats; i++) {
         int format = parse_int16();
         if (format != 0 && format != 1) {
@@ -892,6 +967,8 @@ static size_t parseB(const char *data, size_t len, struct args *args,
         }
     }
     uint16_t num_params = parse_int16();
+    // The declared parameter types are needed for binary parameters.
+    struct pg_statement *stmt = statement_ptr(pg, stmt_name);
     args_clear(&pg->targs);
     for (int i = 0; i < num_params; i++) {
         int32_t len = parse_int32();
@@ -900,24 +977,32 @@ static size_t parseB(const char *data, size_t len, struct args *args,
             len = 0;
         }
         const char *b = parse_bytes(len);
-        args_append(&pg->targs, b, len, false);
+        bool binary = num_formats > 0 &&
+            read_i16(formats+(num_formats == 1 ? 0 : i)*2) == 1;
+        int32_t oid = 0;
+        if (binary && stmt && (size_t)i < stmt->paramoids.len/4) {
+            memcpy(&oid, stmt->paramoids.data+i*4, 4);
+        }
+        append_param(&pg->targs, b, len, binary, oid);
     }
-    // ignore result formats
     uint16_t num_result_formats = parse_int16();
+    struct buf resultfmts = { 0 };
     for (int i = 0; i < num_result_formats; i++) {
-        int result_format_codes = parse_int16();
-        (void)result_format_codes;
+        int result_format_code = parse_int16();
+        buf_append_byte(&resultfmts, result_format_code == 1);
     }
-    parse_end();
-
-    if (strlen(portal_name) >= PGNAMEDATALEN) {
-        parse_seterror("portal name too large");
-        pg->error = 1;
-        return len;
+    if ((size_t)(p-data) != len) {
+        buf_clear(&resultfmts);
+        return -1;
     }
-    if (strlen(stmt_name) >= PGNAMEDATALEN) {
-        parse_seterror("statement name too large");
+
+    if (strlen(portal_name) >= PGNAMEDATALEN ||
+        strlen(stmt_name) >= PGNAMEDATALEN)
+    {
+        parse_seterror(strlen(portal_name) >= PGNAMEDATALEN ? 
+            "portal name too large" : "statement name too large");
         pg->error = 1;
+        buf_clear(&resultfmts);
         return len;
     }
     struct pg_portal portal = { 0 };
@@ -925,6 +1010,7 @@ static size_t parseB(const char *data, size_t len, struct args *args,
     strcpy(portal.stmt, stmt_name);
     memcpy(&portal.params, &pg->targs, sizeof(struct args));
     memset(&pg->targs, 0, sizeof(struct args));
+    portal.resultfmts = resultfmts;
     portal_insert(pg, &portal);
     pg->bind = 1;
     return len;
@@ -971,6 +1057,13 @@ static size_t parseE(const char *data, size_t len, struct args *args,
     }
     // ignore max_rows
     (void)max_rows;
+    // Results are written in the portal's formats.
+    strcpy(pg->stmt, portal.stmt);
+    pg->resultfmts.len = 0;
+    if (portal.resultfmts.len > 0) {
+        buf_append(&pg->resultfmts, portal.resultfmts.data,
+            portal.resultfmts.len);
+    }
 
     // 
     args_clear(&pg->targs);
@@ -1062,6 +1155,252 @@ static size_t parsep(const char *data, size_t len, struct args *args,
     return len;
 }
 
+// Number of pending COPY FROM STDIN bytes that are gathered before the rows
+// are stored, allowing for rows to be stored in batches.
+#define COPYBATCH 262144
+
+static const char copysig[] = "PGCOPY\n\377\r\n\0";
+
+static void copy_fail(struct pg *pg, const char *msg) {
+    if (!pg->copyerr) {
+        pg->copyerr = xmalloc(strlen(msg)+1);
+        strcpy(pg->copyerr, msg);
+    }
+}
+
+// Unescapes a text format column in place. Returns the new length, or -1 for
+// a NULL.
+static ssize_t copy_unescape(char *col, size_t len) {
+    if (len == 2 && col[0] == '\\' && col[1] == 'N') {
+        return -1;
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        char ch = col[i];
+        if (ch == '\\' && i+1 < len) {
+            i++;
+            ch = col[i];
+            switch (ch) {
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case 'v': ch = '\v'; break;
+            case 'x':
+                if (i+1 < len && isxdigit(col[i+1])) {
+                    int x = 0;
+                    for (int k = 0; k < 2 && i+1 < len && isxdigit(col[i+1]);
+                        k++)
+                    {
+                        i++;
+                        x = x*16 + (isdigit(col[i]) ? col[i]-'0' :
+                            (tolower(col[i])-'a'+10));
+                    }
+                    ch = x;
+                }
+                break;
+            default:
+                if (ch >= '0' && ch <= '7') {
+                    int x = ch-'0';
+                    for (int k = 0; k < 2 && i+1 < len && col[i+1] >= '0' &&
+                        col[i+1] <= '7'; k++)
+                    {
+                        i++;
+                        x = x*8 + (col[i]-'0');
+                    }
+                    ch = x;
+                }
+            }
+        }
+        col[j++] = ch;
+    }
+    return j;
+}
+
+// Reads the text format rows, "key\tvalue\n", from the pending copy data.
+static void copy_text_rows(struct pg *pg, struct args *args, bool final) {
+    char *data = pg->copybuf.data;
+    size_t len = pg->copybuf.len;
+    while (pg->copypos < len && !pg->copyend && !pg->copyerr) {
+        char *line = data+pg->copypos;
+        char *eol = memchr(line, '\n', len-pg->copypos);
+        if (!eol && !final) {
+            break;
+        }
+        size_t linelen = eol ? (size_t)(eol-line) : len-pg->copypos;
+        pg->copypos += eol ? linelen+1 : linelen;
+        if (linelen > 0 && line[linelen-1] == '\r') {
+            linelen--;
+        }
+        if (linelen == 2 && line[0] == '\\' && line[1] == '.') {
+            // end of data marker
+            pg->copyend = true;
+            break;
+        }
+        char *tab = memchr(line, '\t', linelen);
+        if (!tab) {
+            copy_fail(pg, "missing data for column \"value\"");
+            break;
+        }
+        if (memchr(tab+1, '\t', linelen-(tab+1-line))) {
+            copy_fail(pg, "extra data after last expected column");
+            break;
+        }
+        ssize_t keylen = copy_unescape(line, tab-line);
+        ssize_t vallen = copy_unescape(tab+1, linelen-(tab+1-line));
+        if (keylen < 0 || vallen < 0) {
+            copy_fail(pg, "null values are not allowed");
+            break;
+        }
+        args_append(args, line, keylen, true);
+        args_append(args, tab+1, vallen, true);
+    }
+}
+
+// Reads the binary format tuples from the pending copy data.
+static void copy_binary_rows(struct pg *pg, struct args *args) {
+    const char *data = pg->copybuf.data;
+    size_t len = pg->copybuf.len;
+    if (!pg->copyhdr) {
+        if (len < 19) {
+            return;
+        }
+        uint32_t extlen = read_i32(data+15);
+        if (memcmp(data, copysig, 11) != 0 || (read_i32(data+11)&0x1FFFF)) {
+            copy_fail(pg, "invalid COPY file header");
+            return;
+        }
+        if (len-19 < extlen) {
+            return;
+        }
+        pg->copypos = 19+extlen;
+        pg->copyhdr = true;
+    }
+    while (pg->copypos+2 <= len && !pg->copyend && !pg->copyerr) {
+        const char *p = data+pg->copypos;
+        size_t n = len-pg->copypos;
+        int16_t nfields = read_i16(p);
+        if (nfields == -1) {
+            // trailer
+            pg->copyend = true;
+            pg->copypos += 2;
+            break;
+        }
+        if (nfields != 2) {
+            copy_fail(pg, "row field count does not match, expected 2");
+            break;
+        }
+        if (n < 2+4) {
+            break;
+        }
+        int32_t keylen = read_i32(p+2);
+        if (keylen < 0) {
+            copy_fail(pg, "null values are not allowed");
+            break;
+        }
+        if (n < 2+4+(size_t)keylen+4) {
+            break;
+        }
+        int32_t vallen = read_i32(p+2+4+keylen);
+        if (vallen < 0) {
+            copy_fail(pg, "null values are not allowed");
+            break;
+        }
+        if (n < 2+4+(size_t)keylen+4+vallen) {
+            break;
+        }
+        args_append(args, p+2+4, keylen, true);
+        args_append(args, p+2+4+keylen+4, vallen, true);
+        pg->copypos += 2+4+keylen+4+vallen;
+    }
+}
+
+// Hands off the complete rows of the pending copy data as the arguments
+// "_copyrows key value [key value ...]". The arguments reference the copy
+// buffer, which is compacted when the next copy data message is read.
+static void copy_rows(struct pg *pg, struct args *args, bool final) {
+    args_append(args, "_copyrows", 9, true);
+    if (pg->copy == PG_COPY_BINARY) {
+        copy_binary_rows(pg, args);
+    } else {
+        copy_text_rows(pg, args, final);
+    }
+    if (final && !pg->copyerr && pg->copypos < pg->copybuf.len &&
+        (pg->copy == PG_COPY_BINARY || !pg->copyend))
+    {
+        copy_fail(pg, "unexpected EOF in COPY data");
+    }
+}
+
+static size_t parsed(const char *data, size_t len, struct args *args,
+    struct pg *pg)
+{
+    // CopyData
+    if (!pg->copy) {
+        parse_seterror("unexpected copy data");
+        pg->error = 1;
+        return len;
+    }
+    if (pg->copyend || pg->copyerr) {
+        // Everything that follows is ignored.
+        return len;
+    }
+    if (pg->copypos > 0) {
+        size_t n = pg->copybuf.len-pg->copypos;
+        memmove(pg->copybuf.data, pg->copybuf.data+pg->copypos, n);
+        pg->copybuf.len = n;
+        pg->copypos = 0;
+    }
+    buf_append(&pg->copybuf, data, len);
+    if (pg->copybuf.len >= COPYBATCH) {
+        copy_rows(pg, args, false);
+        if (pg->copybuf.len-pg->copypos > MAXARGSZ) {
+            // The row that's still incomplete is too large to ever be
+            // stored. Everything that follows is ignored.
+            copy_fail(pg, "COPY row is too large");
+        }
+    }
+    return len;
+}
+
+static size_t parsec(const char *data, size_t len, struct args *args,
+    struct pg *pg)
+{
+    // CopyDone
+    parse_begin();
+    parse_end();
+    if (!pg->copy) {
+        // Ignored outside of a copy, like Postgres does.
+        return len;
+    }
+    if (pg->copyend || pg->copyerr) {
+        args_append(args, "_copyrows", 9, true);
+    } else {
+        copy_rows(pg, args, true);
+    }
+    pg->copydone = true;
+    return len;
+}
+
+static size_t parsef(const char *data, size_t len, struct args *args,
+    struct pg *pg)
+{
+    // CopyFail
+    parse_begin();
+    const char *msg = parse_cstr();
+    parse_end();
+    if (!pg->copy) {
+        return len;
+    }
+    char err[256];
+    snprintf(err, sizeof(err), "COPY from stdin failed: %s", msg);
+    copy_fail(pg, err);
+    args_append(args, "_copyrows", 9, true);
+    pg->copydone = true;
+    return len;
+}
+
 static ssize_t parse_message(const char *data, size_t len, struct args *args,
     struct pg *pg)
 {
@@ -1101,6 +1440,15 @@ static ssize_t parse_message(const char *data, size_t len, struct args *args,
     case 'S':
         ret = parseS(data, msglen, args, pg);
         break;
+    case 'd':
+        ret = parsed(data, msglen, args, pg);
+        break;
+    case 'c':
+        ret = parsec(data, msglen, args, pg);
+        break;
+    case 'f':
+        ret = parsef(data, msglen, args, pg);
+        break;
     default:
         pg->error = 1;
         parse_errorf("unknown message '%c'", msgbyte);
@@ -1253,6 +1601,135 @@ void pg_write_ready(struct conn *conn, unsigned char code) {
     }
 }
 
+static void write_copy_response(struct conn *conn, char type, bool binary,
+    int ncols)
+{
+    // Byte1('G' or 'H')
+    // Int32 length
+    // Int8 overall_format
+    // Int16 num_columns
+    // Int16[] column_formats
+    size_t size = 1+4+1+2+ncols*2;
+    char bytes[64];
+    assert(size <= sizeof(bytes));
+    bytes[0] = type;
+    write_i32(bytes+1, size-1);
+    bytes[5] = binary;
+    write_i16(bytes+6, ncols);
+    for (int i = 0; i < ncols; i++) {
+        write_i16(bytes+8+i*2, binary);
+    }
+    conn_write_raw(conn, bytes, size);
+}
+
+// Starts a COPY FROM STDIN of key and value rows.
+void pg_copy_begin(struct conn *conn, bool binary) {
+    struct pg *pg = conn_pg(conn);
+    pg->copy = binary ? PG_COPY_BINARY : PG_COPY_TEXT;
+    pg->copyhdr = false;
+    pg->copyend = false;
+    pg->copydone = false;
+    pg->copycount = 0;
+    pg->copybuf.len = 0;
+    pg->copypos = 0;
+    write_copy_response(conn, 'G', binary, 2);
+}
+
+bool pg_copying(struct conn *conn) {
+    return conn_pg(conn)->copy != 0;
+}
+
+// Called after a batch of COPY FROM STDIN rows have been stored. Responds to
+// the client once the copy is done.
+void pg_copy_stored(struct conn *conn, size_t count, const char *err) {
+    struct pg *pg = conn_pg(conn);
+    pg->copycount += count;
+    if (err) {
+        copy_fail(pg, err);
+    }
+    if (!pg->copydone) {
+        return;
+    }
+    if (pg->copyerr) {
+        pg_write_error(conn, pg->copyerr);
+    } else {
+        pg_write_completef(conn, "COPY %" PRIu64, pg->copycount);
+    }
+    pg_write_ready(conn, 'I');
+    pg->copy = 0;
+    xfree(pg->copyerr);
+    pg->copyerr = 0;
+    if (pg->copybuf.cap > COPYBATCH*2) {
+        buf_clear(&pg->copybuf);
+    }
+    pg->copybuf.len = 0;
+    pg->copypos = 0;
+}
+
+// Starts a COPY TO STDOUT.
+void pg_write_copy_out(struct conn *conn, bool binary, int ncols) {
+    write_copy_response(conn, 'H', binary, ncols);
+    if (binary) {
+        char hdr[19+5];
+        hdr[0] = 'd';
+        write_i32(hdr+1, 4+19);
+        memcpy(hdr+5, copysig, 11);
+        write_i32(hdr+5+11, 0); // flags
+        write_i32(hdr+5+15, 0); // header extension length
+        conn_write_raw(conn, hdr, sizeof(hdr));
+    }
+}
+
+// Writes one COPY TO STDOUT row as a CopyData message.
+void pg_write_copy_row(struct conn *conn, bool binary, const char **cols,
+    const size_t *collens, int ncols)
+{
+    // The row buffer is reused for all rows of the thread.
+    static __thread struct buf row = { 0 };
+    row.len = 0;
+    buf_append(&row, "d\0\0\0\0", 5);
+    if (binary) {
+        char n[4];
+        write_i16(n, ncols);
+        buf_append(&row, n, 2);
+        for (int i = 0; i < ncols; i++) {
+            write_i32(n, collens[i]);
+            buf_append(&row, n, 4);
+            buf_append(&row, cols[i], collens[i]);
+        }
+    } else {
+        for (int i = 0; i < ncols; i++) {
+            if (i > 0) {
+                buf_append_byte(&row, '\t');
+            }
+            for (size_t j = 0; j < collens[i]; j++) {
+                char ch = cols[i][j];
+                switch (ch) {
+                case '\\': buf_append(&row, "\\\\", 2); break;
+                case '\t': buf_append(&row, "\\t", 2); break;
+                case '\n': buf_append(&row, "\\n", 2); break;
+                case '\r': buf_append(&row, "\\r", 2); break;
+                default: buf_append_byte(&row, ch);
+                }
+            }
+        }
+        buf_append_byte(&row, '\n');
+    }
+    write_i32(row.data+1, row.len-1);
+    conn_write_raw(conn, row.data, row.len);
+    if (row.cap > 65536) {
+        buf_clear(&row);
+    }
+}
+
+// Ends a COPY TO STDOUT.
+void pg_write_copy_done(struct conn *conn, bool binary) {
+    if (binary) {
+        conn_write_raw(conn, "d\0\0\0\6\377\377", 7);
+    }
+    conn_write_raw(conn, "c\0\0\0\4", 5);
+}
+
 void pg_write_status(struct conn *conn, const char *key, const char *val) {
     size_t keylen = strlen(key);
     size_t vallen = strlen(val);
@@ -1266,13 +1743,78 @@ void pg_write_status(struct conn *conn, const char *key, const char *val) {
     xfree(bytes);
 }
 
-void pg_write_row_desc(struct conn *conn, const char **fields, int nfields){
+// Returns true if a binary result was requested for the column.
+static bool result_binary(struct pg *pg, int col) {
+    if (pg->resultfmts.len == 0) {
+        return false;
+    }
+    if (pg->resultfmts.len == 1) {
+        return pg->resultfmts.data[0];
+    }
+    return (size_t)col < pg->resultfmts.len && pg->resultfmts.data[col];
+}
+
+// Writes the attributes of a RowDescription field, following the name.
+static void write_field_attrs(char *p, struct pg *pg, char type, int col) {
+    bool int8 = type == 'i' && result_binary(pg, col);
+    write_i32(p, 0); // table_oid
+    write_i16(p+4, 0); // column_attr_number
+    write_i32(p+6, int8 ? INT8OID : pg->oid); // type_oid
+    write_i16(p+10, int8 ? 8 : -1); // type_size
+    write_i32(p+12, -1); // type_modifier
+    write_i16(p+16, 1); // format_code
+}
+
+// Returns true if the command of the statement is in the query, rather than
+// a parameter, in which case every execution writes the same RowDescription
+// for the same result formats and output oid.
+static bool statement_fixedcmd(struct pg_statement *stmt) {
+    const char *types = stmt->argtypes.data;
+    size_t nargs = stmt->args.len;
+    size_t i = 0;
+    if (nargs > 1 && types[0] == 'A' && stmt->args.bufs[0].len > 1 &&
+        memcmp(stmt->args.bufs[0].data, "::", 2) == 0)
+    {
+        // The command follows the ::type.
+        i = 1;
+    }
+    return i < nargs && types[i] == 'A' &&
+        (i+1 == nargs || (types[i+1] != 'A'+1 && types[i+1] != 'P'+1));
+}
+
+// Returns true if the RowDescription that's kept with the statement was
+// written for the result formats and output oid of this execution.
+static bool rowdesc_cached(struct pg_statement *stmt, struct pg *pg,
+    int nfields)
+{
+    return stmt->rowdesc && stmt->rowdescoid == pg->oid &&
+        read_i16(stmt->rowdesc+5) == nfields &&
+        stmt->rowdescfmts.len == pg->resultfmts.len &&
+        (pg->resultfmts.len == 0 || memcmp(stmt->rowdescfmts.data,
+            pg->resultfmts.data, pg->resultfmts.len) == 0);
+}
+
+// Writes a RowDescription. The 'types' has a type for each field, where 't'
+// is a text or bytea value, as set by ::text and ::bytea, and 'i' is an
+// integer that's written as an int8 when a binary result is requested. A
+// NULL 'types' is all 't'.
+// The message is kept with the prepared statement that's executing, keyed on
+// the result formats and output oid, and the next execution with the same
+// ones writes it as is.
+void pg_write_row_desc_typed(struct conn *conn, const char **fields,
+    const char *types, int nfields)
+{
+    struct pg *pg = conn_pg(conn);
+    struct pg_statement *stmt = pg->stmt[0] ? statement_ptr(pg, pg->stmt) : 0;
+    if (stmt && rowdesc_cached(stmt, pg, nfields)) {
+        conn_write_raw(conn, stmt->rowdesc, stmt->rowdesclen);
+        return;
+    }
     size_t size = 1+4+2;
     for (int i = 0; i < nfields; i++) {
         size += strlen(fields[i])+1;
         size += 4+2+4+2+4+2;
     }
-    int oid = conn_pg(conn)->oid;
     char *bytes = xmalloc(size);
     bytes[0] = 'T';
     write_i32(bytes+1, size-1); // message_size
@@ -1282,21 +1824,39 @@ void pg_write_row_desc(struct conn *conn, const char **fields, int nfields){
         size_t fsize = strlen(fields[i]);
         memcpy(p, fields[i], fsize+1);
         p += fsize+1;
-        write_i32(p, 0); // table_oid
-        p += 4;
-        write_i16(p, 0); // column_attr_number
-        p += 2;
-        write_i32(p, oid); // type_oid
-        p += 4;
-        write_i16(p, -1); // type_size
-        p += 2;
-        write_i32(p, -1); // type_modifier
-        p += 4;
-        write_i16(p, 1); // format_code
-        p += 2;
+        write_field_attrs(p, pg, types ? types[i] : 't', i);
+        p += 18;
     }
     conn_write_raw(conn, bytes, size);
-    xfree(bytes);
+    if (stmt && statement_fixedcmd(stmt)) {
+        xfree(stmt->rowdesc);
+        stmt->rowdesc = bytes;
+        stmt->rowdesclen = size;
+        stmt->rowdescoid = pg->oid;
+        stmt->rowdescfmts.len = 0;
+        if (pg->resultfmts.len > 0) {
+            buf_append(&stmt->rowdescfmts, pg->resultfmts.data,
+                pg->resultfmts.len);
+        }
+    } else {
+        xfree(bytes);
+    }
+}
+
+void pg_write_row_desc(struct conn *conn, const char **fields, int nfields){
+    pg_write_row_desc_typed(conn, fields, 0, nfields);
+}
+
+// Encodes an integer column value into 'dst', which must have room for at
+// least 24 bytes. The value is an int8 when a binary result is requested,
+// otherwise text. Returns the number of bytes.
+size_t pg_encode_i64(struct conn *conn, int col, int64_t x, char *dst) {
+    if (result_binary(conn_pg(conn), col)) {
+        write_i32(dst, (uint64_t)x>>32);
+        write_i32(dst+4, (uint64_t)x&0xFFFFFFFF);
+        return 8;
+    }
+    return i64toa(x, (uint8_t*)dst);
 }
 
 void pg_write_row_data(struct conn *conn, const char **cols, 
@@ -1366,9 +1926,12 @@ void pg_write_simple_row_str_ready(struct conn *conn, const char *desc,
 void pg_write_simple_row_i64_ready(struct conn *conn, const char *desc,
     int64_t row, const char *tag)
 {
-    char val[32];
-    snprintf(val, sizeof(val), "%" PRIi64, row);
-    pg_write_simple_row_str_ready(conn, desc, val, tag);
+    char val[24];
+    size_t n = pg_encode_i64(conn, 0, row, val);
+    pg_write_row_desc_typed(conn, (const char*[]){ desc }, "i", 1);
+    pg_write_row_data(conn, (const char*[]){ val }, (size_t[]){ n }, 1);
+    pg_write_complete(conn, tag);
+    pg_write_ready(conn, 'I');
 }
 
 void pg_write_simple_row_str_readyf(struct conn *conn, const char *desc,
@@ -1512,6 +2075,124 @@ void pg_write_error(struct conn *conn, const char *msg) {
     xfree(bytes);
 }
 
+// Turns a COPY statement into the internal command arguments.
+//   COPY <table> FROM STDIN [BINARY | [WITH] (FORMAT text|binary)]
+//     -> _copyin text|binary
+//   COPY <table> TO STDOUT [...]
+//   COPY (SCAN [MATCH pattern]) TO STDOUT [...]
+//   COPY (KEYS pattern) TO STDOUT [...]
+//     -> _copyout pattern text|binary
+// The table name is not used, rows are always key and value columns.
+// Returns false if there was an error, which has been written.
+static bool copy_command(struct conn *conn, struct args *args, struct pg *pg) {
+    // Parentheses and commas are dropped from the tokens.
+    struct { const char *s; size_t n; } toks[16];
+    int ntoks = 0;
+    for (size_t i = 1; i < args->len; i++) {
+        const char *s = args->bufs[i].data;
+        size_t n = args->bufs[i].len;
+        while (n > 0 && (*s == '(' || *s == ',')) {
+            s++;
+            n--;
+        }
+        while (n > 0 && (s[n-1] == ')' || s[n-1] == ',' || s[n-1] == ';')) {
+            n--;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (ntoks == 16) {
+            goto syntax;
+        }
+        toks[ntoks].s = s;
+        toks[ntoks].n = n;
+        ntoks++;
+    }
+    #define tokeq(i, str) ((i) < ntoks && argeq_bytes(toks[i].s, toks[i].n, str))
+    const char *pattern = "*";
+    size_t patternlen = 1;
+    bool query = false;
+    int i = 0;
+    if (tokeq(i, "scan")) {
+        query = true;
+        i++;
+        if (tokeq(i, "match")) {
+            if (i+1 >= ntoks) {
+                goto syntax;
+            }
+            pattern = toks[i+1].s;
+            patternlen = toks[i+1].n;
+            i += 2;
+        }
+    } else if (tokeq(i, "keys")) {
+        query = true;
+        if (i+1 >= ntoks) {
+            goto syntax;
+        }
+        pattern = toks[i+1].s;
+        patternlen = toks[i+1].n;
+        i += 2;
+    } else if (i < ntoks) {
+        // table name
+        i++;
+    } else {
+        goto syntax;
+    }
+    bool in;
+    if (tokeq(i, "from") && tokeq(i+1, "stdin") && !query) {
+        in = true;
+    } else if (tokeq(i, "to") && tokeq(i+1, "stdout")) {
+        in = false;
+    } else {
+        goto syntax;
+    }
+    i += 2;
+    bool binary = false;
+    if (tokeq(i, "with")) {
+        i++;
+    }
+    if (tokeq(i, "binary")) {
+        binary = true;
+        i++;
+    } else if (tokeq(i, "format")) {
+        if (tokeq(i+1, "binary")) {
+            binary = true;
+        } else if (!tokeq(i+1, "text")) {
+            pg_write_error(conn, "only text and binary formats are supported");
+            pg_write_ready(conn, 'I');
+            return false;
+        }
+        i += 2;
+    }
+    if (i != ntoks) {
+        goto syntax;
+    }
+    #undef tokeq
+    if (in && pg->execute) {
+        pg_write_error(conn,
+            "COPY FROM STDIN requires the simple query protocol");
+        pg_write_ready(conn, 'I');
+        return false;
+    }
+    const char *format = binary ? "binary" : "text";
+    args_clear(&pg->targs);
+    if (in) {
+        args_append(&pg->targs, "_copyin", 7, false);
+    } else {
+        args_append(&pg->targs, "_copyout", 8, false);
+        args_append(&pg->targs, pattern, patternlen, false);
+    }
+    args_append(&pg->targs, format, strlen(format), false);
+    struct args swapargs = *args;
+    *args = pg->targs;
+    pg->targs = swapargs;
+    return true;
+syntax:
+    pg_write_error(conn, "syntax error in COPY statement");
+    pg_write_ready(conn, 'I');
+    return false;
+}
+
 // return true if the command need further execution, of false if this
 // operation handled it already
 bool pg_precommand(struct conn *conn, struct args *args, struct pg *pg) {
@@ -1538,6 +2219,9 @@ bool pg_precommand(struct conn *conn, struct args *args, struct pg *pg) {
                 pg_write_ready(conn, 'I');
                 return false;
             }
+            if (argeq(args, 0, "copy")) {
+                return copy_command(conn, args, pg);
+            }
         }
         if (c == ':' && args->bufs[0].len > 1 && args->bufs[0].data[1] == ':') {
             if (argeq(args, 0, "::bytea") || argeq(args, 0, "::bytes")) {
@@ -15,17 +15,26 @@
 
 #define PGNAMEDATALEN 64
 
+#define PG_COPY_TEXT   1
+#define PG_COPY_BINARY 2
+
 struct pg_statement {
     char name[PGNAMEDATALEN];
     struct args args;
     struct buf argtypes;
+    struct buf paramoids; // declared type oid of each parameter (int32)
     int nparams;
+    char *rowdesc;        // last RowDescription written for the statement
+    size_t rowdesclen;
+    struct buf rowdescfmts; // result format codes the rowdesc was written for
+    int rowdescoid;       // output oid the rowdesc was written for
 };
 
 struct pg_portal {
     char name[PGNAMEDATALEN];
     char stmt[PGNAMEDATALEN];
     struct args params;
+    struct buf resultfmts; // result format code of each column (0 or 1)
 };
 
 struct pg {
@@ -57,6 +66,18 @@ struct pg {
     char *database;
     char *application_name;
     struct buf buf; // query read buffer
+
+    char stmt[PGNAMEDATALEN]; // statement of the executing portal, if any
+    struct buf resultfmts;    // result format codes of the executing portal
+
+    int copy;           // COPY FROM STDIN in progress (PG_COPY_TEXT/BINARY)
+    bool copyhdr;       // binary copy header has been read
+    bool copyend;       // end of copy data marker has been read
+    bool copydone;      // CopyDone or CopyFail message received
+    char *copyerr;      // first copy error, if any
+    uint64_t copycount; // number of rows stored
+    struct buf copybuf; // pending copy data
+    size_t copypos;     // copy data that has been handed off as rows
 };
 
 struct pg *pg_new(void);
@@ -0,0 +1,609 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit repl.c provides primary/replica replication.
+//
+// A replica connects to its primary and sends SYNC with the replication id
+// and offset that it already has. When the primary still has all changes
+// after that offset in its backlog, it continues streaming from there.
+// Otherwise the replica receives a full copy of the data, using the same
+// block format as the persistence file, followed by all changes that were
+// made since the copy started.
+//
+// Changes are captured by the cache notify callback and appended to the
+// backlog, which is a ring buffer, as records of uvarint encoded fields:
+//
+//   store:  'S' keylen key vallen value ttl flags cas grace delta
+//   hash:   'H' keylen key vallen value ttl flags cas grace delta
+//   delete: 'D' keylen key
+//   invalidate: 'I' prefixlen prefix
+//
+// The ttl excludes the grace period, which is zero for entries that are not
+// refreshed. A hash record is a store of an entry with an encoded hash value.
+// An invalidate record is a DELPREFIX, which the replica applies at the time
+// it receives it.
+//
+// The primary sends a ping 'P' to idle replicas. Pings are not part of the
+// backlog and do not move the offset.
+//
+// Records are appended without a lock, because changes are captured while a
+// shard is locked. A writer reserves its bytes, copies the record into the
+// ring, and then waits for the writers before it to publish theirs, so the
+// records are published in the order that they were reserved. A replica that
+// reads bytes which were overwritten while it copied them needs a full sync.
+// The backlog is only active while there are replicas.
+#include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "repl.h"
+#include "save.h"
+#include "buf.h"
+#include "sys.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "hash.h"
+
+#define CHUNKSIZE   65536  // bytes sent to a replica at a time
+#define PINGSECS    1      // ping idle replicas
+#define TIMEOUTSECS 10     // replica reconnects when the primary is silent
+
+extern struct pogocache *cache;
+extern const char *useid;
+extern const char *auth;
+extern const bool useauth;
+extern atomic_bool lowmem;
+extern atomic_bool sweep;
+
+// primary
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool active = false; // backlog is active
+static char *backlog = 0;          // ring buffer of records
+static size_t backlogcap = 0;
+static uint64_t firstofs = 0;      // offset when the backlog was activated
+static atomic_uint_fast64_t reserved = 0; // bytes reserved by writers
+static atomic_uint_fast64_t offset = 0;   // bytes published to replicas
+static atomic_bool waiting = false; // a replica waits for new records
+static int nreplicas = 0;          // connected replicas
+
+// replica
+static const char *primaryhost = 0;
+static const char *primaryport = 0;
+static char primaryid[64] = "";
+static atomic_uint_fast64_t replofs = 0;
+static atomic_bool linkup = false;
+static atomic_uint_fast64_t nfullsyncs = 0;
+static atomic_uint_fast64_t npartialsyncs = 0;
+
+static __thread struct buf threc = { 0 };
+
+void repl_init(size_t backlogsize) {
+    backlogcap = backlogsize < CHUNKSIZE ? CHUNKSIZE : backlogsize;
+}
+
+static void ring_write(uint64_t at, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        size_t pos = at%backlogcap;
+        size_t n = len < backlogcap-pos ? len : backlogcap-pos;
+        memcpy(backlog+pos, p, n);
+        at += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void ring_read(uint64_t at, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        size_t pos = at%backlogcap;
+        size_t n = len < backlogcap-pos ? len : backlogcap-pos;
+        memcpy(p, backlog+pos, n);
+        at += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void append_record(struct buf *rec) {
+    uint64_t at = atomic_fetch_add(&reserved, rec->len);
+    ring_write(at, rec->data, rec->len);
+    while (atomic_load_explicit(&offset, __ATOMIC_ACQUIRE) != at) {
+        // A writer before this one has not published yet.
+        sched_yield();
+    }
+    atomic_store_explicit(&offset, at+rec->len, __ATOMIC_RELEASE);
+    // Only the first record after a replica went idle wakes it up.
+    if (atomic_load(&waiting) && atomic_exchange(&waiting, false)) {
+        pthread_mutex_lock(&mu);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mu);
+    }
+    if (rec->cap > CHUNKSIZE) {
+        buf_clear(rec);
+    }
+}
+
+// Capture a change for the replicas. Called for every change to the cache,
+// while the shard is locked.
+void repl_notify(int shard, int64_t time, struct pogocache_entry *new_entry,
+    struct pogocache_entry *old_entry, void *udata)
+{
+    (void)shard;
+    (void)udata;
+    if (!atomic_load_explicit(&active, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct buf *rec = &threc;
+    rec->len = 0;
+    char buf[128];
+    size_t keylen;
+    if (new_entry) {
+        const void *key = pogocache_entry_key(cache, new_entry, &keylen, buf);
+        bool ishash = pogocache_entry_type(cache, new_entry) == 
+            POGOCACHE_TYPE_HASH;
+        buf_append_byte(rec, ishash ? 'H' : 'S');
+        buf_append_uvarint(rec, keylen);
+        buf_append(rec, key, keylen);
+        size_t vallen;
+        const void *val = pogocache_entry_value(cache, new_entry, &vallen);
+        if (!val) {
+            // No memory for the value. Delete the key on the replicas, so
+            // that they never keep an older value.
+            rec->len = 0;
+            buf_append_byte(rec, 'D');
+            buf_append_uvarint(rec, keylen);
+            buf_append(rec, key, keylen);
+            append_record(rec);
+            return;
+        }
+        buf_append_uvarint(rec, vallen);
+        buf_append(rec, val, vallen);
+        int64_t expires;
+        uint32_t flags;
+        uint64_t cas;
+        int64_t grace;
+        int64_t delta;
+        pogocache_entry_info(cache, new_entry, &expires, &flags, &cas, &grace,
+            &delta);
+        int64_t ttl = 0;
+        if (expires > 0) {
+            // Only the rest of a grace period that started already is sent.
+            ttl = expires > time ? expires-time : 1;
+            grace = expires+grace-(time+ttl);
+            grace = grace > 0 ? grace : 0;
+        }
+        buf_append_uvarint(rec, ttl);
+        buf_append_uvarint(rec, flags);
+        buf_append_uvarint(rec, cas);
+        buf_append_uvarint(rec, grace);
+        buf_append_uvarint(rec, delta);
+    } else {
+        const void *key = pogocache_entry_key(cache, old_entry, &keylen, buf);
+        buf_append_byte(rec, 'D');
+        buf_append_uvarint(rec, keylen);
+        buf_append(rec, key, keylen);
+    }
+    append_record(rec);
+}
+
+// Capture an invalidation of a key prefix for the replicas. Called after the
+// cache was invalidated, so a store that races with it may be dropped by the
+// replica but a stale entry is never kept.
+void repl_invalidate(const char *prefix, size_t prefixlen) {
+    if (!atomic_load_explicit(&active, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct buf *rec = &threc;
+    rec->len = 0;
+    buf_append_byte(rec, 'I');
+    buf_append_uvarint(rec, prefixlen);
+    buf_append(rec, prefix, prefixlen);
+    append_record(rec);
+}
+
+// Write to the non-blocking socket of a replica. Gives up when the replica
+// does not read for TIMEOUTSECS.
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if (poll(&pfd, 1, TIMEOUTSECS*1000) > 0) {
+                    continue;
+                }
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static ssize_t fd_writer(const void *data, size_t len, void *udata) {
+    return write_all(*(int*)udata, data, len) ? (ssize_t)len : -1;
+}
+
+// Serve a replica that sent SYNC on the connection with the socket 'fd'.
+// This runs in a background thread and returns when the replica disconnects
+// or falls too far behind. Only the socket is used, which stays open until
+// the connection is closed after this returns.
+void repl_serve(int fd, const char *id, uint64_t ofs) {
+    pthread_mutex_lock(&mu);
+    // Changes were not captured while there were no replicas, so only an
+    // active backlog can continue a sync.
+    uint64_t end = atomic_load(&offset);
+    bool partial = atomic_load(&active) && strcmp(id, useid) == 0 &&
+        ofs >= firstofs && ofs <= end && end-ofs <= backlogcap;
+    if (!atomic_load(&active)) {
+        if (!backlog) {
+            backlog = xmalloc(backlogcap);
+        }
+        firstofs = end;
+        atomic_store(&active, true);
+    }
+    uint64_t pos = partial ? ofs : end;
+    nreplicas++;
+    pthread_mutex_unlock(&mu);
+    char *chunk = 0;
+    char line[128];
+    if (partial) {
+        snprintf(line, sizeof(line), "+CONTINUE\r\n");
+    } else {
+        snprintf(line, sizeof(line), "+FULLSYNC %s %" PRIu64 "\r\n", useid,
+            pos);
+    }
+    if (!write_all(fd, line, strlen(line))) {
+        goto done;
+    }
+    if (!partial && save_stream(fd_writer, &fd, true) == -1) {
+        goto done;
+    }
+    chunk = xmalloc(CHUNKSIZE);
+    while (1) {
+        uint64_t end = atomic_load_explicit(&offset, __ATOMIC_ACQUIRE);
+        if (pos == end) {
+            pthread_mutex_lock(&mu);
+            atomic_store(&waiting, true);
+            end = atomic_load(&offset);
+            if (pos == end) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += PINGSECS;
+                pthread_cond_timedwait(&cond, &mu, &ts);
+                end = atomic_load(&offset);
+            }
+            pthread_mutex_unlock(&mu);
+        }
+        size_t n = end-pos < CHUNKSIZE ? end-pos : CHUNKSIZE;
+        if (end-pos > backlogcap) {
+            // The replica fell behind and needs a full sync.
+            break;
+        }
+        ring_read(pos, chunk, n);
+        atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (atomic_load(&reserved)-pos > backlogcap) {
+            // Writers overwrote the bytes while they were copied.
+            break;
+        }
+        if (n == 0) {
+            if (!write_all(fd, "P", 1)) {
+                break;
+            }
+            continue;
+        }
+        if (!write_all(fd, chunk, n)) {
+            break;
+        }
+        pos += n;
+    }
+done:
+    xfree(chunk);
+    pthread_mutex_lock(&mu);
+    nreplicas--;
+    if (nreplicas == 0) {
+        // Stop capturing changes until the next replica connects.
+        atomic_store(&active, false);
+    }
+    pthread_mutex_unlock(&mu);
+}
+
+static int dial(const char *host, const char *port) {
+    struct addrinfo hints = { 0 }, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd != -1) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+        struct timeval tv = { .tv_sec = TIMEOUTSECS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+static bool send_cmd(int fd, int nargs, const char *args[]) {
+    struct buf buf = { 0 };
+    char num[32];
+    snprintf(num, sizeof(num), "*%d\r\n", nargs);
+    buf_append(&buf, num, strlen(num));
+    for (int i = 0; i < nargs; i++) {
+        snprintf(num, sizeof(num), "$%zu\r\n", strlen(args[i]));
+        buf_append(&buf, num, strlen(num));
+        buf_append(&buf, args[i], strlen(args[i]));
+        buf_append(&buf, "\r\n", 2);
+    }
+    size_t written = 0;
+    while (written < buf.len) {
+        ssize_t n = write(fd, buf.data+written, buf.len-written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    bool ok = written == buf.len;
+    buf_clear(&buf);
+    return ok;
+}
+
+// Read a reply line one byte at a time, so that nothing after it is consumed.
+static bool read_line(int fd, char *line, size_t cap) {
+    size_t len = 0;
+    while (1) {
+        char ch;
+        if (read(fd, &ch, 1) != 1) {
+            return false;
+        }
+        if (ch == '\n') {
+            break;
+        }
+        if (ch != '\r' && len < cap-1) {
+            line[len++] = ch;
+        }
+    }
+    line[len] = '\0';
+    return true;
+}
+
+// Apply one record from the stream. Returns the number of bytes consumed, or
+// zero if the record is incomplete, or -1 if the record is invalid.
+static ssize_t apply_record(const uint8_t *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *e = data+len;
+    if (p == e) {
+        return 0;
+    }
+    uint8_t kind = *(p++);
+    if (kind == 'P') {
+        return 1;
+    }
+    if (kind != 'S' && kind != 'H' && kind != 'D' && kind != 'I') {
+        return -1;
+    }
+    uint64_t x[7];
+    int nfields = kind == 'D' || kind == 'I' ? 1 : 7;
+    const uint8_t *key = 0;
+    const uint8_t *val = 0;
+    for (int i = 0; i < nfields; i++) {
+        int n = varint_read_u64(p, e-p, &x[i]);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        p += n;
+        if (i < 2) {
+            // key and value bytes follow their lengths
+            if ((uint64_t)(e-p) < x[i]) {
+                return 0;
+            }
+            if (i == 0) {
+                key = p;
+            } else {
+                val = p;
+            }
+            p += x[i];
+        }
+    }
+    int64_t now = sys_now();
+    if (kind == 'H' && !hash_valid((char*)val, x[1])) {
+        return -1;
+    }
+    if (kind == 'I') {
+        struct pogocache_invalidate_opts opts = { .time = now };
+        pogocache_invalidate(cache, key, x[0], &opts);
+        atomic_store(&sweep, true);
+    } else if (kind != 'D') {
+        struct pogocache_store_opts opts = {
+            .time = now,
+            .ttl = (int64_t)x[2],
+            .flags = (uint32_t)x[3],
+            .cas = x[4],
+            .grace = (int64_t)x[5],
+            .delta = (int64_t)x[6],
+            .type = kind == 'H' ? POGOCACHE_TYPE_HASH : POGOCACHE_TYPE_STRING,
+            .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+        };
+        pogocache_store(cache, key, x[0], val, x[1], &opts);
+    } else {
+        struct pogocache_delete_opts opts = { .time = now };
+        pogocache_delete(cache, key, x[0], &opts);
+    }
+    return p-data;
+}
+
+static void replica_session(int fd) {
+    char line[256];
+    if (useauth) {
+        if (!send_cmd(fd, 2, (const char*[]){ "AUTH", auth }) ||
+            !read_line(fd, line, sizeof(line)) || line[0] != '+')
+        {
+            printf("# Replication: auth failed\n");
+            return;
+        }
+    }
+    char ofsstr[32];
+    snprintf(ofsstr, sizeof(ofsstr), "%" PRIu64, atomic_load(&replofs));
+    const char *id = *primaryid ? primaryid : "?";
+    if (!send_cmd(fd, 3, (const char*[]){ "SYNC", id, ofsstr }) ||
+        !read_line(fd, line, sizeof(line)))
+    {
+        return;
+    }
+    if (strcmp(line, "+CONTINUE") == 0) {
+        atomic_fetch_add(&npartialsyncs, 1);
+        printf("* Replication: continuing from offset %s\n", ofsstr);
+    } else if (strncmp(line, "+FULLSYNC ", 10) == 0) {
+        char id[64];
+        uint64_t ofs;
+        if (sscanf(line+10, "%63s %" SCNu64, id, &ofs) != 2) {
+            return;
+        }
+        printf("* Replication: full sync from %s:%s\n", primaryhost,
+            primaryport);
+        struct pogocache_clear_opts copts = { .time = sys_now() };
+        pogocache_clear(cache, &copts);
+        struct load_stats stats;
+        *primaryid = '\0';
+        if (load_fd(fd, true, &stats) == -1) {
+            perror("# Replication: full sync");
+            return;
+        }
+        strcpy(primaryid, id);
+        atomic_store(&replofs, ofs);
+        atomic_fetch_add(&nfullsyncs, 1);
+        printf("* Replication: synced %zu entries\n", stats.ninserted);
+    } else {
+        printf("# Replication: %s\n", line);
+        return;
+    }
+    atomic_store(&linkup, true);
+    struct buf in = { 0 };
+    buf_ensure(&in, CHUNKSIZE);
+    while (1) {
+        buf_ensure(&in, in.len+CHUNKSIZE);
+        ssize_t n = read(fd, in.data+in.len, in.cap-in.len);
+        if (n <= 0) {
+            break;
+        }
+        in.len += n;
+        size_t pos = 0;
+        while (pos < in.len) {
+            ssize_t m = apply_record((uint8_t*)in.data+pos, in.len-pos);
+            if (m == 0) {
+                break;
+            }
+            if (m < 0) {
+                printf("# Replication: invalid record\n");
+                goto done;
+            }
+            if (in.data[pos] != 'P') {
+                atomic_fetch_add(&replofs, m);
+            }
+            pos += m;
+        }
+        memmove(in.data, in.data+pos, in.len-pos);
+        in.len -= pos;
+    }
+done:
+    buf_clear(&in);
+    atomic_store(&linkup, false);
+}
+
+static void *replica_thread(void *arg) {
+    (void)arg;
+    bool logged = false;
+    while (1) {
+        int fd = dial(primaryhost, primaryport);
+        if (fd != -1) {
+            logged = false;
+            replica_session(fd);
+            close(fd);
+        } else if (!logged) {
+            printf("# Replication: cannot connect to %s:%s\n", primaryhost,
+                primaryport);
+            logged = true;
+        }
+        sleep(1);
+    }
+    return 0;
+}
+
+// Start replicating from the primary at addr, which is host:port.
+bool repl_replicaof(const char *addr) {
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || !colon[1]) {
+        errno = EINVAL;
+        return false;
+    }
+    char *host = xmalloc(colon-addr+1);
+    memcpy(host, addr, colon-addr);
+    host[colon-addr] = '\0';
+    primaryhost = host;
+    primaryport = colon+1;
+    pthread_t th;
+    if (pthread_create(&th, 0, replica_thread, 0) != 0) {
+        return false;
+    }
+    pthread_detach(th);
+    return true;
+}
+
+bool repl_isreplica(void) {
+    return primaryhost != 0;
+}
+
+void repl_stats(struct repl_stats *stats) {
+    memset(stats, 0, sizeof(struct repl_stats));
+    stats->replica = repl_isreplica();
+    if (stats->replica) {
+        stats->linkup = atomic_load(&linkup);
+        stats->offset = atomic_load(&replofs);
+        stats->fullsyncs = atomic_load(&nfullsyncs);
+        stats->partialsyncs = atomic_load(&npartialsyncs);
+    } else {
+        pthread_mutex_lock(&mu);
+        stats->offset = atomic_load(&offset);
+        stats->replicas = nreplicas;
+        stats->backlog = backlog ? backlogcap : 0;
+        pthread_mutex_unlock(&mu);
+    }
+}
@@ -0,0 +1,37 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef REPL_H
+#define REPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pogocache.h"
+
+struct repl_stats {
+    bool replica;           // this server is a replica
+    bool linkup;            // replica is connected to its primary
+    uint64_t offset;        // replication offset
+    int replicas;           // number of connected replicas
+    size_t backlog;         // size of the backlog, zero until first replica
+    uint64_t fullsyncs;     // number of full syncs performed by the replica
+    uint64_t partialsyncs;  // number of partial syncs performed by replica
+};
+
+void repl_init(size_t backlogsize);
+void repl_notify(int shard, int64_t time, struct pogocache_entry *new_entry,
+    struct pogocache_entry *old_entry, void *udata);
+void repl_invalidate(const char *prefix, size_t prefixlen);
+void repl_serve(int fd, const char *id, uint64_t ofs);
+bool repl_replicaof(const char *addr);
+bool repl_isreplica(void);
+void repl_stats(struct repl_stats *stats);
+
+#endif
@@ -199,6 +199,7 @@ ssize_t parse_resp(const char *bytes, size_t len, struct args *args) {
         int64_t nbytes;
         read_resp_num(nbytes, 0, MAXARGSZ, "invalid bulk length");
         if (nbytes+2 > end-bytes) {
+            parse_need = nbytes+2-(end-bytes);
             return 0;
         }
         args_append(args, bytes, nbytes, true);
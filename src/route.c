@@ -0,0 +1,807 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit route.c provides the route mode, where the server is a proxy for a
+// fleet of backend servers.
+//
+// Keys are assigned to backends using a jump consistent hash. Commands with
+// keys are forwarded over RESP to the backend that owns the key, and the
+// reply is copied to the client as-is. Multi-key MGET, DEL, EXISTS, and TOUCH
+// are split by backend, sent to all the backends before reading any replies,
+// and the replies are merged.
+//
+// Each network thread has its own connection to every backend, which is
+// shared by all of the thread's clients. Requests are pipelined on it and
+// the replies are matched to the requests in order. The connections are
+// non-blocking and polled by the network thread, and a client waits for its
+// reply without holding up the thread. A backend that does not reply in time
+// fails all of the requests that are waiting on it, and a backend that
+// cannot be reached is not dialed again for a moment, so its requests fail
+// right away.
+//
+// Optionally, GET replies are kept in the local cache for a short time (L1).
+// Writes through this proxy invalidate the local copy, but writes through
+// other proxies are only seen after the L1 ttl has elapsed.
+#include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "route.h"
+#include "net.h"
+#include "buf.h"
+#include "sys.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "pogocache.h"
+
+#define TIMEOUTSECS 5    // backend reply timeout
+#define DIALMS      500  // backend connect timeout
+#define REDIALMS    1000 // wait before dialing an unreachable backend again
+
+extern struct pogocache *cache;
+extern const char *auth;
+extern const bool useauth;
+extern atomic_bool lowmem;
+
+struct backend {
+    char *host;
+    char *port;
+    struct addrinfo *addrs; // resolved at startup
+};
+
+// A client request that is waiting on backend replies. A split request waits
+// on one reply from each backend that it was sent to.
+struct request {
+    struct conn *conn;      // the client, or NULL if it could not wait
+    int waiting;            // replies that have not arrived
+    int failed;             // first backend that failed, or -1
+    int backend;            // backend of a request that is not split
+    bool split;
+    bool keys;              // split by key, otherwise sent to all backends
+    size_t nkeys;
+    int *owners;            // backend of each key
+    char *key;              // key of a GET that is kept in the L1 cache
+    size_t keylen;
+    struct buf *replies;    // one per backend
+};
+
+struct upstream {
+    int i;                  // backend index
+    int fd;                 // -1 when not connected
+    struct net_watch *watch;
+    bool connecting;
+    int64_t deadline;       // time that the connect or oldest reply is due
+    struct buf out;         // requests that have not been written
+    struct buf in;          // reply data
+    struct request **queue; // requests waiting on replies, oldest first. A
+                            // NULL request is waiting on the AUTH reply.
+    size_t qhead;
+    size_t qlen;
+    size_t qcap;
+    int64_t down;           // time that the backend could not be reached
+};
+
+static struct backend *backends = 0;
+static int nbackends = 0;
+static int64_t l1ttl = 0;
+static __thread struct upstream *ups = 0;
+
+static atomic_uint_fast64_t nforwarded = 0;
+static atomic_uint_fast64_t nsplit = 0;
+static atomic_uint_fast64_t nerrors = 0;
+static atomic_uint_fast64_t nl1hits = 0;
+
+// Initialize the route mode using a comma separated list of host:port
+// backends. The l1 param is the time that GET replies are kept locally, or
+// zero for no local caching. The backends are resolved here, so that dialing
+// a backend never waits on a name lookup.
+bool route_init(const char *list, int64_t l1) {
+    const char *p = list;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        if (!end) {
+            end = p+strlen(p);
+        }
+        const char *colon = memchr(p, ':', end-p);
+        if (!colon || colon == p || colon+1 == end) {
+            errno = EINVAL;
+            return false;
+        }
+        backends = xrealloc(backends, (nbackends+1)*sizeof(struct backend));
+        struct backend *b = &backends[nbackends++];
+        b->host = xmalloc(colon-p+1);
+        memcpy(b->host, p, colon-p);
+        b->host[colon-p] = '\0';
+        b->port = xmalloc(end-colon);
+        memcpy(b->port, colon+1, end-colon-1);
+        b->port[end-colon-1] = '\0';
+        struct addrinfo hints = { 0 };
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(b->host, b->port, &hints, &b->addrs) != 0) {
+            errno = EINVAL;
+            return false;
+        }
+        p = *end ? end+1 : end;
+    }
+    if (nbackends == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    l1ttl = l1;
+    return true;
+}
+
+// Jump consistent hash, by John Lamping and Eric Veach.
+static int jump_hash(uint64_t key, int nbuckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < nbuckets) {
+        b = j;
+        key = key*UINT64_C(2862933555777941757)+1;
+        j = (b+1)*((double)(INT64_C(1)<<31)/(double)((key>>33)+1));
+    }
+    return b;
+}
+
+static int key_backend(const char *key, size_t keylen) {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < keylen; i++) {
+        hash = (hash^(uint8_t)key[i])*UINT64_C(0x100000001b3);
+    }
+    return jump_hash(mix13(hash), nbackends);
+}
+
+// Returns the length of the reply at the start of data, zero if the reply is
+// not complete, or -1 if it's not a valid reply.
+static ssize_t reply_len(const char *data, size_t len) {
+    const char *nl = len > 0 ? memchr(data, '\n', len) : 0;
+    if (!nl) {
+        return 0;
+    }
+    size_t hdr = nl-data+1;
+    if (hdr < 3 || data[hdr-2] != '\r') {
+        return -1;
+    }
+    int64_t n;
+    switch (data[0]) {
+    case '+': case '-': case ':':
+        return hdr;
+    case '$':
+        if (!parse_i64(data+1, hdr-3, &n)) {
+            return -1;
+        }
+        if (n < 0) {
+            return hdr;
+        }
+        return len < hdr+n+2 ? 0 : (ssize_t)(hdr+n+2);
+    case '*':
+        if (!parse_i64(data+1, hdr-3, &n)) {
+            return -1;
+        }
+        size_t pos = hdr;
+        for (int64_t i = 0; i < n; i++) {
+            ssize_t m = reply_len(data+pos, len-pos);
+            if (m <= 0) {
+                return m;
+            }
+            pos += m;
+        }
+        return pos;
+    }
+    return -1;
+}
+
+static void append_cmd(struct buf *buf, int nargs, const char *args[],
+    const size_t lens[])
+{
+    char num[32];
+    snprintf(num, sizeof(num), "*%d\r\n", nargs);
+    buf_append(buf, num, strlen(num));
+    for (int i = 0; i < nargs; i++) {
+        snprintf(num, sizeof(num), "$%zu\r\n", lens[i]);
+        buf_append(buf, num, strlen(num));
+        buf_append(buf, args[i], lens[i]);
+        buf_append(buf, "\r\n", 2);
+    }
+}
+
+static void req_free(struct request *req) {
+    for (int i = 0; i < nbackends; i++) {
+        buf_clear(&req->replies[i]);
+    }
+    xfree(req->replies);
+    xfree(req->owners);
+    xfree(req->key);
+    xfree(req);
+}
+
+// A reply from backend i, or a failure when data is NULL. The client is
+// resumed once the last reply is in.
+static void req_reply(struct request *req, int i, const char *data, 
+    size_t len)
+{
+    if (data) {
+        buf_append(&req->replies[i], data, len);
+    } else if (req->failed == -1) {
+        req->failed = i;
+    }
+    if (--req->waiting > 0) {
+        return;
+    }
+    if (req->conn) {
+        conn_unpark(req->conn);
+    } else {
+        req_free(req);
+    }
+}
+
+static void up_push(struct upstream *up, struct request *req) {
+    if (up->qlen == up->qcap) {
+        size_t cap = up->qcap == 0 ? 16 : up->qcap*2;
+        struct request **queue = xmalloc(cap*sizeof(struct request*));
+        for (size_t j = 0; j < up->qlen; j++) {
+            queue[j] = up->queue[(up->qhead+j)%up->qcap];
+        }
+        xfree(up->queue);
+        up->queue = queue;
+        up->qcap = cap;
+        up->qhead = 0;
+    }
+    up->queue[(up->qhead+up->qlen)%up->qcap] = req;
+    up->qlen++;
+}
+
+static struct request *up_pop(struct upstream *up) {
+    struct request *req = up->queue[up->qhead];
+    up->qhead = (up->qhead+1)%up->qcap;
+    up->qlen--;
+    return req;
+}
+
+// The oldest request must be answered within the timeout, which restarts
+// whenever a reply arrives.
+static void up_setdeadline(struct upstream *up, int64_t deadline) {
+    up->deadline = deadline;
+    net_watch_deadline(up->watch, deadline);
+}
+
+// Close the connection and fail the requests that are waiting on it. The
+// backend is not dialed again for a moment when it's down.
+static void up_fail(struct upstream *up, bool down) {
+    if (up->fd != -1) {
+        net_unwatch(up->watch);
+        close(up->fd);
+        up->fd = -1;
+        up->watch = 0;
+    }
+    up->connecting = false;
+    up->deadline = 0;
+    up->in.len = 0;
+    up->out.len = 0;
+    if (down) {
+        up->down = sys_now();
+    }
+    while (up->qlen > 0) {
+        struct request *req = up_pop(up);
+        if (req) {
+            req_reply(req, up->i, 0, 0);
+        }
+    }
+}
+
+// Write as much of the pending output as the socket takes, and poll for
+// writes while there's more.
+static bool up_flush(struct upstream *up) {
+    if (up->connecting) {
+        return true;
+    }
+    size_t pos = 0;
+    while (pos < up->out.len) {
+        ssize_t n = send(up->fd, up->out.data+pos, up->out.len-pos, 
+            MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        pos += n;
+    }
+    memmove(up->out.data, up->out.data+pos, up->out.len-pos);
+    up->out.len -= pos;
+    net_watch_write(up->watch, up->out.len > 0);
+    return true;
+}
+
+// Match the replies that have arrived to the waiting requests.
+static bool up_replies(struct upstream *up) {
+    size_t pos = 0;
+    bool ok = true;
+    while (pos < up->in.len) {
+        ssize_t n = reply_len(up->in.data+pos, up->in.len-pos);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0 || up->qlen == 0) {
+            // Not a valid reply, or a reply that nothing waits on.
+            ok = false;
+            break;
+        }
+        struct request *req = up_pop(up);
+        const char *reply = up->in.data+pos;
+        if (req) {
+            req_reply(req, up->i, reply, n);
+        } else if (reply[0] != '+') {
+            // AUTH was not accepted.
+            ok = false;
+            break;
+        }
+        pos += n;
+    }
+    if (pos > 0) {
+        memmove(up->in.data, up->in.data+pos, up->in.len-pos);
+        up->in.len -= pos;
+        up_setdeadline(up, up->qlen > 0 ? 
+            sys_now()+TIMEOUTSECS*SECOND : 0);
+    }
+    return ok;
+}
+
+// Returns true once the pending connect has finished.
+static bool up_connected(struct upstream *up, bool *failed) {
+    struct pollfd pfd = { .fd = up->fd, .events = POLLOUT };
+    if (poll(&pfd, 1, 0) <= 0) {
+        *failed = sys_now() >= up->deadline;
+        return false;
+    }
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    *failed = getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 ||
+        err != 0;
+    return !*failed;
+}
+
+// Called by the network thread when the backend socket is ready, or when its
+// deadline has passed.
+static void up_event(void *udata) {
+    struct upstream *up = udata;
+    if (up->connecting) {
+        bool failed;
+        if (!up_connected(up, &failed)) {
+            if (failed) {
+                up_fail(up, true);
+            }
+            return;
+        }
+        up->connecting = false;
+        up->down = 0;
+        up_setdeadline(up, up->qlen > 0 ? sys_now()+TIMEOUTSECS*SECOND : 0);
+    }
+    if (!up_flush(up)) {
+        up_fail(up, false);
+        return;
+    }
+    while (1) {
+        buf_ensure(&up->in, up->in.len+16384);
+        ssize_t n = read(up->fd, up->in.data+up->in.len, 
+            up->in.cap-up->in.len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            // Closed by the backend. The requests that were not answered
+            // are failed.
+            up_replies(up);
+            up_fail(up, false);
+            return;
+        }
+        up->in.len += n;
+        if (up->in.len < up->in.cap) {
+            break;
+        }
+    }
+    if (!up_replies(up)) {
+        up_fail(up, false);
+        return;
+    }
+    if (up->qlen > 0 && sys_now() >= up->deadline) {
+        // The backend is not responding. Do not wait on it again for a
+        // moment.
+        up_fail(up, true);
+    }
+}
+
+static bool up_dial(struct upstream *up) {
+    int64_t now = sys_now();
+    if (up->down && now-up->down < REDIALMS*MILLISECOND) {
+        return false;
+    }
+    int fd = -1;
+    bool connecting = false;
+    for (struct addrinfo *ai = backends[up->i].addrs; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags != -1 && fcntl(fd, F_SETFL, flags|O_NONBLOCK) != -1) {
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            if (errno == EINPROGRESS) {
+                connecting = true;
+                break;
+            }
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1) {
+        up->watch = net_watch(fd, up_event, up);
+        if (!up->watch) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        up->down = now;
+        return false;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    up->fd = fd;
+    up->connecting = connecting;
+    if (connecting) {
+        net_watch_write(up->watch, true);
+        up_setdeadline(up, now+DIALMS*MILLISECOND);
+    } else {
+        up->down = 0;
+    }
+    if (useauth) {
+        append_cmd(&up->out, 2, (const char*[]){ "AUTH", auth },
+            (size_t[]){ 4, strlen(auth) });
+        up_push(up, 0);
+    }
+    return true;
+}
+
+// Queue a request on the backend connection, dialing it first if needed.
+static bool up_send(int i, struct request *req, const char *data, 
+    size_t len)
+{
+    if (!ups) {
+        ups = xmalloc(nbackends*sizeof(struct upstream));
+        memset(ups, 0, nbackends*sizeof(struct upstream));
+        for (int j = 0; j < nbackends; j++) {
+            ups[j].i = j;
+            ups[j].fd = -1;
+        }
+    }
+    struct upstream *up = &ups[i];
+    if (up->fd == -1 && !up_dial(up)) {
+        return false;
+    }
+    buf_append(&up->out, data, len);
+    req->waiting++;
+    up_push(up, req);
+    if (!up->connecting && up->deadline == 0) {
+        up_setdeadline(up, sys_now()+TIMEOUTSECS*SECOND);
+    }
+    if (!up_flush(up)) {
+        up_fail(up, false);
+    }
+    return true;
+}
+
+static void write_backend_error(struct conn *conn, int i) {
+    atomic_fetch_add_explicit(&nerrors, 1, __ATOMIC_RELAXED);
+    char err[256];
+    snprintf(err, sizeof(err), "ERR backend %s:%s unavailable",
+        backends[i].host, backends[i].port);
+    conn_write_error(conn, err);
+}
+
+static void l1_entry(int shard, int64_t time, const void *key, size_t keylen,
+    const void *value, size_t valuelen, int64_t expires, uint32_t flags,
+    uint64_t cas, struct pogocache_update **update, void *udata)
+{
+    (void)shard, (void)time, (void)key, (void)keylen, (void)expires;
+    (void)flags, (void)cas, (void)update;
+    conn_write_bulk(udata, value, valuelen);
+}
+
+static bool l1_get(struct conn *conn, struct args *args) {
+    struct pogocache_load_opts opts = {
+        .time = sys_now(),
+        .entry = l1_entry,
+        .udata = conn,
+    };
+    int status = pogocache_load(cache, args->bufs[1].data, args->bufs[1].len,
+        &opts);
+    return status == POGOCACHE_FOUND;
+}
+
+static void l1_store(const char *key, size_t keylen, const char *reply,
+    size_t len)
+{
+    int64_t n;
+    const char *nl = memchr(reply, '\n', len);
+    if (reply[0] != '$' || !parse_i64(reply+1, nl-reply-2, &n) || n < 0) {
+        return;
+    }
+    struct pogocache_store_opts opts = {
+        .time = sys_now(),
+        .ttl = l1ttl,
+        .lowmem = atomic_load_explicit(&lowmem, __ATOMIC_ACQUIRE),
+    };
+    pogocache_store(cache, key, keylen, nl+1, n, &opts);
+}
+
+// Delete the local copies of the keys that a write changes. Only the first
+// argument is a key for single key commands.
+static void l1_delete(struct args *args, int keys) {
+    struct pogocache_delete_opts opts = { .time = sys_now() };
+    size_t nkeys = keys == ROUTE_KEY1 ? 1 : args->len-1;
+    for (size_t i = 1; i <= nkeys; i++) {
+        pogocache_delete(cache, args->bufs[i].data, args->bufs[i].len, &opts);
+    }
+}
+
+static void append_args(struct buf *req, struct args *args) {
+    char num[32];
+    snprintf(num, sizeof(num), "*%zu\r\n", args->len);
+    buf_append(req, num, strlen(num));
+    for (size_t i = 0; i < args->len; i++) {
+        snprintf(num, sizeof(num), "$%zu\r\n", args->bufs[i].len);
+        buf_append(req, num, strlen(num));
+        buf_append(req, args->bufs[i].data, args->bufs[i].len);
+        buf_append(req, "\r\n", 2);
+    }
+}
+
+static struct request *req_new(struct conn *conn) {
+    struct request *req = xmalloc(sizeof(struct request));
+    memset(req, 0, sizeof(struct request));
+    req->conn = conn;
+    req->failed = -1;
+    req->backend = -1;
+    req->replies = xmalloc(nbackends*sizeof(struct buf));
+    memset(req->replies, 0, nbackends*sizeof(struct buf));
+    // The caller holds one wait until all of the requests are queued.
+    req->waiting = 1;
+    return req;
+}
+
+// Write the reply of a request, once all of its backend replies are in.
+// Split replies are merged. Integer replies are summed, arrays are
+// reassembled in key order, and for anything else the first reply is used.
+static void req_respond(struct conn *conn, struct request *req) {
+    if (req->failed != -1) {
+        write_backend_error(conn, req->failed);
+        return;
+    }
+    if (!req->split) {
+        struct buf *reply = &req->replies[req->backend];
+        if (req->key) {
+            l1_store(req->key, req->keylen, reply->data, reply->len);
+        }
+        conn_write_raw(conn, reply->data, reply->len);
+        return;
+    }
+    int first = -1;
+    bool isint = true;
+    bool isarray = true;
+    int64_t sum = 0;
+    for (int i = 0; i < nbackends; i++) {
+        if (req->replies[i].len == 0) {
+            continue;
+        }
+        const char *reply = req->replies[i].data;
+        first = first == -1 ? i : first;
+        int64_t n;
+        if (reply[0] == ':' && 
+            parse_i64(reply+1, req->replies[i].len-3, &n))
+        {
+            sum += n;
+        } else {
+            isint = false;
+        }
+        if (reply[0] != '*') {
+            isarray = false;
+        }
+    }
+    if (isint) {
+        conn_write_int(conn, sum);
+    } else if (isarray && req->keys) {
+        // Walk the elements of each backend reply in key order.
+        size_t *pos = xmalloc(nbackends*sizeof(size_t));
+        for (int i = 0; i < nbackends; i++) {
+            pos[i] = 0;
+            if (req->replies[i].len > 0) {
+                pos[i] = (const char*)memchr(req->replies[i].data, '\n',
+                    req->replies[i].len)-req->replies[i].data+1;
+            }
+        }
+        char num[32];
+        snprintf(num, sizeof(num), "*%zu\r\n", req->nkeys);
+        conn_write_raw(conn, num, strlen(num));
+        for (size_t k = 0; k < req->nkeys; k++) {
+            int i = req->owners[k];
+            const char *elem = req->replies[i].data+pos[i];
+            ssize_t n = reply_len(elem, req->replies[i].len-pos[i]);
+            if (n <= 0) {
+                conn_write_null(conn);
+                continue;
+            }
+            conn_write_raw(conn, elem, n);
+            pos[i] += n;
+        }
+        xfree(pos);
+    } else {
+        conn_write_raw(conn, req->replies[first].data, 
+            req->replies[first].len);
+    }
+}
+
+static void req_done(struct conn *conn, void *udata) {
+    struct request *req = udata;
+    req_respond(conn, req);
+    req_free(req);
+}
+
+// All backend requests are queued. The client waits for the replies, unless
+// they are already in, such as when every backend failed right away.
+static void req_wait(struct conn *conn, struct request *req) {
+    if (--req->waiting == 0) {
+        req_done(conn, req);
+    } else if (!conn_park(conn, req_done, req)) {
+        req->conn = 0;
+        conn_write_error(conn, "ERR backend request could not wait");
+    }
+}
+
+static void forward_one(struct conn *conn, struct args *args, int i,
+    bool isget)
+{
+    atomic_fetch_add_explicit(&nforwarded, 1, __ATOMIC_RELAXED);
+    struct request *req = req_new(conn);
+    req->backend = i;
+    if (isget) {
+        req->keylen = args->bufs[1].len;
+        req->key = xmalloc(req->keylen+1);
+        memcpy(req->key, args->bufs[1].data, req->keylen);
+    }
+    struct buf data = { 0 };
+    append_args(&data, args);
+    if (!up_send(i, req, data.data, data.len)) {
+        req->failed = i;
+    }
+    buf_clear(&data);
+    req_wait(conn, req);
+}
+
+// Send the command to each backend, with only the keys that the backend
+// owns, or to all backends when there are no keys. The replies are merged
+// by req_respond.
+static void forward_split(struct conn *conn, struct args *args, bool keys) {
+    atomic_fetch_add_explicit(&nsplit, 1, __ATOMIC_RELAXED);
+    struct request *req = req_new(conn);
+    req->split = true;
+    req->keys = keys;
+    req->nkeys = keys ? args->len-1 : 0;
+    req->owners = xmalloc((req->nkeys+1)*sizeof(int));
+    size_t *counts = xmalloc(nbackends*sizeof(size_t));
+    memset(counts, 0, nbackends*sizeof(size_t));
+    for (size_t k = 0; k < req->nkeys; k++) {
+        req->owners[k] = key_backend(args->bufs[k+1].data, 
+            args->bufs[k+1].len);
+        counts[req->owners[k]]++;
+    }
+    struct buf data = { 0 };
+    for (int i = 0; i < nbackends; i++) {
+        if (keys && counts[i] == 0) {
+            continue;
+        }
+        data.len = 0;
+        char num[32];
+        snprintf(num, sizeof(num), "*%zu\r\n", keys ? counts[i]+1 : 1);
+        buf_append(&data, num, strlen(num));
+        for (size_t k = 0; k < req->nkeys+1; k++) {
+            if (k > 0 && req->owners[k-1] != i) {
+                continue;
+            }
+            snprintf(num, sizeof(num), "$%zu\r\n", args->bufs[k].len);
+            buf_append(&data, num, strlen(num));
+            buf_append(&data, args->bufs[k].data, args->bufs[k].len);
+            buf_append(&data, "\r\n", 2);
+        }
+        if (!up_send(i, req, data.data, data.len) && req->failed == -1) {
+            req->failed = i;
+        }
+    }
+    buf_clear(&data);
+    xfree(counts);
+    req_wait(conn, req);
+}
+
+// Execute the command in route mode. The keys param is the key layout of
+// the command (ROUTE_NOKEY, ROUTE_KEY1, or ROUTE_KEYN) and write is true for
+// commands that modify data. Returns false if the command should execute
+// locally.
+bool route_command(struct conn *conn, struct args *args, int keys,
+    bool write)
+{
+    if (argeq(args, 0, "keys") || argeq(args, 0, "scan") ||
+        argeq(args, 0, "save") || argeq(args, 0, "load") ||
+        argeq(args, 0, "sync") || argeq(args, 0, "_copyout"))
+    {
+        conn_write_error(conn, "ERR command not available in route mode");
+        return true;
+    }
+    bool broadcast = argeq(args, 0, "dbsize") || argeq(args, 0, "flushdb") ||
+        argeq(args, 0, "flushall") || argeq(args, 0, "flush") ||
+        argeq(args, 0, "delprefix");
+    if (keys == ROUTE_NOKEY && !broadcast) {
+        return false;
+    }
+    if (conn_proto(conn) != PROTO_RESP) {
+        conn_write_error(conn, "ERR route mode only supports RESP clients");
+        return true;
+    }
+    if (broadcast) {
+        if (write && l1ttl > 0) {
+            struct pogocache_clear_opts opts = { .time = sys_now() };
+            pogocache_clear(cache, &opts);
+        }
+        forward_split(conn, args, false);
+        return true;
+    }
+    if (args->len < 2) {
+        return false;
+    }
+    if (l1ttl > 0 && write) {
+        l1_delete(args, keys);
+    }
+    if (keys == ROUTE_KEY1 || args->len == 2) {
+        bool isget = l1ttl > 0 && args->len == 2 && argeq(args, 0, "get");
+        if (isget && l1_get(conn, args)) {
+            atomic_fetch_add_explicit(&nl1hits, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        int i = key_backend(args->bufs[1].data, args->bufs[1].len);
+        forward_one(conn, args, i, isget);
+        return true;
+    }
+    forward_split(conn, args, true);
+    return true;
+}
+
+void route_stats(struct route_stats *stats) {
+    memset(stats, 0, sizeof(struct route_stats));
+    stats->backends = nbackends;
+    stats->forwarded = atomic_load_explicit(&nforwarded, __ATOMIC_RELAXED);
+    stats->split = atomic_load_explicit(&nsplit, __ATOMIC_RELAXED);
+    stats->errors = atomic_load_explicit(&nerrors, __ATOMIC_RELAXED);
+    stats->l1hits = atomic_load_explicit(&nl1hits, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "conn.h"
+#include "args.h"
+
+// Key layouts, same as the command table.
+#define ROUTE_NOKEY 0
+#define ROUTE_KEY1  1
+#define ROUTE_KEYN  2
+
+struct route_stats {
+    int backends;           // number of backends
+    uint64_t forwarded;     // commands forwarded to a single backend
+    uint64_t split;         // commands split across backends
+    uint64_t errors;        // backend failures
+    uint64_t l1hits;        // GETs served from the local cache
+};
+
+bool route_init(const char *list, int64_t l1ttl);
+bool route_command(struct conn *conn, struct args *args, int keys,
+    bool write);
+void route_stats(struct route_stats *stats);
+
+#endif
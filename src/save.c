@@ -29,6 +29,7 @@
 #include "lz4.h"
 #include "sys.h"
 #include "xmalloc.h"
+#include "hash.h"
 
 #define BLOCKSIZE 1048576
 #define COMPRESS
@@ -40,7 +41,8 @@ struct savectx {
     pthread_t th;          // work thread
     int index;             // thread index
     pthread_mutex_t *lock; // write lock
-    int fd;                // work file descriptor
+    ssize_t (*write)(const void *data, size_t len, void *udata);
+    void *wudata;          // write udata
     int start;             // current shard
     int count;             // number of shards to process
     struct buf buf;        // block buffer
@@ -48,6 +50,9 @@ struct savectx {
     int errnum;            // final errno status
     struct buf dst;        // compressed buffer space
     size_t nentries;       // number of entried in block buffer
+    int type;              // type of the current entry
+    int64_t grace;         // grace period of the current entry
+    int64_t delta;         // recompute time of the current entry
 };
 
 static int flush(struct savectx *ctx) {
@@ -80,8 +85,8 @@ static int flush(struct savectx *ctx) {
     bool ok = true;
     pthread_mutex_lock(ctx->lock);
     while (p < end) {
-        ssize_t n = write(ctx->fd, p, end-p);
-        if (n < 0) {
+        ssize_t n = ctx->write(p, end-p, ctx->wudata);
+        if (n <= 0) {
             ok = false;
             break;
         }
@@ -99,20 +104,33 @@ static int save_entry(int shard, int64_t time, const void *key, size_t keylen,
 {
     (void)shard;
     struct savectx *ctx = udata;
-    buf_append_byte(&ctx->buf, 0); // entry type. zero=k/v string pair;
+    // entry kind. bit one=k/v with an encoded hash value, otherwise a k/v
+    // string pair. bit two=the grace period and recompute time follow the
+    // cas.
+    bool refresh = expires > 0 && (ctx->grace > 0 || ctx->delta > 0);
+    buf_append_byte(&ctx->buf, (ctx->type == POGOCACHE_TYPE_HASH ? 1 : 0) |
+        (refresh ? 2 : 0));
     buf_append_uvarint(&ctx->buf, keylen);
     buf_append(&ctx->buf, key, keylen);
     buf_append_uvarint(&ctx->buf, valuelen);
     buf_append(&ctx->buf, value, valuelen);
+    int64_t grace = 0;
     if (expires > 0) {
-        int64_t ttl = expires-time;
-        assert(ttl > 0);
+        // The expiration excludes the grace period, which may have started
+        // already. Only the rest of the grace period is saved.
+        int64_t ttl = expires > time ? expires-time : 1;
+        grace = expires+ctx->grace-(time+ttl);
+        grace = grace > 0 ? grace : 0;
         buf_append_uvarint(&ctx->buf, ttl);
     } else {
         buf_append_uvarint(&ctx->buf, 0);
     }
     buf_append_uvarint(&ctx->buf, flags);
     buf_append_uvarint(&ctx->buf, cas);
+    if (refresh) {
+        buf_append_uvarint(&ctx->buf, grace);
+        buf_append_uvarint(&ctx->buf, ctx->delta);
+    }
     ctx->nentries++;
     return POGOCACHE_ITER_CONTINUE;
 }
@@ -125,6 +143,9 @@ static void *thsave(void *arg) {
             .oneshard = true,
             .oneshardidx = shardidx,
             .time = sys_now(),
+            .type = &ctx->type,
+            .grace = &ctx->grace,
+            .delta = &ctx->delta,
             .entry = save_entry,
             .udata = ctx,
         };
@@ -146,19 +167,9 @@ done:
     return 0;
 }
 
-int save(const char *path, bool fast) {
-    uint64_t seed = sys_seed();
-    size_t psize = strlen(path)+32;
-    char *workpath = xmalloc(psize);
-    snprintf(workpath, psize, "%s.%08x.pogocache.work", path, 
-        (int)(seed%INT_MAX));
-    if (verb >= 2) {
-        printf(". Saving to work file %s\n", workpath);
-    }
-    int fd = open(workpath, O_RDWR|O_CREAT, S_IRUSR|S_IRGRP|S_IROTH);
-    if (fd == -1) {
-        return -1;
-    }
+static int save_blocks(ssize_t (*writer)(const void *data, size_t len, 
+    void *udata), void *udata, bool fast)
+{
     int nshards = pogocache_nshards(cache);
     int nprocs = sys_nprocs();
     if (nprocs > nshards) {
@@ -170,14 +181,14 @@ int save(const char *path, bool fast) {
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     struct savectx *ctxs = xmalloc(nprocs*sizeof(struct savectx));
     memset(ctxs, 0, nprocs*sizeof(struct savectx));
-    bool ok = false;
     int start = 0;
     for (int i = 0; i < nprocs; i++) {
         struct savectx *ctx = &ctxs[i];
         ctx->index = i;
         ctx->start = start;
         ctx->count = nshards/nprocs;
-        ctx->fd = fd;
+        ctx->write = writer;
+        ctx->wudata = udata;
         ctx->lock = &lock;
         if (i == nprocs-1) {
             ctx->count = nshards-ctx->start;
@@ -204,13 +215,40 @@ int save(const char *path, bool fast) {
         }
     }
     // check for any failures
+    bool ok = true;
     for (int i = 0; i < nprocs; i++) {
         struct savectx *ctx = &ctxs[i];
         if (!ctx->ok) {
             errno = ctx->errnum;
-            goto done;
+            ok = false;
+            break;
         }
     }
+    xfree(ctxs);
+    return ok ? 0 : -1;
+}
+
+static ssize_t write_fd(const void *data, size_t len, void *udata) {
+    return write(*(int*)udata, data, len);
+}
+
+int save(const char *path, bool fast) {
+    uint64_t seed = sys_seed();
+    size_t psize = strlen(path)+32;
+    char *workpath = xmalloc(psize);
+    snprintf(workpath, psize, "%s.%08x.pogocache.work", path, 
+        (int)(seed%INT_MAX));
+    if (verb >= 2) {
+        printf(". Saving to work file %s\n", workpath);
+    }
+    int fd = open(workpath, O_RDWR|O_CREAT, S_IRUSR|S_IRGRP|S_IROTH);
+    if (fd == -1) {
+        return -1;
+    }
+    bool ok = false;
+    if (save_blocks(write_fd, &fd, fast) == -1) {
+        goto done;
+    }
     // Move file work file to final path
     if (rename(workpath, path) == -1) {
         goto done;
@@ -220,10 +258,29 @@ done:
     close(fd);
     unlink(workpath);
     xfree(workpath);
-    xfree(ctxs);
     return ok ? 0 : -1;
 }
 
+// Save all data to a stream, such as a network connection, using the same
+// block format as the data file. The stream is terminated by an empty block.
+int save_stream(ssize_t (*writer)(const void *data, size_t len, 
+    void *udata), void *udata, bool fast)
+{
+    if (save_blocks(writer, udata, fast) == -1) {
+        return -1;
+    }
+    uint8_t head[16] = { 'P', 'O', 'G', 'O' };
+    size_t n = 0;
+    while (n < sizeof(head)) {
+        ssize_t ret = writer(head+n, sizeof(head)-n, udata);
+        if (ret <= 0) {
+            return -1;
+        }
+        n += ret;
+    }
+    return 0;
+}
+
 // compressed block
 struct cblock {
     struct buf cdata;   // compressed data
@@ -286,8 +343,9 @@ static bool load_block(struct cblock *block, struct loadctx *ctx) {
         // kind
         uint8_t kind = *(p++);
         
-        if (kind != 0) {
-            // only k/v strings allowed at this time.
+        if (kind > 3) {
+            // only k/v strings and hashes, with an optional grace period,
+            // allowed at this time.
             printf(">> %d\n", kind);
             printf(". unknown kind\n");
             goto done;
@@ -318,6 +376,10 @@ static bool load_block(struct cblock *block, struct loadctx *ctx) {
         }
         const uint8_t *val = p;
         p += vallen;
+        if ((kind&1) && !hash_valid((char*)val, vallen)) {
+            printf(". bad hash value\n");
+            goto done;
+        }
         /////////////////////
         // ttl
         n = varint_read_u64(p, e-p, &x);
@@ -342,20 +404,50 @@ static bool load_block(struct cblock *block, struct loadctx *ctx) {
         }
         uint64_t cas = x;
         p += n;
+        int64_t grace = 0;
+        int64_t delta = 0;
+        if (kind&2) {
+            /////////////////////
+            // grace
+            n = varint_read_u64(p, e-p, &x);
+            if (n <= 0 || (int64_t)x < 0) {
+                goto done;
+            }
+            grace = x;
+            p += n;
+            /////////////////////
+            // delta
+            n = varint_read_u64(p, e-p, &x);
+            if (n <= 0 || (int64_t)x < 0) {
+                goto done;
+            }
+            delta = x;
+            p += n;
+        }
         if (ttl > 0) {
             int64_t unixexpires = int64_add_clamp(unixtime, ttl);
-            if (unixexpires < unixnow) {
+            int64_t unixend = int64_add_clamp(unixexpires, grace);
+            if (unixend < unixnow) {
                 // already expired, skip this entry
                 ctx->nexpired++;
                 continue;
             }
-            ttl = unixexpires-unixnow;
+            if (unixexpires <= unixnow) {
+                // In its grace period. Keep serving it for the rest.
+                ttl = 1;
+                grace = unixend-unixnow-1;
+            } else {
+                ttl = unixexpires-unixnow;
+            }
         }
         struct pogocache_store_opts opts = {
             .flags = flags,
             .time = now,
             .ttl = ttl,
             .cas = cas,
+            .grace = grace,
+            .delta = delta,
+            .type = (kind&1) ? POGOCACHE_TYPE_HASH : POGOCACHE_TYPE_STRING,
         };
         // printf("[%.*s]=[%.*s]\n", (int)keylen, key, (int)vallen, val);
         int ret = pogocache_store(cache, key, keylen, val, vallen, &opts);
@@ -410,6 +502,20 @@ static void *thload(void *arg) {
 
 // load data into cache from path
 int load(const char *path, bool fast, struct load_stats *stats) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = load_fd(fd, fast, stats);
+    int errnum = errno;
+    close(fd);
+    errno = errnum;
+    return ret;
+}
+
+// Load data into cache from a file or stream. Reading stops at the end of
+// the file or at an empty block, which terminates a stream.
+int load_fd(int fd, bool fast, struct load_stats *stats) {
     // Use a single stream reader. Handing off blocks to threads.
     struct load_stats sstats;
     if (!stats) {
@@ -417,11 +523,6 @@ int load(const char *path, bool fast, struct load_stats *stats) {
     }
     memset(stats, 0, sizeof(struct load_stats));
 
-    int fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        return -1;
-    }
-
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
     bool donereading = false;
@@ -466,7 +567,7 @@ int load(const char *path, bool fast, struct load_stats *stats) {
     bool shortread = false;
     while (ok) {
         uint8_t head[16];
-        ssize_t size = read(fd, head, 16);
+        ssize_t size = read_full(fd, head, 16);
         if (size <= 0) {
             if (size == -1) {
                 ok = false;
@@ -487,17 +588,15 @@ int load(const char *path, bool fast, struct load_stats *stats) {
         memcpy(&crc, head+4, 4);
         size_t dlen = read_u32(head+8);
         size_t clen = read_u32(head+12);
+        if (dlen == 0 && clen == 0) {
+            // end of stream
+            break;
+        }
         buf_ensure(&cdata, clen);
         bool okread = true;
-        size_t total = 0;
-        while (total < clen) {
-            ssize_t rlen = read(fd, cdata.data+total, clen-total);
-            if (rlen <= 0) {
-                shortread = true;
-                okread = false;
-                break;
-            }
-            total += rlen;
+        if (read_full(fd, cdata.data, clen) != (ssize_t)clen) {
+            shortread = true;
+            okread = false;
         }
         if (!okread) {
             if (shortread) {
@@ -583,7 +682,6 @@ shutdown_threads:
     }
     xfree(blocks);
     xfree(ctxs);
-    close(fd);
     return ok ? 0 : -1;
 }
 
@@ -11,6 +11,7 @@
 #define SAVE_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 struct load_stats {
     size_t ninserted; // total number of inserted entries
@@ -20,7 +21,10 @@ struct load_stats {
 };
 
 int save(const char *path, bool fast);
+int save_stream(ssize_t (*writer)(const void *data, size_t len, 
+    void *udata), void *udata, bool fast);
 int load(const char *path, bool fast, struct load_stats *stats);
+int load_fd(int fd, bool fast, struct load_stats *stats);
 bool cleanwork(const char *path);
 
 #endif
@@ -0,0 +1,76 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Layout of the shared memory rings that are used by clients on the same
+// host. This file is shared by the server and the client library in the
+// client directory, so it must not depend on anything else in the project.
+//
+// A client connected over the unix socket sends SHMRING [size]. The server
+// responds with +OK and a memfd, passed with SCM_RIGHTS, that both sides map.
+// The memory has a header followed by two byte rings of equal size. The
+// request ring is written by the client and read by the server, and the
+// response ring is written by the server and read by the client. The bytes
+// are the same RESP stream that would otherwise go over the socket.
+//
+// Wakeups:
+// - When the server stops polling it sets srvwait to what it's waiting on.
+//   A client that publishes requests while srvwait is SHMRING_WAITREQ, or
+//   consumes responses while srvwait is SHMRING_WAITSPACE, clears it and
+//   writes one byte to the unix socket. The server discards those bytes.
+// - When the client is sleeping it sets cliwait and waits on the clifutex
+//   word. The server clears cliwait, bumps clifutex, and wakes the futex
+//   after it publishes responses or consumes requests.
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHMRING_MAGIC   0x676e69726f676f70 // "pogoring"
+#define SHMRING_VERSION 1
+#define SHMRING_HDRSIZE 4096
+#define SHMRING_MINSIZE (64*1024)
+#define SHMRING_MAXSIZE (64*1024*1024)
+#define SHMRING_DEFSIZE (1024*1024)
+
+// Values of srvwait
+#define SHMRING_WAITREQ   1 // waiting for requests
+#define SHMRING_WAITSPACE 2 // waiting for space in the response ring
+
+struct shmring_pos {
+    _Atomic(uint64_t) head; // consumer position
+    char pad0[64-sizeof(uint64_t)];
+    _Atomic(uint64_t) tail; // producer position
+    char pad1[64-sizeof(uint64_t)];
+};
+
+struct shmring_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;                  // bytes in each ring, power of two
+    char pad0[64-16];
+    struct shmring_pos req;         // client -> server
+    struct shmring_pos resp;        // server -> client
+    _Atomic(uint32_t) srvwait;      // server is sleeping on the socket
+    char pad1[64-sizeof(uint32_t)];
+    _Atomic(uint32_t) cliwait;      // client is sleeping on clifutex
+    _Atomic(uint32_t) clifutex;
+    char pad2[64-sizeof(uint32_t)*2];
+};
+
+static inline char *shmring_reqbuf(struct shmring_hdr *hdr) {
+    return (char*)hdr+SHMRING_HDRSIZE;
+}
+
+static inline char *shmring_respbuf(struct shmring_hdr *hdr) {
+    return (char*)hdr+SHMRING_HDRSIZE+hdr->size;
+}
+
+#endif
@@ -32,6 +32,10 @@ static atomic_uint_fast64_t g_stat_store_too_large = 0;
 static atomic_uint_fast64_t g_stat_store_no_memory = 0;
 static atomic_uint_fast64_t g_stat_auth_cmds = 0;
 static atomic_uint_fast64_t g_stat_auth_errors = 0;
+static atomic_uint_fast64_t g_stat_lease_granted = 0;
+static atomic_uint_fast64_t g_stat_lease_hot_misses = 0;
+static atomic_uint_fast64_t g_stat_lease_rejected = 0;
+static atomic_uint_fast64_t g_stat_limit_closed = 0;
 
 void stat_cmd_flush_incr(struct conn *conn) {
     (void)conn;
@@ -133,6 +137,26 @@ void stat_auth_errors_incr(struct conn *conn) {
     atomic_fetch_add_explicit(&g_stat_auth_errors, 1, __ATOMIC_RELAXED);
 }
 
+void stat_lease_granted_incr(struct conn *conn) {
+    (void)conn;
+    atomic_fetch_add_explicit(&g_stat_lease_granted, 1, __ATOMIC_RELAXED);
+}
+
+void stat_lease_hot_misses_incr(struct conn *conn) {
+    (void)conn;
+    atomic_fetch_add_explicit(&g_stat_lease_hot_misses, 1, __ATOMIC_RELAXED);
+}
+
+void stat_lease_rejected_incr(struct conn *conn) {
+    (void)conn;
+    atomic_fetch_add_explicit(&g_stat_lease_rejected, 1, __ATOMIC_RELAXED);
+}
+
+void stat_limit_closed_incr(struct conn *conn) {
+    (void)conn;
+    atomic_fetch_add_explicit(&g_stat_limit_closed, 1, __ATOMIC_RELAXED);
+}
+
 uint64_t stat_cmd_flush(void) {
     return atomic_load_explicit(&g_stat_cmd_flush, __ATOMIC_RELAXED);
 }
@@ -213,4 +237,20 @@ uint64_t stat_auth_errors(void) {
     return atomic_load_explicit(&g_stat_auth_errors, __ATOMIC_RELAXED);
 }
 
+uint64_t stat_lease_granted(void) {
+    return atomic_load_explicit(&g_stat_lease_granted, __ATOMIC_RELAXED);
+}
+
+uint64_t stat_lease_hot_misses(void) {
+    return atomic_load_explicit(&g_stat_lease_hot_misses, __ATOMIC_RELAXED);
+}
+
+uint64_t stat_lease_rejected(void) {
+    return atomic_load_explicit(&g_stat_lease_rejected, __ATOMIC_RELAXED);
+}
+
+uint64_t stat_limit_closed(void) {
+    return atomic_load_explicit(&g_stat_limit_closed, __ATOMIC_RELAXED);
+}
+
 
@@ -33,6 +33,10 @@ void stat_store_too_large_incr(struct conn *conn);
 void stat_store_no_memory_incr(struct conn *conn);
 void stat_auth_cmds_incr(struct conn *conn);
 void stat_auth_errors_incr(struct conn *conn);
+void stat_lease_granted_incr(struct conn *conn);
+void stat_lease_hot_misses_incr(struct conn *conn);
+void stat_lease_rejected_incr(struct conn *conn);
+void stat_limit_closed_incr(struct conn *conn);
 
 uint64_t stat_cmd_flush(void);
 uint64_t stat_cmd_touch(void);
@@ -54,6 +58,10 @@ uint64_t stat_store_too_large(void);
 uint64_t stat_store_no_memory(void);
 uint64_t stat_auth_cmds(void);
 uint64_t stat_auth_errors(void);
+uint64_t stat_lease_granted(void);
+uint64_t stat_lease_hot_misses(void);
+uint64_t stat_lease_rejected(void);
+uint64_t stat_limit_closed(void);
 
 
 
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 #if defined(__APPLE__)
 #include <mach/mach_time.h>
 #include <mach/mach.h>
@@ -32,6 +33,7 @@
 #include <windows.h>
 #elif defined(__linux__)
 #include <sys/utsname.h>
+#include <dirent.h>
 #elif defined(__EMSCRIPTEN__)
 #include <emscripten/emscripten.h>
 #endif
@@ -329,3 +331,102 @@ const char *sys_os(void) {
     }
     return buf;
 }
+
+// Parse a cpu list, such as "0-3,8,10-11", into an array of cpu numbers.
+// Returns the number of cpus or -1 if the list is invalid.
+int sys_parsecpus(const char *list, int *cpus, int maxcpus) {
+    int n = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long start = strtol(p, &end, 10);
+        if (end == p || start < 0 || start > 65535) {
+            return -1;
+        }
+        long last = start;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < start || last > 65535) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long i = start; i <= last; i++) {
+            if (n == maxcpus) {
+                return -1;
+            }
+            cpus[n++] = i;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// Returns the cpus that this process is allowed to run on.
+int sys_cpus(int *cpus, int maxcpus) {
+    int n = 0;
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int i = 0; i < CPU_SETSIZE && n < maxcpus; i++) {
+            if (CPU_ISSET(i, &mask)) {
+                cpus[n++] = i;
+            }
+        }
+        return n;
+    }
+#endif
+    int nprocs = sysconf(_SC_NPROCESSORS_CONF);
+    for (int i = 0; i < nprocs && n < maxcpus; i++) {
+        cpus[n++] = i;
+    }
+    return n;
+}
+
+// Returns the NUMA node for a cpu. Systems without NUMA always return zero.
+int sys_cpunode(int cpu) {
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && 
+            isdigit((unsigned char)ent->d_name[4]))
+        {
+            node = atoi(ent->d_name+4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    (void)cpu;
+    return 0;
+#endif
+}
+
+// Pin the calling thread to a single cpu.
+// Returns false if pinning is not supported or failed.
+bool sys_pinthread(int cpu) {
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
@@ -12,6 +12,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 int sys_nprocs(void);
 size_t sys_memory(void);
@@ -31,4 +32,9 @@ void sys_getmeminfo(struct sys_meminfo *info);
 uint64_t sys_threadid(void);
 const char *sys_os(void);
 
+int sys_parsecpus(const char *list, int *cpus, int maxcpus);
+int sys_cpus(int *cpus, int maxcpus);
+int sys_cpunode(int cpu);
+bool sys_pinthread(int cpu);
+
 #endif
@@ -0,0 +1,373 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit tier.c provides tiered storage, where large cold values are moved out
+// of memory into append-only extent files on a local disk.
+//
+// Entries keep their key and metadata in memory, along with a locator that is
+// the extent id, offset, and length of the value. Each extent tracks how many
+// of its bytes are still referenced by entries. Sparse extents are compacted
+// by rewriting their live values into the current extent, and the oldest
+// extents are dropped when the disk tier is full. Reading a value from a
+// dropped extent is treated as a cache miss.
+#include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "tier.h"
+#include "sys.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define EXTENTSIZE  (64*1024*1024) // size of each extent file
+#define LOCATORSIZE 12             // extent id, offset, and length
+#define MINSIZE     1024           // smallest value worth spilling
+#define COMPACTAT   4              // compact extents with less than 1/4 live
+#define MINIDLE     SECOND         // minimum idle time of spilled values
+#define MAXIDLE     HOUR           // maximum idle time of spilled values
+
+extern const int verb;
+
+struct extent {
+    uint32_t id;
+    int fd;
+    atomic_size_t size;     // bytes written
+    atomic_size_t live;     // bytes still referenced by entries
+};
+
+static bool enabled = false;
+static char *dirpath = 0;
+static size_t maxsize = 0;
+static pthread_rwlock_t mu = PTHREAD_RWLOCK_INITIALIZER; // guards extents
+static pthread_mutex_t spillmu = PTHREAD_MUTEX_INITIALIZER;
+static struct extent **extents = 0; // ring of extents, indexed by id. Freed
+                                    // extents leave holes in the ring.
+static int nextents = 0;            // capacity of the ring
+static uint32_t firstid = 0;        // oldest extent
+static uint32_t nextid = 0;         // next extent to be created
+static int64_t minidle = MINUTE;
+static atomic_uint_fast64_t nspilled = 0;
+static atomic_uint_fast64_t nreads = 0;
+static atomic_uint_fast64_t nlost = 0;
+static atomic_uint_fast64_t ncompacted = 0;
+static atomic_uint_fast64_t ndropped = 0;
+static uint32_t compactid = 0;      // extent being compacted
+
+static void extent_path(uint32_t id, char *path, size_t cap) {
+    snprintf(path, cap, "%s/%u.pogocache.extent", dirpath, id);
+}
+
+// Removes extents that were left behind by a previous process.
+static bool cleanextents(void) {
+    DIR *dir = opendir(dirpath);
+    if (!dir) {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *ext = ".pogocache.extent";
+        if (entry->d_type != DT_REG ||
+            strlen(entry->d_name) < strlen(ext) ||
+            strcmp(entry->d_name+strlen(entry->d_name)-strlen(ext), ext) != 0)
+        {
+            continue;
+        }
+        size_t cap = strlen(dirpath)+1+strlen(entry->d_name)+1;
+        char *path = xmalloc(cap);
+        snprintf(path, cap, "%s/%s", dirpath, entry->d_name);
+        unlink(path);
+        xfree(path);
+    }
+    closedir(dir);
+    return true;
+}
+
+// Enables tiered storage using the directory for extent files, which will
+// use at most 'maxsize0' bytes of disk space.
+bool tier_init(const char *dir, size_t maxsize0) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return false;
+    }
+    dirpath = xmalloc(strlen(dir)+1);
+    strcpy(dirpath, dir);
+    if (!cleanextents()) {
+        return false;
+    }
+    maxsize = maxsize0 < EXTENTSIZE*2 ? EXTENTSIZE*2 : maxsize0;
+    nextents = maxsize/EXTENTSIZE+2;
+    extents = xmalloc(nextents*sizeof(struct extent*));
+    memset(extents, 0, nextents*sizeof(struct extent*));
+    enabled = true;
+    return true;
+}
+
+static int extents_count(void) {
+    return nextid-firstid;
+}
+
+// Returns the extent for id, or null if it has been dropped.
+// Caller must hold the mu lock.
+static struct extent *extent_get(uint32_t id) {
+    if (id-firstid >= nextid-firstid) {
+        return 0;
+    }
+    return extents[id%nextents];
+}
+
+// Frees the extent and its file. Caller must hold the mu write lock.
+static void extent_free(uint32_t id) {
+    struct extent *ext = extents[id%nextents];
+    extents[id%nextents] = 0;
+    char path[PATH_MAX];
+    extent_path(ext->id, path, sizeof(path));
+    close(ext->fd);
+    unlink(path);
+    xfree(ext);
+    while (firstid != nextid && !extents[firstid%nextents]) {
+        firstid++;
+    }
+}
+
+// Returns the current extent that has room for 'len' more bytes, creating a
+// new extent if needed. Caller must hold the spillmu lock.
+static struct extent *extent_current(size_t len) {
+    if (extents_count() > 0) {
+        struct extent *ext = extents[(nextid-1)%nextents];
+        if (ext && atomic_load(&ext->size)+len <= EXTENTSIZE) {
+            return ext;
+        }
+    }
+    char path[PATH_MAX];
+    extent_path(nextid, path, sizeof(path));
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        if (verb >= 1) {
+            perror("# tier open");
+        }
+        return 0;
+    }
+    struct extent *ext = xmalloc(sizeof(struct extent));
+    ext->id = nextid;
+    ext->fd = fd;
+    atomic_init(&ext->size, 0);
+    atomic_init(&ext->live, 0);
+    pthread_rwlock_wrlock(&mu);
+    if (extents_count() == nextents) {
+        atomic_fetch_add(&ndropped, 1);
+        extent_free(firstid);
+    }
+    extents[nextid%nextents] = ext;
+    nextid++;
+    pthread_rwlock_unlock(&mu);
+    return ext;
+}
+
+size_t tier_spill(const void *value, size_t valuelen, void *locator,
+    size_t cap, void *udata)
+{
+    (void)udata;
+    if (valuelen > EXTENTSIZE || cap < LOCATORSIZE) {
+        return 0;
+    }
+    pthread_mutex_lock(&spillmu);
+    struct extent *ext = extent_current(valuelen);
+    if (!ext) {
+        pthread_mutex_unlock(&spillmu);
+        return 0;
+    }
+    size_t off = atomic_load(&ext->size);
+    size_t written = 0;
+    while (written < valuelen) {
+        ssize_t n = pwrite(ext->fd, (char*)value+written, valuelen-written,
+            off+written);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_unlock(&spillmu);
+            return 0;
+        }
+        written += n;
+    }
+    atomic_fetch_add(&ext->size, valuelen);
+    atomic_fetch_add(&ext->live, valuelen);
+    uint32_t id = ext->id;
+    pthread_mutex_unlock(&spillmu);
+    write_u32(locator, id);
+    write_u32((char*)locator+4, off);
+    write_u32((char*)locator+8, valuelen);
+    atomic_fetch_add_explicit(&nspilled, 1, __ATOMIC_RELAXED);
+    return LOCATORSIZE;
+}
+
+bool tier_unspill(const void *locator, size_t loclen, void *dst,
+    size_t dstlen, void *udata)
+{
+    (void)udata;
+    if (loclen != LOCATORSIZE) {
+        return false;
+    }
+    uint32_t id = read_u32(locator);
+    uint32_t off = read_u32((char*)locator+4);
+    uint32_t len = read_u32((char*)locator+8);
+    if (len != dstlen) {
+        return false;
+    }
+    bool ok = false;
+    pthread_rwlock_rdlock(&mu);
+    struct extent *ext = extent_get(id);
+    if (ext) {
+        size_t nread = 0;
+        while (nread < len) {
+            ssize_t n = pread(ext->fd, (char*)dst+nread, len-nread,
+                off+nread);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            nread += n;
+        }
+        ok = nread == len;
+    }
+    pthread_rwlock_unlock(&mu);
+    if (ok) {
+        atomic_fetch_add_explicit(&nreads, 1, __ATOMIC_RELAXED);
+    } else {
+        atomic_fetch_add_explicit(&nlost, 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+void tier_release(const void *locator, size_t loclen, void *udata) {
+    (void)udata;
+    if (loclen != LOCATORSIZE) {
+        return;
+    }
+    uint32_t id = read_u32(locator);
+    uint32_t len = read_u32((char*)locator+8);
+    pthread_rwlock_rdlock(&mu);
+    struct extent *ext = extent_get(id);
+    if (ext) {
+        atomic_fetch_sub(&ext->live, len);
+    }
+    pthread_rwlock_unlock(&mu);
+}
+
+static bool respill(const void *locator, size_t loclen, void *udata) {
+    (void)udata;
+    return loclen == LOCATORSIZE && read_u32(locator) == compactid;
+}
+
+// Compacts the oldest sparse extent by rewriting its live values into the
+// current extent. Returns true if an extent was compacted.
+static bool compact(struct pogocache *cache) {
+    pthread_rwlock_rdlock(&mu);
+    bool found = false;
+    // Never compact the current extent.
+    for (uint32_t id = firstid; id+1 < nextid; id++) {
+        struct extent *ext = extents[id%nextents];
+        if (ext && atomic_load(&ext->live) > 0 &&
+            atomic_load(&ext->live) < atomic_load(&ext->size)/COMPACTAT)
+        {
+            compactid = id;
+            found = true;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&mu);
+    if (!found) {
+        return false;
+    }
+    struct pogocache_spill_opts opts = {
+        .minsize = SIZE_MAX,
+        .respill = respill,
+    };
+    pogocache_spill(cache, &opts);
+    atomic_fetch_add(&ncompacted, 1);
+    return true;
+}
+
+// Moves cold values to disk when there's memory pressure, and maintains the
+// extent files. The idle time of spilled values adapts to the pressure, so
+// that only the coldest values are spilled.
+void tier_tick(struct pogocache *cache, bool pressure) {
+    if (!enabled) {
+        return;
+    }
+    if (pressure) {
+        struct pogocache_spill_opts opts = {
+            .minsize = MINSIZE,
+            .minidle = minidle,
+        };
+        size_t n = pogocache_spill(cache, &opts);
+        if (verb >= 2) {
+            printf(". Tier spilled %zu values (idle=%.0fs)\n", n,
+                (double)minidle/SECOND);
+        }
+        minidle = minidle/2 < MINIDLE ? MINIDLE : minidle/2;
+    } else {
+        minidle = minidle*2 > MAXIDLE ? MAXIDLE : minidle*2;
+    }
+    compact(cache);
+    // Free the extents that are empty, and then the oldest extents while the
+    // disk tier is full. Extents before the current one are never written to
+    // again.
+    pthread_rwlock_wrlock(&mu);
+    size_t total = 0;
+    for (uint32_t id = firstid; id+1 < nextid; id++) {
+        struct extent *ext = extents[id%nextents];
+        if (ext && atomic_load(&ext->live) == 0) {
+            extent_free(id);
+        }
+    }
+    for (uint32_t id = firstid; id != nextid; id++) {
+        struct extent *ext = extents[id%nextents];
+        total += ext ? atomic_load(&ext->size) : 0;
+    }
+    while (extents_count() > 1 && total > maxsize) {
+        struct extent *ext = extents[firstid%nextents];
+        total -= atomic_load(&ext->size);
+        atomic_fetch_add(&ndropped, 1);
+        extent_free(firstid);
+    }
+    pthread_rwlock_unlock(&mu);
+}
+
+void tier_stats(struct tier_stats *stats) {
+    memset(stats, 0, sizeof(struct tier_stats));
+    stats->enabled = enabled;
+    if (!enabled) {
+        return;
+    }
+    pthread_rwlock_rdlock(&mu);
+    for (uint32_t id = firstid; id != nextid; id++) {
+        struct extent *ext = extents[id%nextents];
+        if (ext) {
+            stats->extents++;
+            stats->diskbytes += atomic_load(&ext->size);
+            stats->livebytes += atomic_load(&ext->live);
+        }
+    }
+    pthread_rwlock_unlock(&mu);
+    stats->spilled = atomic_load(&nspilled);
+    stats->reads = atomic_load(&nreads);
+    stats->lost = atomic_load(&nlost);
+    stats->compacted = atomic_load(&ncompacted);
+    stats->dropped = atomic_load(&ndropped);
+    stats->minidle = minidle;
+}
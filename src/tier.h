@@ -0,0 +1,40 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef TIER_H
+#define TIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pogocache.h"
+
+struct tier_stats {
+    bool enabled;
+    int extents;            // number of extent files
+    uint64_t diskbytes;     // bytes written to the extent files
+    uint64_t livebytes;     // bytes still referenced by entries
+    uint64_t spilled;       // number of values spilled
+    uint64_t reads;         // number of values read back
+    uint64_t lost;          // values that were no longer on disk
+    uint64_t compacted;     // number of extents compacted
+    uint64_t dropped;       // number of extents dropped for space
+    int64_t minidle;        // current idle time of spilled values
+};
+
+bool tier_init(const char *dir, size_t maxsize);
+size_t tier_spill(const void *value, size_t valuelen, void *locator,
+    size_t cap, void *udata);
+bool tier_unspill(const void *locator, size_t loclen, void *dst,
+    size_t dstlen, void *udata);
+void tier_release(const void *locator, size_t loclen, void *udata);
+void tier_tick(struct pogocache *cache, bool pressure);
+void tier_stats(struct tier_stats *stats);
+
+#endif
@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 #include "tls.h"
 #include "xmalloc.h"
 #include "openssl.h"
@@ -41,8 +43,44 @@ ssize_t tls_write(struct tls *tls, int fd, const void *data, size_t len) {
     (void)tls;
     return write(fd, data, len);
 }
+bool tls_kernel(struct tls *tls) {
+    (void)tls;
+    return false;
+}
+bool tls_wantwrite(struct tls *tls) {
+    (void)tls;
+    return false;
+}
+ssize_t tls_recvmsg(int fd, struct msghdr *msg) {
+    return recvmsg(fd, msg, 0);
+}
+ssize_t tls_record(struct msghdr *msg, ssize_t n) {
+    (void)msg;
+    return n;
+}
+void tls_stats(struct tls_stats *stats) {
+    memset(stats, 0, sizeof(struct tls_stats));
+}
 #else
 
+#define SESSCACHESIZE 20480 // sessions kept for resumption by session id
+#define NUMTICKETS    2     // session tickets sent after a TLS 1.3 handshake
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TLS_GET_RECORD_TYPE
+#define TLS_GET_RECORD_TYPE 2
+#endif
+
+// TLS record content types, alert descriptions, and handshake types
+#define RECORD_ALERT     21
+#define RECORD_HANDSHAKE 22
+#define RECORD_DATA      23
+#define ALERT_CLOSE      0    // close_notify
+#define ALERT_CANCELED   90   // user_canceled, followed by a close_notify
+#define HANDSHAKE_KEYUPDATE 24
+
 extern const bool usetls;
 extern const char *tlscertfile;
 extern const char *tlscacertfile;
@@ -50,8 +88,21 @@ extern const char *tlskeyfile;
 
 static SSL_CTX *ctx;
 
+static atomic_uint_fast64_t nhandshakes = 0;
+static atomic_uint_fast64_t nresumed = 0;
+static atomic_uint_fast64_t nfailed = 0;
+static atomic_uint_fast64_t nktls = 0;
+
+// A connection starts in the handshake state, which is driven one step at a
+// time by tls_read and tls_write as the socket becomes ready. Once the
+// handshake is done, each direction of the record layer is either in the
+// kernel (kTLS) or stays in OpenSSL.
 struct tls {
     SSL *ssl;
+    bool ready;     // handshake is done
+    bool wantwrite; // the last operation is waiting on the socket to write
+    bool ktlssend;  // writes are encrypted by the kernel
+    bool ktlsrecv;  // reads are decrypted by the kernel
 };
 
 void tls_init(void) {
@@ -78,6 +129,17 @@ void tls_init(void) {
         printf("# tls: private key does not match the certificate\n");
         exit(EXIT_FAILURE);
     }
+    // Allow clients to resume sessions, either with a session id from the
+    // server side cache or with a stateless session ticket. Resumed
+    // handshakes skip the certificate exchange and verification.
+    static const unsigned char sessid[] = "pogocache";
+    SSL_CTX_set_session_id_context(ctx, sessid, sizeof(sessid)-1);
+    SSL_CTX_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_MODE, SSL_SESS_CACHE_SERVER, 0);
+    SSL_CTX_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_SIZE, SESSCACHESIZE, 0);
+    SSL_CTX_set_num_tickets(ctx, NUMTICKETS);
+    // Move the record layer into the kernel when the kernel and cipher
+    // support it. OpenSSL falls back to userspace otherwise.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
 }
 
 bool tls_accept(int fd, struct tls **tls_out) {
@@ -94,17 +156,9 @@ bool tls_accept(int fd, struct tls **tls_out) {
     }
     SSL_set_fd(ssl, fd);
     SSL_set_verify(ssl, SSL_VERIFY_PEER, 0);
-    int ret = SSL_accept(ssl);
-    if (ret <= 0) {
-        int err = SSL_get_error(ssl, ret);
-        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
-            printf("# tls: SSL_accept() failed\n");
-            ERR_print_errors_fp(stderr);
-            SSL_free(ssl);
-            *tls_out = 0;
-            return false;
-        }
-    }
+    // The handshake itself happens on the following reads, so that the
+    // event loop is never held up waiting on the client.
+    SSL_set_accept_state(ssl);
     struct tls *tls = xmalloc(sizeof(struct tls));
     memset(tls, 0, sizeof(struct tls));
     tls->ssl = ssl;
@@ -112,9 +166,142 @@ bool tls_accept(int fd, struct tls **tls_out) {
     return true;
 }
 
+// Sets errno for a failed OpenSSL operation.
+static void seterrno(struct tls *tls, int err) {
+    tls->wantwrite = err == SSL_ERROR_WANT_WRITE;
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        // Non-blocking I/O, try again later
+        errno = EAGAIN;
+    } else {
+        // Unreliable errno. Fallback to EIO.
+        errno = EIO;
+    }
+}
+
+// Performs the next step of the handshake.
+// Returns 1 when the handshake is done, or -1 with errno set to EAGAIN if it
+// needs more I/O, or -1 with another errno if it failed.
+static int handshake(struct tls *tls) {
+    int ret = SSL_do_handshake(tls->ssl);
+    if (ret != 1) {
+        int err = SSL_get_error(tls->ssl, ret);
+        seterrno(tls, err);
+        if (errno != EAGAIN) {
+            atomic_fetch_add_explicit(&nfailed, 1, __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    tls->ready = true;
+    tls->ktlssend = BIO_ctrl(SSL_get_wbio(tls->ssl), BIO_CTRL_GET_KTLS_SEND, 0,
+        0) > 0;
+    tls->ktlsrecv = BIO_ctrl(SSL_get_rbio(tls->ssl), BIO_CTRL_GET_KTLS_RECV, 0,
+        0) > 0;
+    atomic_fetch_add_explicit(&nhandshakes, 1, __ATOMIC_RELAXED);
+    if (SSL_session_reused(tls->ssl)) {
+        atomic_fetch_add_explicit(&nresumed, 1, __ATOMIC_RELAXED);
+    }
+    if (tls->ktlssend && tls->ktlsrecv) {
+        atomic_fetch_add_explicit(&nktls, 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+// Returns true when the handshake is done and all records are handled by the
+// kernel, in which case the socket can be read and written directly.
+bool tls_kernel(struct tls *tls) {
+    return tls && tls->ready && tls->ktlssend && tls->ktlsrecv;
+}
+
+// Returns true when the last read or write, such as a step of the handshake,
+// stopped because the socket was not writable. The caller should retry once
+// the socket is writable, even if no data arrives.
+bool tls_wantwrite(struct tls *tls) {
+    return tls && tls->wantwrite;
+}
+
+// Returns the byte at offset i of the n bytes that were read into msg, or -1
+// if the read is too short.
+static int msgbyte(struct msghdr *msg, size_t i, ssize_t n) {
+    if ((ssize_t)i >= n) {
+        return -1;
+    }
+    for (size_t j = 0; j < (size_t)msg->msg_iovlen; j++) {
+        if (i < msg->msg_iov[j].iov_len) {
+            return ((unsigned char*)msg->msg_iov[j].iov_base)[i];
+        }
+        i -= msg->msg_iov[j].iov_len;
+    }
+    return -1;
+}
+
+// Checks the result of a read from a socket that has kTLS receive. The kernel
+// never mixes record types in one read, and a record that is not application
+// data comes with its type in a control message, which needs a control
+// buffer of TLSCMSGSIZE bytes. Without one the read fails with EIO.
+// Returns n for application data, zero for a close_notify alert, or -1 with
+// errno set to EAGAIN for a record that was dropped, or to another errno for
+// a record that ends the connection.
+ssize_t tls_record(struct msghdr *msg, ssize_t n) {
+    if (n <= 0) {
+        return n;
+    }
+    int type = RECORD_DATA;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS && 
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+    {
+        type = *(unsigned char*)CMSG_DATA(cmsg);
+    }
+    switch (type) {
+    case RECORD_DATA:
+        return n;
+    case RECORD_ALERT:
+        // The alert level is followed by the description.
+        switch (msgbyte(msg, 1, n)) {
+        case ALERT_CLOSE:
+            return 0;
+        case ALERT_CANCELED:
+            errno = EAGAIN;
+            return -1;
+        default:
+            errno = ECONNRESET;
+            return -1;
+        }
+    case RECORD_HANDSHAKE:
+        if (msgbyte(msg, 0, n) == HANDSHAKE_KEYUPDATE) {
+            // The new traffic keys can't be derived once the record layer
+            // is in the kernel.
+            errno = EIO;
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    default:
+        errno = EAGAIN;
+        return -1;
+    }
+}
+
+// Reads from a socket that has kTLS receive, dropping the records that are
+// not application data. See tls_record.
+ssize_t tls_recvmsg(int fd, struct msghdr *msg) {
+    size_t controllen = msg->msg_controllen;
+    while (1) {
+        msg->msg_controllen = controllen;
+        ssize_t n = recvmsg(fd, msg, 0);
+        if (n <= 0) {
+            return n;
+        }
+        n = tls_record(msg, n);
+        if (n != -1 || errno != EAGAIN) {
+            return n;
+        }
+    }
+}
+
 int tls_close(struct tls *tls, int fd) {
     if (tls) {
-        if (SSL_shutdown(tls->ssl) == 0) {
+        if (tls->ready && SSL_shutdown(tls->ssl) == 0) {
             SSL_shutdown(tls->ssl);
         }
         SSL_free(tls->ssl);
@@ -127,6 +314,13 @@ ssize_t tls_write(struct tls *tls, int fd, const void *data, size_t len) {
     if (!tls) {
         return write(fd, data, len);
     }
+    tls->wantwrite = false;
+    if (!tls->ready && handshake(tls) == -1) {
+        return -1;
+    }
+    if (tls->ktlssend) {
+        return write(fd, data, len);
+    }
     size_t nbytes;
     int ret = SSL_write_ex(tls->ssl, data, len, &nbytes);
     if (ret == 1) {
@@ -136,13 +330,7 @@ ssize_t tls_write(struct tls *tls, int fd, const void *data, size_t len) {
     if (err == SSL_ERROR_ZERO_RETURN) {
         return 0;
     }
-    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-        // Non-blocking I/O, try again later
-        errno = EAGAIN;
-    } else {
-        // Unreliable errno. Fallback to EIO.
-        errno = EIO;
-    }
+    seterrno(tls, err);
     return -1;
 }
 
@@ -150,6 +338,24 @@ ssize_t tls_read(struct tls *tls, int fd, void *data, size_t len) {
     if (!tls) {
         return read(fd, data, len);
     }
+    tls->wantwrite = false;
+    if (!tls->ready && handshake(tls) == -1) {
+        return -1;
+    }
+    if (tls->ktlsrecv) {
+        struct iovec iov = { .iov_base = data, .iov_len = len };
+        union {
+            char buf[TLSCMSGSIZE];
+            struct cmsghdr align;
+        } cmsg;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = cmsg.buf,
+            .msg_controllen = sizeof(cmsg.buf),
+        };
+        return tls_recvmsg(fd, &msg);
+    }
     size_t nbytes;
     int ret = SSL_read_ex(tls->ssl, data, len, &nbytes);
     if (ret == 1) {
@@ -159,14 +365,16 @@ ssize_t tls_read(struct tls *tls, int fd, void *data, size_t len) {
     if (err == SSL_ERROR_ZERO_RETURN) {
         return 0;
     }
-    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-        // Non-blocking I/O, try again later
-        errno = EAGAIN;
-    } else { 
-        // Unreliable errno. Fallback to EIO.
-        errno = EIO;
-    }
+    seterrno(tls, err);
     return -1;
 }
 
+void tls_stats(struct tls_stats *stats) {
+    memset(stats, 0, sizeof(struct tls_stats));
+    stats->handshakes = atomic_load_explicit(&nhandshakes, __ATOMIC_RELAXED);
+    stats->resumed = atomic_load_explicit(&nresumed, __ATOMIC_RELAXED);
+    stats->failed = atomic_load_explicit(&nfailed, __ATOMIC_RELAXED);
+    stats->ktls = atomic_load_explicit(&nktls, __ATOMIC_RELAXED);
+}
+
 #endif
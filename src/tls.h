@@ -10,12 +10,30 @@
 #ifndef TLS_H
 #define TLS_H
 
+#include <stdint.h>
+
 struct tls;
+struct msghdr;
+
+// Size of the control buffer that receives the record type of a kTLS read.
+#define TLSCMSGSIZE 64
+
+struct tls_stats {
+    uint64_t handshakes;    // completed handshakes
+    uint64_t resumed;       // handshakes that resumed a session
+    uint64_t failed;        // failed handshakes
+    uint64_t ktls;          // connections offloaded to kernel tls
+};
 
 void tls_init(void);
 bool tls_accept(int fd, struct tls **tls);
 int tls_close(struct tls *tls, int fd);
 ssize_t tls_write(struct tls *tls, int fd, const void *data, size_t len);
 ssize_t tls_read(struct tls *tls, int fd, void *data, size_t len);
+bool tls_kernel(struct tls *tls);
+bool tls_wantwrite(struct tls *tls);
+ssize_t tls_recvmsg(int fd, struct msghdr *msg);
+ssize_t tls_record(struct msghdr *msg, ssize_t n);
+void tls_stats(struct tls_stats *stats);
 
 #endif
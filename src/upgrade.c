@@ -0,0 +1,206 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+//
+// Unit upgrade.c provides hot upgrades, where a running server hands over its
+// listening sockets and shared memory cache to a newly started server.
+//
+// The running server listens on a unix socket. A new server connects to it
+// and sends a request. The running server then detaches from the cache, sends
+// its listening sockets using SCM_RIGHTS, and exits. The new server waits for
+// the connection to close before attaching to the cache.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "upgrade.h"
+
+static char sockpath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int sockfd = -1;
+static void (*handover)(int fds[3]) = 0;
+
+static bool unix_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Returns true if a server is listening for upgrades on the unix socket at
+// path. The server ignores the connection, since no request is sent.
+bool upgrade_running(const char *path) {
+    struct sockaddr_un addr;
+    if (!unix_addr(path, &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    bool running = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return running;
+}
+
+// Request a hot upgrade from the server that is listening on the unix socket
+// at path. Returns false if there's no server to upgrade. Otherwise, waits for
+// the server to exit and returns its listening sockets (tcp, unix, tls), with
+// zero for no listener.
+bool upgrade_request(const char *path, int fds[3]) {
+    struct sockaddr_un addr;
+    if (!unix_addr(path, &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        write(fd, "U", 1) != 1)
+    {
+        close(fd);
+        return false;
+    }
+    // The message holds a mask of the listeners that follow.
+    uint8_t mask = 0;
+    struct iovec iov = { .iov_base = &mask, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*3)];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    ssize_t n = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != 1) {
+        close(fd);
+        return false;
+    }
+    int recvd[3];
+    int nrecvd = 0;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        nrecvd = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+        memcpy(recvd, CMSG_DATA(cmsg), sizeof(int)*nrecvd);
+    }
+    int j = 0;
+    for (int i = 0; i < 3; i++) {
+        fds[i] = (mask>>i)&1 && j < nrecvd ? recvd[j++] : 0;
+    }
+    // Wait for the server to exit.
+    char ch;
+    while (read(fd, &ch, 1) > 0);
+    close(fd);
+    return true;
+}
+
+static void *upgrade_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept(sockfd, 0, 0);
+        if (fd == -1) {
+            continue;
+        }
+        char ch;
+        if (read(fd, &ch, 1) != 1 || ch != 'U') {
+            close(fd);
+            continue;
+        }
+        int fds[3];
+        handover(fds);
+        uint8_t mask = 0;
+        int sent[3];
+        int nsent = 0;
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] > 0) {
+                mask |= 1<<i;
+                sent[nsent++] = fds[i];
+            }
+        }
+        struct iovec iov = { .iov_base = &mask, .iov_len = 1 };
+        union {
+            char buf[CMSG_SPACE(sizeof(int)*3)];
+            struct cmsghdr align;
+        } ctrl;
+        memset(&ctrl, 0, sizeof(ctrl));
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (nsent > 0) {
+            msg.msg_control = ctrl.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int)*nsent);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int)*nsent);
+            memcpy(CMSG_DATA(cmsg), sent, sizeof(int)*nsent);
+        }
+        if (sendmsg(fd, &msg, 0) == -1) {
+            perror("# upgrade(sendmsg)");
+        }
+        printf("# Handed over to the new process, exiting now\n");
+        fflush(stdout);
+        _exit(0);
+    }
+    return 0;
+}
+
+// Listen for hot upgrade requests on the unix socket at path. The callback is
+// called when an upgrade is requested. It must stop all use of the shared
+// memory cache and return the listening sockets. The process exits right
+// after the sockets are handed over.
+bool upgrade_listen(const char *path, void (*callback)(int fds[3])) {
+    struct sockaddr_un addr;
+    if (!unix_addr(path, &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 1) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    strcpy(sockpath, path);
+    sockfd = fd;
+    handover = callback;
+    pthread_t th;
+    int ret = pthread_create(&th, 0, upgrade_thread, 0);
+    if (ret != 0) {
+        close(fd);
+        sockfd = -1;
+        unlink(sockpath);
+        return false;
+    }
+    pthread_detach(th);
+    return true;
+}
+
+// Remove the upgrade socket file.
+void upgrade_cleanup(void) {
+    if (sockfd != -1) {
+        unlink(sockpath);
+    }
+}
@@ -0,0 +1,20 @@
+// https://github.com/tidwall/pogocache
+//
+// Copyright 2025 Polypoint Labs, LLC. All rights reserved.
+// This file is part of the Pogocache project.
+// Use of this source code is governed by the MIT that can be found in
+// the LICENSE file.
+//
+// For alternative licensing options or general questions, please contact
+// us at licensing@polypointlabs.com.
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+bool upgrade_running(const char *path);
+bool upgrade_request(const char *path, int fds[3]);
+bool upgrade_listen(const char *path, void (*callback)(int fds[3]));
+void upgrade_cleanup(void);
+
+#endif
@@ -431,6 +431,23 @@ bool match(const char *pat, size_t plen, const char *str, size_t slen,
     return slen == 0 && plen == 0;
 }
 
+// Returns the length of the literal prefix of a pattern, which is the part
+// before the first wildcard. The 'anyrest' is set to true when the remainder
+// of the pattern matches any string, in which case the pattern matches every
+// string that starts with the prefix.
+size_t match_prefix(const char *pat, size_t plen, bool *anyrest) {
+    size_t n = 0;
+    while (n < plen && pat[n] != '*' && pat[n] != '?' && pat[n] != '\\') {
+        n++;
+    }
+    size_t i = n;
+    while (i < plen && pat[i] == '*') {
+        i++;
+    }
+    *anyrest = i == plen && i > n;
+    return n;
+}
+
 // Convert an arg to a c-string. 
 // Returns newly allocated string that must be freed using xfree in the future.
 // Returns null if the idx is out of bounds or there argument contains a null
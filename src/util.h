@@ -75,6 +75,7 @@ uint8_t morris_incr(uint8_t morris, uint64_t rand);
 
 bool match(const char *pat, size_t plen, const char *str, size_t slen,
     int depth);
+size_t match_prefix(const char *pat, size_t plen, bool *anyrest);
 
 #if defined(__x86_64__) || defined(__i386__)
 #define cpu_yield() __builtin_ia32_pause()
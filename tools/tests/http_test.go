@@ -1,7 +1,18 @@
 package tests
 
 import (
+	"bufio"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"net/http/httptrace"
+	"strings"
 	"testing"
+	"time"
+
+	"github.com/gomodule/redigo/redis"
+	"github.com/stretchr/testify/assert"
 )
 
 func TestHTTP(t *testing.T) {
@@ -44,3 +55,221 @@ func TestHTTP(t *testing.T) {
 	}
 
 }
+
+func TestHTTPKeepAlive(t *testing.T) {
+	conn, err := net.Dial("tcp", "127.0.0.1:9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	rd := bufio.NewReader(conn)
+	read := func(method string) (*http.Response, string) {
+		resp, err := http.ReadResponse(rd, &http.Request{Method: method})
+		if err != nil {
+			t.Fatal(err)
+		}
+		body, err := io.ReadAll(resp.Body)
+		if err != nil {
+			t.Fatal(err)
+		}
+		return resp, string(body)
+	}
+	t.Run("PIPELINE", func(t *testing.T) {
+		// All requests are written before any of the responses are read.
+		_, err := conn.Write([]byte(
+			"PUT /keepalive HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello" +
+				"GET /keepalive HTTP/1.1\r\n\r\n" +
+				"GET /missing HTTP/1.1\r\n\r\n" +
+				"DELETE /keepalive HTTP/1.1\r\n\r\n"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		resp, body := read("PUT")
+		assert.Equal(t, "Stored\r\n", body)
+		assert.False(t, resp.Close)
+		resp, body = read("GET")
+		assert.Equal(t, 200, resp.StatusCode)
+		assert.Equal(t, "hello", body)
+		resp, body = read("GET")
+		assert.Equal(t, 404, resp.StatusCode)
+		assert.Equal(t, "Not Found\r\n", body)
+		_, body = read("DELETE")
+		assert.Equal(t, "Deleted\r\n", body)
+	})
+	t.Run("CHUNKED", func(t *testing.T) {
+		_, err := conn.Write([]byte(
+			"PUT /keepalive HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" +
+				"5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n" +
+				"GET /keepalive HTTP/1.1\r\n\r\n"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		_, body := read("PUT")
+		assert.Equal(t, "Stored\r\n", body)
+		_, body = read("GET")
+		assert.Equal(t, "hello world", body)
+	})
+	t.Run("CLOSE", func(t *testing.T) {
+		_, err := conn.Write([]byte(
+			"GET /missing HTTP/1.1\r\nConnection: close\r\n\r\n"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		resp, _ := read("GET")
+		assert.True(t, resp.Close)
+		_, err = rd.ReadByte()
+		assert.Equal(t, io.EOF, err)
+	})
+}
+
+func TestHTTPReuse(t *testing.T) {
+	var reused int
+	trace := &httptrace.ClientTrace{
+		GotConn: func(info httptrace.GotConnInfo) {
+			if info.Reused {
+				reused++
+			}
+		},
+	}
+	client := &http.Client{Transport: &http.Transport{}}
+	for i := 0; i < 10; i++ {
+		uri := fmt.Sprintf("http://127.0.0.1:9401/reuse:%d", i)
+		req, err := http.NewRequest("PUT", uri, strings.NewReader("value"))
+		if err != nil {
+			t.Fatal(err)
+		}
+		req = req.WithContext(httptrace.WithClientTrace(req.Context(), trace))
+		resp, err := client.Do(req)
+		if err != nil {
+			t.Fatal(err)
+		}
+		io.ReadAll(resp.Body)
+		resp.Body.Close()
+	}
+	assert.Equal(t, 9, reused)
+}
+
+func TestHTTPChunked(t *testing.T) {
+	// A body of an unknown length is sent with chunked encoding.
+	body := io.MultiReader(strings.NewReader("hello"),
+		strings.NewReader(" "), strings.NewReader("world"))
+	req, err := http.NewRequest("PUT", "http://127.0.0.1:9401/chunked", body)
+	if err != nil {
+		t.Fatal(err)
+	}
+	resp, err := http.DefaultClient.Do(req)
+	if err != nil {
+		t.Fatal(err)
+	}
+	data, _ := io.ReadAll(resp.Body)
+	resp.Body.Close()
+	assert.Equal(t, "Stored\r\n", string(data))
+	val, err := httpDo(nil, "GET", "/chunked", "")
+	assert.Equal(t, "hello world", val)
+	assert.Nil(t, err)
+	httpDo(nil, "DELETE", "/chunked", "")
+	t.Run("TRICKLE", func(t *testing.T) {
+		// The request arrives a few bytes at a time, splitting the size
+		// lines, the chunks, and the trailers, and a request follows it.
+		conn, err := net.Dial("tcp", "127.0.0.1:9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		conn.Write([]byte("PUT /trickle HTTP/1.1\r\n" +
+			"Transfer-Encoding: chunked\r\n\r\n"))
+		var req, val string
+		for i := 0; i < 50; i++ {
+			chunk := strings.Repeat(fmt.Sprint(i%10), 100+i)
+			req += fmt.Sprintf("%x;ext=%d\r\n%s\r\n", len(chunk), i, chunk)
+			val += chunk
+		}
+		req += "0\r\nX-Trailer: yes\r\n\r\n"
+		req += "GET /trickle HTTP/1.1\r\n\r\n"
+		for i := 0; i < len(req); i += 7 {
+			conn.Write([]byte(req[i:min(i+7, len(req))]))
+			time.Sleep(time.Millisecond / 10)
+		}
+		rd := bufio.NewReader(conn)
+		for _, body := range []string{"Stored\r\n", val} {
+			resp, err := http.ReadResponse(rd, nil)
+			if err != nil {
+				t.Fatal(err)
+			}
+			data, _ := io.ReadAll(resp.Body)
+			resp.Body.Close()
+			assert.Equal(t, body, string(data))
+		}
+		httpDo(nil, "DELETE", "/trickle", "")
+	})
+}
+
+func TestHTTPBatch(t *testing.T) {
+	// The batches are also run in shared-nothing mode, where their keys
+	// belong to the shards of several threads.
+	startServer(t, 9414, "--sharednothing", "yes", "--threads", "4")
+	for _, port := range []int{9401, 9414} {
+		t.Run(fmt.Sprint(port), func(t *testing.T) {
+			testHTTPBatch(t, port)
+		})
+	}
+}
+
+func testHTTPBatch(t *testing.T, port int) {
+	post := func(uri, ctype, body string) (int, string) {
+		resp, err := http.Post(fmt.Sprintf("http://127.0.0.1:%d%s", port,
+			uri), ctype, strings.NewReader(body))
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer resp.Body.Close()
+		data, err := io.ReadAll(resp.Body)
+		if err != nil {
+			t.Fatal(err)
+		}
+		return resp.StatusCode, string(data)
+	}
+	frame := func(vals ...string) string {
+		var body string
+		for _, val := range vals {
+			body += fmt.Sprintf("%d\r\n%s\r\n", len(val), val)
+		}
+		return body
+	}
+	t.Run("LINES", func(t *testing.T) {
+		code, body := post("/_mset", "text/plain",
+			"batch:1 one\nbatch:2 two\n")
+		assert.Equal(t, 200, code)
+		assert.Equal(t, "Stored 2\r\n", body)
+		code, body = post("/_mget", "text/plain",
+			"batch:1\nbatch:missing\nbatch:2")
+		assert.Equal(t, 200, code)
+		assert.Equal(t, "3\r\none\r\n-1\r\n3\r\ntwo\r\n", body)
+	})
+	t.Run("FRAMED", func(t *testing.T) {
+		// Length framed keys and values may have any bytes.
+		vals := []string{"batch 3", "line\r\nbreak", "batch 4", ""}
+		code, body := post("/_mset?ttl=100", "application/octet-stream",
+			frame(vals...))
+		assert.Equal(t, 200, code)
+		assert.Equal(t, "Stored 2\r\n", body)
+		code, body = post("/_mget", "application/octet-stream",
+			frame("batch 4", "batch 3", "batch:missing"))
+		assert.Equal(t, 200, code)
+		assert.Equal(t, frame("", "line\r\nbreak")+"-1\r\n", body)
+		conn, err := redis.Dial("tcp", fmt.Sprintf(":%d", port))
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		ttl, err := redis.Int(conn.Do("TTL", "batch 3"))
+		assert.Greater(t, ttl, 90)
+		assert.Nil(t, err)
+	})
+	t.Run("MALFORMED", func(t *testing.T) {
+		code, _ := post("/_mset", "application/octet-stream", "5\r\nab")
+		assert.Equal(t, 400, code)
+		code, _ = post("/_mset", "text/plain", "nospace\n")
+		assert.Equal(t, 400, code)
+	})
+}
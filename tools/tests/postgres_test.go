@@ -1,11 +1,18 @@
 package tests
 
 import (
+	"bytes"
 	"context"
+	"encoding/binary"
+	"fmt"
+	"math"
+	"sort"
 	"strconv"
+	"strings"
 	"testing"
 
 	"github.com/jackc/pgx/v5"
+	"github.com/stretchr/testify/assert"
 )
 
 func TestPostgres(t *testing.T) {
@@ -86,3 +93,200 @@ func TestPostgres(t *testing.T) {
 	}
 
 }
+
+// pgGet returns the value of a key, using the extended protocol.
+func pgGet(t *testing.T, conn *pgx.Conn, key string) (string, bool) {
+	res := conn.PgConn().ExecParams(context.Background(), "GET $1",
+		[][]byte{[]byte(key)}, nil, nil, nil).Read()
+	if res.Err != nil {
+		t.Fatal(res.Err)
+	}
+	if len(res.Rows) == 0 {
+		return "", false
+	}
+	return string(res.Rows[0][0]), true
+}
+
+func TestPostgresCopy(t *testing.T) {
+	ctx := context.Background()
+	conn, err := pgx.Connect(ctx, "postgres://127.0.0.1:9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close(ctx)
+	pg := conn.PgConn()
+	res := pg.ExecParams(ctx, "FLUSH", nil, nil, nil, nil).Read()
+	assert.Nil(t, res.Err)
+	t.Run("FROM", func(t *testing.T) {
+		var in bytes.Buffer
+		for i := 0; i < 10000; i++ {
+			fmt.Fprintf(&in, "copy:%d\tvalue %d\n", i, i)
+		}
+		in.WriteString("copy:esc\ta\\tb\\\\c\\nd\n")
+		tag, err := pg.CopyFrom(ctx, &in, "COPY cache FROM STDIN")
+		assert.Nil(t, err)
+		assert.Equal(t, "COPY 10001", tag.String())
+		val, ok := pgGet(t, conn, "copy:9999")
+		assert.True(t, ok)
+		assert.Equal(t, "value 9999", val)
+		val, ok = pgGet(t, conn, "copy:esc")
+		assert.True(t, ok)
+		assert.Equal(t, "a\tb\\c\nd", val)
+	})
+	t.Run("TO", func(t *testing.T) {
+		var out bytes.Buffer
+		tag, err := pg.CopyTo(ctx, &out, "COPY cache TO STDOUT")
+		assert.Nil(t, err)
+		assert.Equal(t, "COPY 10001", tag.String())
+		lines := strings.Split(strings.TrimSuffix(out.String(), "\n"), "\n")
+		assert.Equal(t, 10001, len(lines))
+		sort.Strings(lines)
+		assert.Equal(t, "copy:0\tvalue 0", lines[0])
+		assert.Equal(t, "copy:esc\ta\\tb\\\\c\\nd", lines[10000])
+		out.Reset()
+		tag, err = pg.CopyTo(ctx, &out, "COPY (KEYS 'copy:99*') TO STDOUT")
+		assert.Nil(t, err)
+		assert.Equal(t, "COPY 111", tag.String())
+	})
+	t.Run("BINARY", func(t *testing.T) {
+		header := []byte("PGCOPY\n\xff\r\n\x00")
+		var in bytes.Buffer
+		in.Write(header)
+		binary.Write(&in, binary.BigEndian, [2]int32{0, 0})
+		for i := 0; i < 100; i++ {
+			key := fmt.Sprintf("bin:%d", i)
+			val := fmt.Sprintf("\x00\n%d", i)
+			binary.Write(&in, binary.BigEndian, int16(2))
+			binary.Write(&in, binary.BigEndian, int32(len(key)))
+			in.WriteString(key)
+			binary.Write(&in, binary.BigEndian, int32(len(val)))
+			in.WriteString(val)
+		}
+		binary.Write(&in, binary.BigEndian, int16(-1))
+		tag, err := pg.CopyFrom(ctx, &in,
+			"COPY cache FROM STDIN WITH (FORMAT binary)")
+		assert.Nil(t, err)
+		assert.Equal(t, "COPY 100", tag.String())
+		val, ok := pgGet(t, conn, "bin:42")
+		assert.True(t, ok)
+		assert.Equal(t, "\x00\n42", val)
+		var out bytes.Buffer
+		tag, err = pg.CopyTo(ctx, &out, "COPY (KEYS 'bin:42') TO STDOUT BINARY")
+		assert.Nil(t, err)
+		assert.Equal(t, "COPY 1", tag.String())
+		data := out.Bytes()
+		field := []byte("\x00\x00\x00\x04\x00\n42")
+		assert.True(t, bytes.HasPrefix(data, header))
+		assert.True(t, bytes.Contains(data, field))
+		assert.True(t, bytes.HasSuffix(data, []byte{0xff, 0xff}))
+	})
+	t.Run("ERRORS", func(t *testing.T) {
+		_, err := pg.CopyFrom(ctx, strings.NewReader("nokey\n"),
+			"COPY cache FROM STDIN")
+		assert.NotNil(t, err)
+		_, err = pg.CopyFrom(ctx, strings.NewReader("a\tb\n"),
+			"COPY cache FROM STDIN (FORMAT csv)")
+		assert.NotNil(t, err)
+		// The connection is usable after a failed COPY.
+		val, ok := pgGet(t, conn, "copy:1")
+		assert.True(t, ok)
+		assert.Equal(t, "value 1", val)
+	})
+}
+
+func TestPostgresBinary(t *testing.T) {
+	const (
+		textOID   = 25
+		int8OID   = 20
+		float8OID = 701
+	)
+	ctx := context.Background()
+	conn, err := pgx.Connect(ctx, "postgres://127.0.0.1:9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close(ctx)
+	pg := conn.PgConn()
+	i8 := func(x int64) []byte {
+		return binary.BigEndian.AppendUint64(nil, uint64(x))
+	}
+	t.Run("PARAMS", func(t *testing.T) {
+		// Binary numbers are stored as their text.
+		_, err := pg.Prepare(ctx, "setint", "SET $1 $2",
+			[]uint32{textOID, int8OID})
+		assert.Nil(t, err)
+		res := pg.ExecPrepared(ctx, "setint",
+			[][]byte{[]byte("binint"), i8(-42)}, []int16{0, 1}, nil).Read()
+		assert.Nil(t, res.Err)
+		val, _ := pgGet(t, conn, "binint")
+		assert.Equal(t, "-42", val)
+		res = pg.ExecParams(ctx, "SET $1 $2",
+			[][]byte{[]byte("binfloat"), i8(int64(math.Float64bits(1.5)))},
+			[]uint32{textOID, float8OID}, []int16{0, 1}, nil).Read()
+		assert.Nil(t, res.Err)
+		val, _ = pgGet(t, conn, "binfloat")
+		assert.Equal(t, "1.5", val)
+	})
+	t.Run("RESULTS", func(t *testing.T) {
+		_, err := pg.Prepare(ctx, "mgets", "MGETS $1", []uint32{textOID})
+		assert.Nil(t, err)
+		params := [][]byte{[]byte("binint")}
+		// The second execution reuses the row description of the first,
+		// and the third one needs a new one for text results.
+		for i := 0; i < 3; i++ {
+			formats := []int16{1}
+			if i == 2 {
+				formats = nil
+			}
+			res := pg.ExecPrepared(ctx, "mgets", params, nil, formats).Read()
+			assert.Nil(t, res.Err)
+			assert.Equal(t, 4, len(res.FieldDescriptions))
+			assert.Equal(t, 1, len(res.Rows))
+			if len(res.FieldDescriptions) != 4 || len(res.Rows) != 1 {
+				continue
+			}
+			flags := res.FieldDescriptions[1]
+			row := res.Rows[0]
+			assert.Equal(t, "binint", string(row[0]))
+			assert.Equal(t, "-42", string(row[3]))
+			// Columns are always sent in the binary form of their type,
+			// which for text is the same as the text form.
+			if i < 2 {
+				assert.Equal(t, uint32(int8OID), flags.DataTypeOID)
+				assert.Equal(t, i8(0), row[1])
+				assert.Equal(t, 8, len(row[2]))
+			} else {
+				assert.Equal(t, uint32(textOID), flags.DataTypeOID)
+				assert.Equal(t, "0", string(row[1]))
+			}
+		}
+	})
+	t.Run("COMMAND", func(t *testing.T) {
+		// A command that's a parameter gets the row description of each
+		// execution's command.
+		_, err := pg.Prepare(ctx, "anycmd", "$1 binint", []uint32{textOID})
+		assert.Nil(t, err)
+		for _, cmd := range []string{"GET", "MGETS", "GET"} {
+			res := pg.ExecPrepared(ctx, "anycmd", [][]byte{[]byte(cmd)}, nil,
+				nil).Read()
+			assert.Nil(t, res.Err)
+			nfields := 1
+			if cmd == "MGETS" {
+				nfields = 4
+			}
+			assert.Equal(t, nfields, len(res.FieldDescriptions))
+		}
+	})
+	t.Run("DBSIZE", func(t *testing.T) {
+		text := pg.ExecParams(ctx, "DBSIZE", nil, nil, nil, nil).Read()
+		assert.Nil(t, text.Err)
+		bin := pg.ExecParams(ctx, "DBSIZE", nil, nil, nil, []int16{1}).Read()
+		assert.Nil(t, bin.Err)
+		if len(text.Rows) != 1 || len(bin.Rows) != 1 {
+			t.Fatal("expected one row")
+		}
+		n, err := strconv.ParseInt(string(text.Rows[0][0]), 10, 64)
+		assert.Nil(t, err)
+		assert.Equal(t, i8(n), bin.Rows[0][0])
+	})
+}
@@ -1,9 +1,26 @@
 package tests
 
 import (
+	"bufio"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"crypto/tls"
+	"crypto/x509"
+	"crypto/x509/pkix"
+	"encoding/pem"
+	"errors"
 	"fmt"
+	"io"
+	"math/big"
+	"net"
+	"os"
+	"os/exec"
 	"sort"
+	"strconv"
 	"strings"
+	"sync"
+	"syscall"
 	"testing"
 	"time"
 
@@ -441,3 +458,1463 @@ func TestRESPKeyCmds(t *testing.T) {
 		conn.Do("DEL", "hello")
 	})
 }
+
+func TestRESPSharedNothing(t *testing.T) {
+	startServer(t, 9416, "--sharednothing", "yes", "--threads", "4")
+	// Each thread owns a quarter of the shards, so most keys are owned by
+	// a thread other than the one that the connection is on.
+	var conns []redis.Conn
+	for i := 0; i < 4; i++ {
+		conn, err := redis.Dial("tcp", ":9416")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		conns = append(conns, conn)
+	}
+	for i := 0; i < 1000; i++ {
+		key := fmt.Sprintf("key:%d", i)
+		reply, err := redis.String(conns[i%4].Do("SET", key, i))
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+	}
+	for i := 0; i < 1000; i++ {
+		key := fmt.Sprintf("key:%d", i)
+		n, err := redis.Int(conns[(i+1)%4].Do("GET", key))
+		assert.Equal(t, i, n)
+		assert.Nil(t, err)
+	}
+	t.Run("CONCURRENT", func(t *testing.T) {
+		var wg sync.WaitGroup
+		for _, conn := range conns {
+			wg.Add(1)
+			go func(conn redis.Conn) {
+				defer wg.Done()
+				for i := 0; i < 500; i++ {
+					conn.Do("INCR", "counter")
+				}
+			}(conn)
+		}
+		wg.Wait()
+		n, err := redis.Int(conns[0].Do("GET", "counter"))
+		assert.Equal(t, 2000, n)
+		assert.Nil(t, err)
+	})
+	t.Run("MULTIKEY", func(t *testing.T) {
+		vals, err := redis.Ints(conns[0].Do("MGET", "key:1", "key:2",
+			"key:3", "key:4"))
+		assert.Equal(t, []int{1, 2, 3, 4}, vals)
+		assert.Nil(t, err)
+		n, err := redis.Int(conns[1].Do("DEL", "key:1", "key:2", "key:3",
+			"key:4"))
+		assert.Equal(t, 4, n)
+		assert.Nil(t, err)
+	})
+	t.Run("MEMCACHE", func(t *testing.T) {
+		mc, err := net.Dial("tcp", "127.0.0.1:9416")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer mc.Close()
+		for i := 0; i < 16; i++ {
+			key := fmt.Sprintf("mc:%d", i)
+			resp, err := mcRawDo(mc, "set "+key+" 0 0 1\r\nx\r\n")
+			assert.Equal(t, "STORED\r\n", resp)
+			assert.Nil(t, err)
+			resp, err = mcRawDo(mc, "get "+key+"\r\n")
+			assert.Equal(t, "VALUE "+key+" 0 1\r\nx\r\nEND\r\n", resp)
+			assert.Nil(t, err)
+		}
+	})
+	t.Run("STATS", func(t *testing.T) {
+		assert.Greater(t, respStat(conns[0], "cmd_forwarded"), int64(0))
+	})
+}
+
+func TestRESPLockStats(t *testing.T) {
+	t.Run("DISABLED", func(t *testing.T) {
+		conn, err := redis.Dial("tcp", ":9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		_, err = conn.Do("STATS", "LOCKS")
+		assert.Equal(t, "ERR lock stats are not enabled", fmt.Sprint(err))
+		assert.Equal(t, int64(-1), respStat(conn, "lock_acquisitions"))
+	})
+	startServer(t, 9417, "--lockstats", "yes", "--threads", "4",
+		"--shards", "2")
+	conn, err := redis.Dial("tcp", ":9417")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	// Several clients writing to two shards, so that they contend for the
+	// shard locks.
+	var wg sync.WaitGroup
+	for i := 0; i < 8; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			conn, err := redis.Dial("tcp", ":9417")
+			if err != nil {
+				return
+			}
+			defer conn.Close()
+			for j := 0; j < 1000; j++ {
+				conn.Do("SET", fmt.Sprintf("key:%d", j%64), i)
+			}
+		}(i)
+	}
+	wg.Wait()
+	t.Run("STATS", func(t *testing.T) {
+		acquisitions := respStat(conn, "lock_acquisitions")
+		assert.GreaterOrEqual(t, acquisitions, int64(8000))
+		contended := respStat(conn, "lock_contended")
+		assert.GreaterOrEqual(t, contended, int64(0))
+		assert.LessOrEqual(t, contended, acquisitions)
+		assert.GreaterOrEqual(t, respStat(conn, "lock_wait_ns"), int64(0))
+	})
+	t.Run("LOCKS", func(t *testing.T) {
+		vals, err := redis.Values(conn.Do("STATS", "LOCKS"))
+		assert.Nil(t, err)
+		stats := make(map[string]string)
+		for _, val := range vals {
+			pair, err := redis.Strings(val, nil)
+			assert.Nil(t, err)
+			if len(pair) == 2 {
+				stats[pair[0]] = pair[1]
+			}
+		}
+		assert.Equal(t, "2", stats["shards"])
+		// Only the shards that saw contention are listed.
+		n := 0
+		for i := 0; i < 2; i++ {
+			if _, ok := stats[fmt.Sprintf("%d:contended", i)]; ok {
+				n++
+			}
+		}
+		assert.Equal(t, fmt.Sprint(n), stats["contended_shards"])
+	})
+}
+
+func TestRESPCompress(t *testing.T) {
+	startServer(t, 9402, "--compress", "yes")
+	conn, err := redis.Dial("tcp", ":9402")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	keys := make(map[string]string)
+	for i := 0; i < 1000; i++ {
+		var val string
+		switch i % 3 {
+		case 0:
+			val = strings.Repeat(sessionValue(i), 16)
+		case 1:
+			val = randBytes(4096)
+		default:
+			val = sessionValue(i)
+		}
+		keys[fmt.Sprintf("key:%d", i)] = val
+	}
+	for key, val := range keys {
+		reply, err := redis.String(conn.Do("SET", key, val))
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+	}
+	for key, val := range keys {
+		reply, err := redis.String(conn.Do("GET", key))
+		assert.Nil(t, err)
+		if reply != val {
+			t.Fatalf("%s: expected %d bytes, got %d", key, len(val),
+				len(reply))
+		}
+	}
+	t.Run("APPEND", func(t *testing.T) {
+		val := keys["key:0"]
+		n, err := redis.Int(conn.Do("APPEND", "key:0", "tail"))
+		assert.Equal(t, len(val)+4, n)
+		assert.Nil(t, err)
+		reply, err := redis.String(conn.Do("GET", "key:0"))
+		assert.Equal(t, val+"tail", reply)
+		assert.Nil(t, err)
+	})
+	t.Run("STATS", func(t *testing.T) {
+		assert.Greater(t, respStat(conn, "compress_values"), int64(0))
+		raw := respStat(conn, "compress_raw_bytes")
+		stored := respStat(conn, "compress_stored_bytes")
+		assert.Greater(t, stored, int64(0))
+		assert.Greater(t, raw, stored)
+	})
+}
+
+func TestRESPCompressDict(t *testing.T) {
+	startServer(t, 9403, "--compress", "dict")
+	conn, err := redis.Dial("tcp", ":9403")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	set := func() {
+		for i := 0; i < 5000; i++ {
+			conn.Send("SET", fmt.Sprintf("session:%d", i), sessionValue(i))
+		}
+		conn.Flush()
+		for i := 0; i < 5000; i++ {
+			reply, err := redis.String(conn.Receive())
+			assert.Equal(t, "OK", reply)
+			assert.Nil(t, err)
+		}
+	}
+	// The small values are sampled for training the dictionary, which is
+	// then used for the values that are stored after it's ready.
+	set()
+	waitFor(t, 30*time.Second, "trained dictionary", func() bool {
+		return respStat(conn, "compress_dict_version") > 0
+	})
+	set()
+	for i := 0; i < 5000; i++ {
+		reply, err := redis.String(conn.Do("GET", fmt.Sprintf("session:%d", i)))
+		assert.Nil(t, err)
+		if reply != sessionValue(i) {
+			t.Fatalf("session:%d: expected '%s', got '%s'", i,
+				sessionValue(i), reply)
+		}
+	}
+	assert.Greater(t, respStat(conn, "compress_dict_values"), int64(0))
+}
+
+func TestRESPTier(t *testing.T) {
+	startServer(t, 9404, "--maxmemory", "60mb", "--tier", t.TempDir())
+	conn, err := redis.Dial("tcp", ":9404")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	const nkeys = 6000
+	tierValue := func(i int) string {
+		return strings.Repeat(fmt.Sprintf("%08d", i), 1024)
+	}
+	for i := 0; i < nkeys; i++ {
+		conn.Send("SET", fmt.Sprintf("cold:%d", i), tierValue(i))
+	}
+	conn.Flush()
+	for i := 0; i < nkeys; i++ {
+		reply, err := redis.String(conn.Receive())
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+	}
+	// The values don't fit in memory, so the cold ones are spilled rather
+	// than evicted.
+	waitFor(t, 30*time.Second, "spilled values", func() bool {
+		return respStat(conn, "tier_spilled") > 0
+	})
+	for i := 0; i < nkeys; i++ {
+		key := fmt.Sprintf("cold:%d", i)
+		reply, err := redis.String(conn.Do("GET", key))
+		assert.Nil(t, err)
+		if reply != tierValue(i) {
+			t.Fatalf("%s: wrong value of %d bytes", key, len(reply))
+		}
+	}
+	t.Run("CONCURRENT", func(t *testing.T) {
+		// More connections than there are io threads, each with pipelined
+		// reads that queue up behind their spilled values.
+		var wg sync.WaitGroup
+		for c := 0; c < 8; c++ {
+			wg.Add(1)
+			go func(c int) {
+				defer wg.Done()
+				conn, err := redis.Dial("tcp", ":9404")
+				if err != nil {
+					t.Error(err)
+					return
+				}
+				defer conn.Close()
+				for i := c; i < nkeys; i += 8 {
+					conn.Send("GET", fmt.Sprintf("cold:%d", i))
+				}
+				conn.Flush()
+				for i := c; i < nkeys; i += 8 {
+					reply, err := redis.String(conn.Receive())
+					if err != nil || reply != tierValue(i) {
+						t.Errorf("cold:%d: wrong value of %d bytes", i,
+							len(reply))
+						return
+					}
+				}
+			}(c)
+		}
+		wg.Wait()
+	})
+	assert.Greater(t, respStat(conn, "tier_reads"), int64(0))
+	assert.Equal(t, int64(0), respStat(conn, "tier_lost"))
+}
+
+func TestRESPShmRestart(t *testing.T) {
+	path := t.TempDir() + "/cache.shm"
+	s := startServer(t, 9405, "--shm", path)
+	conn, err := redis.Dial("tcp", ":9405")
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i := 0; i < 1000; i++ {
+		conn.Send("SET", fmt.Sprintf("key:%d", i), sessionValue(i))
+	}
+	conn.Send("SET", "ttl", "value", "EX", 100)
+	conn.Send("HSET", "hash", "a", "1", "b", "2")
+	conn.Send("INCRBY", "counter", 42)
+	conn.Flush()
+	for i := 0; i < 1003; i++ {
+		_, err := conn.Receive()
+		assert.Nil(t, err)
+	}
+	conn.Close()
+
+	// The cache is kept in the heap file after a clean shutdown, and the
+	// next server attaches to it instead of starting empty.
+	s.stop()
+	startServer(t, 9405, "--shm", path)
+	conn, err = redis.Dial("tcp", ":9405")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	n, err := redis.Int(conn.Do("DBSIZE"))
+	assert.Equal(t, 1003, n)
+	assert.Nil(t, err)
+	for i := 0; i < 1000; i++ {
+		reply, err := redis.String(conn.Do("GET", fmt.Sprintf("key:%d", i)))
+		assert.Equal(t, sessionValue(i), reply)
+		assert.Nil(t, err)
+	}
+	ttl, err := redis.Int(conn.Do("TTL", "ttl"))
+	assert.Greater(t, ttl, 90)
+	assert.Nil(t, err)
+	vals, err := redis.Strings(conn.Do("HGETALL", "hash"))
+	assert.Equal(t, []string{"a", "1", "b", "2"}, vals)
+	assert.Nil(t, err)
+	n, err = redis.Int(conn.Do("INCR", "counter"))
+	assert.Equal(t, 43, n)
+	assert.Nil(t, err)
+	t.Run("UPGRADE", func(t *testing.T) {
+		path := t.TempDir() + "/upgrade.shm"
+		old := startServer(t, 9421, "--shm", path, "--compress", "yes")
+		conn, err := redis.Dial("tcp", ":9421")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		val := strings.Repeat(sessionValue(1), 16)
+		reply, err := redis.String(conn.Do("SET", "key", val))
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+		// A server that can't read compressed entries refuses to take
+		// over, and the running server keeps serving.
+		out, err := exec.Command("../../pogocache", "-p", "9421", "--shm",
+			path).CombinedOutput()
+		assert.NotNil(t, err)
+		assert.True(t, strings.Contains(string(out), "not compatible"))
+		reply, err = redis.String(conn.Do("GET", "key"))
+		assert.Equal(t, val, reply)
+		assert.Nil(t, err)
+		// A compatible server takes over the cache and the listeners.
+		startServer(t, 9421, "--shm", path, "--compress", "yes")
+		select {
+		case <-old.exited:
+		case <-time.After(10 * time.Second):
+			t.Fatal("the running server did not hand over")
+		}
+		conn2, err := redis.Dial("tcp", ":9421")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn2.Close()
+		reply, err = redis.String(conn2.Do("GET", "key"))
+		assert.Equal(t, val, reply)
+		assert.Nil(t, err)
+	})
+}
+
+func TestRESPReplica(t *testing.T) {
+	startServer(t, 9406)
+	primary, err := redis.Dial("tcp", ":9406")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer primary.Close()
+	for i := 0; i < 1000; i++ {
+		reply, err := redis.String(primary.Do("SET", fmt.Sprintf("key:%d", i),
+			sessionValue(i)))
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+	}
+	startServer(t, 9407, "--replicaof", "127.0.0.1:9406")
+	replica, err := redis.Dial("tcp", ":9407")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer replica.Close()
+	get := func(key string) string {
+		reply, _ := redis.String(replica.Do("GET", key))
+		return reply
+	}
+	// The existing keys arrive with the full sync, and the changes after
+	// it are streamed.
+	waitFor(t, 10*time.Second, "full sync", func() bool {
+		n, _ := redis.Int(replica.Do("DBSIZE"))
+		return n == 1000
+	})
+	for i := 0; i < 1000; i++ {
+		assert.Equal(t, sessionValue(i), get(fmt.Sprintf("key:%d", i)))
+	}
+	primary.Do("SET", "ttl", "value", "EX", 100)
+	primary.Do("DEL", "key:0")
+	primary.Do("HSET", "hash", "a", "1")
+	primary.Do("INCRBY", "counter", 5)
+	primary.Do("DELPREFIX", "key:1")
+	primary.Do("SET", "last", "done")
+	waitFor(t, 10*time.Second, "streamed changes", func() bool {
+		return get("last") == "done"
+	})
+	ttl, err := redis.Int(replica.Do("TTL", "ttl"))
+	assert.Greater(t, ttl, 90)
+	assert.Nil(t, err)
+	reply, err := replica.Do("GET", "key:0")
+	assert.Nil(t, reply)
+	assert.Nil(t, err)
+	assert.Equal(t, "", get("key:123"))
+	assert.Equal(t, sessionValue(200), get("key:200"))
+	field, err := redis.String(replica.Do("HGET", "hash", "a"))
+	assert.Equal(t, "1", field)
+	assert.Nil(t, err)
+	assert.Equal(t, "5", get("counter"))
+	t.Run("READONLY", func(t *testing.T) {
+		_, err := replica.Do("SET", "key", "value")
+		assert.NotNil(t, err)
+		assert.True(t, strings.HasPrefix(err.Error(), "READONLY"))
+	})
+	t.Run("STATS", func(t *testing.T) {
+		stats, err := respStats(replica)
+		assert.Nil(t, err)
+		assert.Equal(t, "replica", stats["repl_role"])
+		assert.Equal(t, "up", stats["repl_link"])
+	})
+}
+
+func TestRESPRoute(t *testing.T) {
+	startServer(t, 9408)
+	startServer(t, 9409)
+	startServer(t, 9410, "--route", "127.0.0.1:9408,127.0.0.1:9409")
+	conn, err := redis.Dial("tcp", ":9410")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	var keys []interface{}
+	for i := 0; i < 1000; i++ {
+		key := fmt.Sprintf("key:%d", i)
+		reply, err := redis.String(conn.Do("SET", key, sessionValue(i)))
+		assert.Equal(t, "OK", reply)
+		assert.Nil(t, err)
+		keys = append(keys, key)
+	}
+	for i, key := range keys {
+		reply, err := redis.String(conn.Do("GET", key))
+		assert.Equal(t, sessionValue(i), reply)
+		assert.Nil(t, err)
+	}
+	// The keys are split between the backends, and a DBSIZE through the
+	// router is their sum.
+	var total int
+	for _, port := range []int{9408, 9409} {
+		backend, err := redis.Dial("tcp", fmt.Sprintf(":%d", port))
+		if err != nil {
+			t.Fatal(err)
+		}
+		n, err := redis.Int(backend.Do("DBSIZE"))
+		assert.Greater(t, n, 0)
+		assert.Nil(t, err)
+		total += n
+		backend.Close()
+	}
+	assert.Equal(t, 1000, total)
+	n, err := redis.Int(conn.Do("DBSIZE"))
+	assert.Equal(t, 1000, n)
+	assert.Nil(t, err)
+	t.Run("MGET", func(t *testing.T) {
+		args := append(keys[:50:50], "missing")
+		vals, err := redis.Values(conn.Do("MGET", args...))
+		assert.Nil(t, err)
+		assert.Equal(t, 51, len(vals))
+		for i := 0; i < 50; i++ {
+			assert.Equal(t, []byte(sessionValue(i)), vals[i])
+		}
+		assert.Nil(t, vals[50])
+	})
+	t.Run("DEL", func(t *testing.T) {
+		n, err := redis.Int(conn.Do("DEL", keys[:100]...))
+		assert.Equal(t, 100, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("DBSIZE"))
+		assert.Equal(t, 900, n)
+		assert.Nil(t, err)
+	})
+	t.Run("CONCURRENT", func(t *testing.T) {
+		// The clients of a network thread share its backend connections,
+		// and their pipelined requests must get their own replies.
+		var wg sync.WaitGroup
+		for c := 0; c < 8; c++ {
+			wg.Add(1)
+			go func(c int) {
+				defer wg.Done()
+				conn, err := redis.Dial("tcp", ":9410")
+				if err != nil {
+					t.Error(err)
+					return
+				}
+				defer conn.Close()
+				for i := 100 + c; i < 1000; i += 8 {
+					conn.Send("GET", keys[i])
+					conn.Send("MGET", keys[i], "missing")
+				}
+				conn.Flush()
+				for i := 100 + c; i < 1000; i += 8 {
+					reply, err := redis.String(conn.Receive())
+					if err != nil || reply != sessionValue(i) {
+						t.Errorf("%s: wrong value %q", keys[i], reply)
+						return
+					}
+					vals, err := redis.Strings(conn.Receive())
+					if err != nil || len(vals) != 2 ||
+						vals[0] != sessionValue(i) {
+						t.Errorf("%s: wrong values %q", keys[i], vals)
+						return
+					}
+				}
+			}(c)
+		}
+		wg.Wait()
+	})
+	t.Run("DOWN", func(t *testing.T) {
+		// Nothing listens on the second backend. Its keys fail right away
+		// and the keys of the first backend are still served.
+		startServer(t, 9422, "--route", "127.0.0.1:9408,127.0.0.1:1")
+		conn, err := redis.Dial("tcp", ":9422")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		start := time.Now()
+		var served, failed int
+		for i := 100; i < 200; i++ {
+			reply, err := redis.String(conn.Do("GET", keys[i]))
+			if err != nil {
+				assert.True(t, strings.Contains(err.Error(), "unavailable"))
+				failed++
+			} else {
+				assert.Equal(t, sessionValue(i), reply)
+				served++
+			}
+		}
+		assert.Greater(t, served, 0)
+		assert.Greater(t, failed, 0)
+		assert.Less(t, time.Since(start), time.Second*2)
+		_, err = conn.Do("MGET", keys[100:200]...)
+		assert.NotNil(t, err)
+	})
+	t.Run("L1", func(t *testing.T) {
+		startServer(t, 9423, "--route", "127.0.0.1:9408,127.0.0.1:9409",
+			"--routel1", "60000")
+		conn, err := redis.Dial("tcp", ":9423")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		conn.Do("SET", "l1:a", "x")
+		reply, err := redis.String(conn.Do("GET", "l1:a"))
+		assert.Equal(t, "x", reply)
+		assert.Nil(t, err)
+		// Change the key behind the proxy. The local copy is kept until a
+		// write through the proxy changes the key, and a value that looks
+		// like the key is not a key.
+		for _, port := range []int{9408, 9409} {
+			backend, err := redis.Dial("tcp", fmt.Sprintf(":%d", port))
+			if err != nil {
+				t.Fatal(err)
+			}
+			backend.Do("SET", "l1:a", "y")
+			backend.Close()
+		}
+		conn.Do("SET", "l1:b", "l1:a")
+		reply, err = redis.String(conn.Do("GET", "l1:a"))
+		assert.Equal(t, "x", reply)
+		assert.Nil(t, err)
+		conn.Do("SET", "l1:a", "z")
+		reply, err = redis.String(conn.Do("GET", "l1:a"))
+		assert.Equal(t, "z", reply)
+		assert.Nil(t, err)
+	})
+	t.Run("KEYS", func(t *testing.T) {
+		_, err := conn.Do("KEYS", "*")
+		assert.NotNil(t, err)
+	})
+}
+
+func TestRESPLease(t *testing.T) {
+	conn1, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn1.Close()
+	conn2, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn2.Close()
+	conn1.Do("DEL", "lease")
+	t.Run("MISS", func(t *testing.T) {
+		// Only the first caller that misses is granted a lease. The others
+		// get a nil and should wait for the value to be filled.
+		token, err := redis.Int64(conn1.Do("LGET", "lease", 5000))
+		assert.Greater(t, token, int64(0))
+		assert.Nil(t, err)
+		reply, err := conn2.Do("LGET", "lease", 5000)
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		reply, err = conn2.Do("SET", "lease", "other", "LEASE", token+1)
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		ok, err := redis.String(conn1.Do("SET", "lease", "value", "LEASE",
+			token))
+		assert.Equal(t, "OK", ok)
+		assert.Nil(t, err)
+		// A lease can only be used once.
+		reply, err = conn1.Do("SET", "lease", "again", "LEASE", token)
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		val, err := redis.String(conn2.Do("LGET", "lease", 5000))
+		assert.Equal(t, "value", val)
+		assert.Nil(t, err)
+	})
+	t.Run("EXPIRED", func(t *testing.T) {
+		conn1.Do("DEL", "lease")
+		token1, err := redis.Int64(conn1.Do("LGET", "lease", 50))
+		assert.Nil(t, err)
+		time.Sleep(time.Millisecond * 100)
+		token2, err := redis.Int64(conn2.Do("LGET", "lease", 5000))
+		assert.Nil(t, err)
+		assert.NotEqual(t, token1, token2)
+		reply, err := conn1.Do("SET", "lease", "late", "LEASE", token1)
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		conn1.Do("DEL", "lease")
+	})
+	t.Run("FORGED", func(t *testing.T) {
+		// Only the tokens that were handed out are accepted, whatever
+		// their bits.
+		conn1.Do("DEL", "lease")
+		for _, token := range []int64{1 << 62, 1<<62 | 12345, 1<<63 - 1} {
+			reply, err := conn1.Do("SET", "lease", "forged", "LEASE", token)
+			assert.Nil(t, reply)
+			assert.Nil(t, err)
+		}
+		reply, err := conn1.Do("GET", "lease")
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+	})
+}
+
+func TestRESPGrace(t *testing.T) {
+	conn1, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn1.Close()
+	conn2, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn2.Close()
+	t.Run("GRACE", func(t *testing.T) {
+		conn1.Do("SET", "grace", "v1", "EX", 1, "GRACE", 3)
+		time.Sleep(time.Millisecond * 1200)
+		// The stale value is served during the grace period, and the
+		// first LGET is also granted a lease for refreshing it.
+		vals, err := redis.Values(conn1.Do("LGET", "grace", 5000))
+		assert.Nil(t, err)
+		assert.Equal(t, 2, len(vals))
+		assert.Equal(t, []byte("v1"), vals[0])
+		token, err := redis.Int64(vals[1], nil)
+		assert.Greater(t, token, int64(0))
+		assert.Nil(t, err)
+		vals, err = redis.Values(conn2.Do("LGET", "grace", 5000))
+		assert.Nil(t, err)
+		assert.Equal(t, []interface{}{[]byte("v1"), nil}, vals)
+		// The other commands can't tell that the value is stale, so for
+		// them the entry has expired.
+		ttl, err := redis.Int(conn2.Do("TTL", "grace"))
+		assert.Equal(t, -2, ttl)
+		assert.Nil(t, err)
+		reply, err := conn2.Do("GET", "grace")
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		ok, err := redis.String(conn1.Do("SET", "grace", "v2", "EX", 10,
+			"LEASE", token))
+		assert.Equal(t, "OK", ok)
+		assert.Nil(t, err)
+		val, err := redis.String(conn2.Do("LGET", "grace", 5000))
+		assert.Equal(t, "v2", val)
+		assert.Nil(t, err)
+		ttl, err = redis.Int(conn2.Do("TTL", "grace"))
+		assert.Greater(t, ttl, 8)
+		assert.Nil(t, err)
+		conn1.Do("DEL", "grace")
+	})
+	t.Run("EXPIRED", func(t *testing.T) {
+		conn1.Do("SET", "grace", "v1", "PX", 50, "GRACE", 0)
+		time.Sleep(time.Millisecond * 100)
+		reply, err := conn1.Do("GET", "grace")
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+	})
+	t.Run("DELTA", func(t *testing.T) {
+		// A delta that is much larger than the TTL makes an early refresh
+		// very likely on each read, but not certain.
+		conn1.Do("SET", "delta", "v1", "EX", 10, "DELTA", 1000000)
+		var refresh bool
+		for i := 0; i < 100 && !refresh; i++ {
+			reply, err := conn1.Do("LGET", "delta", 5000)
+			assert.Nil(t, err)
+			_, refresh = reply.([]interface{})
+		}
+		assert.True(t, refresh)
+		val, err := redis.String(conn2.Do("GET", "delta"))
+		assert.Equal(t, "v1", val)
+		assert.Nil(t, err)
+		conn1.Do("DEL", "delta")
+	})
+	t.Run("SAVE", func(t *testing.T) {
+		path := t.TempDir() + "/grace.save"
+		conn1.Do("SET", "grace", "v1", "EX", 1, "GRACE", 30)
+		ok, err := redis.String(conn1.Do("SAVE", "TO", path))
+		assert.Equal(t, "OK", ok)
+		assert.Nil(t, err)
+		conn1.Do("DEL", "grace")
+		ok, err = redis.String(conn1.Do("LOAD", "FROM", path))
+		assert.Equal(t, "OK", ok)
+		assert.Nil(t, err)
+		time.Sleep(time.Millisecond * 1200)
+		// Still in its grace period after the load.
+		vals, err := redis.Values(conn1.Do("LGET", "grace", 5000))
+		assert.Nil(t, err)
+		assert.Equal(t, 2, len(vals))
+		assert.Equal(t, []byte("v1"), vals[0])
+		conn1.Do("DEL", "grace")
+	})
+}
+
+func TestRESPCounters(t *testing.T) {
+	conn, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	conn.Do("DEL", "counter")
+	t.Run("INCR", func(t *testing.T) {
+		for i := 1; i <= 100; i++ {
+			n, err := redis.Int(conn.Do("INCR", "counter"))
+			assert.Equal(t, i, n)
+			assert.Nil(t, err)
+		}
+		n, err := redis.Int(conn.Do("DECRBY", "counter", 150))
+		assert.Equal(t, -50, n)
+		assert.Nil(t, err)
+		val, err := redis.String(conn.Do("GET", "counter"))
+		assert.Equal(t, "-50", val)
+		assert.Nil(t, err)
+	})
+	t.Run("STRING", func(t *testing.T) {
+		// A counter that is changed as a string is a string again, and
+		// is parsed back into a counter by the next INCR.
+		n, err := redis.Int(conn.Do("APPEND", "counter", "0"))
+		assert.Equal(t, 4, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("INCR", "counter"))
+		assert.Equal(t, -499, n)
+		assert.Nil(t, err)
+		conn.Do("SET", "counter", "12 ")
+		_, err = conn.Do("INCR", "counter")
+		assert.NotNil(t, err)
+		conn.Do("SET", "counter", "12a")
+		_, err = conn.Do("INCR", "counter")
+		assert.NotNil(t, err)
+		conn.Do("SET", "counter", "")
+		_, err = conn.Do("INCR", "counter")
+		assert.NotNil(t, err)
+	})
+	t.Run("OVERFLOW", func(t *testing.T) {
+		conn.Do("SET", "counter", "9223372036854775807")
+		_, err := conn.Do("INCR", "counter")
+		assert.NotNil(t, err)
+		val, err := redis.String(conn.Do("GET", "counter"))
+		assert.Equal(t, "9223372036854775807", val)
+		assert.Nil(t, err)
+		conn.Do("SET", "counter", "0")
+		_, err = conn.Do("UDECR", "counter")
+		assert.NotNil(t, err)
+	})
+	t.Run("TTL", func(t *testing.T) {
+		conn.Do("SET", "counter", "1", "EX", 100)
+		n, err := redis.Int(conn.Do("INCR", "counter"))
+		assert.Equal(t, 2, n)
+		assert.Nil(t, err)
+		ttl, err := redis.Int(conn.Do("TTL", "counter"))
+		assert.Greater(t, ttl, 90)
+		assert.Nil(t, err)
+	})
+	conn.Do("DEL", "counter")
+}
+
+func TestRESPHash(t *testing.T) {
+	conn, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	conn.Do("DEL", "hash", "string")
+	t.Run("HSET", func(t *testing.T) {
+		n, err := redis.Int(conn.Do("HSET", "hash", "a", "1", "b", "2"))
+		assert.Equal(t, 2, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("HSET", "hash", "b", "3", "c", "4"))
+		assert.Equal(t, 1, n)
+		assert.Nil(t, err)
+		typ, err := redis.String(conn.Do("TYPE", "hash"))
+		assert.Equal(t, "hash", typ)
+		assert.Nil(t, err)
+	})
+	t.Run("HGET", func(t *testing.T) {
+		val, err := redis.String(conn.Do("HGET", "hash", "b"))
+		assert.Equal(t, "3", val)
+		assert.Nil(t, err)
+		reply, err := conn.Do("HGET", "hash", "x")
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		vals, err := redis.Values(conn.Do("HMGET", "hash", "a", "x", "c"))
+		assert.Equal(t, []interface{}{[]byte("1"), nil, []byte("4")}, vals)
+		assert.Nil(t, err)
+	})
+	t.Run("HGETALL", func(t *testing.T) {
+		all, err := redis.StringMap(conn.Do("HGETALL", "hash"))
+		assert.Equal(t, map[string]string{"a": "1", "b": "3", "c": "4"}, all)
+		assert.Nil(t, err)
+		keys, err := redis.Strings(conn.Do("HKEYS", "hash"))
+		sort.Strings(keys)
+		assert.Equal(t, []string{"a", "b", "c"}, keys)
+		assert.Nil(t, err)
+		vals, err := redis.Strings(conn.Do("HVALS", "hash"))
+		sort.Strings(vals)
+		assert.Equal(t, []string{"1", "3", "4"}, vals)
+		assert.Nil(t, err)
+		n, err := redis.Int(conn.Do("HLEN", "hash"))
+		assert.Equal(t, 3, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("HEXISTS", "hash", "a"))
+		assert.Equal(t, 1, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("HEXISTS", "hash", "x"))
+		assert.Equal(t, 0, n)
+		assert.Nil(t, err)
+	})
+	t.Run("HINCRBY", func(t *testing.T) {
+		n, err := redis.Int(conn.Do("HINCRBY", "hash", "a", 5))
+		assert.Equal(t, 6, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("HINCRBY", "hash", "new", -5))
+		assert.Equal(t, -5, n)
+		assert.Nil(t, err)
+	})
+	t.Run("HEXPIRE", func(t *testing.T) {
+		vals, err := redis.Ints(conn.Do("HEXPIRE", "hash", 1, "FIELDS", 2,
+			"new", "x"))
+		assert.Equal(t, []int{1, -2}, vals)
+		assert.Nil(t, err)
+		vals, err = redis.Ints(conn.Do("HTTL", "hash", "FIELDS", 2, "new",
+			"a"))
+		assert.Equal(t, []int{1, -1}, vals)
+		assert.Nil(t, err)
+		time.Sleep(time.Millisecond * 1100)
+		reply, err := conn.Do("HGET", "hash", "new")
+		assert.Nil(t, reply)
+		assert.Nil(t, err)
+		n, err := redis.Int(conn.Do("HLEN", "hash"))
+		assert.Equal(t, 3, n)
+		assert.Nil(t, err)
+	})
+	t.Run("HDEL", func(t *testing.T) {
+		n, err := redis.Int(conn.Do("HDEL", "hash", "a", "b", "x"))
+		assert.Equal(t, 2, n)
+		assert.Nil(t, err)
+		// The hash is deleted with its last field.
+		n, err = redis.Int(conn.Do("HDEL", "hash", "c"))
+		assert.Equal(t, 1, n)
+		assert.Nil(t, err)
+		n, err = redis.Int(conn.Do("EXISTS", "hash"))
+		assert.Equal(t, 0, n)
+		assert.Nil(t, err)
+	})
+	t.Run("WRONGTYPE", func(t *testing.T) {
+		conn.Do("SET", "string", "value")
+		_, err := conn.Do("HSET", "string", "a", "1")
+		assert.NotNil(t, err)
+		conn.Do("HSET", "hash", "a", "1")
+		_, err = conn.Do("GET", "hash")
+		assert.NotNil(t, err)
+		conn.Do("DEL", "hash", "string")
+	})
+}
+
+func TestRESPDelPrefix(t *testing.T) {
+	// Few shards and no automatic sweeps, so that each shard piles up many
+	// pending prefixes, some of which overlap.
+	startServer(t, 9411, "--shards", "4", "--autosweep", "no")
+	conn, err := redis.Dial("tcp", ":9411")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	for g := 0; g < 50; g++ {
+		for i := 0; i < 100; i++ {
+			conn.Send("SET", fmt.Sprintf("group:%02d:%d", g, i), "value")
+		}
+	}
+	conn.Flush()
+	for i := 0; i < 5000; i++ {
+		_, err := conn.Receive()
+		assert.Nil(t, err)
+	}
+	for g := 0; g < 40; g++ {
+		// A longer prefix is replaced by the shorter one that follows it,
+		// and a repeated prefix is merged.
+		for _, prefix := range []string{"group:%02d:1", "group:%02d:",
+			"group:%02d:"} {
+			ok, err := redis.String(conn.Do("DELPREFIX",
+				fmt.Sprintf(prefix, g)))
+			assert.Equal(t, "OK", ok)
+			assert.Nil(t, err)
+		}
+	}
+	ok, err := redis.String(conn.Do("SET", "group:00:new", "value"))
+	assert.Equal(t, "OK", ok)
+	assert.Nil(t, err)
+	for g := 0; g < 50; g++ {
+		var args []interface{}
+		for i := 0; i < 100; i++ {
+			args = append(args, fmt.Sprintf("group:%02d:%d", g, i))
+		}
+		n, err := redis.Int(conn.Do("EXISTS", args...))
+		assert.Nil(t, err)
+		if g < 40 {
+			assert.Equal(t, 0, n, "group %d", g)
+		} else {
+			assert.Equal(t, 100, n, "group %d", g)
+		}
+	}
+	// Keys stored after the DELPREFIX are kept.
+	val, err := redis.String(conn.Do("GET", "group:00:new"))
+	assert.Equal(t, "value", val)
+	assert.Nil(t, err)
+	conn.Do("SWEEP")
+	waitFor(t, 10*time.Second, "swept keys", func() bool {
+		n, _ := redis.Int(conn.Do("DBSIZE"))
+		return n == 1001
+	})
+}
+
+func TestRESPScan(t *testing.T) {
+	conn, err := redis.Dial("tcp", ":9401")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	conn.Do("FLUSH")
+	for i := 0; i < 10000; i++ {
+		conn.Send("SET", fmt.Sprintf("key:%d", i), "value")
+	}
+	conn.Send("HSET", "hash", "a", "1")
+	conn.Flush()
+	for i := 0; i < 10001; i++ {
+		_, err := conn.Receive()
+		assert.Nil(t, err)
+	}
+	scan := func(args ...interface{}) map[string]bool {
+		keys := make(map[string]bool)
+		cursor := "0"
+		for {
+			vals, err := redis.Values(conn.Do("SCAN",
+				append([]interface{}{cursor}, args...)...))
+			if err != nil {
+				t.Fatal(err)
+			}
+			cursor, _ = redis.String(vals[0], nil)
+			page, _ := redis.Strings(vals[1], nil)
+			for _, key := range page {
+				keys[key] = true
+			}
+			if cursor == "0" {
+				return keys
+			}
+		}
+	}
+	t.Run("COUNT", func(t *testing.T) {
+		keys := scan("COUNT", 100)
+		assert.Equal(t, 10001, len(keys))
+		for i := 0; i < 10000; i++ {
+			assert.True(t, keys[fmt.Sprintf("key:%d", i)])
+		}
+	})
+	t.Run("MATCH", func(t *testing.T) {
+		keys := scan("MATCH", "key:99*")
+		assert.Equal(t, 111, len(keys))
+	})
+	t.Run("TYPE", func(t *testing.T) {
+		keys := scan("TYPE", "hash")
+		assert.Equal(t, map[string]bool{"hash": true}, keys)
+	})
+	t.Run("KEYS", func(t *testing.T) {
+		keys, err := redis.Strings(conn.Do("KEYS", "key:*"))
+		assert.Equal(t, 10000, len(keys))
+		assert.Nil(t, err)
+	})
+	t.Run("RESIZE", func(t *testing.T) {
+		// The shards grow while the scan is in progress, which moves the
+		// entries around. No key that was there the whole time is missed.
+		writer, err := redis.Dial("tcp", ":9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer writer.Close()
+		done := make(chan bool)
+		go func() {
+			defer close(done)
+			for i := 0; i < 50000; i++ {
+				writer.Send("SET", fmt.Sprintf("new:%d", i), "value")
+			}
+			writer.Flush()
+			for i := 0; i < 50000; i++ {
+				writer.Receive()
+			}
+		}()
+		keys := scan("MATCH", "key:*", "COUNT", 10)
+		<-done
+		assert.Equal(t, 10000, len(keys))
+	})
+	conn.Do("FLUSH")
+}
+
+// writeCert writes a self-signed certificate for 127.0.0.1 and its key to
+// dir, and returns the paths of the files and the certificate.
+func writeCert(t *testing.T, dir string) (string, string, *x509.Certificate) {
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		t.Fatal(err)
+	}
+	tmpl := &x509.Certificate{
+		SerialNumber: big.NewInt(1),
+		Subject:      pkix.Name{CommonName: "pogocache"},
+		IPAddresses:  []net.IP{net.ParseIP("127.0.0.1")},
+		NotBefore:    time.Now().Add(-time.Hour),
+		NotAfter:     time.Now().Add(time.Hour),
+		KeyUsage:     x509.KeyUsageDigitalSignature,
+		ExtKeyUsage:  []x509.ExtKeyUsage{x509.ExtKeyUsageServerAuth},
+	}
+	der, err := x509.CreateCertificate(rand.Reader, tmpl, tmpl, &key.PublicKey,
+		key)
+	if err != nil {
+		t.Fatal(err)
+	}
+	cert, err := x509.ParseCertificate(der)
+	if err != nil {
+		t.Fatal(err)
+	}
+	keyder, err := x509.MarshalECPrivateKey(key)
+	if err != nil {
+		t.Fatal(err)
+	}
+	certfile := dir + "/cert.pem"
+	keyfile := dir + "/key.pem"
+	err = os.WriteFile(certfile, pem.EncodeToMemory(&pem.Block{
+		Type: "CERTIFICATE", Bytes: der}), 0600)
+	if err != nil {
+		t.Fatal(err)
+	}
+	err = os.WriteFile(keyfile, pem.EncodeToMemory(&pem.Block{
+		Type: "EC PRIVATE KEY", Bytes: keyder}), 0600)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return certfile, keyfile, cert
+}
+
+func TestRESPTLSResume(t *testing.T) {
+	certfile, keyfile, cert := writeCert(t, t.TempDir())
+	s, err := launchServer(9412, "--tlsport", "9413", "--tlscert", certfile,
+		"--tlskey", keyfile, "--tlscacert", certfile)
+	if err != nil {
+		t.Skip("no tls support: ", err)
+	}
+	t.Cleanup(s.stop)
+	roots := x509.NewCertPool()
+	roots.AddCert(cert)
+	ping := func(config *tls.Config) bool {
+		conn, err := tls.Dial("tcp", "127.0.0.1:9413", config)
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		conn.Write([]byte("*1\r\n$4\r\nPING\r\n"))
+		// Reading the reply also reads the session tickets of TLS 1.3,
+		// which are sent after the handshake.
+		line, err := bufio.NewReader(conn).ReadString('\n')
+		assert.Equal(t, "+PONG\r\n", line)
+		assert.Nil(t, err)
+		return conn.ConnectionState().DidResume
+	}
+	for _, version := range []uint16{tls.VersionTLS12, tls.VersionTLS13} {
+		name := tls.VersionName(version)
+		t.Run(name, func(t *testing.T) {
+			config := &tls.Config{
+				RootCAs:            roots,
+				MinVersion:         version,
+				MaxVersion:         version,
+				ClientSessionCache: tls.NewLRUClientSessionCache(8),
+			}
+			assert.False(t, ping(config))
+			assert.True(t, ping(config))
+		})
+	}
+	t.Run("CLOSE", func(t *testing.T) {
+		// The close_notify alert is a record of its own, which follows the
+		// commands and ends the stream without an error.
+		conn, err := tls.Dial("tcp", "127.0.0.1:9413",
+			&tls.Config{RootCAs: roots})
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		conn.Write([]byte("*1\r\n$4\r\nPING\r\n*1\r\n$4\r\nPING\r\n"))
+		assert.Nil(t, conn.CloseWrite())
+		replies, err := io.ReadAll(conn)
+		assert.Equal(t, "+PONG\r\n+PONG\r\n", string(replies))
+		assert.Nil(t, err)
+	})
+	conn, err := redis.Dial("tcp", ":9412")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	assert.GreaterOrEqual(t, respStat(conn, "tls_resumed"), int64(2))
+}
+
+func TestRESPShmRing(t *testing.T) {
+	sock := t.TempDir() + "/pogocache.sock"
+	startServer(t, 9420, "-s", sock)
+	// Rings smaller than the large value, so that it wraps around both.
+	shm, err := shmOpen(sock, 64*1024)
+	if errors.Is(err, syscall.EPROTO) {
+		t.Skip("shared memory rings are not supported")
+	}
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer shm.Close()
+	rd := bufio.NewReader(shm)
+	expect := func(t *testing.T, reply string) {
+		t.Helper()
+		buf := make([]byte, len(reply))
+		_, err := io.ReadFull(rd, buf)
+		assert.Nil(t, err)
+		if string(buf) != reply {
+			t.Fatalf("expected %.32q, got %.32q", reply, buf)
+		}
+	}
+	t.Run("COMMAND", func(t *testing.T) {
+		shm.Write([]byte("*3\r\n$3\r\nSET\r\n$5\r\nhello\r\n$5\r\nworld\r\n"))
+		expect(t, "+OK\r\n")
+		shm.Write([]byte("*2\r\n$3\r\nGET\r\n$5\r\nhello\r\n"))
+		expect(t, "$5\r\nworld\r\n")
+	})
+	t.Run("PIPELINE", func(t *testing.T) {
+		var reqs, replies string
+		for i := 0; i < 100; i++ {
+			key := fmt.Sprintf("key:%03d", i)
+			reqs += "*3\r\n$3\r\nSET\r\n$7\r\n" + key + "\r\n$3\r\n" +
+				key[4:] + "\r\n"
+			reqs += "*2\r\n$3\r\nGET\r\n$7\r\n" + key + "\r\n"
+			replies += "+OK\r\n$3\r\n" + key[4:] + "\r\n"
+		}
+		shm.Write([]byte(reqs))
+		expect(t, replies)
+	})
+	t.Run("LARGE", func(t *testing.T) {
+		val := strings.Repeat("0123456789abcdef", 64*1024)
+		shm.Write([]byte(fmt.Sprintf("*3\r\n$3\r\nSET\r\n$5\r\nlarge\r\n"+
+			"$%d\r\n%s\r\n", len(val), val)))
+		expect(t, "+OK\r\n")
+		shm.Write([]byte("*2\r\n$3\r\nGET\r\n$5\r\nlarge\r\n"))
+		expect(t, fmt.Sprintf("$%d\r\n%s\r\n", len(val), val))
+	})
+	t.Run("STATS", func(t *testing.T) {
+		conn, err := redis.Dial("tcp", ":9420")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		assert.Equal(t, int64(1), respStat(conn, "shm_connections"))
+		reply, err := redis.String(conn.Do("GET", "hello"))
+		assert.Equal(t, "world", reply)
+		assert.Nil(t, err)
+	})
+}
+
+func TestRESPBusyPoll(t *testing.T) {
+	t.Run("DISABLED", func(t *testing.T) {
+		conn, err := redis.Dial("tcp", ":9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		assert.Equal(t, int64(-1), respStat(conn, "thread0_poll_spin_us"))
+	})
+	startServer(t, 9418, "--busypoll", "1000", "--threads", "2")
+	conn, err := redis.Dial("tcp", ":9418")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	// Back to back requests arrive while the thread is still spinning
+	// after the previous one.
+	for i := 0; i < 2000; i++ {
+		reply, err := redis.String(conn.Do("PING"))
+		assert.Equal(t, "PONG", reply)
+		assert.Nil(t, err)
+	}
+	stats, err := respStats(conn)
+	if err != nil {
+		t.Fatal(err)
+	}
+	var spinus, hits int64
+	for i := 0; i < 2; i++ {
+		for _, name := range []string{"spin_us", "sleep_us", "spin_hits",
+			"sleeps"} {
+			key := fmt.Sprintf("thread%d_poll_%s", i, name)
+			val, ok := stats[key]
+			assert.True(t, ok, key)
+			n, _ := strconv.ParseInt(val, 10, 64)
+			switch name {
+			case "spin_us":
+				spinus += n
+			case "spin_hits":
+				hits += n
+			}
+		}
+	}
+	assert.Greater(t, spinus, int64(0))
+	assert.Greater(t, hits, int64(0))
+}
+
+func TestRESPMaxConns(t *testing.T) {
+	startServer(t, 9419, "--maxconns", "4", "--threads", "2")
+	dial := func() redis.Conn {
+		conn, err := redis.Dial("tcp", ":9419")
+		if err != nil {
+			t.Fatal(err)
+		}
+		return conn
+	}
+	conn := dial()
+	defer conn.Close()
+	// Wait for the connection that probed for the server start to go.
+	waitFor(t, 10*time.Second, "the probe to close", func() bool {
+		return respStat(conn, "curr_connections") == 1
+	})
+	var conns []redis.Conn
+	for i := 0; i < 3; i++ {
+		c := dial()
+		defer c.Close()
+		reply, err := redis.String(c.Do("PING"))
+		assert.Equal(t, "PONG", reply)
+		assert.Nil(t, err)
+		conns = append(conns, c)
+	}
+	t.Run("REJECT", func(t *testing.T) {
+		// Accepted and then closed by the server, without a reply.
+		c, err := net.Dial("tcp", "127.0.0.1:9419")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer c.Close()
+		c.Write([]byte("PING\r\n"))
+		c.SetReadDeadline(time.Now().Add(10 * time.Second))
+		n, err := c.Read(make([]byte, 1))
+		assert.Equal(t, 0, n)
+		assert.NotNil(t, err)
+		assert.False(t, errors.Is(err, os.ErrDeadlineExceeded))
+		assert.Equal(t, int64(1), respStat(conn, "rejected_connections"))
+		assert.Equal(t, int64(4), respStat(conn, "curr_connections"))
+	})
+	t.Run("OPEN", func(t *testing.T) {
+		// The connections that were accepted still work, each with its
+		// own events.
+		for i, c := range conns {
+			key := fmt.Sprintf("key:%d", i)
+			reply, err := redis.String(c.Do("SET", key, i))
+			assert.Equal(t, "OK", reply)
+			assert.Nil(t, err)
+		}
+		for i, c := range conns {
+			key := fmt.Sprintf("key:%d", i)
+			n, err := redis.Int(c.Do("GET", key))
+			assert.Equal(t, i, n)
+			assert.Nil(t, err)
+		}
+	})
+	t.Run("REUSE", func(t *testing.T) {
+		conns[0].Close()
+		waitFor(t, 10*time.Second, "the close", func() bool {
+			return respStat(conn, "curr_connections") == 3
+		})
+		c := dial()
+		defer c.Close()
+		n, err := redis.Int(c.Do("GET", "key:1"))
+		assert.Equal(t, 1, n)
+		assert.Nil(t, err)
+	})
+}
+
+func TestRESPIdleTimeout(t *testing.T) {
+	startServer(t, 9415, "--idletimeout", "1", "--maxinbuf", "1mb")
+	// A new connection for each read of the stats, because an idle one
+	// would be closed.
+	stat := func(name string) int64 {
+		conn, err := redis.Dial("tcp", ":9415")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		return respStat(conn, name)
+	}
+	t.Run("IDLE", func(t *testing.T) {
+		conn, err := net.Dial("tcp", "127.0.0.1:9415")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		// The connection is closed by the server once it has been idle
+		// for a second, which the read sees as the end of the stream.
+		start := time.Now()
+		conn.SetReadDeadline(start.Add(10 * time.Second))
+		_, err = conn.Read(make([]byte, 1))
+		assert.Equal(t, io.EOF, err)
+		assert.GreaterOrEqual(t, time.Since(start), time.Second)
+		assert.GreaterOrEqual(t, stat("idle_closed_connections"), int64(1))
+	})
+	t.Run("ACTIVE", func(t *testing.T) {
+		conn, err := redis.Dial("tcp", ":9415")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		for i := 0; i < 6; i++ {
+			time.Sleep(time.Millisecond * 500)
+			reply, err := redis.String(conn.Do("PING"))
+			assert.Equal(t, "PONG", reply)
+			assert.Nil(t, err)
+		}
+	})
+	t.Run("MAXINBUF", func(t *testing.T) {
+		conn, err := net.Dial("tcp", "127.0.0.1:9415")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		// A request that stays incomplete past the limit closes the
+		// connection.
+		conn.Write([]byte("*3\r\n$3\r\nSET\r\n$3\r\nbig\r\n$4194304\r\n"))
+		conn.Write([]byte(strings.Repeat("x", 2*1024*1024)))
+		conn.SetReadDeadline(time.Now().Add(10 * time.Second))
+		_, err = conn.Read(make([]byte, 1))
+		assert.NotNil(t, err)
+		assert.GreaterOrEqual(t, stat("limit_closed_connections"), int64(1))
+	})
+}
+
+func TestRESPLargeValue(t *testing.T) {
+	// A value that arrives over many reads, followed by pipelined requests
+	// in the same stream.
+	val := strings.Repeat("0123456789abcdef", 512*1024)
+	write := func(conn net.Conn, stream string) {
+		for i := 0; i < len(stream); i += 1000 {
+			end := i + 1000
+			if end > len(stream) {
+				end = len(stream)
+			}
+			if _, err := conn.Write([]byte(stream[i:end])); err != nil {
+				return
+			}
+			if i%(256*1000) == 0 {
+				time.Sleep(time.Millisecond)
+			}
+		}
+	}
+	expect := func(t *testing.T, rd *bufio.Reader, reply string) {
+		t.Helper()
+		buf := make([]byte, len(reply))
+		_, err := io.ReadFull(rd, buf)
+		assert.Nil(t, err)
+		if string(buf) != reply {
+			t.Fatalf("expected a %d byte reply", len(reply))
+		}
+	}
+	t.Run("RESP", func(t *testing.T) {
+		conn, err := net.Dial("tcp", "127.0.0.1:9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		stream := fmt.Sprintf("*3\r\n$3\r\nSET\r\n$8\r\nlarge:rs\r\n"+
+			"$%d\r\n%s\r\n", len(val), val) +
+			"*2\r\n$3\r\nGET\r\n$8\r\nlarge:rs\r\n" +
+			"*3\r\n$3\r\nSET\r\n$5\r\nsmall\r\n$1\r\nx\r\n" +
+			"*2\r\n$3\r\nGET\r\n$5\r\nsmall\r\n" +
+			"*3\r\n$3\r\nDEL\r\n$8\r\nlarge:rs\r\n$5\r\nsmall\r\n"
+		go write(conn, stream)
+		conn.SetReadDeadline(time.Now().Add(30 * time.Second))
+		rd := bufio.NewReader(conn)
+		expect(t, rd, "+OK\r\n")
+		expect(t, rd, fmt.Sprintf("$%d\r\n%s\r\n", len(val), val))
+		expect(t, rd, "+OK\r\n")
+		expect(t, rd, "$1\r\nx\r\n")
+		expect(t, rd, ":2\r\n")
+	})
+	t.Run("MEMCACHE", func(t *testing.T) {
+		conn, err := net.Dial("tcp", "127.0.0.1:9401")
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		stream := fmt.Sprintf("set large:mc 0 0 %d\r\n%s\r\n", len(val),
+			val) + "get large:mc\r\nset small 0 0 1\r\nx\r\n" +
+			"delete large:mc\r\n"
+		go write(conn, stream)
+		conn.SetReadDeadline(time.Now().Add(30 * time.Second))
+		rd := bufio.NewReader(conn)
+		expect(t, rd, "STORED\r\n")
+		expect(t, rd, fmt.Sprintf("VALUE large:mc 0 %d\r\n%s\r\nEND\r\n",
+			len(val), val))
+		expect(t, rd, "STORED\r\n")
+		expect(t, rd, "DELETED\r\n")
+	})
+}
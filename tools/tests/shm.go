@@ -0,0 +1,56 @@
+package tests
+
+// The shared memory ring tests connect through the client library itself.
+
+// #cgo CFLAGS: -I${SRCDIR}/../../client
+// #include <stdlib.h>
+// #include "pogoshm.c"
+import "C"
+
+import (
+	"unsafe"
+)
+
+// shmConn is a connection that moves its requests and replies through the
+// shared memory rings of a pogoshm handle.
+type shmConn struct {
+	shm *C.struct_pogoshm
+}
+
+func shmOpen(path string, ringsize int) (*shmConn, error) {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	shm, err := C.pogoshm_open(cpath, C.size_t(ringsize))
+	if shm == nil {
+		return nil, err
+	}
+	return &shmConn{shm: shm}, nil
+}
+
+func (c *shmConn) Close() error {
+	C.pogoshm_close(c.shm)
+	return nil
+}
+
+func (c *shmConn) Write(p []byte) (int, error) {
+	if len(p) == 0 {
+		return 0, nil
+	}
+	rc, err := C.pogoshm_write(c.shm, unsafe.Pointer(&p[0]),
+		C.size_t(len(p)))
+	if rc != 0 {
+		return 0, err
+	}
+	return len(p), nil
+}
+
+func (c *shmConn) Read(p []byte) (int, error) {
+	if len(p) == 0 {
+		return 0, nil
+	}
+	n, err := C.pogoshm_read(c.shm, unsafe.Pointer(&p[0]), C.size_t(len(p)))
+	if n < 0 {
+		return 0, err
+	}
+	return int(n), nil
+}
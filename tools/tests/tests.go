@@ -3,10 +3,19 @@ package tests
 import (
 	"bytes"
 	crand "crypto/rand"
+	"errors"
+	"fmt"
 	"io"
 	"math/rand"
 	"net"
 	"net/http"
+	"os/exec"
+	"strconv"
+	"syscall"
+	"testing"
+	"time"
+
+	"github.com/gomodule/redigo/redis"
 )
 
 // randString returns random string with the random size of [0-n).
@@ -69,3 +78,126 @@ func mcRawDo(mc net.Conn, packet string) (string, error) {
 	resp := string(buf[:n])
 	return resp, nil
 }
+
+// server is a Pogocache that was started by a test, for the tests that need
+// options that the shared server on port 9401 does not have.
+type server struct {
+	cmd    *exec.Cmd
+	exited chan struct{}
+}
+
+// launchServer starts a Pogocache on port and waits until it accepts
+// connections. Returns an error if it exits first, such as for an option that
+// this build does not support.
+func launchServer(port int, args ...string) (*server, error) {
+	args = append([]string{"-p", strconv.Itoa(port)}, args...)
+	s := &server{
+		cmd:    exec.Command("../../pogocache", args...),
+		exited: make(chan struct{}),
+	}
+	if err := s.cmd.Start(); err != nil {
+		return nil, err
+	}
+	go func() {
+		s.cmd.Wait()
+		close(s.exited)
+	}()
+	addr := fmt.Sprintf("127.0.0.1:%d", port)
+	start := time.Now()
+	for time.Since(start) < 10*time.Second {
+		select {
+		case <-s.exited:
+			return nil, errors.New("server exited")
+		default:
+		}
+		conn, err := net.Dial("tcp", addr)
+		if err == nil {
+			conn.Close()
+			return s, nil
+		}
+		time.Sleep(50 * time.Millisecond)
+	}
+	s.kill()
+	return nil, errors.New("server did not start")
+}
+
+// startServer is launchServer that fails the test on error. The server is
+// stopped when the test finishes.
+func startServer(t *testing.T, port int, args ...string) *server {
+	t.Helper()
+	s, err := launchServer(port, args...)
+	if err != nil {
+		t.Fatal(err)
+	}
+	t.Cleanup(s.stop)
+	return s
+}
+
+// stop shuts the server down cleanly and waits for it to exit.
+func (s *server) stop() {
+	s.cmd.Process.Signal(syscall.SIGTERM)
+	select {
+	case <-s.exited:
+	case <-time.After(10 * time.Second):
+		s.kill()
+	}
+}
+
+func (s *server) kill() {
+	s.cmd.Process.Kill()
+	<-s.exited
+}
+
+// respStats returns the STATS of a server as a map.
+func respStats(conn redis.Conn) (map[string]string, error) {
+	vals, err := redis.Values(conn.Do("STATS"))
+	if err != nil {
+		return nil, err
+	}
+	stats := make(map[string]string)
+	for _, val := range vals {
+		pair, err := redis.Strings(val, nil)
+		if err != nil {
+			return nil, err
+		}
+		if len(pair) == 2 {
+			stats[pair[0]] = pair[1]
+		}
+	}
+	return stats, nil
+}
+
+// respStat returns one numeric stat of a server, or -1 if it's missing.
+func respStat(conn redis.Conn, name string) int64 {
+	stats, err := respStats(conn)
+	if err != nil {
+		return -1
+	}
+	n, err := strconv.ParseInt(stats[name], 10, 64)
+	if err != nil {
+		return -1
+	}
+	return n
+}
+
+// waitFor polls cond until it returns true, or fails the test after timeout.
+func waitFor(t *testing.T, timeout time.Duration, what string,
+	cond func() bool) {
+	t.Helper()
+	start := time.Now()
+	for !cond() {
+		if time.Since(start) > timeout {
+			t.Fatalf("timed out waiting for %s", what)
+		}
+		time.Sleep(100 * time.Millisecond)
+	}
+}
+
+// sessionValue returns a small JSON document that compresses well, and better
+// yet with a dictionary that has been trained on its siblings.
+func sessionValue(i int) string {
+	return fmt.Sprintf(`{"session_id":"%032x","user":{"id":%d,`+
+		`"name":"user%d","roles":["reader","writer"]},`+
+		`"created_at":"2026-10-18T12:%02d:%02dZ","theme":"dark",`+
+		`"locale":"en-US"}`, i*7919, i, i%1000, i%60, (i*7)%60)
+}